@@ -0,0 +1,654 @@
+/* bench-search.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the search data structures against a synthetic corpus which
+ * is generated from a seed, so that runs on different machines (or before
+ * and after a change) operate on exactly the same keys and queries.
+ *
+ * Results are written as JSON to stdout (or --output) so they can be
+ * compared by scripts, while progress is written to stderr.
+ *
+ *   bench-search --suite fuzzy-index --corpus paths --keys 1000000
+ *
+ * Peak RSS is the high-water mark of the process, so run a single suite
+ * per process to attribute it to that suite.
+ */
+
+#include <dazzle.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_QUERY_LENGTH 8
+#define MAX_MATCHES      25
+
+typedef struct
+{
+  GPtrArray *keys;
+
+  /* Fuzzy queries are subsequences of a key, trie queries are prefixes */
+  GPtrArray *queries [MAX_QUERY_LENGTH + 1];
+  GPtrArray *prefixes [MAX_QUERY_LENGTH + 1];
+} Corpus;
+
+typedef void (*SuiteFunc) (Corpus  *corpus,
+                           GString *json);
+
+static gint      n_keys = 100000;
+static gint      n_queries = 100;
+static gint      seed = 1234;
+static gchar    *corpus_kind;
+static gchar    *suite_name;
+static gchar    *output;
+static GMainLoop *main_loop;
+
+static const GOptionEntry entries[] = {
+  { "keys", 'n', 0, G_OPTION_ARG_INT, &n_keys, "Number of keys in the corpus", "N" },
+  { "queries", 'q', 0, G_OPTION_ARG_INT, &n_queries, "Number of queries per query length", "N" },
+  { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Seed for generating the corpus", "SEED" },
+  { "corpus", 'c', 0, G_OPTION_ARG_STRING, &corpus_kind, "Kind of corpus: symbols or paths", "KIND" },
+  { "suite", 0, 0, G_OPTION_ARG_STRING, &suite_name, "Only run SUITE", "SUITE" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write JSON to FILE instead of stdout", "FILE" },
+  { NULL }
+};
+
+static const gchar *words[] = {
+  "action", "bin", "binding", "box", "buffer", "builder", "button", "cache",
+  "context", "counter", "cursor", "dock", "entry", "file", "frame", "fuzzy",
+  "graph", "group", "heap", "index", "item", "label", "layout", "list",
+  "match", "menu", "model", "monitor", "panel", "path", "pattern", "popover",
+  "property", "reaper", "ring", "search", "shortcut", "signal", "source",
+  "spec", "state", "store", "style", "task", "theme", "tree", "trie", "view",
+  "widget", "window",
+};
+
+static const gchar *symbol_prefixes[] = {
+  "cairo", "dzl", "g", "gdk", "gsk", "gtk", "ide", "pango",
+};
+
+static const gchar *path_dirs[] = {
+  "data", "doc", "include", "lib", "plugins", "src", "tests", "tools",
+};
+
+static const gchar *path_suffixes[] = {
+  ".c", ".css", ".h", ".md", ".py", ".ui",
+};
+
+#define PICK(rand, array) (array [g_rand_int_range (rand, 0, G_N_ELEMENTS (array))])
+
+static gint64
+now_nsec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (gint64)ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static glong
+get_peak_rss_kb (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  return usage.ru_maxrss;
+}
+
+/*
+ * The resident set size of the process right now, rather than its peak,
+ * so that the growth caused by building an in-memory structure can be
+ * measured. Returns zero where /proc is unavailable.
+ */
+static gint64
+get_current_rss_bytes (void)
+{
+  g_autofree gchar *contents = NULL;
+  gint64 resident = 0;
+
+  if (!g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL) ||
+      sscanf (contents, "%*s %" G_GINT64_FORMAT, &resident) != 1)
+    return 0;
+
+  return resident * sysconf (_SC_PAGESIZE);
+}
+
+static gchar *
+generate_key (GRand       *rand,
+              const gchar *kind,
+              guint        id)
+{
+  GString *str = g_string_new (NULL);
+  gint n_parts = g_rand_int_range (rand, 1, 4);
+
+  /* The id keeps keys distinct however large the corpus is */
+  if (g_strcmp0 (kind, "paths") == 0)
+    {
+      g_string_append (str, PICK (rand, path_dirs));
+      for (gint i = 0; i < n_parts; i++)
+        g_string_append_printf (str, "/%s", PICK (rand, words));
+      g_string_append_printf (str, "-%s%u%s", PICK (rand, words), id, PICK (rand, path_suffixes));
+    }
+  else
+    {
+      g_string_append (str, PICK (rand, symbol_prefixes));
+      for (gint i = 0; i < n_parts; i++)
+        g_string_append_printf (str, "_%s", PICK (rand, words));
+      g_string_append_printf (str, "_%u", id);
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+/*
+ * Picks @length characters of @key, in order, the way a user would type
+ * a fuzzy query for it.
+ */
+static gchar *
+generate_subsequence (GRand       *rand,
+                      const gchar *key,
+                      guint        length)
+{
+  GString *str = g_string_new (NULL);
+  guint remaining = strlen (key);
+
+  for (const gchar *iter = key; *iter && str->len < length; iter++, remaining--)
+    {
+      if ((guint)g_rand_int_range (rand, 0, remaining) < length - str->len)
+        g_string_append_c (str, *iter);
+    }
+
+  return g_string_free (str, FALSE);
+}
+
+static void
+corpus_init (Corpus      *corpus,
+             const gchar *kind)
+{
+  GRand *rand = g_rand_new_with_seed (seed);
+
+  corpus->keys = g_ptr_array_new_full (n_keys, g_free);
+
+  for (guint i = 0; i < (guint)n_keys; i++)
+    g_ptr_array_add (corpus->keys, generate_key (rand, kind, i));
+
+  for (guint length = 1; length <= MAX_QUERY_LENGTH; length++)
+    {
+      corpus->queries [length] = g_ptr_array_new_with_free_func (g_free);
+      corpus->prefixes [length] = g_ptr_array_new_with_free_func (g_free);
+
+      for (guint i = 0; i < (guint)n_queries; i++)
+        {
+          const gchar *key = g_ptr_array_index (corpus->keys, g_rand_int_range (rand, 0, n_keys));
+
+          g_ptr_array_add (corpus->queries [length], generate_subsequence (rand, key, length));
+          g_ptr_array_add (corpus->prefixes [length], g_strndup (key, length));
+        }
+    }
+
+  g_rand_free (rand);
+}
+
+static void
+corpus_clear (Corpus *corpus)
+{
+  g_clear_pointer (&corpus->keys, g_ptr_array_unref);
+
+  for (guint length = 1; length <= MAX_QUERY_LENGTH; length++)
+    {
+      g_clear_pointer (&corpus->queries [length], g_ptr_array_unref);
+      g_clear_pointer (&corpus->prefixes [length], g_ptr_array_unref);
+    }
+}
+
+static void
+json_separate (GString *json)
+{
+  gchar last = json->len ? json->str [json->len - 1] : '{';
+
+  if (last != '{' && last != '[')
+    g_string_append_c (json, ',');
+}
+
+static void
+json_add_int (GString     *json,
+              const gchar *name,
+              gint64       value)
+{
+  json_separate (json);
+  g_string_append_printf (json, "\"%s\":%" G_GINT64_FORMAT, name, value);
+}
+
+static void
+json_begin_result (GString     *json,
+                   const gchar *subject)
+{
+  json_separate (json);
+  g_string_append_printf (json, "{\"subject\":\"%s\"", subject);
+}
+
+static void
+json_end_result (GString *json)
+{
+  json_add_int (json, "peak_rss_kb", get_peak_rss_kb ());
+  g_string_append_c (json, '}');
+}
+
+static gint
+compare_int64 (gconstpointer a,
+               gconstpointer b)
+{
+  gint64 ia = *(const gint64 *)a;
+  gint64 ib = *(const gint64 *)b;
+
+  return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * Adds the p50 and p99 latency of @samples, which is sorted in place.
+ */
+static void
+json_add_latencies (GString *json,
+                    guint    length,
+                    GArray  *samples)
+{
+  gint64 *values = (gint64 *)(gpointer)samples->data;
+
+  g_array_sort (samples, compare_int64);
+
+  json_separate (json);
+  g_string_append_c (json, '{');
+  json_add_int (json, "length", length);
+  json_add_int (json, "count", samples->len);
+
+  if (samples->len > 0)
+    {
+      json_add_int (json, "p50_nsec", values [(samples->len - 1) * 50 / 100]);
+      json_add_int (json, "p99_nsec", values [(samples->len - 1) * 99 / 100]);
+    }
+
+  g_string_append_c (json, '}');
+}
+
+static gint64
+get_file_size (const gchar *path)
+{
+  GStatBuf st;
+
+  if (g_stat (path, &st) != 0)
+    return 0;
+
+  return st.st_size;
+}
+
+static gchar *
+create_tmp_file (void)
+{
+  g_autoptr(GError) error = NULL;
+  gchar *path = NULL;
+  gint fd;
+
+  fd = g_file_open_tmp ("bench-search-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  return path;
+}
+
+static void
+query_cb (GObject      *object,
+          GAsyncResult *result,
+          gpointer      user_data)
+{
+  g_autoptr(GListModel) model = NULL;
+  g_autoptr(GError) error = NULL;
+
+  model = dzl_fuzzy_index_query_finish (DZL_FUZZY_INDEX (object), result, &error);
+  g_assert_no_error (error);
+
+  g_main_loop_quit (main_loop);
+}
+
+static void
+bench_fuzzy_index (Corpus  *corpus,
+                   GString *json)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  gint64 begin;
+  gint64 build;
+
+  path = create_tmp_file ();
+  file = g_file_new_for_path (path);
+
+  begin = now_nsec ();
+  builder = dzl_fuzzy_index_builder_new ();
+  for (guint i = 0; i < corpus->keys->len; i++)
+    dzl_fuzzy_index_builder_insert (builder,
+                                    g_ptr_array_index (corpus->keys, i),
+                                    g_variant_new_uint32 (i),
+                                    i % 8);
+  dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  build = now_nsec () - begin;
+  g_clear_object (&builder);
+
+  json_begin_result (json, "DzlFuzzyIndexBuilder");
+  json_add_int (json, "build_usec", build / 1000);
+  json_add_int (json, "size_bytes", get_file_size (path));
+  json_end_result (json);
+
+  begin = now_nsec ();
+  index = dzl_fuzzy_index_new ();
+  dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Repeated queries must be matched again rather than served from the cache */
+  dzl_fuzzy_index_set_cache_budget (index, 0);
+
+  json_begin_result (json, "DzlFuzzyIndex");
+  json_add_int (json, "load_usec", (now_nsec () - begin) / 1000);
+  g_string_append (json, ",\"queries\":[");
+
+  for (guint length = 1; length <= MAX_QUERY_LENGTH; length++)
+    {
+      g_autoptr(GArray) samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+      GPtrArray *queries = corpus->queries [length];
+
+      for (guint i = 0; i < queries->len; i++)
+        {
+          gint64 elapsed;
+
+          /* Includes the round-trip to the worker thread, as seen by a UI */
+          begin = now_nsec ();
+          dzl_fuzzy_index_query_async (index, g_ptr_array_index (queries, i), MAX_MATCHES, NULL, query_cb, NULL);
+          g_main_loop_run (main_loop);
+          elapsed = now_nsec () - begin;
+
+          g_array_append_val (samples, elapsed);
+        }
+
+      json_add_latencies (json, length, samples);
+    }
+
+  g_string_append_c (json, ']');
+  json_end_result (json);
+
+  g_unlink (path);
+}
+
+static void
+bench_fuzzy_mutable_index (Corpus  *corpus,
+                           GString *json)
+{
+  DzlFuzzyMutableIndex *fuzzy;
+  gint64 rss_before;
+  gint64 begin;
+  gint64 build;
+
+  rss_before = get_current_rss_bytes ();
+
+  begin = now_nsec ();
+  fuzzy = dzl_fuzzy_mutable_index_new (FALSE);
+  dzl_fuzzy_mutable_index_begin_bulk_insert (fuzzy);
+  for (guint i = 0; i < corpus->keys->len; i++)
+    dzl_fuzzy_mutable_index_insert (fuzzy, g_ptr_array_index (corpus->keys, i), GUINT_TO_POINTER (i));
+  dzl_fuzzy_mutable_index_end_bulk_insert (fuzzy);
+  build = now_nsec () - begin;
+
+  json_begin_result (json, "DzlFuzzyMutableIndex");
+  json_add_int (json, "build_usec", build / 1000);
+
+  /* The index only lives in memory, so its size is the growth of the RSS */
+  json_add_int (json, "size_bytes", MAX (0, get_current_rss_bytes () - rss_before));
+  g_string_append (json, ",\"queries\":[");
+
+  for (guint length = 1; length <= MAX_QUERY_LENGTH; length++)
+    {
+      g_autoptr(GArray) samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+      GPtrArray *queries = corpus->queries [length];
+
+      for (guint i = 0; i < queries->len; i++)
+        {
+          GArray *matches;
+          gint64 elapsed;
+
+          begin = now_nsec ();
+          matches = dzl_fuzzy_mutable_index_match (fuzzy, g_ptr_array_index (queries, i), MAX_MATCHES);
+          elapsed = now_nsec () - begin;
+
+          g_array_unref (matches);
+          g_array_append_val (samples, elapsed);
+        }
+
+      json_add_latencies (json, length, samples);
+    }
+
+  g_string_append_c (json, ']');
+  json_end_result (json);
+
+  dzl_fuzzy_mutable_index_unref (fuzzy);
+}
+
+static guint
+serialize_value (DzlTrie     *trie,
+                 const gchar *key,
+                 gpointer     value,
+                 gpointer     user_data)
+{
+  return GPOINTER_TO_UINT (value);
+}
+
+static void
+bench_trie (Corpus  *corpus,
+            GString *json)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *path = NULL;
+  DzlTrie *trie;
+  gint64 begin;
+
+  begin = now_nsec ();
+  trie = dzl_trie_new (NULL);
+  for (guint i = 0; i < corpus->keys->len; i++)
+    dzl_trie_insert (trie, g_ptr_array_index (corpus->keys, i), GUINT_TO_POINTER (i + 1));
+
+  json_begin_result (json, "DzlTrie");
+  json_add_int (json, "build_usec", (now_nsec () - begin) / 1000);
+
+  path = create_tmp_file ();
+  file = g_file_new_for_path (path);
+  dzl_trie_save_to_file (trie, file, serialize_value, NULL, NULL, &error);
+  g_assert_no_error (error);
+  json_add_int (json, "size_bytes", get_file_size (path));
+  g_unlink (path);
+
+  /* Completion of the first MAX_MATCHES keys with a prefix */
+  g_string_append (json, ",\"queries\":[");
+
+  for (guint length = 1; length <= MAX_QUERY_LENGTH; length++)
+    {
+      g_autoptr(GArray) samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+      GPtrArray *prefixes = corpus->prefixes [length];
+
+      for (guint i = 0; i < prefixes->len; i++)
+        {
+          DzlTrieIter *iter;
+          const gchar *key;
+          gpointer value;
+          gint64 elapsed;
+          guint count = 0;
+
+          begin = now_nsec ();
+          iter = dzl_trie_iter_new (trie, g_ptr_array_index (prefixes, i), NULL);
+          while (count < MAX_MATCHES && dzl_trie_iter_next (iter, &key, &value))
+            count++;
+          dzl_trie_iter_free (iter);
+          elapsed = now_nsec () - begin;
+
+          g_array_append_val (samples, elapsed);
+        }
+
+      json_add_latencies (json, length, samples);
+    }
+
+  g_string_append_c (json, ']');
+  json_end_result (json);
+
+  dzl_trie_unref (trie);
+}
+
+static void
+bench_levenshtein (Corpus  *corpus,
+                   GString *json)
+{
+  g_autofree gint *distances = g_new (gint, corpus->keys->len);
+
+  /* Scores every key of the corpus, as a typo fallback would */
+  json_begin_result (json, "dzl_levenshtein");
+  g_string_append (json, ",\"queries\":[");
+
+  for (guint length = 1; length <= MAX_QUERY_LENGTH; length++)
+    {
+      g_autoptr(GArray) samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+      GPtrArray *queries = corpus->queries [length];
+
+      for (guint i = 0; i < queries->len; i++)
+        {
+          gint64 begin;
+          gint64 elapsed;
+
+          begin = now_nsec ();
+          dzl_levenshtein_many (g_ptr_array_index (queries, i),
+                                (const gchar * const *)corpus->keys->pdata,
+                                corpus->keys->len,
+                                2,
+                                distances);
+          elapsed = now_nsec () - begin;
+
+          g_array_append_val (samples, elapsed);
+        }
+
+      json_add_latencies (json, length, samples);
+    }
+
+  g_string_append_c (json, ']');
+  json_end_result (json);
+}
+
+static const struct {
+  const gchar *name;
+  SuiteFunc    func;
+} suites[] = {
+  { "fuzzy-index", bench_fuzzy_index },
+  { "fuzzy-mutable-index", bench_fuzzy_mutable_index },
+  { "trie", bench_trie },
+  { "levenshtein", bench_levenshtein },
+};
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GString) json = NULL;
+  Corpus corpus = { 0 };
+  gboolean found = FALSE;
+  gint64 begin;
+
+  context = g_option_context_new ("- benchmark the search data structures");
+  g_option_context_add_main_entries (context, entries, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  if (corpus_kind == NULL)
+    corpus_kind = g_strdup ("symbols");
+
+  if (n_keys <= 0 || n_queries <= 0 ||
+      (g_strcmp0 (corpus_kind, "symbols") != 0 && g_strcmp0 (corpus_kind, "paths") != 0))
+    {
+      g_printerr ("Invalid arguments, see --help\n");
+      return EXIT_FAILURE;
+    }
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  g_printerr ("Generating %d %s…\n", n_keys, corpus_kind);
+  begin = now_nsec ();
+  corpus_init (&corpus, corpus_kind);
+
+  json = g_string_new ("{");
+  g_string_append_printf (json, "\"corpus\":\"%s\"", corpus_kind);
+  json_add_int (json, "n_keys", n_keys);
+  json_add_int (json, "n_queries", n_queries);
+  json_add_int (json, "seed", seed);
+  json_add_int (json, "generate_usec", (now_nsec () - begin) / 1000);
+  g_string_append (json, ",\"results\":[");
+
+  for (guint i = 0; i < G_N_ELEMENTS (suites); i++)
+    {
+      if (suite_name != NULL && g_strcmp0 (suite_name, suites[i].name) != 0)
+        continue;
+
+      g_printerr ("Running %s…\n", suites[i].name);
+      suites[i].func (&corpus, json);
+      found = TRUE;
+    }
+
+  g_string_append (json, "]}\n");
+
+  if (!found)
+    {
+      g_printerr ("No such suite \"%s\"\n", suite_name);
+      return EXIT_FAILURE;
+    }
+
+  if (output != NULL)
+    {
+      if (!g_file_set_contents (output, json->str, json->len, &error))
+        {
+          g_printerr ("%s\n", error->message);
+          return EXIT_FAILURE;
+        }
+    }
+  else
+    {
+      g_print ("%s", json->str);
+    }
+
+  corpus_clear (&corpus);
+  g_main_loop_unref (main_loop);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,429 @@
+/* dzl-task-cache-disk.c
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "dzl-task-cache-disk"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+
+#include "cache/dzl-task-cache-disk.h"
+#include "files/dzl-directory-reaper.h"
+
+/*
+ * Entries are a serialized "(uvv)" of the format version, the key and the
+ * value, always stored little-endian in normal form so that the checksum
+ * of a key, which names its entry, does not depend on the host.
+ */
+#define ENTRY_VERSION 1
+#define ENTRY_SUFFIX  ".gvariant"
+#define ENTRY_TYPE    ((const GVariantType *)"(uvv)")
+
+struct _DzlTaskCacheDisk
+{
+  volatile gint  ref_count;
+
+  GFile         *directory;
+  gchar         *path;
+  guint64        max_size;
+
+  /*
+   * The size of the entries, estimated from the last scan of the directory
+   * and the entries stored since. Guarded by mutex, like reclaiming which
+   * ensures a single thread scans the directory at a time.
+   */
+  GMutex         mutex;
+  guint64        size;
+  guint          scanned : 1;
+  guint          reclaiming : 1;
+};
+
+typedef struct
+{
+  GFile   *file;
+  guint64  size;
+  guint64  mtime;
+} Entry;
+
+DzlTaskCacheDisk *
+dzl_task_cache_disk_new (GFile   *directory,
+                         guint64  max_size)
+{
+  DzlTaskCacheDisk *self;
+
+  g_return_val_if_fail (G_IS_FILE (directory), NULL);
+  g_return_val_if_fail (g_file_is_native (directory), NULL);
+
+  self = g_slice_new0 (DzlTaskCacheDisk);
+  self->ref_count = 1;
+  self->directory = g_object_ref (directory);
+  self->path = g_file_get_path (directory);
+  self->max_size = max_size;
+  g_mutex_init (&self->mutex);
+
+  return self;
+}
+
+DzlTaskCacheDisk *
+dzl_task_cache_disk_ref (DzlTaskCacheDisk *self)
+{
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (self->ref_count > 0, NULL);
+
+  g_atomic_int_inc (&self->ref_count);
+
+  return self;
+}
+
+void
+dzl_task_cache_disk_unref (DzlTaskCacheDisk *self)
+{
+  g_return_if_fail (self != NULL);
+  g_return_if_fail (self->ref_count > 0);
+
+  if (g_atomic_int_dec_and_test (&self->ref_count))
+    {
+      g_clear_object (&self->directory);
+      g_clear_pointer (&self->path, g_free);
+      g_mutex_clear (&self->mutex);
+      g_slice_free (DzlTaskCacheDisk, self);
+    }
+}
+
+static GVariant *
+to_little_endian (GVariant *variant)
+{
+  GVariant *normal = g_variant_get_normal_form (variant);
+
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+  {
+    GVariant *swapped = g_variant_byteswap (normal);
+    g_variant_unref (normal);
+    normal = swapped;
+  }
+#endif
+
+  return normal;
+}
+
+static gchar *
+dzl_task_cache_disk_get_entry_path (DzlTaskCacheDisk *self,
+                                    GVariant         *key)
+{
+  g_autoptr(GVariant) serialized = NULL;
+  g_autofree gchar *checksum = NULL;
+  g_autofree gchar *name = NULL;
+
+  serialized = to_little_endian (key);
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                          g_variant_get_data (serialized),
+                                          g_variant_get_size (serialized));
+  name = g_strconcat (checksum, ENTRY_SUFFIX, NULL);
+
+  return g_build_filename (self->path, name, NULL);
+}
+
+/**
+ * dzl_task_cache_disk_lookup:
+ * @self: a #DzlTaskCacheDisk
+ * @key: the serialized key
+ * @error: a location for a #GError, or %NULL
+ *
+ * Looks up the entry for @key. The value is backed by the mapped file,
+ * so only the pages which are used are read from disk.
+ *
+ * Returns: (transfer full) (nullable): the serialized value, or %NULL if
+ *   there is no entry for @key, or if an error occurred.
+ */
+GVariant *
+dzl_task_cache_disk_lookup (DzlTaskCacheDisk  *self,
+                            GVariant          *key,
+                            GError           **error)
+{
+  g_autoptr(GMappedFile) mapped_file = NULL;
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GVariant) stored_key = NULL;
+  g_autoptr(GVariant) expected_key = NULL;
+  g_autoptr(GVariant) value = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autofree gchar *path = NULL;
+  GError *local_error = NULL;
+  guint32 version = 0;
+
+  g_return_val_if_fail (self != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  path = dzl_task_cache_disk_get_entry_path (self, key);
+
+  if (NULL == (mapped_file = g_mapped_file_new (path, FALSE, &local_error)))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_propagate_error (error, local_error);
+      else
+        g_clear_error (&local_error);
+      return NULL;
+    }
+
+  /* The contents are validated lazily, as they are accessed */
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  entry = g_variant_ref_sink (g_variant_new_from_bytes (ENTRY_TYPE, bytes, FALSE));
+
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+  {
+    GVariant *swapped = g_variant_byteswap (entry);
+    g_variant_unref (entry);
+    entry = swapped;
+  }
+#endif
+
+  g_variant_get (entry, "(u@v@v)", &version, &stored_key, &value);
+
+  if (version != ENTRY_VERSION)
+    return NULL;
+
+  /* Two keys may have the same checksum, however unlikely */
+  expected_key = g_variant_ref_sink (g_variant_new_variant (key));
+  if (!g_variant_equal (stored_key, expected_key))
+    return NULL;
+
+  /* Mark the entry as recently used, so it is reclaimed last */
+  g_utime (path, NULL);
+
+  return g_variant_get_variant (value);
+}
+
+/**
+ * dzl_task_cache_disk_store:
+ * @self: a #DzlTaskCacheDisk
+ * @key: the serialized key
+ * @value: the serialized value
+ * @error: a location for a #GError, or %NULL
+ *
+ * Stores @value as the entry for @key, replacing any previous entry.
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
+ */
+gboolean
+dzl_task_cache_disk_store (DzlTaskCacheDisk  *self,
+                           GVariant          *key,
+                           GVariant          *value,
+                           GError           **error)
+{
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GVariant) serialized = NULL;
+  g_autofree gchar *path = NULL;
+  gsize length;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+  g_return_val_if_fail (value != NULL, FALSE);
+
+  if (g_mkdir_with_parents (self->path, 0750) != 0)
+    {
+      int errsv = errno;
+
+      g_set_error (error,
+                   G_FILE_ERROR,
+                   g_file_error_from_errno (errsv),
+                   "Failed to create directory \"%s\": %s",
+                   self->path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  entry = g_variant_ref_sink (g_variant_new ("(u@v@v)",
+                                             ENTRY_VERSION,
+                                             g_variant_new_variant (key),
+                                             g_variant_new_variant (value)));
+  serialized = to_little_endian (entry);
+  length = g_variant_get_size (serialized);
+  path = dzl_task_cache_disk_get_entry_path (self, key);
+
+  /* Written to a temporary file and renamed, so readers never see a partial entry */
+  if (!g_file_set_contents (path, g_variant_get_data (serialized), length, error))
+    return FALSE;
+
+  g_mutex_lock (&self->mutex);
+  self->size += length;
+  g_mutex_unlock (&self->mutex);
+
+  return TRUE;
+}
+
+static gint
+compare_entry_mtime (gconstpointer a,
+                     gconstpointer b)
+{
+  const Entry *entry_a = a;
+  const Entry *entry_b = b;
+
+  if (entry_a->mtime < entry_b->mtime)
+    return -1;
+  else if (entry_a->mtime > entry_b->mtime)
+    return 1;
+  else
+    return 0;
+}
+
+static void
+clear_entry (gpointer data)
+{
+  Entry *entry = data;
+
+  g_clear_object (&entry->file);
+}
+
+/**
+ * dzl_task_cache_disk_reclaim:
+ * @self: a #DzlTaskCacheDisk
+ * @cancellable: (nullable): a #GCancellable or %NULL
+ * @error: a location for a #GError, or %NULL
+ *
+ * If the entries may exceed the size budget, scans the directory and has
+ * a #DzlDirectoryReaper remove the least recently used entries until they
+ * fit. Entries are only removed once they are at least a second old, so
+ * the budget may be exceeded briefly.
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
+ */
+gboolean
+dzl_task_cache_disk_reclaim (DzlTaskCacheDisk  *self,
+                             GCancellable      *cancellable,
+                             GError           **error)
+{
+  g_autoptr(DzlDirectoryReaper) reaper = NULL;
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+  g_autoptr(GArray) entries = NULL;
+  GError *local_error = NULL;
+  gpointer infoptr;
+  guint64 size = 0;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (self != NULL, FALSE);
+  g_return_val_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable), FALSE);
+
+  g_mutex_lock (&self->mutex);
+  if (self->reclaiming ||
+      (self->scanned && (self->max_size == 0 || self->size <= self->max_size)))
+    {
+      g_mutex_unlock (&self->mutex);
+      return TRUE;
+    }
+  self->reclaiming = TRUE;
+  g_mutex_unlock (&self->mutex);
+
+  entries = g_array_new (FALSE, FALSE, sizeof (Entry));
+  g_array_set_clear_func (entries, clear_entry);
+
+  enumerator = g_file_enumerate_children (self->directory,
+                                          G_FILE_ATTRIBUTE_STANDARD_NAME","
+                                          G_FILE_ATTRIBUTE_STANDARD_SIZE","
+                                          G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                          G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                          cancellable,
+                                          &local_error);
+
+  if (enumerator == NULL)
+    {
+      /* Nothing was stored yet */
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        {
+          g_clear_error (&local_error);
+          ret = TRUE;
+        }
+      goto finish;
+    }
+
+  while (NULL != (infoptr = g_file_enumerator_next_file (enumerator, cancellable, &local_error)))
+    {
+      g_autoptr(GFileInfo) info = infoptr;
+      const gchar *name = g_file_info_get_name (info);
+      Entry entry;
+
+      if (!g_str_has_suffix (name, ENTRY_SUFFIX))
+        continue;
+
+      entry.file = g_file_get_child (self->directory, name);
+      entry.size = g_file_info_get_size (info);
+      entry.mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+      size += entry.size;
+
+      g_array_append_val (entries, entry);
+    }
+
+  if (local_error != NULL)
+    goto finish;
+
+  if (self->max_size > 0 && size > self->max_size)
+    {
+      guint n_reaped = 0;
+
+      g_array_sort (entries, compare_entry_mtime);
+
+      reaper = dzl_directory_reaper_new ();
+
+      for (guint i = 0; i < entries->len && size > self->max_size; i++)
+        {
+          const Entry *entry = &g_array_index (entries, Entry, i);
+
+          dzl_directory_reaper_add_file (reaper, entry->file, 0);
+          size -= entry->size;
+          n_reaped++;
+        }
+
+      g_debug ("Reclaiming %u entries from \"%s\"", n_reaped, self->path);
+
+      if (!dzl_directory_reaper_execute (reaper, cancellable, &local_error))
+        goto finish;
+
+      /*
+       * The reaper skips the entries modified within the current second,
+       * and entries may have been stored again meanwhile, so count the
+       * entries which are still there.
+       */
+      for (guint i = 0; i < n_reaped; i++)
+        {
+          const Entry *entry = &g_array_index (entries, Entry, i);
+          g_autoptr(GFileInfo) info = NULL;
+
+          info = g_file_query_info (entry->file,
+                                    G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                    G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                    cancellable,
+                                    NULL);
+
+          if (info != NULL)
+            size += g_file_info_get_size (info);
+        }
+    }
+
+  ret = TRUE;
+
+finish:
+  g_mutex_lock (&self->mutex);
+  if (ret)
+    {
+      self->size = size;
+      self->scanned = TRUE;
+    }
+  self->reclaiming = FALSE;
+  g_mutex_unlock (&self->mutex);
+
+  if (local_error != NULL)
+    g_propagate_error (error, local_error);
+
+  return ret;
+}
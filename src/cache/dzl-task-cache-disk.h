@@ -0,0 +1,54 @@
+/* dzl-task-cache-disk.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DZL_TASK_CACHE_DISK_H
+#define DZL_TASK_CACHE_DISK_H
+
+#include <gio/gio.h>
+
+/*
+ * The on-disk tier of DzlTaskCache. Each entry is a file holding the
+ * serialized key and value, named after the checksum of the key, which
+ * is mapped into memory when read. None of these functions block on the
+ * main loop, but they do block on I/O, so call them from a worker thread.
+ */
+
+G_BEGIN_DECLS
+
+typedef struct _DzlTaskCacheDisk DzlTaskCacheDisk;
+
+DzlTaskCacheDisk *dzl_task_cache_disk_new     (GFile             *directory,
+                                               guint64            max_size);
+DzlTaskCacheDisk *dzl_task_cache_disk_ref     (DzlTaskCacheDisk  *self);
+void              dzl_task_cache_disk_unref   (DzlTaskCacheDisk  *self);
+GVariant         *dzl_task_cache_disk_lookup  (DzlTaskCacheDisk  *self,
+                                               GVariant          *key,
+                                               GError           **error);
+gboolean          dzl_task_cache_disk_store   (DzlTaskCacheDisk  *self,
+                                               GVariant          *key,
+                                               GVariant          *value,
+                                               GError           **error);
+gboolean          dzl_task_cache_disk_reclaim (DzlTaskCacheDisk  *self,
+                                               GCancellable      *cancellable,
+                                               GError           **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DzlTaskCacheDisk, dzl_task_cache_disk_unref)
+
+G_END_DECLS
+
+#endif /* DZL_TASK_CACHE_DISK_H */
@@ -21,15 +21,84 @@
 #include <glib/gi18n.h>
 
 #include "cache/dzl-task-cache.h"
+#include "cache/dzl-task-cache-disk.h"
 #include "util/dzl-counter.h"
 #include "util/dzl-heap.h"
 
+/* Percentage of the capacity used by the W-TinyLFU admission window */
+#define WINDOW_PERCENT 1
+
+/* Percentage of the capacity used by the W-TinyLFU protected segment */
+#define PROTECTED_PERCENT 80
+
+/* Largest count of the frequency sketch, which saturates after that */
+#define FREQUENCY_MAX 15
+
+/* Number of rows, or hash functions, of the frequency sketch */
+#define FREQUENCY_DEPTH 4
+
+/* Largest number of shards, which is plenty to avoid contention */
+#define MAX_SHARDS 256
+
+typedef enum
+{
+  CACHE_SEGMENT_WINDOW,
+  CACHE_SEGMENT_PROBATION,
+  CACHE_SEGMENT_PROTECTED,
+  N_CACHE_SEGMENTS
+} CacheSegmentKind;
+
+/*
+ * Items are kept in recency order within their segment, the most recently
+ * used at the head. With the LRU policy, every item lives in the window.
+ */
+typedef struct
+{
+  GQueue  queue;
+  guint64 cost;
+} CacheSegment;
+
+/*
+ * A count-min sketch which estimates how often keys were requested. The
+ * counts are halved periodically so that the popularity of keys can
+ * change over time.
+ */
+typedef struct
+{
+  guint8 *counters;
+  guint   width;
+  guint   n_additions;
+  guint   sample_size;
+} FrequencySketch;
+
+/*
+ * Keys are spread over the shards by hash, and each shard is an
+ * independent cache guarded by its own lock. Threads using keys of
+ * different shards never contend with each other.
+ */
+typedef struct
+{
+  GMutex           mutex;
+  GHashTable      *cache;
+  GHashTable      *in_flight;
+  GHashTable      *queued;
+  DzlHeap         *evict_heap;
+  CacheSegment     segments [N_CACHE_SEGMENTS];
+  FrequencySketch  sketch;
+} CacheShard;
+
 typedef struct
 {
   DzlTaskCache *self;
   gpointer      key;
   gpointer      value;
+  gint64        expire_at;
   gint64        evict_at;
+  gsize         heap_index;
+  GList         link;
+  guint64       cost;
+  guint         hash;
+  guint         segment : 2;
 } CacheItem;
 
 typedef struct
@@ -42,9 +111,27 @@ typedef struct
 
 typedef struct
 {
-  GSource  source;
-  DzlHeap *heap;
-} EvictSource;
+  DzlTaskCache *self;
+  gpointer      key;
+  GCancellable *cancellable;
+  guint         check_disk : 1;
+} PendingFetch;
+
+typedef struct
+{
+  DzlTaskCache     *self;
+  DzlTaskCacheDisk *disk;
+  gpointer          key;
+  GVariant         *key_variant;
+  GTask            *fetch_task;
+} DiskFetch;
+
+typedef struct
+{
+  DzlTaskCacheDisk *disk;
+  GVariant         *key_variant;
+  GVariant         *value_variant;
+} DiskStore;
 
 struct _DzlTaskCache
 {
@@ -61,17 +148,54 @@ struct _DzlTaskCache
   gpointer              populate_callback_data;
   GDestroyNotify        populate_callback_data_destroy;
 
-  GHashTable           *cache;
-  GHashTable           *in_flight;
-  GHashTable           *queued;
+  CacheShard           *shards;
+  guint                 n_shards;
 
   gchar                *name;
 
-  DzlHeap              *evict_heap;
+  /*
+   * The thread-default main context when the cache was created. Fetches
+   * are populated and completed here, so that they do not depend on the
+   * main context of the thread which happened to request the key first.
+   */
+  GMainContext         *main_context;
+
+  /* Guards the ready time of @evict_source, which any thread may lower */
+  GMutex                evict_mutex;
   GSource              *evict_source;
-  guint                 evict_source_id;
 
   gint64                time_to_live_usec;
+
+  /* How long expired items are served while being refreshed */
+  gint64                stale_usec;
+
+  /* Percentage of the time to live, before expiry, to refresh items in */
+  guint                 refresh_ahead;
+
+  DzlTaskCacheCostFunc  cost_func;
+  gpointer              cost_func_data;
+  GDestroyNotify        cost_func_data_destroy;
+
+  guint64               max_cost;
+  guint                 max_items;
+
+  /* The capacity of each shard, derived from the limits above */
+  guint64               shard_max_cost;
+  guint                 shard_max_items;
+
+  DzlTaskCacheEvictionPolicy eviction_policy;
+
+  /* The optional on-disk tier, which is replaced under disk_mutex */
+  GMutex                disk_mutex;
+  DzlTaskCacheDisk     *disk;
+  GFile                *disk_directory;
+  guint64               disk_max_size;
+
+  DzlTaskCacheSerializeFunc   key_serialize_func;
+  DzlTaskCacheSerializeFunc   value_serialize_func;
+  DzlTaskCacheDeserializeFunc value_deserialize_func;
+  gpointer                    serialize_data;
+  GDestroyNotify              serialize_data_destroy;
 };
 
 G_DEFINE_TYPE (DzlTaskCache, dzl_task_cache, G_TYPE_OBJECT)
@@ -82,16 +206,30 @@ DZL_DEFINE_COUNTER (queued,     "DzlTaskCache", "Queued",     "Number of queued
 DZL_DEFINE_COUNTER (cached,     "DzlTaskCache", "Cache Size", "Number of cached items")
 DZL_DEFINE_COUNTER (hits,       "DzlTaskCache", "Cache Hits", "Number of cache hits")
 DZL_DEFINE_COUNTER (misses,     "DzlTaskCache", "Cache Miss", "Number of cache misses")
+DZL_DEFINE_COUNTER (evicted,    "DzlTaskCache", "Evictions",  "Number of items evicted to stay within capacity")
+DZL_DEFINE_COUNTER (rejected,   "DzlTaskCache", "Rejected",   "Number of items not admitted by the eviction policy")
+DZL_DEFINE_COUNTER (cost,       "DzlTaskCache", "Cache Cost", "Total cost of cached items")
+DZL_DEFINE_COUNTER (refreshes,  "DzlTaskCache", "Refreshes",  "Number of background refreshes of cached items")
+DZL_DEFINE_COUNTER (disk_hits,  "DzlTaskCache", "Disk Hits",  "Number of cache misses found on disk")
+DZL_DEFINE_COUNTER (disk_miss,  "DzlTaskCache", "Disk Miss",  "Number of cache misses not found on disk")
 
 enum {
   PROP_0,
+  PROP_DISK_DIRECTORY,
+  PROP_DISK_MAX_SIZE,
+  PROP_EVICTION_POLICY,
   PROP_KEY_COPY_FUNC,
   PROP_KEY_DESTROY_FUNC,
   PROP_KEY_EQUAL_FUNC,
   PROP_KEY_HASH_FUNC,
+  PROP_MAX_COST,
+  PROP_MAX_ITEMS,
+  PROP_N_SHARDS,
   PROP_POPULATE_CALLBACK,
   PROP_POPULATE_CALLBACK_DATA,
   PROP_POPULATE_CALLBACK_DATA_DESTROY,
+  PROP_REFRESH_AHEAD,
+  PROP_STALE_WHILE_REVALIDATE,
   PROP_TIME_TO_LIVE,
   PROP_VALUE_COPY_FUNC,
   PROP_VALUE_DESTROY_FUNC,
@@ -100,77 +238,138 @@ enum {
 
 static GParamSpec *properties [LAST_PROP];
 
+static void dzl_task_cache_update_limits (DzlTaskCache *self);
+
+/*
+ * The source is ready once the earliest item expires. Its ready time is
+ * lowered by dzl_task_cache_schedule_eviction() as items are added, and
+ * recomputed by dzl_task_cache_do_eviction() when dispatched.
+ */
 static gboolean
-evict_source_check (GSource *source)
+evict_source_dispatch (GSource     *source,
+                       GSourceFunc  callback,
+                       gpointer     user_data)
 {
-  EvictSource *ev = (EvictSource *)source;
+  gboolean ret = G_SOURCE_CONTINUE;
 
-  g_assert (ev != NULL);
-  g_assert (ev->heap != NULL);
+  if (callback != NULL)
+    ret = callback (user_data);
 
-  if (ev->heap->len > 0)
-    {
-      CacheItem *item;
-      gint64 now;
+  return ret;
+}
+
+static GSourceFuncs evict_source_funcs = {
+  NULL,
+  NULL,
+  evict_source_dispatch,
+  NULL,
+};
+
+static void
+frequency_sketch_clear (FrequencySketch *sketch)
+{
+  g_clear_pointer (&sketch->counters, g_free);
+  sketch->width = 0;
+  sketch->n_additions = 0;
+  sketch->sample_size = 0;
+}
+
+/*
+ * Sizes the sketch for @capacity keys. Growing the sketch loses the
+ * counts gathered so far, which are quickly rebuilt.
+ */
+static void
+frequency_sketch_ensure (FrequencySketch *sketch,
+                         guint            capacity)
+{
+  guint width = 64;
+
+  /* Bound the memory used by the sketch of very large caches */
+  capacity = MIN (capacity, 1 << 18);
 
-      now = g_source_get_time (source);
-      item = dzl_heap_peek (ev->heap, gpointer);
+  while (width < capacity * 4)
+    width <<= 1;
 
-      return (item->evict_at <= now);
+  if (width > sketch->width)
+    {
+      g_free (sketch->counters);
+      sketch->counters = g_new0 (guint8, width * FREQUENCY_DEPTH);
+      sketch->width = width;
+      sketch->n_additions = 0;
+      sketch->sample_size = MAX (capacity, 64) * 10;
     }
+}
 
-  return FALSE;
+static inline guint8 *
+frequency_sketch_counter (const FrequencySketch *sketch,
+                          guint                  hash,
+                          guint                  row)
+{
+  static const guint32 seeds[FREQUENCY_DEPTH] = {
+    0x97cb3127, 0xc2b2ae35, 0x2c1b3c6d, 0x9e3779b1,
+  };
+  guint32 h = (hash + row) * seeds[row];
+
+  h ^= h >> 16;
+
+  return &sketch->counters[row * sketch->width + (h & (sketch->width - 1))];
 }
 
 static void
-evict_source_rearm (GSource *source)
+frequency_sketch_increment (FrequencySketch *sketch,
+                            guint            hash)
 {
-  EvictSource *evict_source = (EvictSource *)source;
-  gint64 ready_time = -1;
-
-  g_assert (source != NULL);
-  g_assert (evict_source != NULL);
+  g_assert (sketch->width > 0);
 
-  if (evict_source->heap->len > 0)
+  for (guint i = 0; i < FREQUENCY_DEPTH; i++)
     {
-      CacheItem *item;
+      guint8 *counter = frequency_sketch_counter (sketch, hash, i);
 
-      item = dzl_heap_peek (evict_source->heap, gpointer);
-      ready_time = item->evict_at;
+      if (*counter < FREQUENCY_MAX)
+        (*counter)++;
     }
 
-  g_source_set_ready_time (source, ready_time);
+  /* Age all counts so that keys which are no longer used lose their rank */
+  if (++sketch->n_additions >= sketch->sample_size)
+    {
+      for (guint i = 0; i < sketch->width * FREQUENCY_DEPTH; i++)
+        sketch->counters[i] >>= 1;
+      sketch->n_additions /= 2;
+    }
 }
 
-static gboolean
-evict_source_dispatch (GSource     *source,
-                       GSourceFunc  callback,
-                       gpointer     user_data)
+static guint
+frequency_sketch_estimate (const FrequencySketch *sketch,
+                           guint                  hash)
 {
-  gboolean ret = G_SOURCE_CONTINUE;
+  guint ret = FREQUENCY_MAX;
 
-  if (callback != NULL)
-    ret = callback (user_data);
+  if (sketch->width == 0)
+    return 0;
 
-  evict_source_rearm (source);
+  for (guint i = 0; i < FREQUENCY_DEPTH; i++)
+    ret = MIN (ret, *frequency_sketch_counter (sketch, hash, i));
 
   return ret;
 }
 
 static void
-evict_source_finalize (GSource *source)
+cache_segment_unlink (CacheSegment *segment,
+                      CacheItem    *item)
 {
-  EvictSource *ev = (EvictSource *)source;
-
-  g_clear_pointer (&ev->heap, dzl_heap_unref);
+  g_queue_unlink (&segment->queue, &item->link);
+  segment->cost -= item->cost;
 }
 
-static GSourceFuncs evict_source_funcs = {
-  NULL,
-  evict_source_check,
-  evict_source_dispatch,
-  evict_source_finalize,
-};
+static void
+cache_segment_push_head (CacheSegment     *segment,
+                         CacheItem        *item,
+                         CacheSegmentKind  kind)
+{
+  g_queue_push_head_link (&segment->queue, &item->link);
+  segment->cost += item->cost;
+  item->segment = kind;
+}
 
 static void
 cache_item_free (gpointer data)
@@ -185,6 +384,15 @@ cache_item_free (gpointer data)
   g_slice_free (CacheItem, item);
 }
 
+static void
+cache_item_set_heap_index (gpointer element,
+                           gsize    index_)
+{
+  CacheItem *item = *(CacheItem **)element;
+
+  item->heap_index = index_;
+}
+
 static gint
 cache_item_compare_evict_at (gconstpointer a,
                              gconstpointer b)
@@ -209,9 +417,33 @@ cache_item_compare_evict_at (gconstpointer a,
     return 0;
 }
 
+/*
+ * Sets the value of @item, which expires after the time to live. Once
+ * expired, it is kept while it may be served stale.
+ */
+static void
+cache_item_set_value (CacheItem     *item,
+                      gconstpointer  value)
+{
+  DzlTaskCache *self = item->self;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (item->value == NULL);
+
+  item->value = self->value_copy_func ((gpointer)value);
+  item->cost = self->cost_func ? self->cost_func (item->value, self->cost_func_data) : 1;
+
+  if (self->time_to_live_usec > 0)
+    {
+      item->expire_at = g_get_monotonic_time () + self->time_to_live_usec;
+      item->evict_at = item->expire_at + self->stale_usec;
+    }
+}
+
 static CacheItem *
 cache_item_new (DzlTaskCache  *self,
                 gconstpointer  key,
+                guint          hash,
                 gconstpointer  value)
 {
   CacheItem *ret;
@@ -221,13 +453,34 @@ cache_item_new (DzlTaskCache  *self,
   ret = g_slice_new0 (CacheItem);
   ret->self = self;
   ret->key = self->key_copy_func ((gpointer)key);
-  ret->value = self->value_copy_func ((gpointer)value);
-  if (self->time_to_live_usec > 0)
-    ret->evict_at = g_get_monotonic_time () + self->time_to_live_usec;
+  ret->link.data = ret;
+  ret->hash = hash;
+  cache_item_set_value (ret, value);
 
   return ret;
 }
 
+/*
+ * Checks if @item should be repopulated in the background when it is
+ * requested, either because it expired but may still be served stale,
+ * or because it expires soon.
+ */
+static gboolean
+cache_item_needs_refresh (const CacheItem *item,
+                          gint64           now)
+{
+  DzlTaskCache *self = item->self;
+
+  if (item->expire_at == 0)
+    return FALSE;
+
+  if (now >= item->expire_at)
+    return self->stale_usec > 0;
+
+  return self->refresh_ahead > 0 &&
+         item->expire_at - now <= self->time_to_live_usec / 100 * self->refresh_ahead;
+}
+
 static void
 cancelled_data_free (gpointer data)
 {
@@ -247,8 +500,7 @@ cancelled_data_free (gpointer data)
 static CancelledData *
 cancelled_data_new (DzlTaskCache  *self,
                     GCancellable  *cancellable,
-                    gconstpointer  key,
-                    gulong         cancelled_id)
+                    gconstpointer  key)
 {
   CancelledData *ret;
 
@@ -256,7 +508,6 @@ cancelled_data_new (DzlTaskCache  *self,
   ret->self = self;
   ret->cancellable = (cancellable != NULL) ? g_object_ref (cancellable) : NULL;
   ret->key = self->key_copy_func ((gpointer)key);
-  ret->cancelled_id = cancelled_id;
 
   return ret;
 }
@@ -267,211 +518,546 @@ dzl_task_cache_dummy_copy_func (gpointer boxed)
   return boxed;
 }
 
+static GVariant *
+dzl_task_cache_variant_serialize (gconstpointer boxed,
+                                  gpointer      user_data)
+{
+  return g_variant_ref ((GVariant *)boxed);
+}
+
+static gpointer
+dzl_task_cache_variant_deserialize (GVariant *variant,
+                                    gpointer  user_data)
+{
+  return g_variant_ref (variant);
+}
+
 static void
 dzl_task_cache_dummy_destroy_func (gpointer boxed)
 {
 }
 
+static CacheShard *
+dzl_task_cache_get_shard (DzlTaskCache *self,
+                          guint         hash)
+{
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (self->shards != NULL);
+
+  /* Mix the high bits in, as hash functions often vary in the low bits */
+  return &self->shards [(hash ^ (hash >> 16)) % self->n_shards];
+}
+
+/*
+ * Lowers the ready time of the eviction source so that it dispatches once
+ * an item expires at @evict_at. This must be called without holding the
+ * lock of any shard.
+ */
+static void
+dzl_task_cache_schedule_eviction (DzlTaskCache *self,
+                                  gint64        evict_at)
+{
+  gint64 ready_time;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+
+  if (evict_at == 0 || self->evict_source == NULL)
+    return;
+
+  g_mutex_lock (&self->evict_mutex);
+  ready_time = g_source_get_ready_time (self->evict_source);
+  if (ready_time < 0 || evict_at < ready_time)
+    g_source_set_ready_time (self->evict_source, evict_at);
+  g_mutex_unlock (&self->evict_mutex);
+}
+
+static void
+dzl_task_cache_remove_item (DzlTaskCache *self,
+                            CacheShard   *shard,
+                            CacheItem    *item,
+                            gboolean      check_heap)
+{
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (shard != NULL);
+  g_assert (item != NULL);
+  g_assert (item->self == self);
+
+  /* Items without a time to live are never in the heap */
+  if (check_heap && item->evict_at != 0)
+    {
+      g_assert (item->heap_index < shard->evict_heap->len);
+      g_assert (item == dzl_heap_index (shard->evict_heap, gpointer, item->heap_index));
+
+      dzl_heap_extract_index (shard->evict_heap, item->heap_index, NULL);
+    }
+
+  cache_segment_unlink (&shard->segments [item->segment], item);
+
+  DZL_COUNTER_DEC (cached);
+  DZL_COUNTER_SUB (cost, (gint64)item->cost);
+
+  g_hash_table_remove (shard->cache, item->key);
+}
+
 static gboolean
 dzl_task_cache_evict_full (DzlTaskCache  *self,
+                           CacheShard    *shard,
                            gconstpointer  key,
                            gboolean       check_heap)
 {
   CacheItem *item;
 
-  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), FALSE);
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (shard != NULL);
 
-  if ((item = g_hash_table_lookup (self->cache, key)))
+  if ((item = g_hash_table_lookup (shard->cache, key)))
     {
-      if (check_heap)
-        {
-          gsize i;
-
-          for (i = 0; i < self->evict_heap->len; i++)
-            {
-              if (item == dzl_heap_index (self->evict_heap, gpointer, i))
-                {
-                  dzl_heap_extract_index (self->evict_heap, i, NULL);
-                  break;
-                }
-            }
-        }
-
-      g_hash_table_remove (self->cache, key);
-
-      DZL_COUNTER_DEC (cached);
+      dzl_task_cache_remove_item (self, shard, item, check_heap);
 
       g_debug ("Evicted 1 item from %s", self->name ?: "unnamed cache");
 
-      if (self->evict_source != NULL)
-        evict_source_rearm (self->evict_source);
-
       return TRUE;
     }
 
   return FALSE;
 }
 
-gboolean
-dzl_task_cache_evict (DzlTaskCache  *self,
-                      gconstpointer  key)
+static gboolean
+dzl_task_cache_is_bounded (DzlTaskCache *self)
 {
-  return dzl_task_cache_evict_full (self, key, TRUE);
+  return self->max_items > 0 || self->max_cost > 0;
 }
 
-void
-dzl_task_cache_evict_all (DzlTaskCache *self)
+/*
+ * Checks if @items items of @cost exceed @percent of the capacity of a
+ * shard. A single item never does, even if it costs more than that.
+ */
+static gboolean
+dzl_task_cache_exceeds (DzlTaskCache *self,
+                        guint         items,
+                        guint64       cost,
+                        guint         percent)
 {
-  guint size;
+  if (items <= 1)
+    return FALSE;
 
-  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+  if (self->shard_max_items > 0 &&
+      items > MAX (1, (guint64)self->shard_max_items * percent / 100))
+    return TRUE;
 
-  size = g_hash_table_size (self->cache);
+  if (self->shard_max_cost > 0 && cost > self->shard_max_cost / 100 * percent)
+    return TRUE;
 
-  while (self->evict_heap->len > 0)
-    {
-      CacheItem *item;
+  return FALSE;
+}
 
-      /* The cache item is owned by the hashtable, so safe to "leak" here */
-      dzl_heap_extract_index (self->evict_heap, self->evict_heap->len - 1, &item);
-    }
+static gboolean
+dzl_task_cache_is_over_budget (DzlTaskCache *self,
+                               CacheShard   *shard)
+{
+  guint64 cost = 0;
 
-  g_hash_table_remove_all (self->cache);
+  for (guint i = 0; i < N_CACHE_SEGMENTS; i++)
+    cost += shard->segments [i].cost;
 
-  DZL_COUNTER_SUB (cached, size);
+  return (self->shard_max_items > 0 && g_hash_table_size (shard->cache) > self->shard_max_items) ||
+         (self->shard_max_cost > 0 && cost > self->shard_max_cost);
+}
 
-  if (self->evict_source != NULL)
-    evict_source_rearm (self->evict_source);
+static gboolean
+dzl_task_cache_segment_is_full (DzlTaskCache     *self,
+                                CacheShard       *shard,
+                                CacheSegmentKind  kind)
+{
+  const CacheSegment *segment = &shard->segments [kind];
+
+  if (self->eviction_policy != DZL_TASK_CACHE_EVICTION_TINY_LFU)
+    return FALSE;
+
+  return dzl_task_cache_exceeds (self,
+                                 segment->queue.length,
+                                 segment->cost,
+                                 kind == CACHE_SEGMENT_WINDOW ? WINDOW_PERCENT : PROTECTED_PERCENT);
 }
 
-/**
- * dzl_task_cache_peek:
- * @self: An #DzlTaskCache
- * @key: The key for the cache
- *
- * Peeks to see @key is contained in the cache and returns the
- * matching #GObject if it does.
- *
- * The reference count of the resulting #GObject is not incremented.
- * For that reason, it is important to remember that this function
- * may only be called from the main thread.
- *
- * Returns: (type GObject.Object) (nullable) (transfer none): A #GObject or
- *   %NULL if the key was not found in the cache.
- */
-gpointer
-dzl_task_cache_peek (DzlTaskCache  *self,
-                     gconstpointer  key)
+static void
+dzl_task_cache_move_item (CacheShard       *shard,
+                          CacheItem        *item,
+                          CacheSegmentKind  kind)
 {
-  CacheItem *item;
+  cache_segment_unlink (&shard->segments [item->segment], item);
+  cache_segment_push_head (&shard->segments [kind], item, kind);
+}
 
-  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), NULL);
+static CacheItem *
+dzl_task_cache_main_victim (CacheShard *shard)
+{
+  GList *link;
 
-  if ((item = g_hash_table_lookup (self->cache, key)))
-    {
-      DZL_COUNTER_INC (hits);
-      return item->value;
-    }
+  if (!(link = shard->segments [CACHE_SEGMENT_PROBATION].queue.tail))
+    link = shard->segments [CACHE_SEGMENT_PROTECTED].queue.tail;
 
-  return NULL;
+  return link ? link->data : NULL;
 }
 
 static void
-dzl_task_cache_propagate_error (DzlTaskCache  *self,
-                                gconstpointer  key,
-                                const GError  *error)
+dzl_task_cache_evict_item (DzlTaskCache *self,
+                           CacheShard   *shard,
+                           CacheItem    *item)
 {
-  GPtrArray *queued;
+  dzl_task_cache_remove_item (self, shard, item, TRUE);
+
+  DZL_COUNTER_INC (evicted);
+}
+
+/*
+ * Evicts items until @shard is within its share of #DzlTaskCache:max-items
+ * and #DzlTaskCache:max-cost.
+ *
+ * With W-TinyLFU, new items enter a small admission window. Once they
+ * leave it, they are only admitted into the main segments if they were
+ * requested more often than the item they would replace. That way, a
+ * scan over many items which are used once cannot flush the items which
+ * are used all the time.
+ */
+static void
+dzl_task_cache_trim (DzlTaskCache *self,
+                     CacheShard   *shard)
+{
+  CacheSegment *window = &shard->segments [CACHE_SEGMENT_WINDOW];
+  guint size;
 
   g_assert (DZL_IS_TASK_CACHE (self));
-  g_assert (error != NULL);
+  g_assert (shard != NULL);
 
-  if ((queued = g_hash_table_lookup (self->queued, key)))
-    {
-      gint64 count = queued->len;
-      gsize i;
+  if (!dzl_task_cache_is_bounded (self))
+    return;
 
-      /* we can't use steal because we want the key freed */
-      g_ptr_array_ref (queued);
-      g_hash_table_remove (self->queued, key);
+  size = g_hash_table_size (shard->cache);
 
-      for (i = 0; i < queued->len; i++)
+  while (dzl_task_cache_segment_is_full (self, shard, CACHE_SEGMENT_WINDOW))
+    {
+      CacheItem *candidate = window->queue.tail->data;
+      CacheItem *victim;
+
+      if (dzl_task_cache_is_over_budget (self, shard) &&
+          NULL != (victim = dzl_task_cache_main_victim (shard)))
         {
-          GTask *task;
+          if (frequency_sketch_estimate (&shard->sketch, candidate->hash) <=
+              frequency_sketch_estimate (&shard->sketch, victim->hash))
+            {
+              dzl_task_cache_evict_item (self, shard, candidate);
+              DZL_COUNTER_INC (rejected);
+              continue;
+            }
 
-          task = g_ptr_array_index (queued, i);
-          g_task_return_error (task, g_error_copy (error));
+          dzl_task_cache_evict_item (self, shard, victim);
         }
 
-      g_ptr_array_unref (queued);
+      dzl_task_cache_move_item (shard, candidate, CACHE_SEGMENT_PROBATION);
+    }
 
-      DZL_COUNTER_SUB (queued, count);
+  while (dzl_task_cache_is_over_budget (self, shard))
+    {
+      CacheItem *victim;
+
+      if (!(victim = dzl_task_cache_main_victim (shard)))
+        victim = window->queue.tail->data;
+
+      dzl_task_cache_evict_item (self, shard, victim);
     }
+
+  if (size != g_hash_table_size (shard->cache))
+    g_debug ("Evicted %u items from %s to stay within capacity",
+             size - g_hash_table_size (shard->cache),
+             self->name ?: "unnamed cache");
 }
 
+/*
+ * Records a request for the key hashing to @hash in the frequency sketch,
+ * which is sized for the capacity, or the current size if unbounded.
+ */
 static void
-dzl_task_cache_populate (DzlTaskCache  *self,
-                         gconstpointer  key,
-                         gpointer       value)
+dzl_task_cache_record (DzlTaskCache *self,
+                       CacheShard   *shard,
+                       guint         hash)
 {
-  CacheItem *item;
-
   g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (shard != NULL);
 
-  item = cache_item_new (self, key, value);
+  if (self->eviction_policy != DZL_TASK_CACHE_EVICTION_TINY_LFU)
+    return;
 
-  if (g_hash_table_contains (self->cache, key))
-    dzl_task_cache_evict (self, key);
-  g_hash_table_insert (self->cache, item->key, item);
-  dzl_heap_insert_val (self->evict_heap, item);
-
-  DZL_COUNTER_INC (cached);
-
-  if (self->evict_source != NULL)
-    evict_source_rearm (self->evict_source);
+  frequency_sketch_ensure (&shard->sketch, MAX (self->shard_max_items, g_hash_table_size (shard->cache) + 1));
+  frequency_sketch_increment (&shard->sketch, hash);
 }
 
+/*
+ * Records a request for @item, which makes it the most recently used
+ * item of its segment. With W-TinyLFU, a hit on an item in the probation
+ * segment promotes it to the protected segment.
+ */
 static void
-dzl_task_cache_propagate_pointer (DzlTaskCache  *self,
-                                  gconstpointer  key,
-                                  gpointer       value)
+dzl_task_cache_touch (DzlTaskCache *self,
+                      CacheShard   *shard,
+                      CacheItem    *item)
 {
-  GPtrArray *queued = NULL;
-
   g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (shard != NULL);
+  g_assert (item != NULL);
 
-  if ((queued = g_hash_table_lookup (self->queued, key)))
-    {
-      gint64 count = queued->len;
-      gsize i;
-
-      g_ptr_array_ref (queued);
-      g_hash_table_remove (self->queued, key);
-
-      for (i = 0; i < queued->len; i++)
-        {
-          GTask *task;
+  dzl_task_cache_record (self, shard, item->hash);
 
-          task = g_ptr_array_index (queued, i);
-          g_task_return_pointer (task,
-                                 self->value_copy_func (value),
-                                 self->value_destroy_func);
-        }
+  if (item->segment == CACHE_SEGMENT_PROBATION)
+    {
+      CacheSegment *protected = &shard->segments [CACHE_SEGMENT_PROTECTED];
 
-      g_ptr_array_unref (queued);
+      dzl_task_cache_move_item (shard, item, CACHE_SEGMENT_PROTECTED);
 
-      DZL_COUNTER_SUB (queued, count);
+      while (dzl_task_cache_segment_is_full (self, shard, CACHE_SEGMENT_PROTECTED))
+        dzl_task_cache_move_item (shard, protected->queue.tail->data, CACHE_SEGMENT_PROBATION);
+    }
+  else
+    {
+      dzl_task_cache_move_item (shard, item, item->segment);
     }
 }
 
+gboolean
+dzl_task_cache_evict (DzlTaskCache  *self,
+                      gconstpointer  key)
+{
+  CacheShard *shard;
+  gboolean ret;
+
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), FALSE);
+
+  shard = dzl_task_cache_get_shard (self, self->key_hash_func (key));
+
+  g_mutex_lock (&shard->mutex);
+  ret = dzl_task_cache_evict_full (self, shard, key, TRUE);
+  g_mutex_unlock (&shard->mutex);
+
+  return ret;
+}
+
+static void
+dzl_task_cache_shard_clear (CacheShard *shard)
+{
+  guint size = g_hash_table_size (shard->cache);
+
+  while (shard->evict_heap->len > 0)
+    {
+      CacheItem *item;
+
+      /* The cache item is owned by the hashtable, so safe to "leak" here */
+      dzl_heap_extract_index (shard->evict_heap, shard->evict_heap->len - 1, &item);
+    }
+
+  for (guint i = 0; i < N_CACHE_SEGMENTS; i++)
+    {
+      DZL_COUNTER_SUB (cost, (gint64)shard->segments [i].cost);
+      g_queue_init (&shard->segments [i].queue);
+      shard->segments [i].cost = 0;
+    }
+
+  g_hash_table_remove_all (shard->cache);
+
+  DZL_COUNTER_SUB (cached, size);
+}
+
+void
+dzl_task_cache_evict_all (DzlTaskCache *self)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+
+  for (guint i = 0; i < self->n_shards; i++)
+    {
+      CacheShard *shard = &self->shards [i];
+
+      g_mutex_lock (&shard->mutex);
+      dzl_task_cache_shard_clear (shard);
+      g_mutex_unlock (&shard->mutex);
+    }
+}
+
+/**
+ * dzl_task_cache_peek:
+ * @self: An #DzlTaskCache
+ * @key: The key for the cache
+ *
+ * Peeks to see @key is contained in the cache and returns the
+ * matching #GObject if it does.
+ *
+ * The reference count of the resulting #GObject is not incremented.
+ * For that reason, it is important to remember that this function
+ * may only be called from the main thread, and only when no other
+ * thread may cause @key to be evicted.
+ *
+ * Returns: (type GObject.Object) (nullable) (transfer none): A #GObject or
+ *   %NULL if the key was not found in the cache.
+ */
+gpointer
+dzl_task_cache_peek (DzlTaskCache  *self,
+                     gconstpointer  key)
+{
+  CacheShard *shard;
+  CacheItem *item;
+  gpointer ret = NULL;
+
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), NULL);
+
+  shard = dzl_task_cache_get_shard (self, self->key_hash_func (key));
+
+  g_mutex_lock (&shard->mutex);
+  if ((item = g_hash_table_lookup (shard->cache, key)))
+    {
+      DZL_COUNTER_INC (hits);
+      dzl_task_cache_touch (self, shard, item);
+      ret = item->value;
+    }
+  g_mutex_unlock (&shard->mutex);
+
+  return ret;
+}
+
+/*
+ * Removes the tasks waiting for @key from @shard. They must be completed
+ * by the caller once the lock of @shard is released.
+ */
+static GPtrArray *
+dzl_task_cache_steal_queued (CacheShard    *shard,
+                             gconstpointer  key)
+{
+  GPtrArray *queued;
+
+  if ((queued = g_hash_table_lookup (shard->queued, key)))
+    {
+      /* we can't use steal because we want the key freed */
+      g_ptr_array_ref (queued);
+      g_hash_table_remove (shard->queued, key);
+    }
+
+  return queued;
+}
+
+static void
+dzl_task_cache_propagate_error (DzlTaskCache *self,
+                                GPtrArray    *queued,
+                                const GError *error)
+{
+  gint64 count = queued->len;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (error != NULL);
+
+  for (guint i = 0; i < queued->len; i++)
+    {
+      GTask *task;
+
+      task = g_ptr_array_index (queued, i);
+      g_task_return_error (task, g_error_copy (error));
+    }
+
+  DZL_COUNTER_SUB (queued, count);
+}
+
+/*
+ * Adds @value to @shard, evicting items as necessary.
+ *
+ * Returns: the time at which the new item expires, or 0.
+ */
+static gint64
+dzl_task_cache_populate (DzlTaskCache  *self,
+                         CacheShard    *shard,
+                         gconstpointer  key,
+                         gpointer       value)
+{
+  CacheItem *item;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (shard != NULL);
+
+  if ((item = g_hash_table_lookup (shard->cache, key)))
+    {
+      CacheSegment *segment = &shard->segments [item->segment];
+
+      /*
+       * Replace the value of refreshed items in place, so that they keep
+       * their rank in the eviction policy.
+       */
+      if (item->evict_at != 0)
+        dzl_heap_extract_index (shard->evict_heap, item->heap_index, NULL);
+
+      cache_segment_unlink (segment, item);
+      DZL_COUNTER_SUB (cost, (gint64)item->cost);
+
+      g_clear_pointer (&item->value, self->value_destroy_func);
+      cache_item_set_value (item, value);
+
+      cache_segment_push_head (segment, item, item->segment);
+      DZL_COUNTER_ADD (cost, (gint64)item->cost);
+    }
+  else
+    {
+      item = cache_item_new (self, key, self->key_hash_func (key), value);
+
+      g_hash_table_insert (shard->cache, item->key, item);
+      cache_segment_push_head (&shard->segments [CACHE_SEGMENT_WINDOW], item, CACHE_SEGMENT_WINDOW);
+
+      DZL_COUNTER_INC (cached);
+      DZL_COUNTER_ADD (cost, (gint64)item->cost);
+    }
+
+  /* Evicting every other item would still not make room for this one */
+  if (self->shard_max_cost > 0 && item->cost > self->shard_max_cost)
+    {
+      dzl_task_cache_remove_item (self, shard, item, FALSE);
+      DZL_COUNTER_INC (rejected);
+      return 0;
+    }
+
+  if (item->evict_at != 0)
+    dzl_heap_insert_val (shard->evict_heap, item);
+
+  dzl_task_cache_trim (self, shard);
+
+  return item->evict_at;
+}
+
+static void
+dzl_task_cache_propagate_pointer (DzlTaskCache *self,
+                                  GPtrArray    *queued,
+                                  gpointer      value)
+{
+  gint64 count = queued->len;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+
+  for (guint i = 0; i < queued->len; i++)
+    {
+      GTask *task;
+
+      task = g_ptr_array_index (queued, i);
+      g_task_return_pointer (task,
+                             self->value_copy_func (value),
+                             self->value_destroy_func);
+    }
+
+  DZL_COUNTER_SUB (queued, count);
+}
+
 static gboolean
 dzl_task_cache_cancel_in_idle (gpointer user_data)
 {
+  g_autoptr(GCancellable) fetch_cancellable = NULL;
   DzlTaskCache *self;
   CancelledData *data;
   GCancellable *cancellable;
+  CacheShard *shard;
   GPtrArray *queued;
   GTask *task = user_data;
+  gboolean found = FALSE;
   gboolean cancelled = FALSE;
 
   g_assert (G_IS_TASK (task));
@@ -486,7 +1072,11 @@ dzl_task_cache_cancel_in_idle (gpointer user_data)
   g_assert (data->self == self);
   g_assert (data->cancellable == cancellable);
 
-  if ((queued = g_hash_table_lookup (self->queued, data->key)))
+  shard = dzl_task_cache_get_shard (self, self->key_hash_func (data->key));
+
+  g_mutex_lock (&shard->mutex);
+
+  if ((queued = g_hash_table_lookup (shard->queued, data->key)))
     {
       for (guint i = 0; i < queued->len; i++)
         {
@@ -498,8 +1088,9 @@ dzl_task_cache_cancel_in_idle (gpointer user_data)
 
           if (queued_task == task && queued_cancellable == cancellable)
             {
-              cancelled = g_task_return_error_if_cancelled (task);
+              /* The idle source holds a reference to @task */
               g_ptr_array_remove_index_fast (queued, i);
+              found = TRUE;
 
               DZL_COUNTER_DEC (queued);
               break;
@@ -508,18 +1099,22 @@ dzl_task_cache_cancel_in_idle (gpointer user_data)
 
       if (queued->len == 0)
         {
-          GTask *fetch_task;
+          GCancellable *in_flight;
 
-          if ((fetch_task = g_hash_table_lookup (self->in_flight, data->key)))
-            {
-              GCancellable *fetch_cancellable;
-
-              fetch_cancellable = g_task_get_cancellable (fetch_task);
-              g_cancellable_cancel (fetch_cancellable);
-            }
+          if ((in_flight = g_hash_table_lookup (shard->in_flight, data->key)))
+            fetch_cancellable = g_object_ref (in_flight);
         }
     }
 
+  g_mutex_unlock (&shard->mutex);
+
+  /* Complete the task without holding the lock, as it may call back into us */
+  if (found)
+    cancelled = g_task_return_error_if_cancelled (task);
+
+  if (fetch_cancellable != NULL)
+    g_cancellable_cancel (fetch_cancellable);
+
   g_return_val_if_fail (cancelled, G_SOURCE_REMOVE);
 
   return G_SOURCE_REMOVE;
@@ -531,7 +1126,6 @@ dzl_task_cache_cancelled_cb (GCancellable *cancellable,
 {
   DzlTaskCache *self;
   CancelledData *data;
-  GMainContext *context;
   g_autoptr(GSource) source = NULL;
   GTask *task = user_data;
 
@@ -546,12 +1140,11 @@ dzl_task_cache_cancelled_cb (GCancellable *cancellable,
   g_assert (data->self == self);
   g_assert (data->cancellable == cancellable);
 
+  /* The cancellable may be cancelled from any thread */
   source = g_idle_source_new ();
   g_source_set_callback (source, dzl_task_cache_cancel_in_idle, g_object_ref (task), g_object_unref);
   g_source_set_name (source, "[dzl] dzl_task_cache_cancel_in_idle");
-
-  context = g_main_context_get_thread_default ();
-  g_source_attach (source, context);
+  g_source_attach (source, g_task_get_context (task));
 }
 
 static void
@@ -560,27 +1153,44 @@ dzl_task_cache_fetch_cb (GObject      *object,
                          gpointer      user_data)
 {
   DzlTaskCache *self = (DzlTaskCache *)object;
+  g_autoptr(GPtrArray) queued = NULL;
   GTask *task = (GTask *)result;
+  CacheShard *shard;
   GError *error = NULL;
   gpointer key = user_data;
   gpointer ret;
+  gint64 evict_at = 0;
 
   g_assert (DZL_IS_TASK_CACHE (self));
   g_assert (G_IS_TASK (task));
 
-  g_hash_table_remove (self->in_flight, key);
-
   ret = g_task_propagate_pointer (task, &error);
 
+  shard = dzl_task_cache_get_shard (self, self->key_hash_func (key));
+
+  g_mutex_lock (&shard->mutex);
+  g_hash_table_remove (shard->in_flight, key);
+  if (ret != NULL)
+    evict_at = dzl_task_cache_populate (self, shard, key, ret);
+  queued = dzl_task_cache_steal_queued (shard, key);
+  g_mutex_unlock (&shard->mutex);
+
+  dzl_task_cache_schedule_eviction (self, evict_at);
+
+  /*
+   * Each waiting task completes on the main context of the thread which
+   * requested it, as GTask dispatches there for us.
+   */
   if (ret != NULL)
     {
-      dzl_task_cache_populate (self, key, ret);
-      dzl_task_cache_propagate_pointer (self, key, ret);
+      if (queued != NULL)
+        dzl_task_cache_propagate_pointer (self, queued, ret);
       self->value_destroy_func (ret);
     }
   else
     {
-      dzl_task_cache_propagate_error (self, key, error);
+      if (queued != NULL)
+        dzl_task_cache_propagate_error (self, queued, error);
       g_clear_error (&error);
     }
 
@@ -590,6 +1200,407 @@ dzl_task_cache_fetch_cb (GObject      *object,
   DZL_COUNTER_DEC (in_flight);
 }
 
+/*
+ * Registers a fetch of @key in @shard, unless one is already in flight.
+ * Requests for the same key wait for the same fetch, whichever thread
+ * started it.
+ *
+ * Returns: (transfer full) (nullable): the cancellable of the new fetch,
+ *   to be passed to dzl_task_cache_dispatch_fetch() once the lock of
+ *   @shard is released.
+ */
+static GCancellable *
+dzl_task_cache_begin_fetch (DzlTaskCache  *self,
+                            CacheShard    *shard,
+                            gconstpointer  key)
+{
+  GCancellable *fetch_cancellable;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (shard != NULL);
+
+  if (g_hash_table_contains (shard->in_flight, key))
+    return NULL;
+
+  fetch_cancellable = g_cancellable_new ();
+  g_hash_table_insert (shard->in_flight,
+                       self->key_copy_func ((gpointer)key),
+                       g_object_ref (fetch_cancellable));
+
+  DZL_COUNTER_INC (in_flight);
+
+  return fetch_cancellable;
+}
+
+static DzlTaskCacheDisk *
+dzl_task_cache_dup_disk (DzlTaskCache *self)
+{
+  DzlTaskCacheDisk *ret = NULL;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+
+  g_mutex_lock (&self->disk_mutex);
+  if (self->disk != NULL)
+    ret = dzl_task_cache_disk_ref (self->disk);
+  g_mutex_unlock (&self->disk_mutex);
+
+  return ret;
+}
+
+static void
+disk_fetch_free (DiskFetch *fetch)
+{
+  g_clear_pointer (&fetch->key, fetch->self->key_destroy_func);
+  g_clear_pointer (&fetch->key_variant, g_variant_unref);
+  g_clear_pointer (&fetch->disk, dzl_task_cache_disk_unref);
+  g_clear_object (&fetch->fetch_task);
+  fetch->self = NULL;
+
+  g_slice_free (DiskFetch, fetch);
+}
+
+static void
+disk_store_free (gpointer data)
+{
+  DiskStore *store = data;
+
+  g_clear_pointer (&store->disk, dzl_task_cache_disk_unref);
+  g_clear_pointer (&store->key_variant, g_variant_unref);
+  g_clear_pointer (&store->value_variant, g_variant_unref);
+
+  g_slice_free (DiskStore, store);
+}
+
+static void
+dzl_task_cache_disk_store_worker (GTask        *task,
+                                  gpointer      source_object,
+                                  gpointer      task_data,
+                                  GCancellable *cancellable)
+{
+  DiskStore *store = task_data;
+  g_autoptr(GError) error = NULL;
+
+  g_assert (G_IS_TASK (task));
+  g_assert (store != NULL);
+
+  if (!dzl_task_cache_disk_store (store->disk, store->key_variant, store->value_variant, &error) ||
+      !dzl_task_cache_disk_reclaim (store->disk, cancellable, &error))
+    g_debug ("Failed to write the disk cache: %s", error->message);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+dzl_task_cache_disk_reclaim_worker (GTask        *task,
+                                    gpointer      source_object,
+                                    gpointer      task_data,
+                                    GCancellable *cancellable)
+{
+  DzlTaskCacheDisk *disk = task_data;
+  g_autoptr(GError) error = NULL;
+
+  g_assert (G_IS_TASK (task));
+  g_assert (disk != NULL);
+
+  if (!dzl_task_cache_disk_reclaim (disk, cancellable, &error))
+    g_warning ("Failed to reclaim the disk cache: %s", error->message);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/*
+ * Writes @value to the disk tier in a worker thread. Values which cannot
+ * be serialized are only kept in memory.
+ */
+static void
+dzl_task_cache_disk_store_async (DzlTaskCache *self,
+                                 DiskFetch    *fetch,
+                                 gpointer      value)
+{
+  g_autoptr(GTask) task = NULL;
+  DiskStore *store;
+  GVariant *value_variant;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (fetch != NULL);
+  g_assert (value != NULL);
+
+  if (!(value_variant = self->value_serialize_func (value, self->serialize_data)))
+    return;
+
+  store = g_slice_new0 (DiskStore);
+  store->disk = dzl_task_cache_disk_ref (fetch->disk);
+  store->key_variant = g_variant_ref (fetch->key_variant);
+  store->value_variant = g_variant_take_ref (value_variant);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_source_tag (task, dzl_task_cache_disk_store_async);
+  g_task_set_task_data (task, store, disk_store_free);
+  g_task_run_in_thread (task, dzl_task_cache_disk_store_worker);
+}
+
+static void
+dzl_task_cache_disk_populate_cb (GObject      *object,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+  DzlTaskCache *self = (DzlTaskCache *)object;
+  DiskFetch *fetch = user_data;
+  GTask *task = (GTask *)result;
+  GTask *fetch_task;
+  GError *error = NULL;
+  gpointer ret;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (G_IS_TASK (task));
+  g_assert (fetch != NULL);
+
+  /* The reference to the fetch is released by dzl_task_cache_fetch_cb() */
+  fetch_task = g_steal_pointer (&fetch->fetch_task);
+
+  /* Write through to disk, then complete the fetch as usual */
+  if ((ret = g_task_propagate_pointer (task, &error)))
+    {
+      dzl_task_cache_disk_store_async (self, fetch, ret);
+      g_task_return_pointer (fetch_task, ret, self->value_destroy_func);
+    }
+  else
+    {
+      g_task_return_error (fetch_task, error);
+    }
+
+  disk_fetch_free (fetch);
+  g_object_unref (task);
+}
+
+/*
+ * Runs the populate callback through an intermediate task, so that the
+ * result may be stored on disk before the fetch completes.
+ */
+static void
+dzl_task_cache_disk_populate (DzlTaskCache *self,
+                              DiskFetch    *fetch)
+{
+  GTask *populate_task;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (fetch != NULL);
+
+  populate_task = g_task_new (self,
+                              g_task_get_cancellable (fetch->fetch_task),
+                              dzl_task_cache_disk_populate_cb,
+                              fetch);
+
+  self->populate_callback (self,
+                           fetch->key,
+                           populate_task,
+                           self->populate_callback_data);
+}
+
+static void
+dzl_task_cache_disk_lookup_worker (GTask        *task,
+                                   gpointer      source_object,
+                                   gpointer      task_data,
+                                   GCancellable *cancellable)
+{
+  DiskFetch *fetch = task_data;
+  g_autoptr(GError) error = NULL;
+  GVariant *value_variant;
+
+  g_assert (G_IS_TASK (task));
+  g_assert (fetch != NULL);
+
+  /* Errors are treated like a miss, as the value can be populated again */
+  if (!(value_variant = dzl_task_cache_disk_lookup (fetch->disk, fetch->key_variant, &error)) &&
+      error != NULL)
+    g_debug ("Failed to read the disk cache: %s", error->message);
+
+  g_task_return_pointer (task, value_variant, (GDestroyNotify)g_variant_unref);
+}
+
+static void
+dzl_task_cache_disk_lookup_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+  DzlTaskCache *self = (DzlTaskCache *)object;
+  g_autoptr(GVariant) value_variant = NULL;
+  DiskFetch *fetch = user_data;
+  gpointer ret = NULL;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (G_IS_TASK (result));
+  g_assert (fetch != NULL);
+
+  value_variant = g_task_propagate_pointer (G_TASK (result), NULL);
+
+  /* Deserialize in the main context of the cache, as the values may not be thread-safe */
+  if (value_variant != NULL)
+    ret = self->value_deserialize_func (value_variant, self->serialize_data);
+
+  if (ret == NULL)
+    {
+      DZL_COUNTER_INC (disk_miss);
+      dzl_task_cache_disk_populate (self, fetch);
+      return;
+    }
+
+  DZL_COUNTER_INC (disk_hits);
+
+  /* The reference to the fetch is released by dzl_task_cache_fetch_cb() */
+  g_task_return_pointer (g_steal_pointer (&fetch->fetch_task), ret, self->value_destroy_func);
+  disk_fetch_free (fetch);
+}
+
+static void
+pending_fetch_free (gpointer data)
+{
+  PendingFetch *pending = data;
+
+  g_clear_pointer (&pending->key, pending->self->key_destroy_func);
+  g_clear_object (&pending->cancellable);
+  g_clear_object (&pending->self);
+
+  g_slice_free (PendingFetch, pending);
+}
+
+static gboolean
+dzl_task_cache_dispatch_in_context (gpointer user_data)
+{
+  g_autoptr(DzlTaskCacheDisk) disk = NULL;
+  g_autoptr(GTask) fetch_task = NULL;
+  PendingFetch *pending = user_data;
+  DzlTaskCache *self;
+  GVariant *key_variant;
+
+  g_assert (pending != NULL);
+  g_assert (DZL_IS_TASK_CACHE (pending->self));
+  g_assert (G_IS_CANCELLABLE (pending->cancellable));
+
+  self = pending->self;
+
+  /*
+   * The tasks of the fetch, including those created by the populate
+   * callback, complete in the main context of the cache.
+   */
+  g_main_context_push_thread_default (self->main_context);
+
+  fetch_task = g_task_new (self,
+                           pending->cancellable,
+                           dzl_task_cache_fetch_cb,
+                           self->key_copy_func (pending->key));
+
+  if (NULL != (disk = dzl_task_cache_dup_disk (self)) &&
+      NULL != (key_variant = self->key_serialize_func (pending->key, self->serialize_data)))
+    {
+      DiskFetch *fetch;
+
+      fetch = g_slice_new0 (DiskFetch);
+      fetch->self = self;
+      fetch->disk = g_steal_pointer (&disk);
+      fetch->key = self->key_copy_func (pending->key);
+      fetch->key_variant = g_variant_take_ref (key_variant);
+      fetch->fetch_task = g_object_ref (fetch_task);
+
+      if (pending->check_disk)
+        {
+          g_autoptr(GTask) task = NULL;
+
+          task = g_task_new (self, NULL, dzl_task_cache_disk_lookup_cb, fetch);
+          g_task_set_source_tag (task, dzl_task_cache_dispatch_in_context);
+          g_task_set_task_data (task, fetch, NULL);
+          g_task_run_in_thread (task, dzl_task_cache_disk_lookup_worker);
+        }
+      else
+        {
+          dzl_task_cache_disk_populate (self, fetch);
+        }
+    }
+  else
+    {
+      self->populate_callback (self,
+                               pending->key,
+                               g_object_ref (fetch_task),
+                               self->populate_callback_data);
+    }
+
+  g_main_context_pop_thread_default (self->main_context);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Populates @key for @fetch_cancellable, which must have been returned by
+ * dzl_task_cache_begin_fetch(). With a disk tier, a miss first looks for
+ * the value on disk, unless @check_disk is %FALSE such as when refreshing
+ * an item, and populated values are written to disk.
+ *
+ * The fetch is shared by every request for @key, so it runs in the main
+ * context of the cache rather than that of the requesting thread, which
+ * may stop iterating its main context once its own request is cancelled.
+ */
+static void
+dzl_task_cache_dispatch_fetch (DzlTaskCache  *self,
+                               gconstpointer  key,
+                               GCancellable  *fetch_cancellable,
+                               gboolean       check_disk)
+{
+  PendingFetch *pending;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (G_IS_CANCELLABLE (fetch_cancellable));
+
+  pending = g_slice_new0 (PendingFetch);
+  pending->self = g_object_ref (self);
+  pending->key = self->key_copy_func ((gpointer)key);
+  pending->cancellable = g_object_ref (fetch_cancellable);
+  pending->check_disk = !!check_disk;
+
+  /* Runs immediately if this thread owns the main context of the cache */
+  g_main_context_invoke_full (self->main_context,
+                              G_PRIORITY_DEFAULT,
+                              dzl_task_cache_dispatch_in_context,
+                              pending,
+                              pending_fetch_free);
+}
+
+/*
+ * Like dzl_task_cache_peek() but returns a copy of the value, which
+ * remains valid if another thread evicts @key. The lock of @shard must
+ * be held.
+ *
+ * If the item is stale, or about to expire, @refresh is set to the
+ * cancellable of a fetch which repopulates it in the background.
+ */
+static gpointer
+dzl_task_cache_lookup (DzlTaskCache   *self,
+                       CacheShard     *shard,
+                       gconstpointer   key,
+                       GCancellable  **refresh)
+{
+  CacheItem *item;
+  gpointer ret = NULL;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+  g_assert (shard != NULL);
+  g_assert (refresh != NULL);
+
+  *refresh = NULL;
+
+  if ((item = g_hash_table_lookup (shard->cache, key)))
+    {
+      DZL_COUNTER_INC (hits);
+      dzl_task_cache_touch (self, shard, item);
+      ret = self->value_copy_func (item->value);
+
+      if (cache_item_needs_refresh (item, g_get_monotonic_time ()) &&
+          NULL != (*refresh = dzl_task_cache_begin_fetch (self, shard, key)))
+        DZL_COUNTER_INC (refreshes);
+    }
+
+  return ret;
+}
+
 void
 dzl_task_cache_get_async (DzlTaskCache        *self,
                           gconstpointer        key,
@@ -598,12 +1609,13 @@ dzl_task_cache_get_async (DzlTaskCache        *self,
                           GAsyncReadyCallback  callback,
                           gpointer             user_data)
 {
-  g_autoptr(GTask) fetch_task = NULL;
+  g_autoptr(GCancellable) fetch_cancellable = NULL;
   g_autoptr(GTask) task = NULL;
   CancelledData *data;
+  CacheShard *shard;
   GPtrArray *queued;
   gpointer ret;
-  gulong cancelled_id = 0;
+  guint hash;
 
   g_return_if_fail (DZL_IS_TASK_CACHE (self));
   g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
@@ -611,27 +1623,48 @@ dzl_task_cache_get_async (DzlTaskCache        *self,
   task = g_task_new (self, cancellable, callback, user_data);
   g_task_set_return_on_cancel (task, FALSE);
 
+  /* Must be set before another thread can see the task in the queue */
+  data = cancelled_data_new (self, cancellable, key);
+  g_task_set_task_data (task, data, cancelled_data_free);
+
+  hash = self->key_hash_func (key);
+  shard = dzl_task_cache_get_shard (self, hash);
+
+  /*
+   * The lookup, queueing the request and starting the fetch happen in a
+   * single critical section. Otherwise a fetch completing in another
+   * thread could populate @key after the miss, and we would fetch it again.
+   */
+  g_mutex_lock (&shard->mutex);
+
   /*
-   * If we have the answer, return it now.
+   * If we have the answer, return it now, even if it is stale. It will
+   * be refreshed in the background for the next request.
    */
-  if (!force_update && (ret = dzl_task_cache_peek (self, key)))
+  if (!force_update && (ret = dzl_task_cache_lookup (self, shard, key, &fetch_cancellable)))
     {
-      g_task_return_pointer (task,
-                             self->value_copy_func (ret),
-                             self->value_destroy_func);
+      g_mutex_unlock (&shard->mutex);
+
+      g_task_return_pointer (task, ret, self->value_destroy_func);
+
+      if (fetch_cancellable != NULL)
+        dzl_task_cache_dispatch_fetch (self, key, fetch_cancellable, FALSE);
+
       return;
     }
 
   DZL_COUNTER_INC (misses);
 
+  dzl_task_cache_record (self, shard, hash);
+
   /*
    * Always queue the request. If we need to dispatch the worker to
    * fetch the result, that will happen with another task.
    */
-  if (!(queued = g_hash_table_lookup (self->queued, key)))
+  if (!(queued = g_hash_table_lookup (shard->queued, key)))
     {
       queued = g_ptr_array_new_with_free_func (g_object_unref);
-      g_hash_table_insert (self->queued,
+      g_hash_table_insert (shard->queued,
                            self->key_copy_func ((gpointer)key),
                            queued);
     }
@@ -643,40 +1676,20 @@ dzl_task_cache_get_async (DzlTaskCache        *self,
    * The in_flight hashtable will have a bit set if we have queued
    * an operation for this key.
    */
-  if (!g_hash_table_contains (self->in_flight, key))
-    {
-      g_autoptr(GCancellable) fetch_cancellable = NULL;
-
-      fetch_cancellable = g_cancellable_new ();
-      fetch_task = g_task_new (self,
-                               fetch_cancellable,
-                               dzl_task_cache_fetch_cb,
-                               self->key_copy_func ((gpointer)key));
-      g_hash_table_insert (self->in_flight,
-                           self->key_copy_func ((gpointer)key),
-                           g_object_ref (fetch_task));
-    }
+  fetch_cancellable = dzl_task_cache_begin_fetch (self, shard, key);
+
+  g_mutex_unlock (&shard->mutex);
 
   if (cancellable != NULL)
     {
-      cancelled_id = g_cancellable_connect (cancellable,
-                                            G_CALLBACK (dzl_task_cache_cancelled_cb),
-                                            task,
-                                            NULL);
+      data->cancelled_id = g_cancellable_connect (cancellable,
+                                                  G_CALLBACK (dzl_task_cache_cancelled_cb),
+                                                  task,
+                                                  NULL);
     }
 
-  data = cancelled_data_new (self, cancellable, key, cancelled_id);
-  g_task_set_task_data (task, data, cancelled_data_free);
-
-  if (fetch_task != NULL)
-    {
-      self->populate_callback (self,
-                               key,
-                               g_object_ref (fetch_task),
-                               self->populate_callback_data);
-
-      DZL_COUNTER_INC (in_flight);
-    }
+  if (fetch_cancellable != NULL)
+    dzl_task_cache_dispatch_fetch (self, key, fetch_cancellable, !force_update);
 }
 
 /**
@@ -705,46 +1718,62 @@ dzl_task_cache_do_eviction (gpointer user_data)
 {
   DzlTaskCache *self = user_data;
   gint64 now = g_get_monotonic_time ();
+  gint64 ready_time = -1;
+
+  /*
+   * Holding evict_mutex while walking the shards ensures that items added
+   * meanwhile lower the ready time after we have computed it.
+   */
+  g_mutex_lock (&self->evict_mutex);
 
-  while (self->evict_heap->len > 0)
+  for (guint i = 0; i < self->n_shards; i++)
     {
-      CacheItem *item;
+      CacheShard *shard = &self->shards [i];
 
-      item = dzl_heap_peek (self->evict_heap, gpointer);
+      g_mutex_lock (&shard->mutex);
 
-      if (item->evict_at <= now)
+      while (shard->evict_heap->len > 0)
         {
-          dzl_heap_extract (self->evict_heap, NULL);
-          dzl_task_cache_evict_full (self, item->key, FALSE);
-          continue;
+          CacheItem *item;
+
+          item = dzl_heap_peek (shard->evict_heap, gpointer);
+
+          if (item->evict_at <= now)
+            {
+              dzl_heap_extract (shard->evict_heap, NULL);
+              dzl_task_cache_evict_full (self, shard, item->key, FALSE);
+              continue;
+            }
+
+          if (ready_time < 0 || item->evict_at < ready_time)
+            ready_time = item->evict_at;
+
+          break;
         }
 
-      break;
+      g_mutex_unlock (&shard->mutex);
     }
 
+  g_source_set_ready_time (self->evict_source, ready_time);
+
+  g_mutex_unlock (&self->evict_mutex);
+
   return G_SOURCE_CONTINUE;
 }
 
 static void
 dzl_task_cache_install_evict_source (DzlTaskCache *self)
 {
-  GMainContext *main_context;
-  EvictSource *evict_source;
   GSource *source;
 
-  main_context = g_main_context_get_thread_default ();
-
-  source = g_source_new (&evict_source_funcs, sizeof (EvictSource));
+  source = g_source_new (&evict_source_funcs, sizeof (GSource));
   g_source_set_callback (source, dzl_task_cache_do_eviction, self, NULL);
   g_source_set_name (source, "DzlTaskCache Eviction");
   g_source_set_priority (source, G_PRIORITY_LOW);
   g_source_set_ready_time (source, -1);
 
-  evict_source = (EvictSource *)source;
-  evict_source->heap = dzl_heap_ref (self->evict_heap);
-
   self->evict_source = source;
-  self->evict_source_id = g_source_attach (source, main_context);
+  g_source_attach (source, self->main_context);
 }
 
 static void
@@ -770,30 +1799,49 @@ dzl_task_cache_constructed (GObject *object)
   if (self->key_destroy_func == NULL)
     self->key_destroy_func = dzl_task_cache_dummy_destroy_func;
 
-  /*
-   * This is where the cached result objects live.
-   */
-  self->cache = g_hash_table_new_full (self->key_hash_func,
-                                       self->key_equal_func,
-                                       NULL,
-                                       cache_item_free);
+  self->main_context = g_main_context_ref_thread_default ();
 
-  /*
-   * This is where we store a bit to know if we have an inflight
-   * request for this cache key.
-   */
-  self->in_flight = g_hash_table_new_full (self->key_hash_func,
-                                           self->key_equal_func,
-                                           self->key_destroy_func,
-                                           g_object_unref);
+  self->n_shards = CLAMP (self->n_shards, 1, MAX_SHARDS);
+  self->shards = g_new0 (CacheShard, self->n_shards);
 
-  /*
-   * This is where tasks queue waiting for an in_flight callback.
-   */
-  self->queued = g_hash_table_new_full (self->key_hash_func,
-                                        self->key_equal_func,
-                                        self->key_destroy_func,
-                                        (GDestroyNotify)g_ptr_array_unref);
+  for (guint i = 0; i < self->n_shards; i++)
+    {
+      CacheShard *shard = &self->shards [i];
+
+      g_mutex_init (&shard->mutex);
+
+      /*
+       * This is where the cached result objects live.
+       */
+      shard->cache = g_hash_table_new_full (self->key_hash_func,
+                                            self->key_equal_func,
+                                            NULL,
+                                            cache_item_free);
+
+      /*
+       * This is where we store the cancellable of the inflight request
+       * for this cache key, if any.
+       */
+      shard->in_flight = g_hash_table_new_full (self->key_hash_func,
+                                                self->key_equal_func,
+                                                self->key_destroy_func,
+                                                g_object_unref);
+
+      /*
+       * This is where tasks queue waiting for an in_flight callback.
+       */
+      shard->queued = g_hash_table_new_full (self->key_hash_func,
+                                             self->key_equal_func,
+                                             self->key_destroy_func,
+                                             (GDestroyNotify)g_ptr_array_unref);
+
+      shard->evict_heap = dzl_heap_new (sizeof (gpointer),
+                                        cache_item_compare_evict_at);
+      dzl_heap_set_index_func (shard->evict_heap, cache_item_set_heap_index);
+    }
+
+  /* The limits may have been set before the shards existed */
+  dzl_task_cache_update_limits (self);
 
   /*
    * Register our eviction source if we have a time_to_live.
@@ -818,46 +1866,40 @@ dzl_task_cache_dispose (GObject *object)
 {
   DzlTaskCache *self = (DzlTaskCache *)object;
 
-  if (self->evict_source_id != 0)
+  if (self->evict_source != NULL)
     {
-      g_source_remove (self->evict_source_id);
-      self->evict_source_id = 0;
-      self->evict_source = NULL;
+      g_source_destroy (self->evict_source);
+      g_clear_pointer (&self->evict_source, g_source_unref);
     }
 
-  g_clear_pointer (&self->evict_heap, dzl_heap_unref);
-
-  if (self->cache != NULL)
+  for (guint i = 0; i < self->n_shards && self->shards != NULL; i++)
     {
-      gint64 count;
+      CacheShard *shard = &self->shards [i];
+      gint64 count = 0;
 
-      count = g_hash_table_size (self->cache);
-      g_clear_pointer (&self->cache, g_hash_table_unref);
+      if (shard->cache == NULL)
+        continue;
 
-      g_debug ("Evicted cache of %"G_GINT64_FORMAT" items from %s",
-               count, self->name ?: "unnamed cache");
-
-      DZL_COUNTER_SUB (cached, count);
-    }
+      g_mutex_lock (&shard->mutex);
 
-  if (self->queued != NULL)
-    {
-      gint64 count = 0;
+      count = g_hash_table_size (shard->cache);
+      dzl_task_cache_shard_clear (shard);
+      g_clear_pointer (&shard->cache, g_hash_table_unref);
+      g_clear_pointer (&shard->evict_heap, dzl_heap_unref);
 
-      g_hash_table_foreach (self->queued, count_queued_cb, &count);
-      g_clear_pointer (&self->queued, g_hash_table_unref);
+      g_debug ("Evicted cache of %"G_GINT64_FORMAT" items from %s",
+               count, self->name ?: "unnamed cache");
 
+      count = 0;
+      g_hash_table_foreach (shard->queued, count_queued_cb, &count);
+      g_clear_pointer (&shard->queued, g_hash_table_unref);
       DZL_COUNTER_SUB (queued, count);
-    }
-
-  if (self->in_flight != NULL)
-    {
-      gint64 count;
-
-      count = g_hash_table_size (self->in_flight);
-      g_clear_pointer (&self->in_flight, (GDestroyNotify)g_hash_table_unref);
 
+      count = g_hash_table_size (shard->in_flight);
+      g_clear_pointer (&shard->in_flight, (GDestroyNotify)g_hash_table_unref);
       DZL_COUNTER_SUB (in_flight, count);
+
+      g_mutex_unlock (&shard->mutex);
     }
 
   if (self->populate_callback_data)
@@ -866,6 +1908,15 @@ dzl_task_cache_dispose (GObject *object)
         self->populate_callback_data_destroy (self->populate_callback_data);
     }
 
+  if (self->cost_func_data_destroy)
+    g_clear_pointer (&self->cost_func_data, self->cost_func_data_destroy);
+  self->cost_func = NULL;
+
+  g_mutex_lock (&self->disk_mutex);
+  g_clear_pointer (&self->disk, dzl_task_cache_disk_unref);
+  g_mutex_unlock (&self->disk_mutex);
+  g_clear_object (&self->disk_directory);
+
   G_OBJECT_CLASS (dzl_task_cache_parent_class)->dispose (object);
 }
 
@@ -874,13 +1925,73 @@ dzl_task_cache_finalize (GObject *object)
 {
   DzlTaskCache *self = (DzlTaskCache *)object;
 
+  for (guint i = 0; i < self->n_shards && self->shards != NULL; i++)
+    {
+      g_mutex_clear (&self->shards [i].mutex);
+      frequency_sketch_clear (&self->shards [i].sketch);
+    }
+
+  g_clear_pointer (&self->shards, g_free);
   g_clear_pointer (&self->name, g_free);
+  g_clear_pointer (&self->main_context, g_main_context_unref);
+  g_mutex_clear (&self->evict_mutex);
+  g_mutex_clear (&self->disk_mutex);
+
+  if (self->serialize_data_destroy)
+    g_clear_pointer (&self->serialize_data, self->serialize_data_destroy);
 
   G_OBJECT_CLASS (dzl_task_cache_parent_class)->finalize (object);
 
   DZL_COUNTER_DEC (instances);
 }
 
+static void
+dzl_task_cache_get_property (GObject    *object,
+                             guint       prop_id,
+                             GValue     *value,
+                             GParamSpec *pspec)
+{
+  DzlTaskCache *self = DZL_TASK_CACHE(object);
+
+  switch (prop_id)
+    {
+    case PROP_DISK_DIRECTORY:
+      g_value_set_object (value, dzl_task_cache_get_disk_directory (self));
+      break;
+
+    case PROP_DISK_MAX_SIZE:
+      g_value_set_uint64 (value, dzl_task_cache_get_disk_max_size (self));
+      break;
+
+    case PROP_EVICTION_POLICY:
+      g_value_set_enum (value, dzl_task_cache_get_eviction_policy (self));
+      break;
+
+    case PROP_MAX_COST:
+      g_value_set_uint64 (value, dzl_task_cache_get_max_cost (self));
+      break;
+
+    case PROP_MAX_ITEMS:
+      g_value_set_uint (value, dzl_task_cache_get_max_items (self));
+      break;
+
+    case PROP_N_SHARDS:
+      g_value_set_uint (value, dzl_task_cache_get_n_shards (self));
+      break;
+
+    case PROP_REFRESH_AHEAD:
+      g_value_set_uint (value, dzl_task_cache_get_refresh_ahead (self));
+      break;
+
+    case PROP_STALE_WHILE_REVALIDATE:
+      g_value_set_int64 (value, dzl_task_cache_get_stale_while_revalidate (self));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    }
+}
+
 static void
 dzl_task_cache_set_property (GObject      *object,
                              guint         prop_id,
@@ -891,6 +2002,18 @@ dzl_task_cache_set_property (GObject      *object,
 
   switch (prop_id)
     {
+    case PROP_DISK_DIRECTORY:
+      dzl_task_cache_set_disk_directory (self, g_value_get_object (value));
+      break;
+
+    case PROP_DISK_MAX_SIZE:
+      dzl_task_cache_set_disk_max_size (self, g_value_get_uint64 (value));
+      break;
+
+    case PROP_EVICTION_POLICY:
+      dzl_task_cache_set_eviction_policy (self, g_value_get_enum (value));
+      break;
+
     case PROP_KEY_COPY_FUNC:
       self->key_copy_func = g_value_get_pointer (value);
       break;
@@ -907,6 +2030,18 @@ dzl_task_cache_set_property (GObject      *object,
       self->key_hash_func = g_value_get_pointer (value);
       break;
 
+    case PROP_MAX_COST:
+      dzl_task_cache_set_max_cost (self, g_value_get_uint64 (value));
+      break;
+
+    case PROP_MAX_ITEMS:
+      dzl_task_cache_set_max_items (self, g_value_get_uint (value));
+      break;
+
+    case PROP_N_SHARDS:
+      self->n_shards = g_value_get_uint (value);
+      break;
+
     case PROP_POPULATE_CALLBACK:
       self->populate_callback = g_value_get_pointer (value);
       break;
@@ -919,6 +2054,14 @@ dzl_task_cache_set_property (GObject      *object,
       self->populate_callback_data_destroy = g_value_get_pointer (value);
       break;
 
+    case PROP_REFRESH_AHEAD:
+      dzl_task_cache_set_refresh_ahead (self, g_value_get_uint (value));
+      break;
+
+    case PROP_STALE_WHILE_REVALIDATE:
+      dzl_task_cache_set_stale_while_revalidate (self, g_value_get_int64 (value));
+      break;
+
     case PROP_TIME_TO_LIVE:
       self->time_to_live_usec = (g_value_get_int64 (value) * 1000L);
       break;
@@ -931,20 +2074,125 @@ dzl_task_cache_set_property (GObject      *object,
       self->value_destroy_func = g_value_get_pointer (value);
       break;
 
-    default:
-      G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
-    }
-}
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    }
+}
+
+static void
+dzl_task_cache_class_init (DzlTaskCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->constructed = dzl_task_cache_constructed;
+  object_class->dispose = dzl_task_cache_dispose;
+  object_class->finalize = dzl_task_cache_finalize;
+  object_class->get_property = dzl_task_cache_get_property;
+  object_class->set_property = dzl_task_cache_set_property;
+
+  /**
+   * DzlTaskCache:disk-directory:
+   *
+   * A local directory in which populated values are stored, so that they
+   * survive restarts. A miss looks for the value on disk before calling
+   * the populate callback. %NULL disables the disk tier.
+   *
+   * Keys and values are stored as #GVariant, see
+   * dzl_task_cache_set_serialize_funcs().
+   */
+  properties [PROP_DISK_DIRECTORY] =
+    g_param_spec_object ("disk-directory",
+                         "Disk Directory",
+                         "The directory of the on-disk tier",
+                         G_TYPE_FILE,
+                         (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * DzlTaskCache:disk-max-size:
+   *
+   * The largest size in bytes of the entries in #DzlTaskCache:disk-directory.
+   * The least recently used entries are removed with a #DzlDirectoryReaper
+   * when it is exceeded.
+   *
+   * A value of zero indicates no limit.
+   */
+  properties [PROP_DISK_MAX_SIZE] =
+    g_param_spec_uint64 ("disk-max-size",
+                         "Disk Max Size",
+                         "The largest size in bytes of the on-disk tier",
+                         0,
+                         G_MAXUINT64,
+                         0,
+                         (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * DzlTaskCache:eviction-policy:
+   *
+   * The policy used to select the items to evict when the cache exceeds
+   * #DzlTaskCache:max-items or #DzlTaskCache:max-cost.
+   */
+  properties [PROP_EVICTION_POLICY] =
+    g_param_spec_enum ("eviction-policy",
+                       "Eviction Policy",
+                       "The policy used to select the items to evict",
+                       DZL_TYPE_TASK_CACHE_EVICTION_POLICY,
+                       DZL_TASK_CACHE_EVICTION_LRU,
+                       (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * DzlTaskCache:max-cost:
+   *
+   * The largest total cost of the items in the cache, as computed by the
+   * function set with dzl_task_cache_set_cost_func(). Without a cost
+   * function, every item costs 1.
+   *
+   * A value of zero indicates no limit.
+   */
+  properties [PROP_MAX_COST] =
+    g_param_spec_uint64 ("max-cost",
+                         "Max Cost",
+                         "The largest total cost of the cached items",
+                         0,
+                         G_MAXUINT64,
+                         0,
+                         (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
 
-static void
-dzl_task_cache_class_init (DzlTaskCacheClass *klass)
-{
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  /**
+   * DzlTaskCache:max-items:
+   *
+   * The largest number of items in the cache.
+   *
+   * A value of zero indicates no limit.
+   */
+  properties [PROP_MAX_ITEMS] =
+    g_param_spec_uint ("max-items",
+                       "Max Items",
+                       "The largest number of cached items",
+                       0,
+                       G_MAXUINT,
+                       0,
+                       (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
 
-  object_class->constructed = dzl_task_cache_constructed;
-  object_class->dispose = dzl_task_cache_dispose;
-  object_class->finalize = dzl_task_cache_finalize;
-  object_class->set_property = dzl_task_cache_set_property;
+  /**
+   * DzlTaskCache:n-shards:
+   *
+   * The number of shards the keys are spread over. Each shard has its own
+   * lock, so that threads using different keys rarely contend, and holds
+   * an equal share of #DzlTaskCache:max-items and #DzlTaskCache:max-cost.
+   *
+   * Use more than one shard when the cache is shared by many threads.
+   * Whichever thread requests a key, it is populated in the main context
+   * the cache was created in, and the result is delivered to the main
+   * context of each requesting thread.
+   */
+  properties [PROP_N_SHARDS] =
+    g_param_spec_uint ("n-shards",
+                       "N Shards",
+                       "The number of independently locked shards",
+                       1,
+                       MAX_SHARDS,
+                       1,
+                       (G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
   properties [PROP_KEY_HASH_FUNC] =
     g_param_spec_pointer ("key-hash-func",
@@ -988,6 +2236,42 @@ dzl_task_cache_class_init (DzlTaskCacheClass *klass)
                          "Populate Callback Data Destroy",
                          (G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * DzlTaskCache:refresh-ahead:
+   *
+   * When an item is requested within the last percentage of its
+   * #DzlTaskCache:time-to-live given by this property, it is repopulated
+   * in the background, so that frequently used items never expire.
+   *
+   * A value of zero indicates items are not refreshed ahead of time.
+   */
+  properties [PROP_REFRESH_AHEAD] =
+    g_param_spec_uint ("refresh-ahead",
+                       "Refresh Ahead",
+                       "The percentage of the time to live, before expiry, to refresh items in",
+                       0,
+                       100,
+                       0,
+                       (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * DzlTaskCache:stale-while-revalidate:
+   *
+   * The number of milliseconds after an item expired during which it is
+   * still returned by dzl_task_cache_get_async(), while a single request
+   * repopulates it in the background.
+   *
+   * A value of zero indicates expired items are evicted.
+   */
+  properties [PROP_STALE_WHILE_REVALIDATE] =
+    g_param_spec_int64 ("stale-while-revalidate",
+                        "Stale While Revalidate",
+                        "The time in milliseconds to serve expired items while refreshing them",
+                        0,
+                        G_MAXINT64 / 1000,
+                        0,
+                        (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
   /**
    * DzlTaskCache:time-to-live:
    *
@@ -1020,13 +2304,19 @@ dzl_task_cache_class_init (DzlTaskCacheClass *klass)
   g_object_class_install_properties (object_class, LAST_PROP, properties);
 }
 
+
 void
 dzl_task_cache_init (DzlTaskCache *self)
 {
   DZL_COUNTER_INC (instances);
 
-  self->evict_heap = dzl_heap_new (sizeof (gpointer),
-                                   cache_item_compare_evict_at);
+  g_mutex_init (&self->evict_mutex);
+  g_mutex_init (&self->disk_mutex);
+  self->n_shards = 1;
+
+  self->key_serialize_func = dzl_task_cache_variant_serialize;
+  self->value_serialize_func = dzl_task_cache_variant_serialize;
+  self->value_deserialize_func = dzl_task_cache_variant_deserialize;
 }
 
 /**
@@ -1075,20 +2365,29 @@ GPtrArray *
 dzl_task_cache_get_values (DzlTaskCache *self)
 {
   GPtrArray *ar;
-  GHashTableIter iter;
-  gpointer value;
 
   g_return_val_if_fail (DZL_IS_TASK_CACHE (self), NULL);
 
   ar = g_ptr_array_new_with_free_func (self->value_destroy_func);
 
-  g_hash_table_iter_init (&iter, self->cache);
-
-  while (g_hash_table_iter_next (&iter, NULL, &value))
+  for (guint i = 0; i < self->n_shards; i++)
     {
-      CacheItem *item = value;
+      CacheShard *shard = &self->shards [i];
+      GHashTableIter iter;
+      gpointer value;
+
+      g_mutex_lock (&shard->mutex);
 
-      g_ptr_array_add (ar, self->value_copy_func (item->value));
+      g_hash_table_iter_init (&iter, shard->cache);
+
+      while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+          CacheItem *item = value;
+
+          g_ptr_array_add (ar, self->value_copy_func (item->value));
+        }
+
+      g_mutex_unlock (&shard->mutex);
     }
 
   return ar;
@@ -1111,3 +2410,470 @@ dzl_task_cache_set_name (DzlTaskCache *self,
       g_source_set_name (self->evict_source, full_name);
     }
 }
+
+/**
+ * dzl_task_cache_get_n_shards:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:n-shards.
+ *
+ * Returns: the number of shards the keys are spread over.
+ */
+guint
+dzl_task_cache_get_n_shards (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), 0);
+
+  return self->n_shards;
+}
+
+/*
+ * Splits the limits of the cache evenly between the shards, rounding up
+ * so that a small limit still allows one item per shard, and evicts the
+ * items which no longer fit.
+ */
+static void
+dzl_task_cache_update_limits (DzlTaskCache *self)
+{
+  g_assert (DZL_IS_TASK_CACHE (self));
+
+  if (self->shards == NULL)
+    return;
+
+  self->shard_max_items = self->max_items / self->n_shards +
+                          (self->max_items % self->n_shards != 0);
+  self->shard_max_cost = self->max_cost / self->n_shards +
+                         (self->max_cost % self->n_shards != 0);
+
+  for (guint i = 0; i < self->n_shards; i++)
+    {
+      CacheShard *shard = &self->shards [i];
+
+      g_mutex_lock (&shard->mutex);
+      dzl_task_cache_trim (self, shard);
+      g_mutex_unlock (&shard->mutex);
+    }
+}
+
+/**
+ * dzl_task_cache_get_max_items:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:max-items.
+ *
+ * Returns: the largest number of items, or 0 if there is no limit.
+ */
+guint
+dzl_task_cache_get_max_items (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), 0);
+
+  return self->max_items;
+}
+
+/**
+ * dzl_task_cache_set_max_items:
+ * @self: A #DzlTaskCache
+ * @max_items: the largest number of items, or 0 for no limit
+ *
+ * Sets #DzlTaskCache:max-items, evicting items as necessary.
+ *
+ * Each of the #DzlTaskCache:n-shards shards holds an equal share of
+ * @max_items, rounded up.
+ */
+void
+dzl_task_cache_set_max_items (DzlTaskCache *self,
+                              guint         max_items)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+
+  if (self->max_items != max_items)
+    {
+      self->max_items = max_items;
+      dzl_task_cache_update_limits (self);
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_MAX_ITEMS]);
+    }
+}
+
+/**
+ * dzl_task_cache_get_max_cost:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:max-cost.
+ *
+ * Returns: the largest total cost of the items, or 0 if there is no limit.
+ */
+guint64
+dzl_task_cache_get_max_cost (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), 0);
+
+  return self->max_cost;
+}
+
+/**
+ * dzl_task_cache_set_max_cost:
+ * @self: A #DzlTaskCache
+ * @max_cost: the largest total cost of the items, or 0 for no limit
+ *
+ * Sets #DzlTaskCache:max-cost, evicting items as necessary.
+ *
+ * Each of the #DzlTaskCache:n-shards shards holds an equal share of
+ * @max_cost, rounded up.
+ */
+void
+dzl_task_cache_set_max_cost (DzlTaskCache *self,
+                             guint64       max_cost)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+
+  if (self->max_cost != max_cost)
+    {
+      self->max_cost = max_cost;
+      dzl_task_cache_update_limits (self);
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_MAX_COST]);
+    }
+}
+
+/**
+ * dzl_task_cache_set_cost_func: (skip)
+ * @self: A #DzlTaskCache
+ * @cost_func: (nullable): a #DzlTaskCacheCostFunc or %NULL
+ * @cost_func_data: user data for @cost_func
+ * @cost_func_data_destroy: (nullable): destroys @cost_func_data
+ *
+ * Sets the function computing the cost of the values, which is counted
+ * against #DzlTaskCache:max-cost. If %NULL, every value costs 1.
+ *
+ * The cost of values already in the cache is not recomputed, so this
+ * should be called before populating the cache.
+ */
+void
+dzl_task_cache_set_cost_func (DzlTaskCache         *self,
+                              DzlTaskCacheCostFunc  cost_func,
+                              gpointer              cost_func_data,
+                              GDestroyNotify        cost_func_data_destroy)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+
+  if (self->cost_func_data_destroy)
+    g_clear_pointer (&self->cost_func_data, self->cost_func_data_destroy);
+
+  self->cost_func = cost_func;
+  self->cost_func_data = cost_func_data;
+  self->cost_func_data_destroy = cost_func_data_destroy;
+}
+
+/**
+ * dzl_task_cache_get_eviction_policy:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:eviction-policy.
+ *
+ * Returns: A #DzlTaskCacheEvictionPolicy.
+ */
+DzlTaskCacheEvictionPolicy
+dzl_task_cache_get_eviction_policy (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), DZL_TASK_CACHE_EVICTION_LRU);
+
+  return self->eviction_policy;
+}
+
+/**
+ * dzl_task_cache_set_eviction_policy:
+ * @self: A #DzlTaskCache
+ * @eviction_policy: A #DzlTaskCacheEvictionPolicy
+ *
+ * Sets #DzlTaskCache:eviction-policy.
+ */
+void
+dzl_task_cache_set_eviction_policy (DzlTaskCache               *self,
+                                    DzlTaskCacheEvictionPolicy  eviction_policy)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+  g_return_if_fail (eviction_policy <= DZL_TASK_CACHE_EVICTION_TINY_LFU);
+
+  if (self->eviction_policy == eviction_policy)
+    return;
+
+  self->eviction_policy = eviction_policy;
+
+  /*
+   * LRU keeps every item in the window. Moving the main segments after the
+   * window keeps the most recently used items first. Switching to W-TinyLFU
+   * moves the items out of the window as it is trimmed.
+   */
+  for (guint i = 0; i < self->n_shards && self->shards != NULL; i++)
+    {
+      CacheShard *shard = &self->shards [i];
+      CacheSegment *window = &shard->segments [CACHE_SEGMENT_WINDOW];
+
+      g_mutex_lock (&shard->mutex);
+
+      for (guint j = CACHE_SEGMENT_PROTECTED; j > CACHE_SEGMENT_WINDOW; j--)
+        {
+          CacheSegment *segment = &shard->segments [j];
+
+          while (segment->queue.head != NULL)
+            {
+              CacheItem *item = segment->queue.head->data;
+
+              cache_segment_unlink (segment, item);
+              g_queue_push_tail_link (&window->queue, &item->link);
+              window->cost += item->cost;
+              item->segment = CACHE_SEGMENT_WINDOW;
+            }
+        }
+
+      if (eviction_policy != DZL_TASK_CACHE_EVICTION_TINY_LFU)
+        frequency_sketch_clear (&shard->sketch);
+      else
+        dzl_task_cache_trim (self, shard);
+
+      g_mutex_unlock (&shard->mutex);
+    }
+
+  g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_EVICTION_POLICY]);
+}
+
+/**
+ * dzl_task_cache_get_stale_while_revalidate:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:stale-while-revalidate.
+ *
+ * Returns: the time in milliseconds, or 0.
+ */
+gint64
+dzl_task_cache_get_stale_while_revalidate (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), 0);
+
+  return self->stale_usec / 1000L;
+}
+
+/**
+ * dzl_task_cache_set_stale_while_revalidate:
+ * @self: A #DzlTaskCache
+ * @stale_while_revalidate: the time in milliseconds, or 0
+ *
+ * Sets #DzlTaskCache:stale-while-revalidate. This only applies to the
+ * items populated afterwards.
+ */
+void
+dzl_task_cache_set_stale_while_revalidate (DzlTaskCache *self,
+                                           gint64        stale_while_revalidate)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+  g_return_if_fail (stale_while_revalidate >= 0);
+
+  if (self->stale_usec != stale_while_revalidate * 1000L)
+    {
+      self->stale_usec = stale_while_revalidate * 1000L;
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_STALE_WHILE_REVALIDATE]);
+    }
+}
+
+/**
+ * dzl_task_cache_get_refresh_ahead:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:refresh-ahead.
+ *
+ * Returns: a percentage of #DzlTaskCache:time-to-live, or 0.
+ */
+guint
+dzl_task_cache_get_refresh_ahead (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), 0);
+
+  return self->refresh_ahead;
+}
+
+/**
+ * dzl_task_cache_set_refresh_ahead:
+ * @self: A #DzlTaskCache
+ * @refresh_ahead: a percentage of #DzlTaskCache:time-to-live, or 0
+ *
+ * Sets #DzlTaskCache:refresh-ahead.
+ */
+void
+dzl_task_cache_set_refresh_ahead (DzlTaskCache *self,
+                                  guint         refresh_ahead)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+  g_return_if_fail (refresh_ahead <= 100);
+
+  if (self->refresh_ahead != refresh_ahead)
+    {
+      self->refresh_ahead = refresh_ahead;
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_REFRESH_AHEAD]);
+    }
+}
+
+/**
+ * dzl_task_cache_get_disk_directory:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:disk-directory.
+ *
+ * Returns: (transfer none) (nullable): a #GFile or %NULL.
+ */
+GFile *
+dzl_task_cache_get_disk_directory (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), NULL);
+
+  return self->disk_directory;
+}
+
+static void
+dzl_task_cache_reload_disk (DzlTaskCache *self)
+{
+  DzlTaskCacheDisk *disk = NULL;
+
+  g_assert (DZL_IS_TASK_CACHE (self));
+
+  if (self->disk_directory != NULL)
+    {
+      g_autoptr(GTask) task = NULL;
+
+      disk = dzl_task_cache_disk_new (self->disk_directory, self->disk_max_size);
+
+      /* Measure the entries left by previous runs, reclaiming space as needed */
+      task = g_task_new (NULL, NULL, NULL, NULL);
+      g_task_set_source_tag (task, dzl_task_cache_reload_disk);
+      g_task_set_task_data (task,
+                            dzl_task_cache_disk_ref (disk),
+                            (GDestroyNotify)dzl_task_cache_disk_unref);
+      g_task_run_in_thread (task, dzl_task_cache_disk_reclaim_worker);
+    }
+
+  g_mutex_lock (&self->disk_mutex);
+  g_clear_pointer (&self->disk, dzl_task_cache_disk_unref);
+  self->disk = disk;
+  g_mutex_unlock (&self->disk_mutex);
+}
+
+/**
+ * dzl_task_cache_set_disk_directory:
+ * @self: A #DzlTaskCache
+ * @disk_directory: (nullable): a local directory, or %NULL
+ *
+ * Sets #DzlTaskCache:disk-directory.
+ *
+ * Entries on disk do not expire. To remove old entries, add
+ * @disk_directory to a #DzlDirectoryReaper.
+ */
+void
+dzl_task_cache_set_disk_directory (DzlTaskCache *self,
+                                   GFile        *disk_directory)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+  g_return_if_fail (!disk_directory || G_IS_FILE (disk_directory));
+  g_return_if_fail (!disk_directory || g_file_is_native (disk_directory));
+
+  if (g_set_object (&self->disk_directory, disk_directory))
+    {
+      dzl_task_cache_reload_disk (self);
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_DISK_DIRECTORY]);
+    }
+}
+
+/**
+ * dzl_task_cache_get_disk_max_size:
+ * @self: A #DzlTaskCache
+ *
+ * Gets #DzlTaskCache:disk-max-size.
+ *
+ * Returns: the largest size in bytes, or 0 if there is no limit.
+ */
+guint64
+dzl_task_cache_get_disk_max_size (DzlTaskCache *self)
+{
+  g_return_val_if_fail (DZL_IS_TASK_CACHE (self), 0);
+
+  return self->disk_max_size;
+}
+
+/**
+ * dzl_task_cache_set_disk_max_size:
+ * @self: A #DzlTaskCache
+ * @disk_max_size: the largest size in bytes, or 0 for no limit
+ *
+ * Sets #DzlTaskCache:disk-max-size.
+ */
+void
+dzl_task_cache_set_disk_max_size (DzlTaskCache *self,
+                                  guint64       disk_max_size)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+
+  if (self->disk_max_size != disk_max_size)
+    {
+      self->disk_max_size = disk_max_size;
+      dzl_task_cache_reload_disk (self);
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_DISK_MAX_SIZE]);
+    }
+}
+
+/**
+ * dzl_task_cache_set_serialize_funcs: (skip)
+ * @self: A #DzlTaskCache
+ * @key_serialize_func: serializes the keys
+ * @value_serialize_func: serializes the values
+ * @value_deserialize_func: deserializes the values
+ * @user_data: user data for the functions
+ * @user_data_destroy: (nullable): destroys @user_data
+ *
+ * Sets the functions converting keys and values to the #GVariant stored
+ * in the disk tier. By default, keys and values must be #GVariant.
+ *
+ * Entries are addressed by their serialized key, so keys are never
+ * deserialized. The functions are called in the main context the cache
+ * was created in, and should be set before the disk tier is used.
+ */
+void
+dzl_task_cache_set_serialize_funcs (DzlTaskCache                *self,
+                                    DzlTaskCacheSerializeFunc    key_serialize_func,
+                                    DzlTaskCacheSerializeFunc    value_serialize_func,
+                                    DzlTaskCacheDeserializeFunc  value_deserialize_func,
+                                    gpointer                     user_data,
+                                    GDestroyNotify               user_data_destroy)
+{
+  g_return_if_fail (DZL_IS_TASK_CACHE (self));
+  g_return_if_fail (key_serialize_func != NULL);
+  g_return_if_fail (value_serialize_func != NULL);
+  g_return_if_fail (value_deserialize_func != NULL);
+
+  if (self->serialize_data_destroy)
+    g_clear_pointer (&self->serialize_data, self->serialize_data_destroy);
+
+  self->key_serialize_func = key_serialize_func;
+  self->value_serialize_func = value_serialize_func;
+  self->value_deserialize_func = value_deserialize_func;
+  self->serialize_data = user_data;
+  self->serialize_data_destroy = user_data_destroy;
+}
+
+GType
+dzl_task_cache_eviction_policy_get_type (void)
+{
+  static GType type_id;
+  static const GEnumValue values[] = {
+    { DZL_TASK_CACHE_EVICTION_LRU, "DZL_TASK_CACHE_EVICTION_LRU", "lru" },
+    { DZL_TASK_CACHE_EVICTION_TINY_LFU, "DZL_TASK_CACHE_EVICTION_TINY_LFU", "tiny-lfu" },
+    { 0 }
+  };
+
+  if (g_once_init_enter (&type_id))
+    {
+      GType _type_id;
+
+      _type_id = g_enum_register_static ("DzlTaskCacheEvictionPolicy", values);
+      g_once_init_leave (&type_id, _type_id);
+    }
+
+  return type_id;
+}
@@ -23,10 +23,27 @@
 
 G_BEGIN_DECLS
 
-#define DZL_TYPE_TASK_CACHE (dzl_task_cache_get_type())
+#define DZL_TYPE_TASK_CACHE                 (dzl_task_cache_get_type())
+#define DZL_TYPE_TASK_CACHE_EVICTION_POLICY (dzl_task_cache_eviction_policy_get_type())
 
 G_DECLARE_FINAL_TYPE (DzlTaskCache, dzl_task_cache, DZL, TASK_CACHE, GObject)
 
+/**
+ * DzlTaskCacheEvictionPolicy:
+ * @DZL_TASK_CACHE_EVICTION_LRU: evict the least recently used item.
+ * @DZL_TASK_CACHE_EVICTION_TINY_LFU: only admit new items into the cache
+ *   when they are used more often than the items they would replace, so
+ *   that scanning many items once does not flush the frequently used ones.
+ *
+ * The policy used to select which items to evict when the cache exceeds
+ * #DzlTaskCache:max-items or #DzlTaskCache:max-cost.
+ */
+typedef enum
+{
+  DZL_TASK_CACHE_EVICTION_LRU,
+  DZL_TASK_CACHE_EVICTION_TINY_LFU,
+} DzlTaskCacheEvictionPolicy;
+
 /**
  * DzlTaskCacheCallback:
  * @self: An #DzlTaskCache.
@@ -49,6 +66,47 @@ typedef void (*DzlTaskCacheCallback) (DzlTaskCache  *self,
                                       GTask         *task,
                                       gpointer       user_data);
 
+/**
+ * DzlTaskCacheCostFunc:
+ * @value: a value of the cache
+ * @user_data: user_data registered with dzl_task_cache_set_cost_func()
+ *
+ * Computes the cost of keeping @value in the cache, such as its size in
+ * bytes. The cost is computed once, when @value is added to the cache.
+ *
+ * Returns: the cost of @value, counted against #DzlTaskCache:max-cost.
+ */
+typedef gsize (*DzlTaskCacheCostFunc) (gconstpointer  value,
+                                       gpointer       user_data);
+
+/**
+ * DzlTaskCacheSerializeFunc:
+ * @boxed: a key or value of the cache
+ * @user_data: user_data registered with dzl_task_cache_set_serialize_funcs()
+ *
+ * Serializes a key or value so that it can be stored in the disk tier set
+ * with dzl_task_cache_set_disk_directory().
+ *
+ * Returns: (transfer full) (nullable): a #GVariant, possibly floating, or
+ *   %NULL if @boxed should not be stored on disk.
+ */
+typedef GVariant *(*DzlTaskCacheSerializeFunc) (gconstpointer  boxed,
+                                                gpointer       user_data);
+
+/**
+ * DzlTaskCacheDeserializeFunc:
+ * @variant: a value serialized by a #DzlTaskCacheSerializeFunc
+ * @user_data: user_data registered with dzl_task_cache_set_serialize_funcs()
+ *
+ * Creates a value of the cache from the disk tier.
+ *
+ * Returns: (transfer full) (nullable): the value, or %NULL if @variant is
+ *   not valid, in which case the value is populated again.
+ */
+typedef gpointer (*DzlTaskCacheDeserializeFunc) (GVariant  *variant,
+                                                 gpointer   user_data);
+
+GType         dzl_task_cache_eviction_policy_get_type (void);
 DzlTaskCache *dzl_task_cache_new        (GHashFunc              key_hash_func,
                                          GEqualFunc             key_equal_func,
                                          GBoxedCopyFunc         key_copy_func,
@@ -76,6 +134,39 @@ void          dzl_task_cache_evict_all  (DzlTaskCache          *self);
 gpointer      dzl_task_cache_peek       (DzlTaskCache          *self,
                                          gconstpointer          key);
 GPtrArray    *dzl_task_cache_get_values (DzlTaskCache          *self);
+guint         dzl_task_cache_get_max_items       (DzlTaskCache               *self);
+void          dzl_task_cache_set_max_items       (DzlTaskCache               *self,
+                                                  guint                       max_items);
+guint64       dzl_task_cache_get_max_cost        (DzlTaskCache               *self);
+void          dzl_task_cache_set_max_cost        (DzlTaskCache               *self,
+                                                  guint64                     max_cost);
+void          dzl_task_cache_set_cost_func       (DzlTaskCache               *self,
+                                                  DzlTaskCacheCostFunc        cost_func,
+                                                  gpointer                    cost_func_data,
+                                                  GDestroyNotify              cost_func_data_destroy);
+DzlTaskCacheEvictionPolicy
+              dzl_task_cache_get_eviction_policy (DzlTaskCache               *self);
+void          dzl_task_cache_set_eviction_policy (DzlTaskCache               *self,
+                                                  DzlTaskCacheEvictionPolicy  eviction_policy);
+guint         dzl_task_cache_get_n_shards        (DzlTaskCache               *self);
+gint64        dzl_task_cache_get_stale_while_revalidate (DzlTaskCache          *self);
+void          dzl_task_cache_set_stale_while_revalidate (DzlTaskCache          *self,
+                                                         gint64                 stale_while_revalidate);
+guint         dzl_task_cache_get_refresh_ahead   (DzlTaskCache               *self);
+void          dzl_task_cache_set_refresh_ahead   (DzlTaskCache               *self,
+                                                  guint                       refresh_ahead);
+GFile        *dzl_task_cache_get_disk_directory  (DzlTaskCache               *self);
+void          dzl_task_cache_set_disk_directory  (DzlTaskCache               *self,
+                                                  GFile                      *disk_directory);
+guint64       dzl_task_cache_get_disk_max_size   (DzlTaskCache               *self);
+void          dzl_task_cache_set_disk_max_size   (DzlTaskCache               *self,
+                                                  guint64                     disk_max_size);
+void          dzl_task_cache_set_serialize_funcs (DzlTaskCache               *self,
+                                                  DzlTaskCacheSerializeFunc   key_serialize_func,
+                                                  DzlTaskCacheSerializeFunc   value_serialize_func,
+                                                  DzlTaskCacheDeserializeFunc value_deserialize_func,
+                                                  gpointer                    user_data,
+                                                  GDestroyNotify              user_data_destroy);
 
 G_END_DECLS
 
@@ -19,10 +19,18 @@
 #define G_LOG_DOMAIN    "dzl-fuzzy-index-builder"
 #define MAX_KEY_ENTRIES (0x00FFFFFF)
 
+/* Tables smaller than this are sorted on the calling thread */
+#define MIN_PARALLEL_SORT_ITEMS 8192
+
+/* Number of items buffered per run while merging spilled runs */
+#define MERGE_BUFFER_ITEMS 4096
+
 #include <stdlib.h>
 #include <string.h>
 
 #include "search/dzl-fuzzy-index-builder.h"
+#include "search/dzl-fuzzy-index-private.h"
+#include "util/dzl-heap.h"
 #include "util/dzl-variant.h"
 
 struct _DzlFuzzyIndexBuilder
@@ -89,6 +97,20 @@ struct _DzlFuzzyIndexBuilder
    * your indexer code, you can force a rebuild of the index.
    */
   GHashTable *metadata;
+
+  /*
+   * The approximate number of bytes that may be used for the character
+   * tables while writing the index. Once exceeded, the tables are sorted
+   * and spilled to a temporary file to be merged into the index. Zero
+   * means there is no limit.
+   */
+  guint64 memory_budget;
+
+  /*
+   * Documents that should be removed from the index layers beneath
+   * this one, when used as a delta with dzl_fuzzy_index_add_delta().
+   */
+  GPtrArray *tombstones;
 };
 
 typedef struct
@@ -112,11 +134,60 @@ typedef struct
   guint lookaside_id;
 } IndexItem;
 
+/* These are written directly into the index, so they must match the reader */
+G_STATIC_ASSERT (sizeof (KVPair) == sizeof (DzlFuzzyIndexLookaside));
+G_STATIC_ASSERT (sizeof (IndexItem) == sizeof (DzlFuzzyIndexItem));
+
+/* A sorted run of a table that was spilled to the temporary file */
+typedef struct
+{
+  guint64 offset;
+  guint64 n_items;
+} SpilledRun;
+
+typedef struct
+{
+  /* Items that have not been spilled yet */
+  GArray *items;
+
+  /* Previously spilled runs of SpilledRun, or %NULL */
+  GArray *spilled;
+} IndexRow;
+
+typedef struct
+{
+  /* Maps character to IndexRow */
+  GHashTable    *rows;
+
+  /* Temporary file for spilled runs, created on demand */
+  GFile         *spill_file;
+  GFileIOStream *spill_stream;
+  guint64        spill_offset;
+} IndexTables;
+
+/* Reads back a spilled run or the in-memory remainder of a table */
+typedef struct
+{
+  const IndexItem *items;
+  gsize            n_items;
+  gsize            pos;
+  guint64          file_offset;
+  guint64          file_remaining;
+  IndexItem       *buffer;
+} MergeSource;
+
+typedef struct
+{
+  IndexItem item;
+  guint     source;
+} MergeHead;
+
 G_DEFINE_TYPE (DzlFuzzyIndexBuilder, dzl_fuzzy_index_builder, G_TYPE_OBJECT)
 
 enum {
   PROP_0,
   PROP_CASE_SENSITIVE,
+  PROP_MEMORY_BUDGET,
   N_PROPS
 };
 
@@ -139,6 +210,7 @@ dzl_fuzzy_index_builder_finalize (GObject *object)
   g_clear_pointer (&self->kv_pairs, g_array_unref);
   g_clear_pointer (&self->metadata, g_hash_table_unref);
   g_clear_pointer (&self->key_ids, g_hash_table_unref);
+  g_clear_pointer (&self->tombstones, g_ptr_array_unref);
 
   G_OBJECT_CLASS (dzl_fuzzy_index_builder_parent_class)->finalize (object);
 }
@@ -157,6 +229,10 @@ dzl_fuzzy_index_builder_get_property (GObject    *object,
       g_value_set_boolean (value, dzl_fuzzy_index_builder_get_case_sensitive (self));
       break;
 
+    case PROP_MEMORY_BUDGET:
+      g_value_set_uint64 (value, dzl_fuzzy_index_builder_get_memory_budget (self));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -176,6 +252,10 @@ dzl_fuzzy_index_builder_set_property (GObject      *object,
       dzl_fuzzy_index_builder_set_case_sensitive (self, g_value_get_boolean (value));
       break;
 
+    case PROP_MEMORY_BUDGET:
+      dzl_fuzzy_index_builder_set_memory_budget (self, g_value_get_uint64 (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -197,6 +277,25 @@ dzl_fuzzy_index_builder_class_init (DzlFuzzyIndexBuilderClass *klass)
                           FALSE,
                           (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * DzlFuzzyIndexBuilder:memory-budget:
+   *
+   * The approximate number of bytes to use for the character tables while
+   * writing the index, or zero for no limit.
+   *
+   * When the budget is exceeded, the tables are sorted and written to a
+   * temporary file as a sorted run. The runs are then merged while writing
+   * the index. The keys and documents are always kept in memory.
+   */
+  properties [PROP_MEMORY_BUDGET] =
+    g_param_spec_uint64 ("memory-budget",
+                         "Memory Budget",
+                         "The approximate number of bytes to use for tables while writing",
+                         0,
+                         G_MAXUINT64,
+                         0,
+                         (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
@@ -310,51 +409,285 @@ pos_doc_pair_compare (gconstpointer a,
 {
   const IndexItem *paira = a;
   const IndexItem *pairb = b;
-  gint ret;
 
-  ret = paira->lookaside_id - pairb->lookaside_id;
+  /*
+   * The lookaside_id contains the priority in the high bits, so we must
+   * not subtract here or the result could overflow gint. Readers rely on
+   * these being in unsigned order.
+   */
+  if (paira->lookaside_id < pairb->lookaside_id)
+    return -1;
+  else if (paira->lookaside_id > pairb->lookaside_id)
+    return 1;
 
-  if (ret == 0)
-    ret = paira->position - pairb->position;
+  if (paira->position < pairb->position)
+    return -1;
+  else if (paira->position > pairb->position)
+    return 1;
 
-  return ret;
+  return 0;
 }
 
-static GVariant *
-dzl_fuzzy_index_builder_build_keys (DzlFuzzyIndexBuilder *self)
+static gint
+table_compare (gconstpointer a,
+               gconstpointer b)
 {
-  g_assert (DZL_IS_FUZZY_INDEX_BUILDER (self));
+  const DzlFuzzyIndexTable *tablea = a;
+  const DzlFuzzyIndexTable *tableb = b;
+
+  if (tablea->ch < tableb->ch)
+    return -1;
+  else if (tablea->ch > tableb->ch)
+    return 1;
+  return 0;
+}
 
-  return g_variant_new_strv ((const gchar * const *)self->keys->pdata,
-                             self->keys->len);
+static inline guint64
+align_section (guint64 offset)
+{
+  return (offset + 7) & ~G_GUINT64_CONSTANT (7);
 }
 
-static GVariant *
-dzl_fuzzy_index_builder_build_lookaside (DzlFuzzyIndexBuilder *self)
+static gint
+merge_head_compare (gconstpointer a,
+                    gconstpointer b)
 {
-  g_assert (DZL_IS_FUZZY_INDEX_BUILDER (self));
+  const MergeHead *heada = a;
+  const MergeHead *headb = b;
 
-  return g_variant_new_fixed_array ((const GVariantType *)"(uu)",
-                                    self->kv_pairs->data,
-                                    self->kv_pairs->len,
-                                    sizeof (KVPair));
+  /* DzlHeap keeps the greatest element on top, we want the smallest */
+  return pos_doc_pair_compare (&headb->item, &heada->item);
 }
 
-static GVariant *
-dzl_fuzzy_index_builder_build_index (DzlFuzzyIndexBuilder *self)
+static void
+index_row_free (gpointer data)
 {
-  g_autoptr(GPtrArray) ar = NULL;
-  g_autoptr(GHashTable) rows = NULL;
-  GVariantDict dict;
+  IndexRow *row = data;
+
+  g_clear_pointer (&row->items, g_array_unref);
+  g_clear_pointer (&row->spilled, g_array_unref);
+  g_slice_free (IndexRow, row);
+}
+
+static void
+index_tables_free (IndexTables *tables)
+{
+  g_clear_pointer (&tables->rows, g_hash_table_unref);
+
+  if (tables->spill_stream != NULL)
+    {
+      g_io_stream_close (G_IO_STREAM (tables->spill_stream), NULL, NULL);
+      g_clear_object (&tables->spill_stream);
+    }
+
+  if (tables->spill_file != NULL)
+    {
+      g_file_delete (tables->spill_file, NULL, NULL);
+      g_clear_object (&tables->spill_file);
+    }
+
+  g_slice_free (IndexTables, tables);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (IndexTables, index_tables_free)
+
+typedef struct
+{
+  GMutex mutex;
+  GCond  cond;
+  guint  n_active;
+} SortGroup;
+
+typedef struct
+{
+  GArray    *items;
+  SortGroup *group;
+} SortJob;
+
+static void
+sort_row_worker (gpointer data,
+                 gpointer user_data)
+{
+  SortJob *job = data;
+  SortGroup *group = job->group;
+
+  g_array_sort (job->items, pos_doc_pair_compare);
+
+  g_mutex_lock (&group->mutex);
+  if (--group->n_active == 0)
+    g_cond_signal (&group->cond);
+  g_mutex_unlock (&group->mutex);
+}
+
+/*
+ * The pool is shared by every builder, rather than being created for each
+ * spill, as threads are expensive to start compared to sorting a table.
+ */
+static GThreadPool *
+get_sort_pool (void)
+{
+  static GThreadPool *pool;
+
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *instance;
+
+      instance = g_thread_pool_new (sort_row_worker,
+                                    NULL,
+                                    g_get_num_processors (),
+                                    FALSE,
+                                    NULL);
+      g_once_init_leave (&pool, instance);
+    }
+
+  return pool;
+}
+
+/*
+ * Sorts the pending items of every table. Each table is independent, so
+ * the larger ones are sorted in parallel on a thread pool.
+ */
+static void
+index_tables_sort (IndexTables *tables)
+{
+  g_autoptr(GArray) jobs = NULL;
+  GHashTableIter iter;
+  SortGroup group;
+  IndexRow *row;
+  guint i;
+
+  g_assert (tables != NULL);
+
+  jobs = g_array_new (FALSE, FALSE, sizeof (SortJob));
+
+  g_hash_table_iter_init (&iter, tables->rows);
+
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&row))
+    {
+      SortJob job;
+
+      if (row->items->len < MIN_PARALLEL_SORT_ITEMS)
+        {
+          g_array_sort (row->items, pos_doc_pair_compare);
+          continue;
+        }
+
+      job.items = row->items;
+      job.group = &group;
+      g_array_append_val (jobs, job);
+    }
+
+  if (jobs->len == 0)
+    return;
+
+  g_mutex_init (&group.mutex);
+  g_cond_init (&group.cond);
+  group.n_active = jobs->len - 1;
+
+  /* The jobs are only pushed once @jobs will no longer be reallocated */
+  for (i = 1; i < jobs->len; i++)
+    g_thread_pool_push (get_sort_pool (), &g_array_index (jobs, SortJob, i), NULL);
+
+  /* Use this thread for the first table rather than sitting idle */
+  g_array_sort (g_array_index (jobs, SortJob, 0).items, pos_doc_pair_compare);
+
+  g_mutex_lock (&group.mutex);
+  while (group.n_active > 0)
+    g_cond_wait (&group.cond, &group.mutex);
+  g_mutex_unlock (&group.mutex);
+
+  g_cond_clear (&group.cond);
+  g_mutex_clear (&group.mutex);
+}
+
+/*
+ * Sorts the pending items of every table and appends them to the
+ * temporary file as sorted runs, releasing their memory.
+ */
+static gboolean
+index_tables_spill (IndexTables   *tables,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  GOutputStream *stream;
   GHashTableIter iter;
-  gpointer keyptr;
-  GArray *row;
+  IndexRow *row;
+
+  g_assert (tables != NULL);
+
+  if (tables->spill_stream == NULL)
+    {
+      tables->spill_file = g_file_new_tmp ("dzl-fuzzy-index-XXXXXX", &tables->spill_stream, error);
+      if (tables->spill_file == NULL)
+        return FALSE;
+    }
+
+  index_tables_sort (tables);
+
+  stream = g_io_stream_get_output_stream (G_IO_STREAM (tables->spill_stream));
+
+  if (!g_seekable_seek (G_SEEKABLE (tables->spill_stream), tables->spill_offset, G_SEEK_SET, cancellable, error))
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, tables->rows);
+
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&row))
+    {
+      SpilledRun run;
+
+      if (row->items->len == 0)
+        continue;
+
+      run.offset = tables->spill_offset;
+      run.n_items = row->items->len;
+
+      if (!g_output_stream_write_all (stream, row->items->data, sizeof (IndexItem) * run.n_items, NULL, cancellable, error))
+        return FALSE;
+
+      if (row->spilled == NULL)
+        row->spilled = g_array_new (FALSE, FALSE, sizeof (SpilledRun));
+      g_array_append_val (row->spilled, run);
+
+      tables->spill_offset += sizeof (IndexItem) * run.n_items;
+
+      /* Release the memory rather than keeping the allocation around */
+      g_array_unref (row->items);
+      row->items = g_array_new (FALSE, FALSE, sizeof (IndexItem));
+    }
+
+  return g_output_stream_flush (stream, cancellable, error);
+}
+
+/*
+ * Builds the per-character tables. @directory is filled with a
+ * DzlFuzzyIndexTable for each character, sorted by character. The
+ * items of each table are sorted, but if the memory budget was exceeded
+ * some of them may live in sorted runs within a temporary file. Use
+ * dzl_fuzzy_index_builder_write_table() to write them out.
+ */
+static IndexTables *
+dzl_fuzzy_index_builder_build_index (DzlFuzzyIndexBuilder  *self,
+                                     GArray                *directory,
+                                     guint64               *n_items,
+                                     GCancellable          *cancellable,
+                                     GError               **error)
+{
+  g_autoptr(IndexTables) tables = NULL;
+  guint64 max_pending = 0;
+  guint64 n_pending = 0;
+  guint64 offset = 0;
+  IndexRow *row;
   guint i;
 
   g_assert (DZL_IS_FUZZY_INDEX_BUILDER (self));
+  g_assert (directory != NULL);
+  g_assert (n_items != NULL);
+
+  tables = g_slice_new0 (IndexTables);
+  tables->rows = g_hash_table_new_full (NULL, NULL, NULL, index_row_free);
 
-  ar = g_ptr_array_new_with_free_func ((GDestroyNotify)g_array_unref);
-  rows = g_hash_table_new (NULL, NULL);
+  if (self->memory_budget > 0)
+    max_pending = MAX (1, self->memory_budget / sizeof (IndexItem));
 
   for (i = 0; i < self->kv_pairs->len; i++)
     {
@@ -381,41 +714,217 @@ dzl_fuzzy_index_builder_build_index (DzlFuzzyIndexBuilder *self)
         {
           gunichar ch = g_utf8_get_char (tmp);
 
-          row = g_hash_table_lookup (rows, GUINT_TO_POINTER (ch));
+          row = g_hash_table_lookup (tables->rows, GUINT_TO_POINTER (ch));
 
           if G_UNLIKELY (row == NULL)
             {
-              row = g_array_new (FALSE, FALSE, sizeof (IndexItem));
-              g_hash_table_insert (rows, GUINT_TO_POINTER (ch), row);
+              DzlFuzzyIndexTable table = { ch, 0, 0 };
+
+              row = g_slice_new0 (IndexRow);
+              row->items = g_array_new (FALSE, FALSE, sizeof (IndexItem));
+              g_hash_table_insert (tables->rows, GUINT_TO_POINTER (ch), row);
+              g_array_append_val (directory, table);
             }
 
           item.position = position++;
-          g_array_append_val (row, item);
+          g_array_append_val (row->items, item);
+          n_pending++;
+        }
+
+      if (max_pending > 0 && n_pending >= max_pending)
+        {
+          if (!index_tables_spill (tables, cancellable, error))
+            return NULL;
+          n_pending = 0;
         }
     }
 
-  g_variant_dict_init (&dict, NULL);
+  index_tables_sort (tables);
 
-  g_hash_table_iter_init (&iter, rows);
+  /*
+   * The directory is sorted by character so that the reader can locate
+   * the table for a character with a binary search over the mmap()'d
+   * region instead of decoding a dictionary.
+   */
+  g_array_sort (directory, table_compare);
 
-  while (g_hash_table_iter_next (&iter, &keyptr, (gpointer *)&row))
+  for (i = 0; i < directory->len; i++)
     {
-      gchar key[12];
-      GVariant *variant;
-      gunichar ch = GPOINTER_TO_UINT (keyptr);
+      DzlFuzzyIndexTable *table = &g_array_index (directory, DzlFuzzyIndexTable, i);
+      guint64 row_len;
 
-      key [g_unichar_to_utf8 (ch, key)] = 0;
+      row = g_hash_table_lookup (tables->rows, GUINT_TO_POINTER (table->ch));
+      row_len = row->items->len;
+
+      if (row->spilled != NULL)
+        {
+          for (guint j = 0; j < row->spilled->len; j++)
+            row_len += g_array_index (row->spilled, SpilledRun, j).n_items;
+        }
 
-      g_array_sort (row, pos_doc_pair_compare);
+      if (row_len > G_MAXUINT32)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_NO_SPACE,
+                       "Index table exceeds the maximum table size");
+          return NULL;
+        }
 
-      variant = g_variant_new_fixed_array ((const GVariantType *)"(uu)",
-                                           row->data,
-                                           row->len,
-                                           sizeof (IndexItem));
-      g_variant_dict_insert_value (&dict, key, variant);
+      table->n_items = row_len;
+      table->offset = offset;
+      offset += row_len;
     }
 
-  return g_variant_dict_end (&dict);
+  *n_items = offset;
+
+  return g_steal_pointer (&tables);
+}
+
+static gboolean
+merge_source_fill (MergeSource   *source,
+                   IndexTables   *tables,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  GInputStream *stream;
+  gsize n_items;
+
+  g_assert (source != NULL);
+  g_assert (source->buffer != NULL);
+  g_assert (source->file_remaining > 0);
+
+  stream = g_io_stream_get_input_stream (G_IO_STREAM (tables->spill_stream));
+  n_items = MIN (MERGE_BUFFER_ITEMS, source->file_remaining);
+
+  if (!g_seekable_seek (G_SEEKABLE (tables->spill_stream), source->file_offset, G_SEEK_SET, cancellable, error) ||
+      !g_input_stream_read_all (stream, source->buffer, sizeof (IndexItem) * n_items, NULL, cancellable, error))
+    return FALSE;
+
+  source->items = source->buffer;
+  source->n_items = n_items;
+  source->pos = 0;
+  source->file_offset += sizeof (IndexItem) * n_items;
+  source->file_remaining -= n_items;
+
+  return TRUE;
+}
+
+/*
+ * Gets the next item from @source, refilling from the temporary file as
+ * necessary. Sets @done when there are no more items.
+ */
+static gboolean
+merge_source_next (MergeSource   *source,
+                   IndexTables   *tables,
+                   IndexItem     *item,
+                   gboolean      *done,
+                   GCancellable  *cancellable,
+                   GError       **error)
+{
+  *done = FALSE;
+
+  if (source->pos == source->n_items)
+    {
+      if (source->file_remaining == 0)
+        {
+          *done = TRUE;
+          return TRUE;
+        }
+
+      if (!merge_source_fill (source, tables, cancellable, error))
+        return FALSE;
+    }
+
+  *item = source->items[source->pos++];
+
+  return TRUE;
+}
+
+/*
+ * Writes the sorted items of @ch to @stream. If the table has spilled
+ * runs, they are merged with the items still in memory.
+ */
+static gboolean
+dzl_fuzzy_index_builder_write_table (IndexTables    *tables,
+                                     gunichar        ch,
+                                     GOutputStream  *stream,
+                                     GCancellable   *cancellable,
+                                     GError        **error)
+{
+  g_autoptr(DzlHeap) heap = NULL;
+  g_autoptr(GArray) out = NULL;
+  g_autofree MergeSource *sources = NULL;
+  g_autofree IndexItem *buffers = NULL;
+  IndexRow *row;
+  guint n_sources;
+  gboolean done;
+
+  g_assert (tables != NULL);
+  g_assert (G_IS_OUTPUT_STREAM (stream));
+
+  row = g_hash_table_lookup (tables->rows, GUINT_TO_POINTER (ch));
+
+  g_assert (row != NULL);
+
+  if (row->spilled == NULL)
+    return g_output_stream_write_all (stream, row->items->data, sizeof (IndexItem) * row->items->len,
+                                      NULL, cancellable, error);
+
+  /* One source for each spilled run, plus the items still in memory */
+  n_sources = row->spilled->len + 1;
+  sources = g_new0 (MergeSource, n_sources);
+  buffers = g_new (IndexItem, (gsize)MERGE_BUFFER_ITEMS * row->spilled->len);
+  heap = dzl_heap_new (sizeof (MergeHead), merge_head_compare);
+  out = g_array_sized_new (FALSE, FALSE, sizeof (IndexItem), MERGE_BUFFER_ITEMS);
+
+  for (guint i = 0; i < row->spilled->len; i++)
+    {
+      const SpilledRun *run = &g_array_index (row->spilled, SpilledRun, i);
+
+      sources[i].buffer = &buffers[(gsize)MERGE_BUFFER_ITEMS * i];
+      sources[i].file_offset = run->offset;
+      sources[i].file_remaining = run->n_items;
+    }
+
+  sources[n_sources - 1].items = (const IndexItem *)(gpointer)row->items->data;
+  sources[n_sources - 1].n_items = row->items->len;
+
+  for (guint i = 0; i < n_sources; i++)
+    {
+      MergeHead head;
+
+      head.source = i;
+
+      if (!merge_source_next (&sources[i], tables, &head.item, &done, cancellable, error))
+        return FALSE;
+
+      if (!done)
+        dzl_heap_insert_val (heap, head);
+    }
+
+  while (heap->len > 0)
+    {
+      MergeHead head;
+
+      dzl_heap_extract (heap, &head);
+      g_array_append_val (out, head.item);
+
+      if (out->len == MERGE_BUFFER_ITEMS)
+        {
+          if (!g_output_stream_write_all (stream, out->data, sizeof (IndexItem) * out->len, NULL, cancellable, error))
+            return FALSE;
+          g_array_set_size (out, 0);
+        }
+
+      if (!merge_source_next (&sources[head.source], tables, &head.item, &done, cancellable, error))
+        return FALSE;
+
+      if (!done)
+        dzl_heap_insert_val (heap, head);
+    }
+
+  return g_output_stream_write_all (stream, out->data, sizeof (IndexItem) * out->len, NULL, cancellable, error);
 }
 
 static GVariant *
@@ -443,6 +952,77 @@ dzl_fuzzy_index_builder_build_metadata (DzlFuzzyIndexBuilder *self)
   return g_variant_dict_end (&dict);
 }
 
+static GVariant *
+dzl_fuzzy_index_builder_build_variant (DzlFuzzyIndexBuilder *self)
+{
+  GVariantDict dict;
+
+  g_assert (DZL_IS_FUZZY_INDEX_BUILDER (self));
+
+  g_variant_dict_init (&dict, NULL);
+
+  /* Build our dicitionary of metadata */
+  g_variant_dict_insert_value (&dict,
+                               "metadata",
+                               dzl_fuzzy_index_builder_build_metadata (self));
+
+  /*
+   * The documents are stored as an array where the document identifier is
+   * their index position. We then use a lookaside buffer to map the insertion
+   * id to the document id. Otherwise, we can't disambiguate between two
+   * keys that insert the same document (as we deduplicate documents inserted
+   * into the index).
+   */
+  g_variant_dict_insert_value (&dict,
+                               "documents",
+                               g_variant_new_array (NULL,
+                                                    (GVariant * const *)self->documents->pdata,
+                                                    self->documents->len));
+
+  if (self->tombstones != NULL && self->tombstones->len > 0)
+    {
+      GVariantBuilder builder;
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE ("av"));
+      for (guint i = 0; i < self->tombstones->len; i++)
+        g_variant_builder_add (&builder, "v", g_ptr_array_index (self->tombstones, i));
+      g_variant_dict_insert_value (&dict, "tombstones", g_variant_builder_end (&builder));
+    }
+
+  return g_variant_ref_sink (g_variant_dict_end (&dict));
+}
+
+static gboolean
+write_section (GOutputStream  *stream,
+               guint64        *offset,
+               gconstpointer   data,
+               gsize           length,
+               GCancellable   *cancellable,
+               GError        **error)
+{
+  static const guint8 padding[8];
+  guint64 aligned;
+
+  g_assert (G_IS_OUTPUT_STREAM (stream));
+  g_assert (offset != NULL);
+
+  /* @data may be %NULL if the caller streamed the section contents itself */
+  if (data != NULL && length > 0 &&
+      !g_output_stream_write_all (stream, data, length, NULL, cancellable, error))
+    return FALSE;
+
+  *offset += length;
+  aligned = align_section (*offset);
+
+  if (aligned > *offset &&
+      !g_output_stream_write_all (stream, padding, aligned - *offset, NULL, cancellable, error))
+    return FALSE;
+
+  *offset = aligned;
+
+  return TRUE;
+}
+
 static void
 dzl_fuzzy_index_builder_write_worker (GTask        *task,
                                       gpointer      source_object,
@@ -450,78 +1030,122 @@ dzl_fuzzy_index_builder_write_worker (GTask        *task,
                                       GCancellable *cancellable)
 {
   DzlFuzzyIndexBuilder *self = source_object;
+  g_autoptr(GFileOutputStream) file_stream = NULL;
+  g_autoptr(GOutputStream) stream = NULL;
   g_autoptr(GVariant) variant = NULL;
-  g_autoptr(GVariant) documents = NULL;
-  g_autoptr(GPtrArray) array_of_keys = NULL;
-  GVariantDict dict;
+  g_autoptr(GArray) key_offsets = NULL;
+  g_autoptr(GArray) directory = NULL;
+  g_autoptr(IndexTables) tables = NULL;
+  DzlFuzzyIndexHeader header = { { 0 } };
   GFile *file = task_data;
   GError *error = NULL;
+  guint64 strings_length = 0;
+  guint64 offset = 0;
+  guint i;
 
   g_assert (G_IS_TASK (task));
   g_assert (DZL_IS_FUZZY_INDEX_BUILDER (self));
   g_assert (G_IS_FILE (file));
   g_assert (!cancellable || G_IS_CANCELLABLE (cancellable));
 
-  g_variant_dict_init (&dict, NULL);
+  /* Keys are packed back to back and addressed by their offset */
+  key_offsets = g_array_sized_new (FALSE, FALSE, sizeof (guint32), self->keys->len);
 
-  /* Set our version number for the document */
-  g_variant_dict_insert (&dict, "version", "i", 1);
+  for (i = 0; i < self->keys->len; i++)
+    {
+      const gchar *key = g_ptr_array_index (self->keys, i);
+      guint32 key_offset;
 
-  /* Build our dicitionary of metadata */
-  g_variant_dict_insert_value (&dict,
-                               "metadata",
-                               dzl_fuzzy_index_builder_build_metadata (self));
+      if (strings_length > G_MAXUINT32)
+        {
+          g_task_return_new_error (task,
+                                   G_IO_ERROR,
+                                   G_IO_ERROR_NO_SPACE,
+                                   "Index keys exceed the maximum index size");
+          return;
+        }
 
-  /* Keys is an array of string keys where the index is the "key_id" */
-  g_variant_dict_insert_value (&dict,
-                               "keys",
-                               dzl_fuzzy_index_builder_build_keys (self));
-
-  /* The lookaside is a mapping of kvpair to the repsective keys and
-   * documents. This allows the tables to use the kvpair id as the value
-   * in the index so we can have both document deduplication as well as
-   * the ability to disambiguate the keys which point to the same
-   * document. The contents are "a{uu}".
-   */
-  g_variant_dict_insert_value (&dict,
-                               "lookaside",
-                               dzl_fuzzy_index_builder_build_lookaside (self));
+      key_offset = strings_length;
+      g_array_append_val (key_offsets, key_offset);
+      strings_length += strlen (key) + 1;
+    }
 
-  /* Build our dicitionary of character → [(pos,lookaside_id),..] tuples.
+  /* Build our directory of character → [(pos,lookaside_id),..] tables.
    * The position is the utf8 character position within the string.
    * The lookaside_id is the index within the lookaside buffer to locate
    * the document_id or key_id.
    */
-  g_variant_dict_insert_value (&dict,
-                               "tables",
-                               dzl_fuzzy_index_builder_build_index (self));
+  directory = g_array_new (FALSE, FALSE, sizeof (DzlFuzzyIndexTable));
+  tables = dzl_fuzzy_index_builder_build_index (self, directory, &header.n_items, cancellable, &error);
+  if (tables == NULL)
+    goto failure;
+
+  variant = dzl_fuzzy_index_builder_build_variant (self);
+
+  memcpy (header.magic, DZL_FUZZY_INDEX_MAGIC, DZL_FUZZY_INDEX_MAGIC_LEN);
+  header.version = DZL_FUZZY_INDEX_VERSION_2;
+  header.byte_order = G_BYTE_ORDER;
+  header.flags = self->case_sensitive ? DZL_FUZZY_INDEX_CASE_SENSITIVE : 0;
+  header.n_keys = self->keys->len;
+  header.n_lookaside = self->kv_pairs->len;
+  header.n_tables = directory->len;
+
+  /* Layout the sections in the order that they are written below */
+  header.keys_offset = align_section (sizeof header);
+  header.strings_offset = align_section (header.keys_offset + sizeof (guint32) * header.n_keys);
+  header.strings_length = strings_length;
+  header.lookaside_offset = align_section (header.strings_offset + strings_length);
+  header.directory_offset = align_section (header.lookaside_offset + sizeof (KVPair) * header.n_lookaside);
+  header.items_offset = align_section (header.directory_offset + sizeof (DzlFuzzyIndexTable) * header.n_tables);
+  header.variant_offset = align_section (header.items_offset + sizeof (IndexItem) * header.n_items);
+  header.variant_length = g_variant_get_size (variant);
+
+  file_stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, cancellable, &error);
+  if (file_stream == NULL)
+    goto failure;
+
+  stream = g_buffered_output_stream_new_sized (G_OUTPUT_STREAM (file_stream), 1024 * 64);
+
+  if (!write_section (stream, &offset, &header, sizeof header, cancellable, &error) ||
+      !write_section (stream, &offset, key_offsets->data, sizeof (guint32) * key_offsets->len, cancellable, &error))
+    goto failure;
+
+  for (i = 0; i < self->keys->len; i++)
+    {
+      const gchar *key = g_ptr_array_index (self->keys, i);
 
-  /*
-   * The documents are stored as an array where the document identifier is
-   * their index position. We then use a lookaside buffer to map the insertion
-   * id to the document id. Otherwise, we can't disambiguate between two
-   * keys that insert the same document (as we deduplicate documents inserted
-   * into the index).
-   */
-  documents = g_variant_new_array (NULL,
-                                   (GVariant * const *)self->documents->pdata,
-                                   self->documents->len);
-  g_variant_dict_insert_value (&dict, "documents", g_variant_ref_sink (documents));
-
-  /* Now write the variant to disk */
-  variant = g_variant_ref_sink (g_variant_dict_end (&dict));
-  if (!g_file_replace_contents (file,
-                                g_variant_get_data (variant),
-                                g_variant_get_size (variant),
-                                NULL,
-                                FALSE,
-                                G_FILE_CREATE_NONE,
-                                NULL,
-                                cancellable,
-                                &error))
-    g_task_return_error (task, error);
-  else
-    g_task_return_boolean (task, TRUE);
+      if (!g_output_stream_write_all (stream, key, strlen (key) + 1, NULL, cancellable, &error))
+        goto failure;
+    }
+
+  if (!write_section (stream, &offset, NULL, strings_length, cancellable, &error) ||
+      !write_section (stream, &offset, self->kv_pairs->data, sizeof (KVPair) * self->kv_pairs->len, cancellable, &error) ||
+      !write_section (stream, &offset, directory->data, sizeof (DzlFuzzyIndexTable) * directory->len, cancellable, &error))
+    goto failure;
+
+  for (i = 0; i < directory->len; i++)
+    {
+      const DzlFuzzyIndexTable *table = &g_array_index (directory, DzlFuzzyIndexTable, i);
+
+      if (!dzl_fuzzy_index_builder_write_table (tables, table->ch, stream, cancellable, &error))
+        goto failure;
+    }
+
+  if (!write_section (stream, &offset, NULL, sizeof (IndexItem) * header.n_items, cancellable, &error) ||
+      !write_section (stream, &offset, g_variant_get_data (variant), header.variant_length, cancellable, &error))
+    goto failure;
+
+  g_assert (offset == align_section (header.variant_offset + header.variant_length));
+
+  if (!g_output_stream_close (stream, cancellable, &error))
+    goto failure;
+
+  g_task_return_boolean (task, TRUE);
+
+  return;
+
+failure:
+  g_task_return_error (task, error);
 }
 
 /**
@@ -533,9 +1157,12 @@ dzl_fuzzy_index_builder_write_worker (GTask        *task,
  * @callback: A callback for completion or %NULL
  * @user_data: User data for @callback
  *
- * Builds and writes the index to @file. The file format is a
- * GVariant on disk and can be loaded and searched using
- * #FuzzyIndex.
+ * Builds and writes the index to @file. The file format is a flat
+ * binary index designed to be mmap()'d and can be loaded and searched
+ * using #DzlFuzzyIndex.
+ *
+ * The character tables are sorted in parallel. See
+ * #DzlFuzzyIndexBuilder:memory-budget to limit the memory used for them.
  */
 void
 dzl_fuzzy_index_builder_write_async (DzlFuzzyIndexBuilder *self,
@@ -688,3 +1315,69 @@ dzl_fuzzy_index_builder_set_case_sensitive (DzlFuzzyIndexBuilder *self,
       g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_CASE_SENSITIVE]);
     }
 }
+
+/**
+ * dzl_fuzzy_index_builder_add_tombstone:
+ * @self: A #DzlFuzzyIndexBuilder
+ * @document: The document to remove
+ *
+ * Records that @document has been removed. This is only useful when
+ * building a delta index to be layered on top of another index with
+ * dzl_fuzzy_index_add_delta(). Matches for @document in the layers
+ * beneath the delta are then ignored.
+ *
+ * To replace a document, add a tombstone for it and insert it again.
+ *
+ * If @document is floating, it's floating reference will be sunk using
+ * g_variant_ref_sink().
+ */
+void
+dzl_fuzzy_index_builder_add_tombstone (DzlFuzzyIndexBuilder *self,
+                                       GVariant             *document)
+{
+  g_return_if_fail (DZL_IS_FUZZY_INDEX_BUILDER (self));
+  g_return_if_fail (document != NULL);
+
+  if (self->tombstones == NULL)
+    self->tombstones = g_ptr_array_new_with_free_func ((GDestroyNotify)g_variant_unref);
+
+  g_ptr_array_add (self->tombstones, g_variant_ref_sink (document));
+}
+
+/**
+ * dzl_fuzzy_index_builder_get_memory_budget:
+ * @self: A #DzlFuzzyIndexBuilder
+ *
+ * Gets the approximate number of bytes to use for the character tables
+ * while writing the index. See #DzlFuzzyIndexBuilder:memory-budget.
+ *
+ * Returns: the budget in bytes, or zero if there is no limit
+ */
+guint64
+dzl_fuzzy_index_builder_get_memory_budget (DzlFuzzyIndexBuilder *self)
+{
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX_BUILDER (self), 0);
+
+  return self->memory_budget;
+}
+
+/**
+ * dzl_fuzzy_index_builder_set_memory_budget:
+ * @self: A #DzlFuzzyIndexBuilder
+ * @memory_budget: the budget in bytes, or zero for no limit
+ *
+ * Sets the approximate number of bytes to use for the character tables
+ * while writing the index. See #DzlFuzzyIndexBuilder:memory-budget.
+ */
+void
+dzl_fuzzy_index_builder_set_memory_budget (DzlFuzzyIndexBuilder *self,
+                                           guint64               memory_budget)
+{
+  g_return_if_fail (DZL_IS_FUZZY_INDEX_BUILDER (self));
+
+  if (self->memory_budget != memory_budget)
+    {
+      self->memory_budget = memory_budget;
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_MEMORY_BUDGET]);
+    }
+}
@@ -31,6 +31,9 @@ DzlFuzzyIndexBuilder *dzl_fuzzy_index_builder_new                 (void);
 gboolean              dzl_fuzzy_index_builder_get_case_sensitive  (DzlFuzzyIndexBuilder  *self);
 void                  dzl_fuzzy_index_builder_set_case_sensitive  (DzlFuzzyIndexBuilder  *self,
                                                                    gboolean               case_sensitive);
+guint64               dzl_fuzzy_index_builder_get_memory_budget   (DzlFuzzyIndexBuilder  *self);
+void                  dzl_fuzzy_index_builder_set_memory_budget   (DzlFuzzyIndexBuilder  *self,
+                                                                   guint64                memory_budget);
 guint64               dzl_fuzzy_index_builder_insert              (DzlFuzzyIndexBuilder  *self,
                                                                    const gchar           *key,
                                                                    GVariant              *document,
@@ -49,6 +52,8 @@ void                  dzl_fuzzy_index_builder_write_async         (DzlFuzzyIndex
 gboolean              dzl_fuzzy_index_builder_write_finish        (DzlFuzzyIndexBuilder  *self,
                                                                    GAsyncResult          *result,
                                                                    GError               **error);
+void                  dzl_fuzzy_index_builder_add_tombstone       (DzlFuzzyIndexBuilder  *self,
+                                                                   GVariant              *document);
 const GVariant       *dzl_fuzzy_index_builder_get_document        (DzlFuzzyIndexBuilder  *self,
                                                                    guint64                document_id);
 void                  dzl_fuzzy_index_builder_set_metadata        (DzlFuzzyIndexBuilder  *self,
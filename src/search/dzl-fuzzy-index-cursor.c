@@ -23,33 +23,72 @@
 #include "search/dzl-fuzzy-index-cursor.h"
 #include "search/dzl-fuzzy-index-match.h"
 #include "search/dzl-fuzzy-index-private.h"
+#include "util/dzl-heap.h"
 #include "util/dzl-int-pair.h"
 
+/*
+ * The first table of a query is split into shards which are matched in
+ * parallel. Shards smaller than this are not worth the cost of handing
+ * them to another thread.
+ */
+#define MIN_ITEMS_PER_SHARD 4096
+
+/* Number of items to check linearly before galloping forward */
+#define GALLOP_LINEAR_ITEMS 8
+
+/* Number of first-table items to match between checks for cancellation */
+#define CANCEL_CHECK_INTERVAL 1024
+
+/* Number of recently returned match objects kept around */
+#define MATCH_CACHE_SIZE 32
+
 struct _DzlFuzzyIndexCursor
 {
   GObject          object;
 
   DzlFuzzyIndex   *index;
   gchar           *query;
-  GVariantDict    *tables;
   GArray          *matches;
+
+  /* Cancelled by the index once a newer query supersedes this one */
+  GCancellable    *superseded;
+
+  /*
+   * The tombstones of the layers above the index, if it is queried as a
+   * layer of another index. Documents found in them are skipped.
+   */
+  GPtrArray       *removed;
+
   guint            max_matches;
+  guint            max_errors;
   guint            case_sensitive : 1;
-};
 
-typedef struct
-{
-  guint position;
-  guint lookaside_id;
-} DzlFuzzyIndexItem;
+  /*
+   * The characters of the query used to select tables, and the sorted
+   * lookaside ids of every key that matched them (before deduplication
+   * and max_matches were applied). A later query that extends @needle
+   * can only match a subset of @candidates, which lets us refine the
+   * results rather than walking the full tables again.
+   */
+  gchar           *needle;
+  GArray          *candidates;
 
-typedef struct
-{
-  const gchar *key;
-  guint        document_id;
-  gfloat       score;
-  guint        priority;
-} DzlFuzzyMatch;
+  /* The needle and candidates of the cursor we are refining, if any */
+  gchar           *refine_needle;
+  GArray          *refine_candidates;
+  guint            refine_case_sensitive : 1;
+
+  /*
+   * Recently returned match objects, indexed by position modulo
+   * MATCH_CACHE_SIZE, so that asking for the same position again returns
+   * the same object. Once handed out, a match is never modified.
+   */
+  DzlFuzzyIndexMatch *match_cache [MATCH_CACHE_SIZE];
+  guint               match_cache_position [MATCH_CACHE_SIZE];
+};
+
+/* Matches are stored in the public form so they can be copied out in bulk */
+typedef DzlFuzzyIndexCursorMatch DzlFuzzyMatch;
 
 typedef struct
 {
@@ -61,14 +100,113 @@ typedef struct
   guint                            max_matches;
   const gchar                     *needle;
   GHashTable                      *matches;
+  GCancellable                    *cancellable;
+  GCancellable                    *superseded;
 } DzlFuzzyLookup;
 
+typedef struct
+{
+  GMutex mutex;
+  GCond  cond;
+  guint  n_active;
+} DzlFuzzyShardGroup;
+
+typedef struct
+{
+  /* A copy of the lookup with a private tables_state and matches */
+  DzlFuzzyLookup      lookup;
+
+  /*
+   * The range of items within the first table to match, or if
+   * @candidates is set, the range of lookaside ids within it.
+   */
+  const guint        *candidates;
+  gsize               begin;
+  gsize               end;
+
+  DzlFuzzyShardGroup *group;
+} DzlFuzzyShard;
+
+/*
+ * The best match seen for a document. When collecting all matches,
+ * @match_index is the position of that match in the results so it can
+ * be replaced in place. When collecting into a heap, it is the position
+ * of the match within the heap, kept up to date by the heap's index func,
+ * or FUZZY_DOC_NONE if the match is not in the heap.
+ */
+typedef struct
+{
+  guint  document_id;
+  guint  match_index;
+  gfloat score;
+  guint  used : 1;
+  guint  removed : 1;
+} DzlFuzzyDocSlot;
+
+/*
+ * An open-addressing (linear probing) table keyed by document id. Entries
+ * are never removed, so no tombstones are needed.
+ */
+typedef struct
+{
+  DzlFuzzyDocSlot *slots;
+  guint            mask;
+  guint            n_used;
+} DzlFuzzyDocTable;
+
+/*
+ * The items of a single key in the table for a character of the query,
+ * which are sorted by position.
+ */
+typedef struct
+{
+  const DzlFuzzyIndexItem *items;
+  gsize                    n_items;
+} DzlFuzzyPositions;
+
+typedef struct
+{
+  const DzlFuzzyPositions *positions;
+  guint                    n_positions;
+  guint                    max_errors;
+
+  /* The best match found so far, if best_score != G_MAXUINT */
+  guint                    best_errors;
+  guint                    best_score;
+  guint                    best_last;
+} DzlFuzzyErrorsMatch;
+
+/*
+ * The elements of the heap of best matches. The table is needed by the
+ * heap's index func to find the slot of the match, which must be first
+ * so that the entry can be compared with fuzzy_match_compare().
+ */
+typedef struct
+{
+  DzlFuzzyMatch     match;
+  DzlFuzzyDocTable *by_document;
+} DzlFuzzyHeapEntry;
+
+typedef struct
+{
+  DzlFuzzyIndex    *index;
+  GArray           *matches;
+  DzlFuzzyDocTable *by_document;
+  DzlHeap          *heap;
+  GPtrArray        *removed;
+  guint             max_matches;
+} DzlFuzzyCollector;
+
+#define FUZZY_DOC_TABLE_MIN_SIZE 64
+#define FUZZY_DOC_NONE           G_MAXUINT
+
 enum {
   PROP_0,
   PROP_CASE_SENSITIVE,
   PROP_INDEX,
-  PROP_TABLES,
+  PROP_MAX_ERRORS,
   PROP_MAX_MATCHES,
+  PROP_PREVIOUS,
   PROP_QUERY,
   N_PROPS
 };
@@ -82,49 +220,47 @@ G_DEFINE_TYPE_EXTENDED (DzlFuzzyIndexCursor, dzl_fuzzy_index_cursor, G_TYPE_OBJE
                         G_IMPLEMENT_INTERFACE (G_TYPE_ASYNC_INITABLE, async_initable_iface_init)
                         G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL, list_model_iface_init))
 
-static inline gfloat
-pointer_to_float (gpointer ptr)
-{
-  union {
-    gpointer ptr;
-#if __WORDSIZE == 64
-    gdouble fval;
-#else
-    gfloat fval;
-#endif
-  } convert;
-  convert.ptr = ptr;
-  return (gfloat)convert.fval;
-}
-
-static inline gpointer
-float_to_pointer (gfloat fval)
-{
-  union {
-    gpointer ptr;
-#if __WORDSIZE == 64
-    gdouble fval;
-#else
-    gfloat fval;
-#endif
-  } convert;
-  convert.fval = fval;
-  return convert.ptr;
-}
-
 static void
 dzl_fuzzy_index_cursor_finalize (GObject *object)
 {
   DzlFuzzyIndexCursor *self = (DzlFuzzyIndexCursor *)object;
 
   g_clear_object (&self->index);
+  g_clear_object (&self->superseded);
+  g_clear_pointer (&self->removed, g_ptr_array_unref);
   g_clear_pointer (&self->query, g_free);
   g_clear_pointer (&self->matches, g_array_unref);
-  g_clear_pointer (&self->tables, g_variant_dict_unref);
+  g_clear_pointer (&self->needle, g_free);
+  g_clear_pointer (&self->candidates, g_array_unref);
+  g_clear_pointer (&self->refine_needle, g_free);
+  g_clear_pointer (&self->refine_candidates, g_array_unref);
+
+  for (guint i = 0; i < MATCH_CACHE_SIZE; i++)
+    g_clear_object (&self->match_cache [i]);
 
   G_OBJECT_CLASS (dzl_fuzzy_index_cursor_parent_class)->finalize (object);
 }
 
+static void
+dzl_fuzzy_index_cursor_set_previous (DzlFuzzyIndexCursor *self,
+                                     DzlFuzzyIndexCursor *previous)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+  g_assert (!previous || DZL_IS_FUZZY_INDEX_CURSOR (previous));
+
+  /*
+   * We only copy what we need from @previous so that refining a long
+   * sequence of queries does not keep every cursor alive. The candidates
+   * are immutable once the previous cursor has completed.
+   */
+  if (previous != NULL && previous->candidates != NULL)
+    {
+      self->refine_needle = g_strdup (previous->needle);
+      self->refine_candidates = g_array_ref (previous->candidates);
+      self->refine_case_sensitive = previous->case_sensitive;
+    }
+}
+
 static void
 dzl_fuzzy_index_cursor_get_property (GObject    *object,
                                  guint       prop_id,
@@ -143,6 +279,10 @@ dzl_fuzzy_index_cursor_get_property (GObject    *object,
       g_value_set_object (value, self->index);
       break;
 
+    case PROP_MAX_ERRORS:
+      g_value_set_uint (value, self->max_errors);
+      break;
+
     case PROP_MAX_MATCHES:
       g_value_set_uint (value, self->max_matches);
       break;
@@ -174,14 +314,18 @@ dzl_fuzzy_index_cursor_set_property (GObject      *object,
       self->index = g_value_dup_object (value);
       break;
 
-    case PROP_TABLES:
-      self->tables = g_value_dup_boxed (value);
+    case PROP_MAX_ERRORS:
+      self->max_errors = g_value_get_uint (value);
       break;
 
     case PROP_MAX_MATCHES:
       self->max_matches = g_value_get_uint (value);
       break;
 
+    case PROP_PREVIOUS:
+      dzl_fuzzy_index_cursor_set_previous (self, g_value_get_object (value));
+      break;
+
     case PROP_QUERY:
       self->query = g_value_dup_string (value);
       break;
@@ -214,12 +358,12 @@ dzl_fuzzy_index_cursor_class_init (DzlFuzzyIndexCursorClass *klass)
                          DZL_TYPE_FUZZY_INDEX,
                          (G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
-  properties [PROP_TABLES] =
-    g_param_spec_boxed ("tables",
-                        "Tables",
-                        "The dictionary of character indexes",
-                        G_TYPE_VARIANT_DICT,
-                        (G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+  properties [PROP_PREVIOUS] =
+    g_param_spec_object ("previous",
+                         "Previous",
+                         "A completed cursor whose results may be refined",
+                         DZL_TYPE_FUZZY_INDEX_CURSOR,
+                         (G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
   properties [PROP_QUERY] =
     g_param_spec_string ("query",
@@ -237,6 +381,29 @@ dzl_fuzzy_index_cursor_class_init (DzlFuzzyIndexCursorClass *klass)
                        0,
                        (G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * DzlFuzzyIndexCursor:max-errors:
+   *
+   * The number of errors allowed when matching a key. An error is a
+   * character of the query that is missing from the key (or was mistyped
+   * as another character), or two characters of the query that appear in
+   * the key in the opposite order.
+   *
+   * Matches are ordered by the priority of their key first. Among keys of
+   * the same priority, each error ranks a match as if it were four times
+   * looser, so typos only win over much looser matches. At least one
+   * character of the query must match. Cursors with errors cannot be
+   * refined.
+   */
+  properties [PROP_MAX_ERRORS] =
+    g_param_spec_uint ("max-errors",
+                       "Max Errors",
+                       "The max number of typos to allow in a match",
+                       0,
+                       DZL_FUZZY_INDEX_MAX_ERRORS,
+                       0,
+                       (G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
@@ -261,6 +428,81 @@ fuzzy_match_compare (gconstpointer a,
   return strcmp (ma->key, mb->key);
 }
 
+/*
+ * Items are sorted by lookaside_id and then position, which is the same
+ * order as this 64-bit key.
+ */
+static inline guint64
+fuzzy_item_key (const DzlFuzzyIndexItem *item)
+{
+  return ((guint64)item->lookaside_id << 32) | item->position;
+}
+
+/*
+ * Checks whether the query was cancelled, or superseded by a newer query,
+ * every CANCEL_CHECK_INTERVAL items so that the work can be abandoned
+ * without the cost of checking for every item.
+ */
+static inline gboolean
+fuzzy_lookup_is_cancelled (const DzlFuzzyLookup *lookup,
+                           gsize                 n_items)
+{
+  if (n_items % CANCEL_CHECK_INTERVAL != 0)
+    return FALSE;
+
+  return g_cancellable_is_cancelled (lookup->cancellable) ||
+         g_cancellable_is_cancelled (lookup->superseded);
+}
+
+/*
+ * Finds the first item at or after @begin that sorts after @key.
+ *
+ * Tables for common characters can contain millions of items, and the
+ * item we are looking for may be far away. So after checking a few items
+ * linearly, we gallop forward in exponentially growing steps and then
+ * binary search within the last step.
+ */
+static inline gsize
+fuzzy_gallop (const DzlFuzzyIndexItem *table,
+              gsize                    begin,
+              gsize                    n_elements,
+              guint64                  key)
+{
+  gsize lo = begin;
+  gsize hi;
+  gsize step = 1;
+  guint i;
+
+  for (i = 0; i < GALLOP_LINEAR_ITEMS && lo < n_elements; i++, lo++)
+    {
+      if (fuzzy_item_key (&table [lo]) > key)
+        return lo;
+    }
+
+  /* Everything before @lo sorts before or equal to @key */
+  hi = lo;
+  while (hi < n_elements && fuzzy_item_key (&table [hi]) <= key)
+    {
+      lo = hi + 1;
+      hi += step;
+      step <<= 1;
+    }
+
+  hi = MIN (hi, n_elements);
+
+  while (lo < hi)
+    {
+      gsize mid = lo + ((hi - lo) / 2);
+
+      if (fuzzy_item_key (&table [mid]) <= key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
 static gboolean
 fuzzy_do_match (const DzlFuzzyLookup    *lookup,
                 const DzlFuzzyIndexItem *item,
@@ -281,6 +523,9 @@ fuzzy_do_match (const DzlFuzzyLookup    *lookup,
   n_elements = (gssize)lookup->tables_n_elements [table_index];
   state = &lookup->tables_state [table_index];
 
+  /* Skip items of earlier keys and earlier positions within this key */
+  state [0] = (gint)fuzzy_gallop (table, state [0], n_elements, fuzzy_item_key (item));
+
   for (; state [0] < n_elements; state [0]++)
     {
       DzlIntPair *lookup_pair;
@@ -288,11 +533,8 @@ fuzzy_do_match (const DzlFuzzyLookup    *lookup,
 
       iter = &table [state [0]];
 
-      if ((iter->lookaside_id < item->lookaside_id) ||
-          ((iter->lookaside_id == item->lookaside_id) &&
-           (iter->position <= item->position)))
-        continue;
-      else if (iter->lookaside_id > item->lookaside_id)
+      /* Everything from here on sorts after @item */
+      if (iter->lookaside_id > item->lookaside_id)
         break;
 
       iter_score = score + (iter->position - item->position);
@@ -320,242 +562,1016 @@ fuzzy_do_match (const DzlFuzzyLookup    *lookup,
   return FALSE;
 }
 
+/*
+ * Returns the first item in @positions after @position, if any.
+ */
+static inline const DzlFuzzyIndexItem *
+fuzzy_positions_after (const DzlFuzzyPositions *positions,
+                       gint                     position)
+{
+  for (gsize i = 0; i < positions->n_items; i++)
+    {
+      if ((gint)positions->items [i].position > position)
+        return &positions->items [i];
+    }
+
+  return NULL;
+}
+
+/*
+ * Matches the characters of the query from @char_index onwards against a
+ * single key, given the position of the first and last character matched
+ * so far (or -1). Each character may be matched, skipped as missing or
+ * mistyped, or swapped with the next character, the latter two costing an
+ * error. Like fuzzy_do_match(), characters after the first match at the
+ * earliest possible position, which is enough to find whether a match
+ * exists with a given number of errors.
+ */
 static void
-dzl_fuzzy_index_cursor_worker (GTask        *task,
-                               gpointer      source_object,
-                               gpointer      task_data,
-                               GCancellable *cancellable)
+fuzzy_do_match_errors (DzlFuzzyErrorsMatch *state,
+                       guint                char_index,
+                       gint                 first,
+                       gint                 last,
+                       guint                errors)
 {
-  DzlFuzzyIndexCursor *self = source_object;
-  g_autoptr(GHashTable) matches = NULL;
-  g_autoptr(GHashTable) by_document = NULL;
-  g_autoptr(GPtrArray) tables = NULL;
-  g_autoptr(GArray) tables_n_elements = NULL;
-  g_autofree gint *tables_state = NULL;
-  g_autofree gchar *freeme = NULL;
-  const gchar *query;
-  DzlFuzzyLookup lookup = { 0 };
-  GHashTableIter iter;
-  const gchar *str;
-  gpointer key, value;
-  guint i;
+  const DzlFuzzyPositions *positions;
+  const DzlFuzzyIndexItem *item;
+  const DzlFuzzyIndexItem *next;
 
-  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
-  g_assert (G_IS_TASK (task));
+  g_assert (state != NULL);
 
-  if (g_task_return_error_if_cancelled (task))
+  /* Fewer errors always win, no matter the score */
+  if (errors > state->best_errors)
     return;
 
-  /* No matches with empty query */
-  if (self->query == NULL || *self->query == '\0')
-    goto cleanup;
+  if (char_index == state->n_positions)
+    {
+      guint score;
 
-  /* If we are not case-sensitive, we need to downcase the query string */
-  query = self->query;
-  if (!self->case_sensitive)
-    query = freeme = g_utf8_casefold (query, -1);
+      if (first < 0)
+        return;
 
-  tables = g_ptr_array_new ();
-  tables_n_elements = g_array_new (FALSE, FALSE, sizeof (gsize));
-  matches = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)dzl_int_pair_free);
+      /* The same score fuzzy_do_match() accumulates */
+      score = MIN (16, first * 2) + (last - first);
 
-  for (str = query; *str; str = g_utf8_next_char (str))
-    {
-      gunichar ch = g_utf8_get_char (str);
-      g_autoptr(GVariant) table = NULL;
-      gconstpointer fixed;
-      gsize n_elements;
-      gchar char_key[8];
+      if (errors < state->best_errors || score < state->best_score)
+        {
+          state->best_errors = errors;
+          state->best_score = score;
+          state->best_last = last;
+        }
 
-      if (g_unichar_isspace (ch))
-        continue;
+      return;
+    }
 
-      char_key [g_unichar_to_utf8 (ch, char_key)] = '\0';
-      table = g_variant_dict_lookup_value (self->tables,
-                                           char_key,
-                                           (const GVariantType *)"a(uu)");
+  positions = &state->positions [char_index];
 
-      /* No possible matches, missing table for character */
-      if (table == NULL)
-        goto cleanup;
+  if (first < 0)
+    {
+      for (gsize i = 0; i < positions->n_items; i++)
+        {
+          gint position = positions->items [i].position;
 
-      fixed = g_variant_get_fixed_array (table, &n_elements, sizeof (DzlFuzzyIndexItem));
-      g_array_append_val (tables_n_elements, n_elements);
-      g_ptr_array_add (tables, (gpointer)fixed);
+          fuzzy_do_match_errors (state, char_index + 1, position, position, errors);
+        }
+    }
+  else if (NULL != (item = fuzzy_positions_after (positions, last)))
+    {
+      fuzzy_do_match_errors (state, char_index + 1, first, item->position, errors);
     }
 
-  if (tables->len == 0)
-    goto cleanup;
-
-  g_assert (tables->len > 0);
-  g_assert (tables->len == tables_n_elements->len);
+  if (errors == state->max_errors)
+    return;
 
-  tables_state = g_new0 (gint, tables->len);
+  /* Swapped with the next character of the query */
+  if (char_index + 1 < state->n_positions &&
+      NULL != (next = fuzzy_positions_after (&state->positions [char_index + 1], last)) &&
+      NULL != (item = fuzzy_positions_after (positions, next->position)))
+    fuzzy_do_match_errors (state,
+                           char_index + 2,
+                           first < 0 ? (gint)next->position : first,
+                           item->position,
+                           errors + 1);
+
+  /* Missing from the key, or mistyped */
+  fuzzy_do_match_errors (state, char_index + 1, first, last, errors + 1);
+}
 
-  lookup.index = self->index;
-  lookup.matches = matches;
-  lookup.tables = (const DzlFuzzyIndexItem * const *)tables->pdata;
-  lookup.tables_n_elements = (const gsize *)tables_n_elements->data;
-  lookup.tables_state = tables_state;
-  lookup.n_tables = tables->len;
-  lookup.needle = query;
-  lookup.max_matches = self->max_matches;
+static gsize
+fuzzy_lower_bound (const DzlFuzzyIndexItem *table,
+                   gsize                    begin,
+                   gsize                    n_elements,
+                   guint                    lookaside_id)
+{
+  gsize lo = begin;
+  gsize hi = n_elements;
 
-  if G_LIKELY (lookup.n_tables > 1)
+  while (lo < hi)
     {
-      for (i = 0; i < lookup.tables_n_elements[0]; i++)
-        {
-          const DzlFuzzyIndexItem *item = &lookup.tables[0][i];
+      gsize mid = lo + ((hi - lo) / 2);
 
-          fuzzy_do_match (&lookup, item, 1, MIN (16, item->position * 2));
-        }
+      if (table[mid].lookaside_id < lookaside_id)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
-  else
+
+  return lo;
+}
+
+static void
+fuzzy_match_shard (DzlFuzzyShard *shard)
+{
+  const DzlFuzzyLookup *lookup = &shard->lookup;
+  gsize i;
+
+  if (shard->candidates != NULL)
     {
-      guint last_id = G_MAXUINT;
+      gsize pos = 0;
 
-      for (i = 0; i < lookup.tables_n_elements[0]; i++)
+      /*
+       * Refining a previous query. Rather than walking the first table,
+       * we jump directly to the items for each candidate in every table.
+       * Candidates are sorted, so the positions only move forward.
+       */
+      for (i = shard->begin; i < shard->end; i++)
         {
-          const DzlFuzzyIndexItem *item = &lookup.tables[0][i];
-          DzlFuzzyMatch match;
+          guint lookaside_id = shard->candidates[i];
+          guint j;
 
-          if (item->lookaside_id != last_id)
+          if (fuzzy_lookup_is_cancelled (lookup, i - shard->begin))
+            return;
+
+          pos = fuzzy_lower_bound (lookup->tables[0], pos, lookup->tables_n_elements[0], lookaside_id);
+
+          for (j = 1; j < lookup->n_tables; j++)
+            lookup->tables_state[j] = (gint)fuzzy_lower_bound (lookup->tables[j],
+                                                               lookup->tables_state[j],
+                                                               lookup->tables_n_elements[j],
+                                                               lookaside_id);
+
+          for (; pos < lookup->tables_n_elements[0]; pos++)
             {
-              last_id = item->lookaside_id;
+              const DzlFuzzyIndexItem *item = &lookup->tables[0][pos];
 
-              if G_UNLIKELY (!_dzl_fuzzy_index_resolve (self->index,
-                                                        item->lookaside_id,
-                                                        &match.document_id,
-                                                        &match.key,
-                                                        &match.priority,
-                                                        item->position,
-                                                        item->position,
-                                                        &match.score))
-                continue;
-
-              g_array_append_val (self->matches, match);
+              if (item->lookaside_id != lookaside_id)
+                break;
+
+              fuzzy_do_match (lookup, item, 1, MIN (16, item->position * 2));
             }
         }
 
-      goto cleanup;
+      return;
     }
 
-  if (g_task_return_error_if_cancelled (task))
-    return;
+  for (i = shard->begin; i < shard->end; i++)
+    {
+      const DzlFuzzyIndexItem *item = &lookup->tables[0][i];
 
-  by_document = g_hash_table_new (NULL, NULL);
+      if (fuzzy_lookup_is_cancelled (lookup, i - shard->begin))
+        return;
 
-  g_hash_table_iter_init (&iter, matches);
+      fuzzy_do_match (lookup, item, 1, MIN (16, item->position * 2));
+    }
+}
 
-  while (g_hash_table_iter_next (&iter, &key, &value))
-    {
-      DzlIntPair *pair = value;
-      guint score = dzl_int_pair_first (pair);
-      guint last_offset = dzl_int_pair_second (pair);
-      gpointer other_score;
-      DzlFuzzyMatch match;
-      guint lookaside_id = GPOINTER_TO_UINT (key);
+static void
+fuzzy_match_shard_worker (gpointer data,
+                          gpointer user_data)
+{
+  DzlFuzzyShard *shard = data;
+  DzlFuzzyShardGroup *group = shard->group;
 
-      if G_UNLIKELY (!_dzl_fuzzy_index_resolve (self->index,
-                                                lookaside_id,
-                                                &match.document_id,
-                                                &match.key,
-                                                &match.priority,
-                                                score,
-                                                last_offset,
-                                                &match.score))
-        continue;
+  fuzzy_match_shard (shard);
 
-      if (g_hash_table_lookup_extended (by_document,
-                                        GUINT_TO_POINTER (match.document_id),
-                                        NULL,
-                                        &other_score) &&
-          match.score <= pointer_to_float (other_score))
-        continue;
+  g_mutex_lock (&group->mutex);
+  if (--group->n_active == 0)
+    g_cond_signal (&group->cond);
+  g_mutex_unlock (&group->mutex);
+}
 
-      g_hash_table_insert (by_document,
-                           GUINT_TO_POINTER (match.document_id),
-                           float_to_pointer (match.score));
+static GThreadPool *
+fuzzy_get_shard_pool (void)
+{
+  static GThreadPool *pool;
 
-      g_array_append_val (self->matches, match);
+  if (g_once_init_enter (&pool))
+    {
+      GThreadPool *instance;
+
+      instance = g_thread_pool_new (fuzzy_match_shard_worker,
+                                    NULL,
+                                    g_get_num_processors (),
+                                    FALSE,
+                                    NULL);
+      g_once_init_leave (&pool, instance);
     }
 
-  /*
-   * Because we have to do the deduplication of documents after
-   * searching all the potential matches, we could have duplicates
-   * in the array. So we need to filter them out. Not that big
-   * of a deal, since we can do remove_fast on the index and
-   * we have to sort them afterwards anyway. Potentially, we could
-   * do both at once if we felt like doing our own sort.
-   */
-  for (i = 0; i < self->matches->len; i++)
-    {
-      DzlFuzzyMatch *match;
-      gpointer other_score;
+  return pool;
+}
 
-    next:
-      match = &g_array_index (self->matches, DzlFuzzyMatch, i);
-      other_score = g_hash_table_lookup (by_document, GUINT_TO_POINTER (match->document_id));
+/*
+ * Splits the first table of @lookup into shards on lookaside_id boundaries
+ * so that each shard can be matched independently. Each shard gets its own
+ * matches table and tables_state, which is positioned at the first item in
+ * each table that could belong to the shard. Since tables are sorted by
+ * lookaside_id, this produces the same matches as a single walk.
+ */
+static GArray *
+fuzzy_create_candidate_shards (const DzlFuzzyLookup *lookup,
+                               GArray               *candidates)
+{
+  GArray *shards;
+  guint n_shards;
+  guint i;
 
-      /*
-       * This item should have been discarded, but we didn't have enough
-       * information at the time we built the array.
-       */
-      if (pointer_to_float (other_score) < match->score)
-        {
-          g_array_remove_index_fast (self->matches, i);
-          if (i < self->matches->len - 1)
-            goto next;
-        }
-    }
+  g_assert (candidates != NULL);
 
-  if (g_task_return_error_if_cancelled (task))
-    return;
+  n_shards = MIN (g_get_num_processors (), candidates->len / MIN_ITEMS_PER_SHARD);
+  n_shards = MAX (1, n_shards);
 
-cleanup:
-  if (self->matches != NULL)
+  shards = g_array_sized_new (FALSE, TRUE, sizeof (DzlFuzzyShard), n_shards);
+
+  for (i = 0; i < n_shards; i++)
     {
-      g_array_sort (self->matches, fuzzy_match_compare);
-      if (lookup.max_matches > 0 && lookup.max_matches < self->matches->len)
-        g_array_set_size (self->matches, lookup.max_matches);
+      DzlFuzzyShard shard = { { 0 } };
+
+      shard.lookup = *lookup;
+      shard.lookup.matches = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)dzl_int_pair_free);
+      shard.lookup.tables_state = g_new0 (gint, lookup->n_tables);
+      shard.candidates = (const guint *)(gpointer)candidates->data;
+      shard.begin = (gsize)candidates->len * i / n_shards;
+      shard.end = (gsize)candidates->len * (i + 1) / n_shards;
+
+      g_array_append_val (shards, shard);
     }
 
-  g_task_return_boolean (task, TRUE);
+  return shards;
 }
 
-static void
-dzl_fuzzy_index_cursor_init_async (GAsyncInitable      *initable,
-                               gint                 io_priority,
-                               GCancellable        *cancellable,
-                               GAsyncReadyCallback  callback,
-                               gpointer             user_data)
+static GArray *
+fuzzy_create_shards (const DzlFuzzyLookup *lookup)
 {
-  DzlFuzzyIndexCursor *self = (DzlFuzzyIndexCursor *)initable;
-  g_autoptr(GTask) task = NULL;
+  const DzlFuzzyIndexItem *first = lookup->tables[0];
+  gsize n_elements = lookup->tables_n_elements[0];
+  GArray *shards;
+  gsize begin = 0;
+  guint n_shards;
+  guint i;
 
-  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
-  g_assert (!cancellable || G_IS_CANCELLABLE (cancellable));
+  n_shards = MIN (g_get_num_processors (), n_elements / MIN_ITEMS_PER_SHARD);
+  n_shards = MAX (1, n_shards);
 
-  task = g_task_new (self, cancellable, callback, user_data);
-  g_task_set_source_tag (task, dzl_fuzzy_index_cursor_init_async);
-  g_task_set_priority (task, io_priority);
-  g_task_set_check_cancellable (task, FALSE);
-  g_task_run_in_thread (task, dzl_fuzzy_index_cursor_worker);
+  shards = g_array_sized_new (FALSE, TRUE, sizeof (DzlFuzzyShard), n_shards);
+
+  for (i = 0; i < n_shards && begin < n_elements; i++)
+    {
+      DzlFuzzyShard shard = { { 0 } };
+      gsize end = n_elements * (i + 1) / n_shards;
+      guint j;
+
+      /* Never split the items for a single key across shards */
+      end = MAX (end, begin + 1);
+      while (end < n_elements && first[end].lookaside_id == first[end - 1].lookaside_id)
+        end++;
+
+      shard.lookup = *lookup;
+      shard.lookup.matches = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)dzl_int_pair_free);
+      shard.lookup.tables_state = g_new0 (gint, lookup->n_tables);
+      shard.begin = begin;
+      shard.end = end;
+
+      for (j = 1; j < lookup->n_tables; j++)
+        shard.lookup.tables_state[j] = (gint)fuzzy_lower_bound (lookup->tables[j],
+                                                                0,
+                                                                lookup->tables_n_elements[j],
+                                                                first[begin].lookaside_id);
+
+      g_array_append_val (shards, shard);
+
+      begin = end;
+    }
+
+  return shards;
 }
 
-static gboolean
-dzl_fuzzy_index_cursor_init_finish (GAsyncInitable  *initiable,
-                                GAsyncResult    *result,
-                                GError         **error)
+static void
+fuzzy_shard_clear (gpointer data)
 {
-  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (initiable));
-  g_assert (G_IS_TASK (result));
+  DzlFuzzyShard *shard = data;
 
-  return g_task_propagate_boolean (G_TASK (result), error);
+  g_clear_pointer (&shard->lookup.matches, g_hash_table_unref);
+  g_clear_pointer (&shard->lookup.tables_state, g_free);
 }
 
 static void
-async_initable_iface_init (GAsyncInitableIface *iface)
+fuzzy_run_shards (GArray *shards)
+{
+  DzlFuzzyShardGroup group;
+  guint i;
+
+  g_assert (shards != NULL);
+
+  if (shards->len <= 1)
+    {
+      if (shards->len == 1)
+        fuzzy_match_shard (&g_array_index (shards, DzlFuzzyShard, 0));
+      return;
+    }
+
+  g_mutex_init (&group.mutex);
+  g_cond_init (&group.cond);
+  group.n_active = shards->len - 1;
+
+  for (i = 1; i < shards->len; i++)
+    {
+      DzlFuzzyShard *shard = &g_array_index (shards, DzlFuzzyShard, i);
+
+      shard->group = &group;
+      g_thread_pool_push (fuzzy_get_shard_pool (), shard, NULL);
+    }
+
+  /* Use this thread for the first shard rather than sitting idle */
+  fuzzy_match_shard (&g_array_index (shards, DzlFuzzyShard, 0));
+
+  g_mutex_lock (&group.mutex);
+  while (group.n_active > 0)
+    g_cond_wait (&group.cond, &group.mutex);
+  g_mutex_unlock (&group.mutex);
+
+  g_cond_clear (&group.cond);
+  g_mutex_clear (&group.mutex);
+}
+
+/*
+ * @size_hint must be an upper bound of the number of documents, such as
+ * the number of candidates, as the table grows as needed anyway.
+ */
+static DzlFuzzyDocTable *
+fuzzy_doc_table_new (guint size_hint)
+{
+  DzlFuzzyDocTable *table;
+  guint size = FUZZY_DOC_TABLE_MIN_SIZE;
+
+  /* Keep the load factor at or below one half */
+  while (size / 2 < size_hint && size <= (G_MAXUINT / 4))
+    size <<= 1;
+
+  table = g_slice_new0 (DzlFuzzyDocTable);
+  table->slots = g_new0 (DzlFuzzyDocSlot, size);
+  table->mask = size - 1;
+
+  return table;
+}
+
+static void
+fuzzy_doc_table_free (DzlFuzzyDocTable *table)
+{
+  if (table != NULL)
+    {
+      g_free (table->slots);
+      g_slice_free (DzlFuzzyDocTable, table);
+    }
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DzlFuzzyDocTable, fuzzy_doc_table_free)
+
+static inline guint
+fuzzy_doc_table_hash (guint document_id)
+{
+  /* Fibonacci hashing spreads sequential document ids */
+  return document_id * 2654435761U;
+}
+
+static DzlFuzzyDocSlot *
+fuzzy_doc_table_probe (DzlFuzzyDocSlot *slots,
+                       guint            mask,
+                       guint            document_id)
+{
+  guint pos = fuzzy_doc_table_hash (document_id) & mask;
+
+  while (slots[pos].used && slots[pos].document_id != document_id)
+    pos = (pos + 1) & mask;
+
+  return &slots[pos];
+}
+
+static void
+fuzzy_doc_table_grow (DzlFuzzyDocTable *table)
+{
+  DzlFuzzyDocSlot *old_slots = table->slots;
+  guint old_size = table->mask + 1;
+  guint new_size = old_size * 2;
+
+  g_assert (new_size > old_size);
+
+  table->slots = g_new0 (DzlFuzzyDocSlot, new_size);
+  table->mask = new_size - 1;
+
+  for (guint i = 0; i < old_size; i++)
+    {
+      if (old_slots[i].used)
+        *fuzzy_doc_table_probe (table->slots, table->mask, old_slots[i].document_id) = old_slots[i];
+    }
+
+  g_free (old_slots);
+}
+
+/*
+ * Returns the slot for @document_id, creating it if necessary. New slots
+ * have a score of zero and a match_index of FUZZY_DOC_NONE.
+ */
+static DzlFuzzyDocSlot *
+fuzzy_doc_table_lookup (DzlFuzzyDocTable *table,
+                        guint             document_id)
+{
+  DzlFuzzyDocSlot *slot;
+
+  g_assert (table != NULL);
+
+  slot = fuzzy_doc_table_probe (table->slots, table->mask, document_id);
+
+  if (slot->used)
+    return slot;
+
+  if ((table->n_used + 1) * 2 > table->mask + 1)
+    {
+      fuzzy_doc_table_grow (table);
+      slot = fuzzy_doc_table_probe (table->slots, table->mask, document_id);
+    }
+
+  slot->used = TRUE;
+  slot->document_id = document_id;
+  slot->match_index = FUZZY_DOC_NONE;
+  slot->score = 0.0f;
+  table->n_used++;
+
+  return slot;
+}
+
+static void
+fuzzy_heap_entry_set_index (gpointer element,
+                            gsize    index_)
+{
+  DzlFuzzyHeapEntry *entry = element;
+
+  /* The slot exists for every match in the heap, so this never grows */
+  fuzzy_doc_table_lookup (entry->by_document, entry->match.document_id)->match_index = index_;
+}
+
+static gint
+uint_compare (gconstpointer a,
+              gconstpointer b)
+{
+  guint ua = *(const guint *)a;
+  guint ub = *(const guint *)b;
+
+  if (ua < ub)
+    return -1;
+  else if (ua > ub)
+    return 1;
+  return 0;
+}
+
+static GArray *
+fuzzy_collect_candidates (GArray *shards)
+{
+  GArray *candidates;
+  guint i;
+
+  g_assert (shards != NULL);
+
+  candidates = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (i = 0; i < shards->len; i++)
+    {
+      const DzlFuzzyShard *shard = &g_array_index (shards, DzlFuzzyShard, i);
+      GHashTableIter iter;
+      gpointer key;
+
+      g_hash_table_iter_init (&iter, shard->lookup.matches);
+
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          guint lookaside_id = GPOINTER_TO_UINT (key);
+          g_array_append_val (candidates, lookaside_id);
+        }
+    }
+
+  g_array_sort (candidates, uint_compare);
+
+  return candidates;
+}
+
+/*
+ * Checks if @document_id was removed by a layer above the index.
+ */
+static gboolean
+fuzzy_collector_is_removed (DzlFuzzyCollector *collector,
+                            guint              document_id)
+{
+  g_autoptr(GVariant) document = NULL;
+
+  g_assert (collector != NULL);
+  g_assert (collector->removed != NULL);
+
+  document = _dzl_fuzzy_index_lookup_document (collector->index, document_id);
+
+  for (guint i = 0; i < collector->removed->len; i++)
+    {
+      if (g_hash_table_contains (g_ptr_array_index (collector->removed, i), document))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/*
+ * Adds the match for @lookaside_id to the results, keeping only the best
+ * scoring match for each document. When max_matches is set, only the best
+ * max_matches are kept in a heap (with the worst match at the top) and
+ * candidates that cannot make the cut are discarded before resolving them.
+ */
+static void
+fuzzy_collect (DzlFuzzyCollector *collector,
+               guint              lookaside_id,
+               guint              score,
+               guint              last_offset,
+               guint              errors)
+{
+  DzlFuzzyHeapEntry entry;
+  DzlFuzzyDocSlot *slot;
+  DzlFuzzyMatch match;
+
+  g_assert (collector != NULL);
+
+  if (collector->heap != NULL &&
+      collector->heap->len == collector->max_matches &&
+      _dzl_fuzzy_index_score (lookaside_id, score, last_offset, errors) <
+      dzl_heap_peek (collector->heap, DzlFuzzyHeapEntry).match.score)
+    return;
+
+  if G_UNLIKELY (!_dzl_fuzzy_index_resolve (collector->index,
+                                            lookaside_id,
+                                            &match.document_id,
+                                            &match.key,
+                                            &match.priority,
+                                            score,
+                                            last_offset,
+                                            errors,
+                                            &match.score))
+    return;
+
+  slot = fuzzy_doc_table_lookup (collector->by_document, match.document_id);
+
+  /*
+   * Documents removed by the layers above never take up room in the
+   * results. New slots have a score of zero, so each is checked once.
+   */
+  if G_UNLIKELY (collector->removed != NULL)
+    {
+      if (slot->removed)
+        return;
+
+      if (slot->score == 0.0f && fuzzy_collector_is_removed (collector, match.document_id))
+        {
+          slot->removed = TRUE;
+          return;
+        }
+    }
+
+  /* Scores are always positive, so new slots never discard the match */
+  if (match.score <= slot->score)
+    return;
+
+  slot->score = match.score;
+
+  if (collector->heap == NULL)
+    {
+      /* Replace the lower scoring match for the document in place */
+      if (slot->match_index != FUZZY_DOC_NONE)
+        {
+          g_array_index (collector->matches, DzlFuzzyMatch, slot->match_index) = match;
+        }
+      else
+        {
+          slot->match_index = collector->matches->len;
+          g_array_append_val (collector->matches, match);
+        }
+
+      return;
+    }
+
+  if (slot->match_index != FUZZY_DOC_NONE)
+    {
+      /* Replace the previous, lower scoring, match for the document */
+      dzl_heap_extract_index (collector->heap, slot->match_index, NULL);
+    }
+  else if (collector->heap->len == collector->max_matches)
+    {
+      DzlFuzzyHeapEntry worst;
+
+      /*
+       * The slot keeps the best score even though the match is dropped.
+       * Any later match for this document with a lower score would also
+       * be dropped, since the worst score in the heap only increases.
+       */
+      if (fuzzy_match_compare (&match, &dzl_heap_peek (collector->heap, DzlFuzzyHeapEntry)) >= 0)
+        return;
+
+      dzl_heap_extract (collector->heap, &worst);
+      fuzzy_doc_table_lookup (collector->by_document, worst.match.document_id)->match_index = FUZZY_DOC_NONE;
+    }
+
+  entry.match = match;
+  entry.by_document = collector->by_document;
+  dzl_heap_insert_val (collector->heap, entry);
+}
+
+/*
+ * Matches every key containing enough of the characters of the query to
+ * be matched with at most @max_errors errors. Tables of missing characters
+ * are empty. Since each table is sorted by lookaside_id, merging them
+ * yields the positions of every character within one key at a time.
+ */
+static void
+fuzzy_match_errors (const DzlFuzzyLookup *lookup,
+                    guint                 max_errors,
+                    DzlFuzzyCollector    *collector)
+{
+  g_autofree DzlFuzzyPositions *positions = NULL;
+  g_autofree gsize *state = NULL;
+  gsize n_keys = 0;
+  guint i;
+
+  g_assert (lookup != NULL);
+  g_assert (max_errors > 0);
+  g_assert (max_errors < lookup->n_tables);
+  g_assert (collector != NULL);
+
+  positions = g_new0 (DzlFuzzyPositions, lookup->n_tables);
+  state = g_new0 (gsize, lookup->n_tables);
+
+  for (;;)
+    {
+      DzlFuzzyErrorsMatch match = { 0 };
+      gboolean found = FALSE;
+      guint lookaside_id = 0;
+      guint n_present = 0;
+
+      for (i = 0; i < lookup->n_tables; i++)
+        {
+          if (state [i] < lookup->tables_n_elements [i] &&
+              (!found || lookup->tables [i][state [i]].lookaside_id < lookaside_id))
+            {
+              lookaside_id = lookup->tables [i][state [i]].lookaside_id;
+              found = TRUE;
+            }
+        }
+
+      if (!found || fuzzy_lookup_is_cancelled (lookup, n_keys++))
+        break;
+
+      for (i = 0; i < lookup->n_tables; i++)
+        {
+          gsize begin = state [i];
+
+          while (state [i] < lookup->tables_n_elements [i] &&
+                 lookup->tables [i][state [i]].lookaside_id == lookaside_id)
+            state [i]++;
+
+          /* Characters missing from the index have no table at all */
+          positions [i].items = lookup->tables [i] != NULL ? &lookup->tables [i][begin] : NULL;
+          positions [i].n_items = state [i] - begin;
+
+          if (positions [i].n_items > 0)
+            n_present++;
+        }
+
+      /* Every character missing from the key is an error */
+      if (n_present + max_errors < lookup->n_tables)
+        continue;
+
+      match.positions = positions;
+      match.n_positions = lookup->n_tables;
+      match.max_errors = max_errors;
+      match.best_errors = max_errors;
+      match.best_score = G_MAXUINT;
+
+      fuzzy_do_match_errors (&match, 0, -1, -1, 0);
+
+      if (match.best_score != G_MAXUINT)
+        fuzzy_collect (collector, lookaside_id, match.best_score, match.best_last, match.best_errors);
+    }
+}
+
+static void
+fuzzy_collector_finish (DzlFuzzyCollector *collector)
+{
+  g_assert (collector != NULL);
+
+  if (collector->heap == NULL)
+    {
+      /* Documents were deduplicated as they were collected */
+      g_array_sort (collector->matches, fuzzy_match_compare);
+    }
+  else
+    {
+      guint len = collector->heap->len;
+      DzlFuzzyHeapEntry entry;
+
+      /* The heap yields the worst match first, so fill from the end */
+      g_array_set_size (collector->matches, len);
+      while (len > 0 && dzl_heap_extract (collector->heap, &entry))
+        g_array_index (collector->matches, DzlFuzzyMatch, --len) = entry.match;
+    }
+}
+
+/*
+ * Completes @task with an error if the query was cancelled or superseded
+ * by a newer query of the index.
+ */
+static gboolean
+dzl_fuzzy_index_cursor_return_if_cancelled (DzlFuzzyIndexCursor *self,
+                                            GTask               *task)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+  g_assert (G_IS_TASK (task));
+
+  if (g_task_return_error_if_cancelled (task))
+    return TRUE;
+
+  if (g_cancellable_is_cancelled (self->superseded))
+    {
+      g_task_return_new_error (task,
+                               G_IO_ERROR,
+                               G_IO_ERROR_CANCELLED,
+                               "The query was superseded by a newer query");
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+dzl_fuzzy_index_cursor_worker (GTask        *task,
+                               gpointer      source_object,
+                               gpointer      task_data,
+                               GCancellable *cancellable)
+{
+  DzlFuzzyIndexCursor *self = source_object;
+  g_autoptr(DzlFuzzyDocTable) by_document = NULL;
+  g_autoptr(DzlHeap) heap = NULL;
+  g_autoptr(GPtrArray) tables = NULL;
+  g_autoptr(GArray) tables_n_elements = NULL;
+  g_autoptr(GArray) shards = NULL;
+  g_autoptr(GArray) refine_candidates = NULL;
+  g_autofree gchar *refine_needle = NULL;
+  g_autofree gchar *freeme = NULL;
+  g_autoptr(GString) needle = NULL;
+  const gchar *query;
+  DzlFuzzyLookup lookup = { 0 };
+  DzlFuzzyCollector collector = { 0 };
+  GHashTableIter iter;
+  const gchar *str;
+  gpointer key, value;
+  gsize n_candidates;
+  guint max_errors;
+  guint n_missing = 0;
+  guint i;
+
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+  g_assert (G_IS_TASK (task));
+
+  /* We only need these for the duration of the worker */
+  refine_needle = g_steal_pointer (&self->refine_needle);
+  refine_candidates = g_steal_pointer (&self->refine_candidates);
+
+  if (dzl_fuzzy_index_cursor_return_if_cancelled (self, task))
+    return;
+
+  /* No matches with empty query */
+  if (self->query == NULL || *self->query == '\0')
+    goto cleanup;
+
+  /* If we are not case-sensitive, we need to downcase the query string */
+  query = self->query;
+  if (!self->case_sensitive)
+    query = freeme = g_utf8_casefold (query, -1);
+
+  tables = g_ptr_array_new ();
+  tables_n_elements = g_array_new (FALSE, FALSE, sizeof (gsize));
+  needle = g_string_new (NULL);
+  max_errors = self->max_errors;
+
+  for (str = query; *str; str = g_utf8_next_char (str))
+    {
+      gunichar ch = g_utf8_get_char (str);
+      const DzlFuzzyIndexItem *fixed;
+      gsize n_elements;
+
+      if (g_unichar_isspace (ch))
+        continue;
+
+      fixed = _dzl_fuzzy_index_lookup_table (self->index, ch, &n_elements);
+
+      /* No possible matches, missing table for character */
+      if (fixed == NULL)
+        {
+          if (++n_missing > max_errors)
+            goto cleanup;
+          n_elements = 0;
+        }
+
+      g_array_append_val (tables_n_elements, n_elements);
+      g_ptr_array_add (tables, (gpointer)fixed);
+      g_string_append_unichar (needle, ch);
+    }
+
+  if (tables->len == 0)
+    goto cleanup;
+
+  /* At least one character of the query must match */
+  max_errors = MIN (max_errors, tables->len - 1);
+  if (n_missing > max_errors)
+    goto cleanup;
+
+  g_assert (tables->len > 0);
+  g_assert (tables->len == tables_n_elements->len);
+
+  lookup.index = self->index;
+  lookup.tables = (const DzlFuzzyIndexItem * const *)tables->pdata;
+  lookup.tables_n_elements = (const gsize *)tables_n_elements->data;
+  lookup.n_tables = tables->len;
+  lookup.needle = query;
+  lookup.max_matches = self->max_matches;
+  lookup.cancellable = cancellable;
+  lookup.superseded = self->superseded;
+
+  /*
+   * Each key matching without errors is in every table, so the smallest
+   * table bounds the number of documents. With errors, a key need only be
+   * in one of the tables. Sizing the table from max_matches alone could
+   * allocate a huge table for a few candidates.
+   */
+  n_candidates = (max_errors == 0) ? G_MAXSIZE : 0;
+
+  for (i = 0; i < lookup.n_tables; i++)
+    {
+      gsize n_elements = lookup.tables_n_elements[i];
+
+      if (max_errors == 0)
+        n_candidates = MIN (n_candidates, n_elements);
+      else
+        n_candidates = (n_candidates > G_MAXSIZE - n_elements) ? G_MAXSIZE : n_candidates + n_elements;
+    }
+
+  if (self->max_matches > 0)
+    n_candidates = MIN (n_candidates, self->max_matches);
+
+  by_document = fuzzy_doc_table_new (MIN (n_candidates, G_MAXUINT));
+
+  if (self->max_matches > 0)
+    {
+      heap = dzl_heap_new (sizeof (DzlFuzzyHeapEntry), fuzzy_match_compare);
+      dzl_heap_set_index_func (heap, fuzzy_heap_entry_set_index);
+    }
+
+  collector.index = self->index;
+  collector.matches = self->matches;
+  collector.by_document = by_document;
+  collector.heap = heap;
+  collector.removed = self->removed;
+  collector.max_matches = self->max_matches;
+
+  /* Typo tolerant queries neither use nor record candidates for refining */
+  if (max_errors > 0)
+    {
+      fuzzy_match_errors (&lookup, max_errors, &collector);
+      goto finish;
+    }
+
+  if G_LIKELY (lookup.n_tables > 1)
+    {
+      /*
+       * If this query extends the query of the cursor we are refining, the
+       * results can only be a subset of its candidates. So only match those
+       * rather than every key in the index.
+       */
+      if (refine_candidates != NULL &&
+          self->refine_case_sensitive == self->case_sensitive &&
+          g_str_has_prefix (needle->str, refine_needle))
+        shards = fuzzy_create_candidate_shards (&lookup, refine_candidates);
+      else
+        shards = fuzzy_create_shards (&lookup);
+
+      g_array_set_clear_func (shards, fuzzy_shard_clear);
+      fuzzy_run_shards (shards);
+
+      /* Abandoned shards leave incomplete candidates */
+      if (dzl_fuzzy_index_cursor_return_if_cancelled (self, task))
+        return;
+
+      self->needle = g_strdup (needle->str);
+      self->candidates = fuzzy_collect_candidates (shards);
+    }
+  else
+    {
+      g_autoptr(GArray) candidates = NULL;
+      guint last_id = G_MAXUINT;
+
+      /*
+       * Every key containing the character is a candidate. The table is
+       * sorted by lookaside_id, so the candidates are recorded in order.
+       */
+      candidates = g_array_new (FALSE, FALSE, sizeof (guint));
+
+      for (i = 0; i < lookup.tables_n_elements[0]; i++)
+        {
+          const DzlFuzzyIndexItem *item = &lookup.tables[0][i];
+
+          if (fuzzy_lookup_is_cancelled (&lookup, i))
+            break;
+
+          if (item->lookaside_id != last_id)
+            {
+              last_id = item->lookaside_id;
+              g_array_append_val (candidates, last_id);
+              fuzzy_collect (&collector, item->lookaside_id, item->position, item->position, 0);
+            }
+        }
+
+      /* Abandoned queries leave incomplete candidates */
+      if (dzl_fuzzy_index_cursor_return_if_cancelled (self, task))
+        return;
+
+      self->needle = g_strdup (needle->str);
+      self->candidates = g_steal_pointer (&candidates);
+
+      goto finish;
+    }
+
+  /*
+   * Shards contain disjoint sets of lookaside ids, so merging is a matter
+   * of walking each of them. Deduplication by document happens here.
+   */
+  for (i = 0; i < shards->len; i++)
+    {
+      const DzlFuzzyShard *shard = &g_array_index (shards, DzlFuzzyShard, i);
+
+      g_hash_table_iter_init (&iter, shard->lookup.matches);
+
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        fuzzy_collect (&collector,
+                       GPOINTER_TO_UINT (key),
+                       dzl_int_pair_first (value),
+                       dzl_int_pair_second (value),
+                       0);
+    }
+
+finish:
+  if (dzl_fuzzy_index_cursor_return_if_cancelled (self, task))
+    return;
+
+  fuzzy_collector_finish (&collector);
+
+cleanup:
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+dzl_fuzzy_index_cursor_init_async (GAsyncInitable      *initable,
+                               gint                 io_priority,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  DzlFuzzyIndexCursor *self = (DzlFuzzyIndexCursor *)initable;
+  g_autoptr(GTask) task = NULL;
+
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+  g_assert (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, dzl_fuzzy_index_cursor_init_async);
+  g_task_set_priority (task, io_priority);
+  g_task_set_check_cancellable (task, FALSE);
+  g_task_run_in_thread (task, dzl_fuzzy_index_cursor_worker);
+}
+
+static gboolean
+dzl_fuzzy_index_cursor_init_finish (GAsyncInitable  *initiable,
+                                GAsyncResult    *result,
+                                GError         **error)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (initiable));
+  g_assert (G_IS_TASK (result));
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+async_initable_iface_init (GAsyncInitableIface *iface)
 {
   iface->init_async = dzl_fuzzy_index_cursor_init_async;
   iface->init_finish = dzl_fuzzy_index_cursor_init_finish;
@@ -583,21 +1599,36 @@ dzl_fuzzy_index_cursor_get_item (GListModel *model,
 {
   DzlFuzzyIndexCursor *self = (DzlFuzzyIndexCursor *)model;
   g_autoptr(GVariant) document = NULL;
+  DzlFuzzyIndexMatch *ret;
   DzlFuzzyMatch *match;
+  guint slot;
 
   g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
   g_assert (position < self->matches->len);
 
+  slot = position % MATCH_CACHE_SIZE;
+
+  if (self->match_cache [slot] != NULL && self->match_cache_position [slot] == position)
+    return g_object_ref (self->match_cache [slot]);
+
   match = &g_array_index (self->matches, DzlFuzzyMatch, position);
 
+  /* The document is a view into the mmap()'d index, not a copy */
   document = _dzl_fuzzy_index_lookup_document (self->index, match->document_id);
 
-  return g_object_new (DZL_TYPE_FUZZY_INDEX_MATCH,
-                       "document", document,
-                       "key", match->key,
-                       "score", match->score,
-                       "priority", match->priority,
-                       NULL);
+  /* Borrow the key from the index rather than copying it */
+  ret = g_object_new (DZL_TYPE_FUZZY_INDEX_MATCH, NULL);
+  _dzl_fuzzy_index_match_set (ret,
+                              G_OBJECT (self->index),
+                              document,
+                              match->key,
+                              match->score,
+                              match->priority);
+
+  g_set_object (&self->match_cache [slot], ret);
+  self->match_cache_position [slot] = position;
+
+  return ret;
 }
 
 static void
@@ -608,6 +1639,89 @@ list_model_iface_init (GListModelInterface *iface)
   iface->get_item = dzl_fuzzy_index_cursor_get_item;
 }
 
+/*
+ * Creates a completed cursor for @query whose results are @matches, such
+ * as those of an earlier cursor. The matches are shared, not copied, as
+ * they are never modified once a cursor has completed.
+ */
+DzlFuzzyIndexCursor *
+_dzl_fuzzy_index_cursor_new_for_matches (DzlFuzzyIndex *index,
+                                         gboolean       case_sensitive,
+                                         const gchar   *query,
+                                         guint          max_matches,
+                                         GArray        *matches)
+{
+  DzlFuzzyIndexCursor *self;
+
+  g_assert (DZL_IS_FUZZY_INDEX (index));
+  g_assert (query != NULL);
+  g_assert (matches != NULL);
+  g_assert (g_array_get_element_size (matches) == sizeof (DzlFuzzyMatch));
+
+  self = g_object_new (DZL_TYPE_FUZZY_INDEX_CURSOR,
+                       "case-sensitive", case_sensitive,
+                       "index", index,
+                       "query", query,
+                       "max-matches", max_matches,
+                       NULL);
+
+  g_array_unref (self->matches);
+  self->matches = g_array_ref (matches);
+
+  return self;
+}
+
+/*
+ * Sets a cancellable which the index cancels once a newer query
+ * supersedes this one. Must be called before the cursor is initialized.
+ */
+void
+_dzl_fuzzy_index_cursor_set_superseded (DzlFuzzyIndexCursor *self,
+                                        GCancellable        *superseded)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+  g_assert (!superseded || G_IS_CANCELLABLE (superseded));
+
+  g_set_object (&self->superseded, superseded);
+}
+
+/*
+ * Sets the tombstones of the layers above the index, as #GHashTable of
+ * documents, so that the documents they remove are skipped rather than
+ * taking up room within max-matches. Must be called before the cursor is
+ * initialized.
+ */
+void
+_dzl_fuzzy_index_cursor_set_removed (DzlFuzzyIndexCursor *self,
+                                     GPtrArray           *removed)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+
+  if (removed != NULL)
+    g_ptr_array_ref (removed);
+  g_clear_pointer (&self->removed, g_ptr_array_unref);
+  self->removed = removed;
+}
+
+gboolean
+_dzl_fuzzy_index_cursor_is_superseded (DzlFuzzyIndexCursor *self)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+
+  return g_cancellable_is_cancelled (self->superseded);
+}
+
+/*
+ * Returns: (transfer none): the matches of a completed cursor.
+ */
+GArray *
+_dzl_fuzzy_index_cursor_get_match_array (DzlFuzzyIndexCursor *self)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (self));
+
+  return self->matches;
+}
+
 /**
  * dzl_fuzzy_index_cursor_get_index:
  * @self: A #DzlFuzzyIndexCursor
@@ -623,3 +1737,58 @@ dzl_fuzzy_index_cursor_get_index (DzlFuzzyIndexCursor *self)
 
   return self->index;
 }
+
+/**
+ * dzl_fuzzy_index_cursor_get_matches:
+ * @self: A #DzlFuzzyIndexCursor
+ * @position: the position of the first match
+ * @matches: (out caller-allocates) (array length=n_matches): the matches
+ * @n_matches: the number of elements in @matches
+ *
+ * Copies up to @n_matches matches, starting from @position, into
+ * @matches. This avoids creating a #DzlFuzzyIndexMatch for each item,
+ * which is useful when paging through a large number of results.
+ *
+ * Returns: the number of matches copied into @matches
+ */
+guint
+dzl_fuzzy_index_cursor_get_matches (DzlFuzzyIndexCursor      *self,
+                                    guint                     position,
+                                    DzlFuzzyIndexCursorMatch *matches,
+                                    guint                     n_matches)
+{
+  guint count;
+
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX_CURSOR (self), 0);
+  g_return_val_if_fail (matches != NULL || n_matches == 0, 0);
+
+  if (position >= self->matches->len)
+    return 0;
+
+  count = MIN (n_matches, self->matches->len - position);
+
+  if (count > 0)
+    memcpy (matches,
+            &g_array_index (self->matches, DzlFuzzyMatch, position),
+            sizeof (DzlFuzzyIndexCursorMatch) * count);
+
+  return count;
+}
+
+/**
+ * dzl_fuzzy_index_cursor_get_document:
+ * @self: A #DzlFuzzyIndexCursor
+ * @document_id: a document id from dzl_fuzzy_index_cursor_get_matches()
+ *
+ * Gets the document for @document_id.
+ *
+ * Returns: (transfer full): A #GVariant
+ */
+GVariant *
+dzl_fuzzy_index_cursor_get_document (DzlFuzzyIndexCursor *self,
+                                     guint                document_id)
+{
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX_CURSOR (self), NULL);
+
+  return _dzl_fuzzy_index_lookup_document (self->index, document_id);
+}
@@ -29,7 +29,31 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (DzlFuzzyIndexCursor, dzl_fuzzy_index_cursor, DZL, FUZZY_INDEX_CURSOR, GObject)
 
-DzlFuzzyIndex *dzl_fuzzy_index_cursor_get_index (DzlFuzzyIndexCursor *self);
+/**
+ * DzlFuzzyIndexCursorMatch:
+ * @key: the key that matched, owned by the index
+ * @document_id: the id of the document, see dzl_fuzzy_index_cursor_get_document()
+ * @score: the score of the match
+ * @priority: the priority of the key
+ *
+ * A match within a #DzlFuzzyIndexCursor, without creating a
+ * #DzlFuzzyIndexMatch. @key is valid for the lifetime of the cursor.
+ */
+typedef struct
+{
+  const gchar *key;
+  guint        document_id;
+  gfloat       score;
+  guint        priority;
+} DzlFuzzyIndexCursorMatch;
+
+DzlFuzzyIndex *dzl_fuzzy_index_cursor_get_index    (DzlFuzzyIndexCursor      *self);
+guint          dzl_fuzzy_index_cursor_get_matches  (DzlFuzzyIndexCursor      *self,
+                                                    guint                     position,
+                                                    DzlFuzzyIndexCursorMatch *matches,
+                                                    guint                     n_matches);
+GVariant      *dzl_fuzzy_index_cursor_get_document (DzlFuzzyIndexCursor      *self,
+                                                    guint                     document_id);
 
 G_END_DECLS
 
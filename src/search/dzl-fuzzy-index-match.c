@@ -19,12 +19,20 @@
 #define G_LOG_DOMAIN "dzl-fuzzy-index-match"
 
 #include "dzl-fuzzy-index-match.h"
+#include "dzl-fuzzy-index-private.h"
 
 struct _DzlFuzzyIndexMatch
 {
   GObject   object;
   GVariant *document;
+
+  /*
+   * If @owner is set, @key is borrowed from it (such as the mmap()'d
+   * region of a #DzlFuzzyIndex) rather than owned by the match.
+   */
+  GObject  *owner;
   gchar    *key;
+
   gfloat    score;
   guint     priority;
 };
@@ -48,7 +56,10 @@ dzl_fuzzy_index_match_finalize (GObject *object)
   DzlFuzzyIndexMatch *self = (DzlFuzzyIndexMatch *)object;
 
   g_clear_pointer (&self->document, g_variant_unref);
-  g_clear_pointer (&self->key, g_free);
+
+  if (self->owner == NULL)
+    g_clear_pointer (&self->key, g_free);
+  g_clear_object (&self->owner);
 
   G_OBJECT_CLASS (dzl_fuzzy_index_match_parent_class)->finalize (object);
 }
@@ -201,3 +212,44 @@ dzl_fuzzy_index_match_get_priority (DzlFuzzyIndexMatch *self)
 
   return self->priority;
 }
+
+/*
+ * _dzl_fuzzy_index_match_set:
+ * @self: A #DzlFuzzyIndexMatch
+ * @owner: (nullable): An object owning @key, or %NULL to copy @key
+ * @document: (nullable): The document for the match
+ * @key: the key for the match
+ * @score: the score for the match
+ * @priority: the priority for the match
+ *
+ * Replaces the contents of @self. This allows cursors to borrow keys from
+ * the index rather than copying every key they hand out.
+ */
+void
+_dzl_fuzzy_index_match_set (DzlFuzzyIndexMatch *self,
+                            GObject            *owner,
+                            GVariant           *document,
+                            const gchar        *key,
+                            gfloat              score,
+                            guint               priority)
+{
+  g_assert (DZL_IS_FUZZY_INDEX_MATCH (self));
+  g_assert (!owner || G_IS_OBJECT (owner));
+
+  if (document != NULL)
+    g_variant_ref (document);
+  g_clear_pointer (&self->document, g_variant_unref);
+  self->document = document;
+
+  if (self->owner == NULL)
+    g_free (self->key);
+
+  if (owner != NULL)
+    g_object_ref (owner);
+  g_clear_object (&self->owner);
+  self->owner = owner;
+
+  self->key = owner != NULL ? (gchar *)key : g_strdup (key);
+  self->score = score;
+  self->priority = priority;
+}
@@ -20,19 +20,139 @@
 #define DZL_FUZZY_INDEX_PRIVATE_H
 
 #include "dzl-fuzzy-index.h"
+#include "dzl-fuzzy-index-cursor.h"
+#include "dzl-fuzzy-index-match.h"
 
 G_BEGIN_DECLS
 
-GVariant    *_dzl_fuzzy_index_lookup_document (DzlFuzzyIndex  *self,
-                                               guint           document_id);
-gboolean     _dzl_fuzzy_index_resolve         (DzlFuzzyIndex  *self,
-                                               guint           lookaside_id,
-                                               guint          *document_id,
-                                               const gchar   **key,
-                                               guint          *priority,
-                                               guint           in_score,
-                                               guint           last_offset,
-                                               gfloat         *out_score);
+/*
+ * Version 2 of the index is a flat binary file that is mmap()'d and used
+ * directly. The header is followed by sections which are all 8-byte aligned
+ * and addressed by their offset from the start of the file.
+ *
+ *  - keys:      guint32[n_keys] offsets into the strings section
+ *  - strings:   \0 terminated UTF-8 keys, packed back to back
+ *  - lookaside: DzlFuzzyIndexLookaside[n_lookaside]
+ *  - directory: DzlFuzzyIndexTable[n_tables], sorted by character
+ *  - items:     DzlFuzzyIndexItem[n_items], grouped by directory entry
+ *  - variant:   a serialized "a{sv}" containing "documents" and "metadata"
+ *
+ * All integers are stored in host byte order; the byte_order field is
+ * used to reject indexes built on a machine of different endianness.
+ */
+#define DZL_FUZZY_INDEX_MAGIC         "DZLFUZZY"
+#define DZL_FUZZY_INDEX_MAGIC_LEN     8
+#define DZL_FUZZY_INDEX_VERSION_1     1
+#define DZL_FUZZY_INDEX_VERSION_2     2
+#define DZL_FUZZY_INDEX_CASE_SENSITIVE (1 << 0)
+
+/* The largest number of errors a query may allow */
+#define DZL_FUZZY_INDEX_MAX_ERRORS    3
+
+typedef struct
+{
+  gchar   magic[DZL_FUZZY_INDEX_MAGIC_LEN];
+  guint32 version;
+  guint32 byte_order;
+  guint32 flags;
+  guint32 n_keys;
+  guint32 n_lookaside;
+  guint32 n_tables;
+  guint64 n_items;
+  guint64 keys_offset;
+  guint64 strings_offset;
+  guint64 strings_length;
+  guint64 lookaside_offset;
+  guint64 directory_offset;
+  guint64 items_offset;
+  guint64 variant_offset;
+  guint64 variant_length;
+} DzlFuzzyIndexHeader;
+
+typedef struct
+{
+  /* The unicode character this table contains positions for */
+  guint32 ch;
+
+  /* The number of DzlFuzzyIndexItem in the table */
+  guint32 n_items;
+
+  /* The offset of the first item, in items, within the items section */
+  guint64 offset;
+} DzlFuzzyIndexTable;
+
+typedef struct
+{
+  /* The key_id, with the priority stashed in the high 8 bits */
+  guint key_id;
+  guint document_id;
+} DzlFuzzyIndexLookaside;
+
+typedef struct
+{
+  guint position;
+  guint lookaside_id;
+} DzlFuzzyIndexItem;
+
+G_STATIC_ASSERT (sizeof (DzlFuzzyIndexHeader) % 8 == 0);
+G_STATIC_ASSERT (sizeof (DzlFuzzyIndexTable) == 16);
+G_STATIC_ASSERT (sizeof (DzlFuzzyIndexLookaside) == 8);
+G_STATIC_ASSERT (sizeof (DzlFuzzyIndexItem) == 8);
+
+/*
+ * Scores a match. The priority of the key is stashed in the high 8 bits
+ * of the lookaside_id, so this can be used to discard a candidate before
+ * resolving it.
+ *
+ * Matches are ordered by the priority of their key first, which adds
+ * (255 - priority) / 256 to the score. Within the same priority, the
+ * remaining 1/256 goes to tighter matches. Each error (a character of the
+ * query that was missing or swapped) makes a match rank as if it were four
+ * times looser, so exact matches keep the score they always had.
+ */
+static inline gfloat
+_dzl_fuzzy_index_score (guint lookaside_id,
+                        guint in_score,
+                        guint last_offset,
+                        guint errors)
+{
+  guint priority = (lookaside_id & 0xFF000000) >> 24;
+
+  return ((1.0 / 256.0) / ((gdouble)(1 + last_offset + in_score) * (1 << (2 * errors)))) +
+         ((255.0 - priority) / 256.0);
+}
+
+GVariant                *_dzl_fuzzy_index_lookup_document (DzlFuzzyIndex  *self,
+                                                           guint           document_id);
+const DzlFuzzyIndexItem *_dzl_fuzzy_index_lookup_table    (DzlFuzzyIndex  *self,
+                                                           gunichar        ch,
+                                                           gsize          *n_items);
+gboolean                 _dzl_fuzzy_index_resolve         (DzlFuzzyIndex  *self,
+                                                           guint           lookaside_id,
+                                                           guint          *document_id,
+                                                           const gchar   **key,
+                                                           guint          *priority,
+                                                           guint           in_score,
+                                                           guint           last_offset,
+                                                           guint           errors,
+                                                           gfloat         *out_score);
+void                     _dzl_fuzzy_index_match_set       (DzlFuzzyIndexMatch *self,
+                                                           GObject            *owner,
+                                                           GVariant           *document,
+                                                           const gchar        *key,
+                                                           gfloat              score,
+                                                           guint               priority);
+DzlFuzzyIndexCursor     *_dzl_fuzzy_index_cursor_new_for_matches (DzlFuzzyIndex *index,
+                                                                  gboolean       case_sensitive,
+                                                                  const gchar   *query,
+                                                                  guint          max_matches,
+                                                                  GArray        *matches);
+GArray                  *_dzl_fuzzy_index_cursor_get_match_array (DzlFuzzyIndexCursor *self);
+void                     _dzl_fuzzy_index_cursor_set_superseded  (DzlFuzzyIndexCursor *self,
+                                                                  GCancellable        *superseded);
+void                     _dzl_fuzzy_index_cursor_set_removed     (DzlFuzzyIndexCursor *self,
+                                                                  GPtrArray           *removed);
+gboolean                 _dzl_fuzzy_index_cursor_is_superseded   (DzlFuzzyIndexCursor *self);
 
 G_END_DECLS
 
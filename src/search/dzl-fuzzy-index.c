@@ -21,14 +21,13 @@
 #include <string.h>
 
 #include "dzl-fuzzy-index.h"
+#include "dzl-fuzzy-index-builder.h"
 #include "dzl-fuzzy-index-cursor.h"
+#include "dzl-fuzzy-index-match.h"
 #include "dzl-fuzzy-index-private.h"
 
-typedef struct
-{
-  guint key_id;
-  guint document_id;
-} LookasideEntry;
+#include "util/dzl-counter.h"
+#include "util/dzl-variant.h"
 
 struct _DzlFuzzyIndex
 {
@@ -37,12 +36,17 @@ struct _DzlFuzzyIndex
   guint         loaded : 1;
   guint         case_sensitive : 1;
 
+  /* The format version of the loaded index */
+  guint         version;
+
   GMappedFile  *mapped_file;
 
   /*
-   * Toplevel variant for the whole document. This is loaded from the entire
-   * contents of @mapped_file. It contains a dictionary of "a{sv}"
-   * containing all of our index data tables.
+   * Toplevel variant for the whole document. For version 1 indexes, this
+   * is loaded from the entire contents of @mapped_file and contains a
+   * dictionary of "a{sv}" containing all of our index data tables. For
+   * version 2 indexes, this is only the trailing variant section which
+   * contains the documents and metadata.
    */
   GVariant *variant;
 
@@ -56,9 +60,22 @@ struct _DzlFuzzyIndex
   /*
    * The keys found within the index. The index of the key is the "key_id"
    * used in other datastructures, such as the @lookaside array.
+   *
+   * Only used for version 1 indexes, version 2 indexes use @key_offsets
+   * into the @strings section of the mmap()'d file.
    */
   GVariant *keys;
 
+  /*
+   * The offset of each key within @strings, indexed by "key_id". Resolving
+   * a key is a direct load from the mmap()'d region. Only used for version
+   * 2 indexes.
+   */
+  const guint32 *key_offsets;
+  gsize n_keys;
+  const gchar *strings;
+  gsize strings_len;
+
   /*
    * The lookaside array is used to disambiguate between multiple keys
    * pointing to the same document. Each element in the array is of type
@@ -66,26 +83,40 @@ struct _DzlFuzzyIndex
    * being the "document_id". Each of these are indexes into the
    * corresponding @documents and @keys arrays.
    *
-   * This is a fixed array type and therefore can have the raw data
-   * accessed with g_variant_get_fixed_array() to save on lookup
-   * costs.
+   * For version 1 indexes, this is a fixed array type and therefore can
+   * have the raw data accessed with g_variant_get_fixed_array() to save
+   * on lookup costs.
    */
   GVariant *lookaside;
 
   /*
    * Raw pointers for fast access to the lookaside buffer.
    */
-  const LookasideEntry *lookaside_raw;
+  const DzlFuzzyIndexLookaside *lookaside_raw;
   gsize lookaside_len;
 
   /*
-   * This vardict is used to get the fixed array containing the
-   * (offset, lookaside_id) for each unicode character in the index.
-   * These are accessed by the cursors to layout the fulltext search
-   * index by each character in the input string. Doing so, is what
-   * gives us the O(mn) worst-case running time.
+   * This hashtable maps each unicode character in the index to the
+   * variant of its fixed array containing the (offset, lookaside_id)
+   * pairs. These are accessed by the cursors to layout the fulltext
+   * search index by each character in the input string. Doing so, is
+   * what gives us the O(mn) worst-case running time.
+   *
+   * The table variants are kept alive here, rather than looked up for
+   * each query, so that the fixed arrays handed out to the cursors stay
+   * valid for as long as the index. Only used for version 1 indexes.
+   */
+  GHashTable *tables;
+
+  /*
+   * The directory of tables for version 2 indexes, sorted by character
+   * so that we can binary search for the table of a given character. Each
+   * entry points to a range within @items.
    */
-  GVariantDict *tables;
+  const DzlFuzzyIndexTable *directory;
+  gsize n_directory;
+  const DzlFuzzyIndexItem *items;
+  gsize n_items;
 
   /*
    * The metadata located within the search index. This contains
@@ -93,31 +124,326 @@ struct _DzlFuzzyIndex
    * of its typed variants.
    */
   GVariantDict *metadata;
+
+  /*
+   * The documents removed from the layers beneath this index, if it was
+   * built as a delta. See dzl_fuzzy_index_builder_add_tombstone().
+   */
+  GHashTable *tombstones;
+
+  /*
+   * Delta indexes layered on top of this index with
+   * dzl_fuzzy_index_add_delta(), oldest first.
+   */
+  GPtrArray *layers;
+
+  /*
+   * Results of recent queries, keyed by the query, max_matches and
+   * max_errors. The
+   * entries are also linked into @cache_lru, most recently used first, so
+   * the least recently used can be evicted once the approximate size of
+   * the entries exceeds @cache_budget. The index is immutable once loaded,
+   * so entries never need to be invalidated.
+   */
+  GHashTable *cache;
+  GQueue      cache_lru;
+  guint64     cache_budget;
+  guint64     cache_size;
+
+  /*
+   * When @latest_wins is set, the cursors of each query are cancelled
+   * through @latest_query as soon as another query is started.
+   */
+  GCancellable *latest_query;
+  guint         latest_wins : 1;
+
+  /* The number of errors allowed when matching a key */
+  guint max_errors;
+};
+
+typedef struct
+{
+  GList   link;
+  gchar  *key;
+  GArray *matches;
+  gsize   cost;
+} CacheEntry;
+
+typedef struct
+{
+  /* The base index followed by its deltas */
+  GPtrArray *layers;
+
+  /* The results for each layer, in the same order */
+  GPtrArray *results;
+
+  GError    *error;
+  guint      max_matches;
+  guint      n_active;
+} LayeredQuery;
+
+typedef struct
+{
+  /* The base index followed by its deltas */
+  GPtrArray *layers;
+  GFile     *file;
+} CompactState;
+
+enum {
+  PROP_0,
+  PROP_CACHE_BUDGET,
+  PROP_LATEST_WINS,
+  PROP_MAX_ERRORS,
+  N_PROPS
 };
 
 G_DEFINE_TYPE (DzlFuzzyIndex, dzl_fuzzy_index, G_TYPE_OBJECT)
 
+DZL_DEFINE_COUNTER (cache_hits, "DzlFuzzyIndex", "Cache Hits", "Number of queries served from the cache")
+DZL_DEFINE_COUNTER (cache_miss, "DzlFuzzyIndex", "Cache Miss", "Number of queries not found in the cache")
+
+static GParamSpec *properties [N_PROPS];
+
+static void
+cache_entry_free (gpointer data)
+{
+  CacheEntry *entry = data;
+
+  g_free (entry->key);
+  g_array_unref (entry->matches);
+  g_slice_free (CacheEntry, entry);
+}
+
+static gchar *
+dzl_fuzzy_index_cache_key (const gchar *query,
+                           guint        max_matches,
+                           guint        max_errors)
+{
+  return g_strdup_printf ("%u:%u:%s", max_matches, max_errors, query);
+}
+
+/*
+ * Evicts the least recently used results until the cache fits @budget.
+ */
+static void
+dzl_fuzzy_index_cache_trim (DzlFuzzyIndex *self,
+                            guint64        budget)
+{
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+
+  while (self->cache_size > budget)
+    {
+      GList *link = g_queue_pop_tail_link (&self->cache_lru);
+      CacheEntry *entry = link->data;
+
+      self->cache_size -= entry->cost;
+      g_hash_table_remove (self->cache, entry->key);
+    }
+}
+
+/*
+ * Returns: (transfer none) (nullable): the cached matches for @key.
+ */
+static GArray *
+dzl_fuzzy_index_cache_lookup (DzlFuzzyIndex *self,
+                              const gchar   *key)
+{
+  CacheEntry *entry;
+
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+  g_assert (key != NULL);
+
+  if (self->cache == NULL || NULL == (entry = g_hash_table_lookup (self->cache, key)))
+    return NULL;
+
+  g_queue_unlink (&self->cache_lru, &entry->link);
+  g_queue_push_head_link (&self->cache_lru, &entry->link);
+
+  return entry->matches;
+}
+
+static void
+dzl_fuzzy_index_cache_insert (DzlFuzzyIndex *self,
+                              const gchar   *key,
+                              GArray        *matches)
+{
+  CacheEntry *entry;
+  gsize cost;
+
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+  g_assert (key != NULL);
+  g_assert (matches != NULL);
+
+  /* The keys of the matches point into the index and cost nothing */
+  cost = sizeof (CacheEntry) + strlen (key) + 1 +
+         ((gsize)matches->len * g_array_get_element_size (matches));
+
+  if (cost > self->cache_budget)
+    return;
+
+  if (self->cache == NULL)
+    self->cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cache_entry_free);
+
+  if (NULL != (entry = g_hash_table_lookup (self->cache, key)))
+    {
+      g_queue_unlink (&self->cache_lru, &entry->link);
+      self->cache_size -= entry->cost;
+      g_hash_table_remove (self->cache, key);
+    }
+
+  entry = g_slice_new0 (CacheEntry);
+  entry->link.data = entry;
+  entry->key = g_strdup (key);
+  entry->matches = g_array_ref (matches);
+  entry->cost = cost;
+
+  g_hash_table_insert (self->cache, entry->key, entry);
+  g_queue_push_head_link (&self->cache_lru, &entry->link);
+  self->cache_size += cost;
+
+  dzl_fuzzy_index_cache_trim (self, self->cache_budget);
+}
+
 static void
 dzl_fuzzy_index_finalize (GObject *object)
 {
   DzlFuzzyIndex *self = (DzlFuzzyIndex *)object;
 
-  g_clear_pointer (&self->mapped_file, g_mapped_file_unref);
   g_clear_pointer (&self->variant, g_variant_unref);
   g_clear_pointer (&self->documents, g_variant_unref);
   g_clear_pointer (&self->keys, g_variant_unref);
-  g_clear_pointer (&self->tables, g_variant_dict_unref);
+  g_clear_pointer (&self->tables, g_hash_table_unref);
+  g_clear_pointer (&self->metadata, g_variant_dict_unref);
   g_clear_pointer (&self->lookaside, g_variant_unref);
+  g_clear_pointer (&self->tombstones, g_hash_table_unref);
+  g_clear_pointer (&self->layers, g_ptr_array_unref);
+  g_clear_pointer (&self->mapped_file, g_mapped_file_unref);
+  g_clear_pointer (&self->cache, g_hash_table_unref);
+  g_clear_object (&self->latest_query);
 
   G_OBJECT_CLASS (dzl_fuzzy_index_parent_class)->finalize (object);
 }
 
+static void
+dzl_fuzzy_index_get_property (GObject    *object,
+                              guint       prop_id,
+                              GValue     *value,
+                              GParamSpec *pspec)
+{
+  DzlFuzzyIndex *self = DZL_FUZZY_INDEX (object);
+
+  switch (prop_id)
+    {
+    case PROP_CACHE_BUDGET:
+      g_value_set_uint64 (value, dzl_fuzzy_index_get_cache_budget (self));
+      break;
+
+    case PROP_LATEST_WINS:
+      g_value_set_boolean (value, dzl_fuzzy_index_get_latest_wins (self));
+      break;
+
+    case PROP_MAX_ERRORS:
+      g_value_set_uint (value, dzl_fuzzy_index_get_max_errors (self));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+dzl_fuzzy_index_set_property (GObject      *object,
+                              guint         prop_id,
+                              const GValue *value,
+                              GParamSpec   *pspec)
+{
+  DzlFuzzyIndex *self = DZL_FUZZY_INDEX (object);
+
+  switch (prop_id)
+    {
+    case PROP_CACHE_BUDGET:
+      dzl_fuzzy_index_set_cache_budget (self, g_value_get_uint64 (value));
+      break;
+
+    case PROP_LATEST_WINS:
+      dzl_fuzzy_index_set_latest_wins (self, g_value_get_boolean (value));
+      break;
+
+    case PROP_MAX_ERRORS:
+      dzl_fuzzy_index_set_max_errors (self, g_value_get_uint (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
 static void
 dzl_fuzzy_index_class_init (DzlFuzzyIndexClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
   object_class->finalize = dzl_fuzzy_index_finalize;
+  object_class->get_property = dzl_fuzzy_index_get_property;
+  object_class->set_property = dzl_fuzzy_index_set_property;
+
+  /**
+   * DzlFuzzyIndex:cache-budget:
+   *
+   * The approximate number of bytes to use for caching the results of
+   * recent queries, or zero to disable the cache.
+   *
+   * Users often delete and retype characters of a query. With the cache,
+   * repeating one of the recent queries completes without matching the
+   * index again, sharing the results with the earlier query. Least
+   * recently used results are evicted to stay within the budget.
+   */
+  properties [PROP_CACHE_BUDGET] =
+    g_param_spec_uint64 ("cache-budget",
+                         "Cache Budget",
+                         "The approximate number of bytes to use for caching query results",
+                         0,
+                         G_MAXUINT64,
+                         0,
+                         (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * DzlFuzzyIndex:latest-wins:
+   *
+   * If set, starting a query cancels any query of the index which is still
+   * running, which then completes with %G_IO_ERROR_CANCELLED.
+   *
+   * This suits a search entry, where only the results for the latest text
+   * are of interest. Obsolete queries then stop matching promptly rather
+   * than delaying the query that matters.
+   */
+  properties [PROP_LATEST_WINS] =
+    g_param_spec_boolean ("latest-wins",
+                          "Latest Wins",
+                          "If a new query cancels the queries still running",
+                          FALSE,
+                          (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * DzlFuzzyIndex:max-errors:
+   *
+   * The number of errors allowed when matching a key, for the queries
+   * started after it is set. See #DzlFuzzyIndexCursor:max-errors.
+   *
+   * Allowing errors finds keys despite typos in the query, such as two
+   * swapped characters, at the cost of slower queries which cannot be
+   * refined.
+   */
+  properties [PROP_MAX_ERRORS] =
+    g_param_spec_uint ("max-errors",
+                       "Max Errors",
+                       "The max number of typos to allow in a match",
+                       0,
+                       DZL_FUZZY_INDEX_MAX_ERRORS,
+                       0,
+                       (G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
 static void
@@ -131,6 +457,300 @@ dzl_fuzzy_index_new (void)
   return g_object_new (DZL_TYPE_FUZZY_INDEX, NULL);
 }
 
+/*
+ * Makes sure every lookaside entry references a valid key and document so
+ * that _dzl_fuzzy_index_resolve() and _dzl_fuzzy_index_lookup_document()
+ * may trust them without further checks.
+ */
+static gboolean
+lookaside_is_valid (const DzlFuzzyIndexLookaside  *lookaside,
+                    gsize                          n_lookaside,
+                    gsize                          n_keys,
+                    gsize                          n_documents,
+                    GError                       **error)
+{
+  for (gsize i = 0; i < n_lookaside; i++)
+    {
+      if ((lookaside [i].key_id & 0x00FFFFFF) >= n_keys ||
+          lookaside [i].document_id >= n_documents)
+        {
+          g_set_error (error,
+                       G_IO_ERROR,
+                       G_IO_ERROR_INVALID_DATA,
+                       "Invalid lookaside entry %"G_GSIZE_FORMAT" in index",
+                       i);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+dzl_fuzzy_index_load_v1 (DzlFuzzyIndex  *self,
+                         GMappedFile    *mapped_file,
+                         GError        **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) documents = NULL;
+  g_autoptr(GVariant) lookaside = NULL;
+  g_autoptr(GVariant) keys = NULL;
+  g_autoptr(GVariant) tables = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  const DzlFuzzyIndexLookaside *lookaside_raw;
+  GVariantDict dict;
+  gsize lookaside_len = 0;
+  GVariantIter iter;
+  const gchar *char_key;
+  GVariant *table;
+  gint version = 0;
+
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+  g_assert (mapped_file != NULL);
+
+  variant = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
+                                     g_mapped_file_get_contents (mapped_file),
+                                     g_mapped_file_get_length (mapped_file),
+                                     FALSE, NULL, NULL);
+
+  if (variant == NULL)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVAL,
+                   "Failed to parse GVariant");
+      return FALSE;
+    }
+
+  g_variant_ref_sink (variant);
+
+  g_variant_dict_init (&dict, variant);
+
+  if (!g_variant_dict_lookup (&dict, "version", "i", &version) ||
+      version != DZL_FUZZY_INDEX_VERSION_1)
+    {
+      g_variant_dict_clear (&dict);
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVAL,
+                   "Version mismatch in gvariant. Got %d, expected 1",
+                   version);
+      return FALSE;
+    }
+
+  documents = g_variant_dict_lookup_value (&dict, "documents", G_VARIANT_TYPE_ARRAY);
+  keys = g_variant_dict_lookup_value (&dict, "keys", G_VARIANT_TYPE_STRING_ARRAY);
+  lookaside = g_variant_dict_lookup_value (&dict, "lookaside", G_VARIANT_TYPE_ARRAY);
+  tables = g_variant_dict_lookup_value (&dict, "tables", G_VARIANT_TYPE_VARDICT);
+  metadata = g_variant_dict_lookup_value (&dict, "metadata", G_VARIANT_TYPE_VARDICT);
+  g_variant_dict_clear (&dict);
+
+  if (keys == NULL || documents == NULL || tables == NULL || metadata == NULL || lookaside == NULL)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVAL,
+                   "Invalid gvariant index");
+      return FALSE;
+    }
+
+  lookaside_raw = g_variant_get_fixed_array (lookaside, &lookaside_len, sizeof (DzlFuzzyIndexLookaside));
+
+  if (!lookaside_is_valid (lookaside_raw,
+                           lookaside_len,
+                           g_variant_n_children (keys),
+                           g_variant_n_children (documents),
+                           error))
+    return FALSE;
+
+  self->version = DZL_FUZZY_INDEX_VERSION_1;
+  self->variant = g_steal_pointer (&variant);
+  self->documents = g_steal_pointer (&documents);
+  self->lookaside = g_steal_pointer (&lookaside);
+  self->keys = g_steal_pointer (&keys);
+  self->metadata = g_variant_dict_new (metadata);
+
+  self->tables = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_variant_unref);
+
+  g_variant_iter_init (&iter, tables);
+  while (g_variant_iter_next (&iter, "{&sv}", &char_key, &table))
+    {
+      gunichar ch = g_utf8_get_char (char_key);
+
+      if (!g_variant_is_of_type (table, (const GVariantType *)"a(uu)"))
+        {
+          g_variant_unref (table);
+          continue;
+        }
+
+      g_hash_table_insert (self->tables, GUINT_TO_POINTER (ch), table);
+    }
+
+  self->lookaside_raw = lookaside_raw;
+  self->lookaside_len = lookaside_len;
+
+  return TRUE;
+}
+
+static inline gboolean
+section_is_valid (gsize   file_length,
+                  guint64 offset,
+                  guint64 n_elements,
+                  gsize   element_size)
+{
+  /* Sections must be aligned so that we can access them in place */
+  if (offset % 8 != 0 || offset > file_length)
+    return FALSE;
+
+  return n_elements <= (file_length - offset) / element_size;
+}
+
+static gboolean
+dzl_fuzzy_index_load_v2 (DzlFuzzyIndex  *self,
+                         GMappedFile    *mapped_file,
+                         GError        **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GVariant) documents = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) tombstones = NULL;
+  const DzlFuzzyIndexHeader *header;
+  const DzlFuzzyIndexTable *directory;
+  const DzlFuzzyIndexLookaside *lookaside;
+  const guint32 *key_offsets;
+  const gchar *contents;
+  GVariantDict dict;
+  gsize length;
+  guint i;
+
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+  g_assert (mapped_file != NULL);
+
+  contents = g_mapped_file_get_contents (mapped_file);
+  length = g_mapped_file_get_length (mapped_file);
+  header = (const DzlFuzzyIndexHeader *)(gconstpointer)contents;
+
+  g_assert (length >= sizeof *header);
+
+  if (header->version != DZL_FUZZY_INDEX_VERSION_2)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVAL,
+                   "Version mismatch in index. Got %u, expected 2",
+                   header->version);
+      return FALSE;
+    }
+
+  if (header->byte_order != G_BYTE_ORDER)
+    {
+      g_set_error (error,
+                   G_IO_ERROR,
+                   G_IO_ERROR_INVAL,
+                   "Index was created with a different byte order");
+      return FALSE;
+    }
+
+  if (!section_is_valid (length, header->keys_offset, header->n_keys, sizeof (guint32)) ||
+      !section_is_valid (length, header->strings_offset, header->strings_length, 1) ||
+      !section_is_valid (length, header->lookaside_offset, header->n_lookaside, sizeof (DzlFuzzyIndexLookaside)) ||
+      !section_is_valid (length, header->directory_offset, header->n_tables, sizeof (DzlFuzzyIndexTable)) ||
+      !section_is_valid (length, header->items_offset, header->n_items, sizeof (DzlFuzzyIndexItem)) ||
+      !section_is_valid (length, header->variant_offset, header->variant_length, 1) ||
+      (header->strings_length > 0 && contents [header->strings_offset + header->strings_length - 1] != '\0'))
+    goto invalid;
+
+  /*
+   * Make sure the directory is sorted and only references items within the
+   * items section so that lookups may trust it without further checks.
+   */
+  directory = (const DzlFuzzyIndexTable *)(gconstpointer)&contents [header->directory_offset];
+
+  for (i = 0; i < header->n_tables; i++)
+    {
+      if ((i > 0 && directory [i - 1].ch >= directory [i].ch) ||
+          directory [i].offset > header->n_items ||
+          directory [i].n_items > header->n_items - directory [i].offset)
+        goto invalid;
+    }
+
+  /* The strings section is \0 terminated, so any offset within it is safe */
+  key_offsets = (const guint32 *)(gconstpointer)&contents [header->keys_offset];
+
+  for (i = 0; i < header->n_keys; i++)
+    {
+      if (key_offsets [i] >= header->strings_length)
+        goto invalid;
+    }
+
+  variant = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
+                                     &contents [header->variant_offset],
+                                     header->variant_length,
+                                     FALSE, NULL, NULL);
+  g_variant_ref_sink (variant);
+
+  g_variant_dict_init (&dict, variant);
+  documents = g_variant_dict_lookup_value (&dict, "documents", G_VARIANT_TYPE_ARRAY);
+  metadata = g_variant_dict_lookup_value (&dict, "metadata", G_VARIANT_TYPE_VARDICT);
+  tombstones = g_variant_dict_lookup_value (&dict, "tombstones", G_VARIANT_TYPE ("av"));
+  g_variant_dict_clear (&dict);
+
+  if (documents == NULL || metadata == NULL)
+    goto invalid;
+
+  lookaside = (const DzlFuzzyIndexLookaside *)(gconstpointer)&contents [header->lookaside_offset];
+
+  if (!lookaside_is_valid (lookaside,
+                           header->n_lookaside,
+                           header->n_keys,
+                           g_variant_n_children (documents),
+                           error))
+    return FALSE;
+
+  if (tombstones != NULL && g_variant_n_children (tombstones) > 0)
+    {
+      gsize n_tombstones = g_variant_n_children (tombstones);
+
+      self->tombstones = g_hash_table_new_full (dzl_g_variant_hash,
+                                                g_variant_equal,
+                                                (GDestroyNotify)g_variant_unref,
+                                                NULL);
+
+      for (gsize j = 0; j < n_tombstones; j++)
+        {
+          g_autoptr(GVariant) boxed = g_variant_get_child_value (tombstones, j);
+
+          g_hash_table_add (self->tombstones, g_variant_get_variant (boxed));
+        }
+    }
+
+  self->version = DZL_FUZZY_INDEX_VERSION_2;
+  self->case_sensitive = !!(header->flags & DZL_FUZZY_INDEX_CASE_SENSITIVE);
+  self->variant = g_steal_pointer (&variant);
+  self->documents = g_steal_pointer (&documents);
+  self->metadata = g_variant_dict_new (metadata);
+  self->key_offsets = key_offsets;
+  self->n_keys = header->n_keys;
+  self->strings = &contents [header->strings_offset];
+  self->strings_len = header->strings_length;
+  self->lookaside_raw = lookaside;
+  self->lookaside_len = header->n_lookaside;
+  self->directory = directory;
+  self->n_directory = header->n_tables;
+  self->items = (const DzlFuzzyIndexItem *)(gconstpointer)&contents [header->items_offset];
+  self->n_items = header->n_items;
+
+  return TRUE;
+
+invalid:
+  g_set_error (error,
+               G_IO_ERROR,
+               G_IO_ERROR_INVAL,
+               "Invalid index");
+
+  return FALSE;
+}
+
 static void
 dzl_fuzzy_index_load_file_worker (GTask        *task,
                                   gpointer      source_object,
@@ -139,18 +759,11 @@ dzl_fuzzy_index_load_file_worker (GTask        *task,
 {
   g_autofree gchar *path = NULL;
   g_autoptr(GMappedFile) mapped_file = NULL;
-  g_autoptr(GVariant) variant = NULL;
-  g_autoptr(GVariant) documents = NULL;
-  g_autoptr(GVariant) lookaside = NULL;
-  g_autoptr(GVariant) keys = NULL;
-  g_autoptr(GVariant) tables = NULL;
-  g_autoptr(GVariant) metadata = NULL;
   DzlFuzzyIndex *self = source_object;
   GFile *file = task_data;
-  GVariantDict dict;
   GError *error = NULL;
-  gint version = 0;
   gboolean case_sensitive = FALSE;
+  gboolean ret;
 
   g_assert (DZL_IS_FUZZY_INDEX (self));
   g_assert (G_IS_FILE (file));
@@ -182,190 +795,776 @@ dzl_fuzzy_index_load_file_worker (GTask        *task,
       return;
     }
 
-  variant = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
-                                     g_mapped_file_get_contents (mapped_file),
-                                     g_mapped_file_get_length (mapped_file),
-                                     FALSE, NULL, NULL);
+  /*
+   * Version 2 indexes start with a magic header. Anything else is treated
+   * as a version 1 index, which is a GVariant of the entire file.
+   */
+  if (g_mapped_file_get_length (mapped_file) >= sizeof (DzlFuzzyIndexHeader) &&
+      memcmp (g_mapped_file_get_contents (mapped_file),
+              DZL_FUZZY_INDEX_MAGIC,
+              DZL_FUZZY_INDEX_MAGIC_LEN) == 0)
+    ret = dzl_fuzzy_index_load_v2 (self, mapped_file, &error);
+  else
+    ret = dzl_fuzzy_index_load_v1 (self, mapped_file, &error);
 
-  if (variant == NULL)
+  if (!ret)
     {
-      g_task_return_new_error (task,
-                               G_IO_ERROR,
-                               G_IO_ERROR_INVAL,
-                               "Failed to parse GVariant");
+      g_task_return_error (task, error);
       return;
     }
 
-  g_variant_ref_sink (variant);
+  /* Our variants and raw pointers reference the mapped contents */
+  self->mapped_file = g_steal_pointer (&mapped_file);
 
-  g_variant_dict_init (&dict, variant);
+  if (g_variant_dict_lookup (self->metadata, "case-sensitive", "b", &case_sensitive))
+    self->case_sensitive = !!case_sensitive;
+
+  g_task_return_boolean (task, TRUE);
+}
+
+void
+dzl_fuzzy_index_load_file_async (DzlFuzzyIndex          *self,
+                             GFile               *file,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
+  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, dzl_fuzzy_index_load_file);
+  g_task_set_task_data (task, g_object_ref (file), g_object_unref);
+  g_task_set_check_cancellable (task, FALSE);
+  g_task_run_in_thread (task, dzl_fuzzy_index_load_file_worker);
+}
+
+gboolean
+dzl_fuzzy_index_load_file_finish (DzlFuzzyIndex  *self,
+                                  GAsyncResult   *result,
+                                  GError        **error)
+{
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+gboolean
+dzl_fuzzy_index_load_file (DzlFuzzyIndex  *self,
+                           GFile          *file,
+                           GCancellable   *cancellable,
+                           GError        **error)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), FALSE);
+  g_return_val_if_fail (G_IS_FILE (file), FALSE);
+  g_return_val_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable), FALSE);
+
+  task = g_task_new (self, cancellable, NULL, NULL);
+  g_task_set_source_tag (task, dzl_fuzzy_index_load_file);
+  g_task_set_task_data (task, g_object_ref (file), g_object_unref);
+  g_task_set_check_cancellable (task, FALSE);
+
+  dzl_fuzzy_index_load_file_worker (task, self, file, cancellable);
 
-  if (!g_variant_dict_lookup (&dict, "version", "i", &version) || version != 1)
+  return g_task_propagate_boolean (task, error);
+}
+
+static void
+dzl_fuzzy_index_query_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  DzlFuzzyIndexCursor *cursor = (DzlFuzzyIndexCursor *)object;
+  g_autoptr(GTask) task = user_data;
+  DzlFuzzyIndex *self;
+  const gchar *cache_key;
+  GError *error = NULL;
+
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (cursor));
+  g_assert (G_IS_ASYNC_RESULT (result));
+  g_assert (G_IS_TASK (task));
+
+  if (!g_async_initable_init_finish (G_ASYNC_INITABLE (cursor), result, &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  self = g_task_get_source_object (task);
+  cache_key = g_task_get_task_data (task);
+
+  /* The budget may have been disabled while the query was running */
+  if (cache_key != NULL && self->cache_budget > 0)
+    dzl_fuzzy_index_cache_insert (self, cache_key, _dzl_fuzzy_index_cursor_get_match_array (cursor));
+
+  /*
+   * The cursor may have completed before a newer query was started, but
+   * the caller no longer wants the results, so they are not delivered.
+   */
+  if (_dzl_fuzzy_index_cursor_is_superseded (cursor))
     {
-      g_variant_dict_clear (&dict);
       g_task_return_new_error (task,
                                G_IO_ERROR,
-                               G_IO_ERROR_INVAL,
-                               "Version mismatch in gvariant. Got %d, expected 1",
-                               version);
+                               G_IO_ERROR_CANCELLED,
+                               "The query was superseded by a newer query");
       return;
     }
 
-  documents = g_variant_dict_lookup_value (&dict, "documents", G_VARIANT_TYPE_ARRAY);
-  keys = g_variant_dict_lookup_value (&dict, "keys", G_VARIANT_TYPE_STRING_ARRAY);
-  lookaside = g_variant_dict_lookup_value (&dict, "lookaside", G_VARIANT_TYPE_ARRAY);
-  tables = g_variant_dict_lookup_value (&dict, "tables", G_VARIANT_TYPE_VARDICT);
-  metadata = g_variant_dict_lookup_value (&dict, "metadata", G_VARIANT_TYPE_VARDICT);
-  g_variant_dict_clear (&dict);
+  g_task_return_pointer (task, g_object_ref (cursor), g_object_unref);
+}
+
+static gboolean
+dzl_fuzzy_index_return_cached (gpointer user_data)
+{
+  GTask *task = user_data;
+  DzlFuzzyIndexCursor *cursor;
+
+  g_assert (G_IS_TASK (task));
+
+  cursor = g_task_get_task_data (task);
+
+  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (cursor));
+
+  if (_dzl_fuzzy_index_cursor_is_superseded (cursor))
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_CANCELLED,
+                             "The query was superseded by a newer query");
+  else if (!g_task_return_error_if_cancelled (task))
+    g_task_return_pointer (task, g_object_ref (cursor), g_object_unref);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+dzl_fuzzy_index_query_single (DzlFuzzyIndex       *self,
+                              GListModel          *previous,
+                              const gchar         *query,
+                              guint                max_matches,
+                              guint                max_errors,
+                              GPtrArray           *removed,
+                              GCancellable        *superseded,
+                              GCancellable        *cancellable,
+                              GAsyncReadyCallback  callback,
+                              gpointer             user_data,
+                              gpointer             source_tag)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(DzlFuzzyIndexCursor) cursor = NULL;
+
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+  g_assert (!previous || DZL_IS_FUZZY_INDEX_CURSOR (previous));
+  g_assert (query != NULL);
+  g_assert (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+
+  /* Results filtered by the layers above are not cached */
+  if (self->cache_budget > 0 && removed == NULL)
+    {
+      g_autofree gchar *cache_key = dzl_fuzzy_index_cache_key (query, max_matches, max_errors);
+      GArray *matches;
+
+      /*
+       * The results are immutable, so the new cursor can share them. The
+       * cursor is delivered from an idle, like the results of any other
+       * query, so a newer query started in the meantime supersedes it.
+       */
+      if (NULL != (matches = dzl_fuzzy_index_cache_lookup (self, cache_key)))
+        {
+          GSource *source;
+
+          DZL_COUNTER_INC (cache_hits);
+
+          cursor = _dzl_fuzzy_index_cursor_new_for_matches (self, self->case_sensitive, query, max_matches, matches);
+          _dzl_fuzzy_index_cursor_set_superseded (cursor, superseded);
+          g_task_set_task_data (task, g_steal_pointer (&cursor), g_object_unref);
+
+          source = g_idle_source_new ();
+          g_source_set_priority (source, G_PRIORITY_LOW);
+          g_source_set_callback (source,
+                                 dzl_fuzzy_index_return_cached,
+                                 g_object_ref (task),
+                                 g_object_unref);
+          g_source_attach (source, g_task_get_context (task));
+          g_source_unref (source);
+
+          return;
+        }
+
+      DZL_COUNTER_INC (cache_miss);
+
+      g_task_set_task_data (task, g_steal_pointer (&cache_key), g_free);
+    }
+
+  cursor = g_object_new (DZL_TYPE_FUZZY_INDEX_CURSOR,
+                         "case-sensitive", self->case_sensitive,
+                         "index", self,
+                         "query", query,
+                         "max-matches", max_matches,
+                         "max-errors", max_errors,
+                         "previous", previous,
+                         NULL);
+  _dzl_fuzzy_index_cursor_set_superseded (cursor, superseded);
+  _dzl_fuzzy_index_cursor_set_removed (cursor, removed);
+
+  g_async_initable_init_async (G_ASYNC_INITABLE (cursor),
+                               G_PRIORITY_LOW,
+                               cancellable,
+                               dzl_fuzzy_index_query_cb,
+                               g_object_ref (task));
+}
+
+static void
+layered_query_free (gpointer data)
+{
+  LayeredQuery *lq = data;
+
+  for (guint i = 0; i < lq->results->len; i++)
+    g_clear_object (&g_ptr_array_index (lq->results, i));
+
+  g_clear_pointer (&lq->layers, g_ptr_array_unref);
+  g_clear_pointer (&lq->results, g_ptr_array_unref);
+  g_clear_error (&lq->error);
+  g_slice_free (LayeredQuery, lq);
+}
+
+/*
+ * Checks if @document was removed by one of the layers above @layer.
+ */
+static gboolean
+dzl_fuzzy_index_is_removed (GPtrArray *layers,
+                            guint      layer,
+                            GVariant  *document)
+{
+  for (guint i = layer + 1; i < layers->len; i++)
+    {
+      DzlFuzzyIndex *above = g_ptr_array_index (layers, i);
+
+      if (above->tombstones != NULL && g_hash_table_contains (above->tombstones, document))
+        return TRUE;
+    }
+
+  return FALSE;
+}
 
-  if (keys == NULL || documents == NULL || tables == NULL || metadata == NULL)
+static gint
+layered_match_compare (gconstpointer a,
+                       gconstpointer b)
+{
+  DzlFuzzyIndexMatch *ma = *(DzlFuzzyIndexMatch * const *)a;
+  DzlFuzzyIndexMatch *mb = *(DzlFuzzyIndexMatch * const *)b;
+  gfloat score_a = dzl_fuzzy_index_match_get_score (ma);
+  gfloat score_b = dzl_fuzzy_index_match_get_score (mb);
+
+  if (score_a < score_b)
+    return 1;
+  else if (score_a > score_b)
+    return -1;
+
+  return g_strcmp0 (dzl_fuzzy_index_match_get_key (ma), dzl_fuzzy_index_match_get_key (mb));
+}
+
+static GListModel *
+layered_query_merge (LayeredQuery *lq)
+{
+  g_autoptr(GPtrArray) matches = NULL;
+  g_autoptr(GHashTable) seen = NULL;
+  GListStore *store;
+
+  g_assert (lq != NULL);
+
+  matches = g_ptr_array_new_with_free_func (g_object_unref);
+  seen = g_hash_table_new (dzl_g_variant_hash, g_variant_equal);
+  store = g_list_store_new (DZL_TYPE_FUZZY_INDEX_MATCH);
+
+  for (guint i = 0; i < lq->results->len; i++)
+    {
+      GListModel *model = g_ptr_array_index (lq->results, i);
+      guint n_items;
+
+      if (model == NULL)
+        continue;
+
+      n_items = g_list_model_get_n_items (model);
+
+      for (guint j = 0; j < n_items; j++)
+        {
+          g_ptr_array_add (matches, g_list_model_get_item (model, j));
+        }
+    }
+
+  g_ptr_array_sort (matches, layered_match_compare);
+
+  /* Only keep the best match for each document */
+  for (guint i = 0; i < matches->len; i++)
+    {
+      DzlFuzzyIndexMatch *match = g_ptr_array_index (matches, i);
+      GVariant *document = dzl_fuzzy_index_match_get_document (match);
+
+      if (lq->max_matches > 0 && g_list_model_get_n_items (G_LIST_MODEL (store)) >= lq->max_matches)
+        break;
+
+      if (g_hash_table_contains (seen, document))
+        continue;
+
+      g_hash_table_add (seen, document);
+      g_list_store_append (store, match);
+    }
+
+  return G_LIST_MODEL (store);
+}
+
+static void
+dzl_fuzzy_index_query_layer_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+  DzlFuzzyIndex *layer = (DzlFuzzyIndex *)object;
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GListModel) model = NULL;
+  GError *error = NULL;
+  LayeredQuery *lq;
+
+  g_assert (DZL_IS_FUZZY_INDEX (layer));
+  g_assert (G_IS_TASK (result));
+  g_assert (G_IS_TASK (task));
+
+  lq = g_task_get_task_data (task);
+
+  model = g_task_propagate_pointer (G_TASK (result), &error);
+
+  if (model == NULL)
+    {
+      if (lq->error == NULL)
+        lq->error = error;
+      else
+        g_clear_error (&error);
+    }
+  else
+    {
+      for (guint i = 0; i < lq->layers->len; i++)
+        {
+          if (g_ptr_array_index (lq->layers, i) == (gpointer)layer)
+            {
+              g_ptr_array_index (lq->results, i) = g_steal_pointer (&model);
+              break;
+            }
+        }
+    }
+
+  lq->n_active--;
+
+  if (lq->n_active > 0)
+    return;
+
+  if (lq->error != NULL)
+    g_task_return_error (task, g_steal_pointer (&lq->error));
+  else
+    g_task_return_pointer (task, layered_query_merge (lq), g_object_unref);
+}
+
+/*
+ * Queries the base index and each of its deltas, then merges the
+ * results. Each layer skips the documents removed by the layers above
+ * it, so none of them needs more than @max_matches.
+ */
+static void
+dzl_fuzzy_index_query_layered (DzlFuzzyIndex       *self,
+                               const gchar         *query,
+                               guint                max_matches,
+                               guint                max_errors,
+                               GCancellable        *superseded,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data,
+                               gpointer             source_tag)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GPtrArray) removed = NULL;
+  LayeredQuery *lq;
+
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+  g_assert (self->layers != NULL);
+  g_assert (query != NULL);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, source_tag);
+
+  lq = g_slice_new0 (LayeredQuery);
+  lq->max_matches = max_matches;
+  lq->layers = g_ptr_array_new_with_free_func (g_object_unref);
+  lq->results = g_ptr_array_new ();
+
+  g_ptr_array_add (lq->layers, g_object_ref (self));
+  for (guint i = 0; i < self->layers->len; i++)
+    g_ptr_array_add (lq->layers, g_object_ref (g_ptr_array_index (self->layers, i)));
+  g_ptr_array_set_size (lq->results, lq->layers->len);
+
+  lq->n_active = lq->layers->len;
+  g_task_set_task_data (task, lq, layered_query_free);
+
+  /*
+   * Query from the newest layer down, collecting the tombstones of each
+   * layer for the ones below it. The queries run concurrently, so a new
+   * array is made rather than growing the one handed to the layer above.
+   */
+  for (guint i = lq->layers->len; i > 0; i--)
     {
-      g_task_return_new_error (task,
-                               G_IO_ERROR,
-                               G_IO_ERROR_INVAL,
-                               "Invalid gvariant index");
-      return;
+      DzlFuzzyIndex *layer = g_ptr_array_index (lq->layers, i - 1);
+
+      dzl_fuzzy_index_query_single (layer,
+                                    NULL,
+                                    query,
+                                    max_matches,
+                                    max_errors,
+                                    removed,
+                                    superseded,
+                                    cancellable,
+                                    dzl_fuzzy_index_query_layer_cb,
+                                    g_object_ref (task),
+                                    dzl_fuzzy_index_query_layered);
+
+      if (layer->tombstones != NULL && g_hash_table_size (layer->tombstones) > 0)
+        {
+          GPtrArray *above = g_ptr_array_new_with_free_func ((GDestroyNotify)g_hash_table_unref);
+
+          if (removed != NULL)
+            {
+              for (guint j = 0; j < removed->len; j++)
+                g_ptr_array_add (above, g_hash_table_ref (g_ptr_array_index (removed, j)));
+            }
+
+          g_ptr_array_add (above, g_hash_table_ref (layer->tombstones));
+          g_clear_pointer (&removed, g_ptr_array_unref);
+          removed = above;
+        }
     }
+}
 
-  self->mapped_file = g_steal_pointer (&mapped_file);
-  self->variant = g_steal_pointer (&variant);
-  self->documents = g_steal_pointer (&documents);
-  self->lookaside = g_steal_pointer (&lookaside);
-  self->keys = g_steal_pointer (&keys);
-  self->tables = g_variant_dict_new (tables);
-  self->metadata = g_variant_dict_new (metadata);
+static void
+dzl_fuzzy_index_query_internal (DzlFuzzyIndex       *self,
+                                GListModel          *previous,
+                                const gchar         *query,
+                                guint                max_matches,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data,
+                                gpointer             source_tag)
+{
+  g_autoptr(GCancellable) superseded = NULL;
 
-  self->lookaside_raw = g_variant_get_fixed_array (self->lookaside,
-                                                   &self->lookaside_len,
-                                                   sizeof (LookasideEntry));
+  g_assert (DZL_IS_FUZZY_INDEX (self));
 
-  if (g_variant_dict_lookup (self->metadata, "case-sensitive", "b", &case_sensitive))
-    self->case_sensitive = !!case_sensitive;
+  if (self->latest_wins)
+    {
+      if (self->latest_query != NULL)
+        g_cancellable_cancel (self->latest_query);
 
-  g_task_return_boolean (task, TRUE);
+      superseded = g_cancellable_new ();
+      g_set_object (&self->latest_query, superseded);
+    }
+
+  if (self->layers != NULL && self->layers->len > 0)
+    dzl_fuzzy_index_query_layered (self, query, max_matches, self->max_errors, superseded, cancellable, callback, user_data, source_tag);
+  else
+    dzl_fuzzy_index_query_single (self, previous, query, max_matches, self->max_errors, NULL, superseded, cancellable, callback, user_data, source_tag);
 }
 
 void
-dzl_fuzzy_index_load_file_async (DzlFuzzyIndex          *self,
-                             GFile               *file,
+dzl_fuzzy_index_query_async (DzlFuzzyIndex       *self,
+                             const gchar         *query,
+                             guint                max_matches,
                              GCancellable        *cancellable,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
 {
-  g_autoptr(GTask) task = NULL;
+  g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
+  g_return_if_fail (query != NULL);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  dzl_fuzzy_index_query_internal (self,
+                                  NULL,
+                                  query,
+                                  max_matches,
+                                  cancellable,
+                                  callback,
+                                  user_data,
+                                  dzl_fuzzy_index_query_async);
+}
+
+/**
+ * dzl_fuzzy_index_query_finish:
+ *
+ * Completes an asynchronous request to dzl_fuzzy_index_query_async().
+ *
+ * Returns: (transfer full): A #GListModel of results.
+ */
+GListModel *
+dzl_fuzzy_index_query_finish (DzlFuzzyIndex  *self,
+                              GAsyncResult   *result,
+                              GError        **error)
+{
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
 
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+/**
+ * dzl_fuzzy_index_query_refine_async:
+ * @self: A #DzlFuzzyIndex
+ * @previous: (nullable): A #GListModel from dzl_fuzzy_index_query_finish()
+ * @query: the new query
+ * @max_matches: the max number of matches, or 0 for unlimited
+ * @cancellable: (nullable): A #GCancellable or %NULL
+ * @callback: A callback to execute upon completion
+ * @user_data: user data for @callback
+ *
+ * This is like dzl_fuzzy_index_query_async() but is optimized for the
+ * common case of a user typing additional characters into a search entry.
+ *
+ * If @query extends the query used to create @previous, only the keys
+ * that matched @previous are considered rather than the whole index. The
+ * results are the same as those of dzl_fuzzy_index_query_async(). If
+ * @previous cannot be refined, a full query is performed.
+ */
+void
+dzl_fuzzy_index_query_refine_async (DzlFuzzyIndex       *self,
+                                    GListModel          *previous,
+                                    const gchar         *query,
+                                    guint                max_matches,
+                                    GCancellable        *cancellable,
+                                    GAsyncReadyCallback  callback,
+                                    gpointer             user_data)
+{
   g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
-  g_return_if_fail (G_IS_FILE (file));
+  g_return_if_fail (!previous || G_IS_LIST_MODEL (previous));
+  g_return_if_fail (query != NULL);
   g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
-  task = g_task_new (self, cancellable, callback, user_data);
-  g_task_set_source_tag (task, dzl_fuzzy_index_load_file);
-  g_task_set_task_data (task, g_object_ref (file), g_object_unref);
-  g_task_set_check_cancellable (task, FALSE);
-  g_task_run_in_thread (task, dzl_fuzzy_index_load_file_worker);
+  /* Merged results of layered indexes and results from another index cannot be refined */
+  if (previous != NULL &&
+      (!DZL_IS_FUZZY_INDEX_CURSOR (previous) ||
+       dzl_fuzzy_index_cursor_get_index (DZL_FUZZY_INDEX_CURSOR (previous)) != self))
+    previous = NULL;
+
+  dzl_fuzzy_index_query_internal (self,
+                                  previous,
+                                  query,
+                                  max_matches,
+                                  cancellable,
+                                  callback,
+                                  user_data,
+                                  dzl_fuzzy_index_query_refine_async);
 }
 
-gboolean
-dzl_fuzzy_index_load_file_finish (DzlFuzzyIndex  *self,
-                                  GAsyncResult   *result,
-                                  GError        **error)
+/**
+ * dzl_fuzzy_index_query_refine_finish:
+ *
+ * Completes an asynchronous request to dzl_fuzzy_index_query_refine_async().
+ *
+ * Returns: (transfer full): A #GListModel of results.
+ */
+GListModel *
+dzl_fuzzy_index_query_refine_finish (DzlFuzzyIndex  *self,
+                                     GAsyncResult   *result,
+                                     GError        **error)
 {
-  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), FALSE);
-  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), NULL);
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
 
-  return g_task_propagate_boolean (G_TASK (result), error);
+  return g_task_propagate_pointer (G_TASK (result), error);
 }
 
-gboolean
-dzl_fuzzy_index_load_file (DzlFuzzyIndex  *self,
-                           GFile          *file,
-                           GCancellable   *cancellable,
-                           GError        **error)
+/**
+ * dzl_fuzzy_index_add_delta:
+ * @self: A loaded #DzlFuzzyIndex
+ * @delta: A loaded #DzlFuzzyIndex to layer on top of @self
+ *
+ * Layers @delta on top of @self. This allows updating a large index by
+ * building a small delta index containing only the changed documents,
+ * rather than rebuilding the whole index.
+ *
+ * Queries on @self will then query each layer and merge the results.
+ * Documents that @delta removed with dzl_fuzzy_index_builder_add_tombstone()
+ * are ignored in @self and any delta added before @delta.
+ *
+ * The merged results are not a #DzlFuzzyIndexCursor and therefore cannot
+ * be refined with dzl_fuzzy_index_query_refine_async().
+ *
+ * Use dzl_fuzzy_index_compact_async() to fold the deltas into a new index.
+ */
+void
+dzl_fuzzy_index_add_delta (DzlFuzzyIndex *self,
+                           DzlFuzzyIndex *delta)
 {
-  g_autoptr(GTask) task = NULL;
+  g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
+  g_return_if_fail (DZL_IS_FUZZY_INDEX (delta));
+  g_return_if_fail (self != delta);
+  g_return_if_fail (self->mapped_file != NULL);
+  g_return_if_fail (delta->mapped_file != NULL);
+  g_return_if_fail (delta->layers == NULL);
+  g_return_if_fail (delta->case_sensitive == self->case_sensitive);
 
-  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), FALSE);
-  g_return_val_if_fail (G_IS_FILE (file), FALSE);
-  g_return_val_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable), FALSE);
+  if (self->layers == NULL)
+    self->layers = g_ptr_array_new_with_free_func (g_object_unref);
 
-  task = g_task_new (self, cancellable, NULL, NULL);
-  g_task_set_source_tag (task, dzl_fuzzy_index_load_file);
-  g_task_set_task_data (task, g_object_ref (file), g_object_unref);
-  g_task_set_check_cancellable (task, FALSE);
+  for (guint i = 0; i < self->layers->len; i++)
+    g_return_if_fail (g_ptr_array_index (self->layers, i) != (gpointer)delta);
 
-  dzl_fuzzy_index_load_file_worker (task, self, file, cancellable);
+  g_ptr_array_add (self->layers, g_object_ref (delta));
+}
 
-  return g_task_propagate_boolean (task, error);
+static void
+compact_state_free (gpointer data)
+{
+  CompactState *state = data;
+
+  g_clear_pointer (&state->layers, g_ptr_array_unref);
+  g_clear_object (&state->file);
+  g_slice_free (CompactState, state);
 }
 
 static void
-dzl_fuzzy_index_query_cb (GObject      *object,
-                          GAsyncResult *result,
-                          gpointer      user_data)
+dzl_fuzzy_index_compact_worker (GTask        *task,
+                                gpointer      source_object,
+                                gpointer      task_data,
+                                GCancellable *cancellable)
 {
-  DzlFuzzyIndexCursor *cursor = (DzlFuzzyIndexCursor *)object;
-  g_autoptr(GTask) task = user_data;
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  CompactState *state = task_data;
+  DzlFuzzyIndex *base;
   GError *error = NULL;
 
-  g_assert (DZL_IS_FUZZY_INDEX_CURSOR (cursor));
-  g_assert (G_IS_ASYNC_RESULT (result));
   g_assert (G_IS_TASK (task));
+  g_assert (state != NULL);
+  g_assert (state->layers->len > 0);
 
-  if (!g_async_initable_init_finish (G_ASYNC_INITABLE (cursor), result, &error))
+  base = g_ptr_array_index (state->layers, 0);
+
+  builder = dzl_fuzzy_index_builder_new ();
+  dzl_fuzzy_index_builder_set_case_sensitive (builder, base->case_sensitive);
+
+  for (guint i = 0; i < state->layers->len; i++)
+    {
+      DzlFuzzyIndex *layer = g_ptr_array_index (state->layers, i);
+      g_autoptr(GVariant) metadata = NULL;
+
+      /* Metadata from newer layers replaces that of older layers */
+      metadata = g_variant_lookup_value (layer->variant, "metadata", G_VARIANT_TYPE_VARDICT);
+
+      if (metadata != NULL)
+        {
+          GVariantIter iter;
+          const gchar *key;
+          GVariant *value;
+
+          g_variant_iter_init (&iter, metadata);
+          while (g_variant_iter_loop (&iter, "{&sv}", &key, &value))
+            {
+              if (g_strcmp0 (key, "case-sensitive") != 0)
+                dzl_fuzzy_index_builder_set_metadata (builder, key, value);
+            }
+        }
+
+      for (gsize id = 0; id < layer->lookaside_len; id++)
+        {
+          g_autoptr(GVariant) document = NULL;
+          const gchar *key = NULL;
+          guint document_id;
+          guint priority;
+          gfloat score;
+
+          if ((id & 0xFFF) == 0 && g_task_return_error_if_cancelled (task))
+            return;
+
+          if (!_dzl_fuzzy_index_resolve (layer, id, &document_id, &key, &priority, 0, 0, 0, &score))
+            continue;
+
+          document = _dzl_fuzzy_index_lookup_document (layer, document_id);
+
+          if (dzl_fuzzy_index_is_removed (state->layers, i, document))
+            continue;
+
+          dzl_fuzzy_index_builder_insert (builder, key, document, priority);
+        }
+    }
+
+  if (!dzl_fuzzy_index_builder_write (builder, state->file, G_PRIORITY_DEFAULT, cancellable, &error))
     g_task_return_error (task, error);
   else
-    g_task_return_pointer (task, g_object_ref (cursor), g_object_unref);
+    g_task_return_boolean (task, TRUE);
 }
 
+/**
+ * dzl_fuzzy_index_compact_async:
+ * @self: A #DzlFuzzyIndex
+ * @file: A #GFile to write the new index to
+ * @io_priority: The priority for IO operations
+ * @cancellable: (nullable): An optional #GCancellable or %NULL
+ * @callback: A callback for completion or %NULL
+ * @user_data: User data for @callback
+ *
+ * Folds the deltas added with dzl_fuzzy_index_add_delta() into @self,
+ * and writes the result to @file in a thread. Removed documents are
+ * dropped from the new index.
+ *
+ * Since a #DzlFuzzyIndex cannot be reloaded, load @file into a new
+ * #DzlFuzzyIndex to replace @self once this completes.
+ */
 void
-dzl_fuzzy_index_query_async (DzlFuzzyIndex       *self,
-                             const gchar         *query,
-                             guint                max_matches,
-                             GCancellable        *cancellable,
-                             GAsyncReadyCallback  callback,
-                             gpointer             user_data)
+dzl_fuzzy_index_compact_async (DzlFuzzyIndex       *self,
+                               GFile               *file,
+                               gint                 io_priority,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
 {
   g_autoptr(GTask) task = NULL;
-  g_autoptr(DzlFuzzyIndexCursor) cursor = NULL;
+  CompactState *state;
 
   g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
-  g_return_if_fail (query != NULL);
+  g_return_if_fail (self->mapped_file != NULL);
+  g_return_if_fail (G_IS_FILE (file));
   g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
   task = g_task_new (self, cancellable, callback, user_data);
-  g_task_set_source_tag (task, dzl_fuzzy_index_query_async);
+  g_task_set_source_tag (task, dzl_fuzzy_index_compact_async);
+  g_task_set_priority (task, io_priority);
+  g_task_set_check_cancellable (task, FALSE);
 
-  cursor = g_object_new (DZL_TYPE_FUZZY_INDEX_CURSOR,
-                         "case-sensitive", self->case_sensitive,
-                         "index", self,
-                         "query", query,
-                         "max-matches", max_matches,
-                         "tables", self->tables,
-                         NULL);
+  /* Snapshot the layers, since more deltas may be added meanwhile */
+  state = g_slice_new0 (CompactState);
+  state->file = g_object_ref (file);
+  state->layers = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (state->layers, g_object_ref (self));
+  if (self->layers != NULL)
+    {
+      for (guint i = 0; i < self->layers->len; i++)
+        g_ptr_array_add (state->layers, g_object_ref (g_ptr_array_index (self->layers, i)));
+    }
+  g_task_set_task_data (task, state, compact_state_free);
 
-  g_async_initable_init_async (G_ASYNC_INITABLE (cursor),
-                               G_PRIORITY_LOW,
-                               cancellable,
-                               dzl_fuzzy_index_query_cb,
-                               g_object_ref (task));
+  g_task_run_in_thread (task, dzl_fuzzy_index_compact_worker);
 }
 
-/**
- * dzl_fuzzy_index_query_finish:
- *
- * Completes an asynchronous request to dzl_fuzzy_index_query_async().
- *
- * Returns: (transfer full): A #GListModel of results.
- */
-GListModel *
-dzl_fuzzy_index_query_finish (DzlFuzzyIndex  *self,
-                              GAsyncResult   *result,
-                              GError        **error)
+gboolean
+dzl_fuzzy_index_compact_finish (DzlFuzzyIndex  *self,
+                                GAsyncResult   *result,
+                                GError        **error)
 {
-  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), NULL);
-  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), FALSE);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
 
-  return g_task_propagate_pointer (G_TASK (result), error);
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 /**
@@ -457,6 +1656,65 @@ _dzl_fuzzy_index_lookup_document (DzlFuzzyIndex *self,
   return g_variant_get_child_value (self->documents, document_id);
 }
 
+/**
+ * _dzl_fuzzy_index_lookup_table:
+ * @self: A #DzlFuzzyIndex
+ * @ch: the (possibly casefolded) character to locate
+ * @n_items: (out): the number of items in the table
+ *
+ * Locates the table of (position, lookaside_id) pairs for @ch. The table
+ * is sorted by lookaside_id and then position.
+ *
+ * For version 2 indexes, this is a binary search over the directory which
+ * is stored in the mmap()'d file.
+ *
+ * Returns: (nullable) (transfer none): The table for @ch, or %NULL if no
+ *   key in the index contains @ch.
+ */
+const DzlFuzzyIndexItem *
+_dzl_fuzzy_index_lookup_table (DzlFuzzyIndex *self,
+                               gunichar       ch,
+                               gsize         *n_items)
+{
+  g_assert (DZL_IS_FUZZY_INDEX (self));
+  g_assert (n_items != NULL);
+
+  *n_items = 0;
+
+  if (self->version == DZL_FUZZY_INDEX_VERSION_2)
+    {
+      gsize lo = 0;
+      gsize hi = self->n_directory;
+
+      while (lo < hi)
+        {
+          gsize mid = lo + ((hi - lo) / 2);
+          const DzlFuzzyIndexTable *table = &self->directory [mid];
+
+          if (table->ch < ch)
+            lo = mid + 1;
+          else if (table->ch > ch)
+            hi = mid;
+          else
+            {
+              *n_items = table->n_items;
+              return &self->items [table->offset];
+            }
+        }
+    }
+  else if (self->tables != NULL)
+    {
+      GVariant *table = g_hash_table_lookup (self->tables, GUINT_TO_POINTER (ch));
+
+      /* The fixed array points into our mmap()'d region, and @table is
+       * owned by the index so it remains valid for as long as we are. */
+      if (table != NULL)
+        return g_variant_get_fixed_array (table, n_items, sizeof (DzlFuzzyIndexItem));
+    }
+
+  return NULL;
+}
+
 gboolean
 _dzl_fuzzy_index_resolve (DzlFuzzyIndex  *self,
                           guint           lookaside_id,
@@ -465,9 +1723,10 @@ _dzl_fuzzy_index_resolve (DzlFuzzyIndex  *self,
                           guint          *priority,
                           guint           in_score,
                           guint           last_offset,
+                          guint           errors,
                           gfloat         *out_score)
 {
-  const LookasideEntry *entry;
+  const DzlFuzzyIndexLookaside *entry;
   const gchar *local_key = NULL;
   guint key_id;
 
@@ -486,10 +1745,12 @@ _dzl_fuzzy_index_resolve (DzlFuzzyIndex  *self,
 
   /* The key_id has a mask with the priority as well */
   key_id = entry->key_id & 0x00FFFFFF;
-  if G_UNLIKELY (key_id >= g_variant_n_children (self->keys))
-    return FALSE;
 
-  g_variant_get_child (self->keys, key_id, "&s", &local_key);
+  /* The key_id was validated when loading the index */
+  if (self->version == DZL_FUZZY_INDEX_VERSION_2)
+    local_key = &self->strings [self->key_offsets [key_id]];
+  else
+    g_variant_get_child (self->keys, key_id, "&s", &local_key);
 
   if (key != NULL)
     *key = local_key;
@@ -498,7 +1759,128 @@ _dzl_fuzzy_index_resolve (DzlFuzzyIndex  *self,
     *document_id = entry->document_id;
 
   *priority = (entry->key_id & 0xFF000000) >> 24;
-  *out_score = ((1.0 / 256.0) / (1 + last_offset + in_score)) + ((255.0 - *priority) / 256.0);
+  *out_score = _dzl_fuzzy_index_score (entry->key_id, in_score, last_offset, errors);
 
   return TRUE;
 }
+
+/**
+ * dzl_fuzzy_index_get_cache_budget:
+ * @self: A #DzlFuzzyIndex
+ *
+ * Gets the approximate number of bytes used for caching the results of
+ * recent queries. See #DzlFuzzyIndex:cache-budget.
+ *
+ * Returns: the budget in bytes, or zero if the cache is disabled
+ */
+guint64
+dzl_fuzzy_index_get_cache_budget (DzlFuzzyIndex *self)
+{
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), 0);
+
+  return self->cache_budget;
+}
+
+/**
+ * dzl_fuzzy_index_set_cache_budget:
+ * @self: A #DzlFuzzyIndex
+ * @cache_budget: the budget in bytes, or zero to disable the cache
+ *
+ * Sets the approximate number of bytes to use for caching the results of
+ * recent queries. See #DzlFuzzyIndex:cache-budget.
+ */
+void
+dzl_fuzzy_index_set_cache_budget (DzlFuzzyIndex *self,
+                                  guint64        cache_budget)
+{
+  g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
+
+  if (self->cache_budget != cache_budget)
+    {
+      self->cache_budget = cache_budget;
+      if (self->cache != NULL)
+        dzl_fuzzy_index_cache_trim (self, cache_budget);
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_CACHE_BUDGET]);
+    }
+}
+
+/**
+ * dzl_fuzzy_index_get_latest_wins:
+ * @self: A #DzlFuzzyIndex
+ *
+ * Gets whether starting a query cancels the queries of @self which are
+ * still running. See #DzlFuzzyIndex:latest-wins.
+ *
+ * Returns: %TRUE if only the latest query delivers its results
+ */
+gboolean
+dzl_fuzzy_index_get_latest_wins (DzlFuzzyIndex *self)
+{
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), FALSE);
+
+  return self->latest_wins;
+}
+
+/**
+ * dzl_fuzzy_index_set_latest_wins:
+ * @self: A #DzlFuzzyIndex
+ * @latest_wins: if starting a query cancels the running queries
+ *
+ * Sets whether starting a query cancels the queries of @self which are
+ * still running. See #DzlFuzzyIndex:latest-wins.
+ */
+void
+dzl_fuzzy_index_set_latest_wins (DzlFuzzyIndex *self,
+                                 gboolean       latest_wins)
+{
+  g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
+
+  latest_wins = !!latest_wins;
+
+  if (self->latest_wins != latest_wins)
+    {
+      self->latest_wins = latest_wins;
+      if (!latest_wins)
+        g_clear_object (&self->latest_query);
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_LATEST_WINS]);
+    }
+}
+
+/**
+ * dzl_fuzzy_index_get_max_errors:
+ * @self: A #DzlFuzzyIndex
+ *
+ * Gets the number of errors allowed when matching a key. See
+ * #DzlFuzzyIndex:max-errors.
+ *
+ * Returns: the max number of errors, or zero for exact matches only
+ */
+guint
+dzl_fuzzy_index_get_max_errors (DzlFuzzyIndex *self)
+{
+  g_return_val_if_fail (DZL_IS_FUZZY_INDEX (self), 0);
+
+  return self->max_errors;
+}
+
+/**
+ * dzl_fuzzy_index_set_max_errors:
+ * @self: A #DzlFuzzyIndex
+ * @max_errors: the max number of errors, up to 3
+ *
+ * Sets the number of errors allowed when matching a key, for the queries
+ * started afterwards. See #DzlFuzzyIndex:max-errors.
+ */
+void
+dzl_fuzzy_index_set_max_errors (DzlFuzzyIndex *self,
+                                guint          max_errors)
+{
+  g_return_if_fail (DZL_IS_FUZZY_INDEX (self));
+  g_return_if_fail (max_errors <= DZL_FUZZY_INDEX_MAX_ERRORS);
+
+  if (self->max_errors != max_errors)
+    {
+      self->max_errors = max_errors;
+      g_object_notify_by_pspec (G_OBJECT (self), properties [PROP_MAX_ERRORS]);
+    }
+}
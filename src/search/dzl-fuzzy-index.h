@@ -49,6 +49,27 @@ void            dzl_fuzzy_index_query_async         (DzlFuzzyIndex        *self,
 GListModel     *dzl_fuzzy_index_query_finish        (DzlFuzzyIndex        *self,
                                                      GAsyncResult         *result,
                                                      GError              **error);
+void            dzl_fuzzy_index_query_refine_async  (DzlFuzzyIndex        *self,
+                                                     GListModel           *previous,
+                                                     const gchar          *query,
+                                                     guint                 max_matches,
+                                                     GCancellable         *cancellable,
+                                                     GAsyncReadyCallback   callback,
+                                                     gpointer              user_data);
+GListModel     *dzl_fuzzy_index_query_refine_finish (DzlFuzzyIndex        *self,
+                                                     GAsyncResult         *result,
+                                                     GError              **error);
+void            dzl_fuzzy_index_add_delta           (DzlFuzzyIndex        *self,
+                                                     DzlFuzzyIndex        *delta);
+void            dzl_fuzzy_index_compact_async       (DzlFuzzyIndex        *self,
+                                                     GFile                *file,
+                                                     gint                  io_priority,
+                                                     GCancellable         *cancellable,
+                                                     GAsyncReadyCallback   callback,
+                                                     gpointer              user_data);
+gboolean        dzl_fuzzy_index_compact_finish      (DzlFuzzyIndex        *self,
+                                                     GAsyncResult         *result,
+                                                     GError              **error);
 GVariant       *dzl_fuzzy_index_get_metadata        (DzlFuzzyIndex        *self,
                                                      const gchar          *key);
 guint32         dzl_fuzzy_index_get_metadata_uint32 (DzlFuzzyIndex        *self,
@@ -57,6 +78,15 @@ guint64         dzl_fuzzy_index_get_metadata_uint64 (DzlFuzzyIndex        *self,
                                                      const gchar          *key);
 const gchar    *dzl_fuzzy_index_get_metadata_string (DzlFuzzyIndex        *self,
                                                      const gchar          *key);
+guint64         dzl_fuzzy_index_get_cache_budget    (DzlFuzzyIndex        *self);
+void            dzl_fuzzy_index_set_cache_budget    (DzlFuzzyIndex        *self,
+                                                     guint64               cache_budget);
+gboolean        dzl_fuzzy_index_get_latest_wins     (DzlFuzzyIndex        *self);
+void            dzl_fuzzy_index_set_latest_wins     (DzlFuzzyIndex        *self,
+                                                     gboolean              latest_wins);
+guint           dzl_fuzzy_index_get_max_errors      (DzlFuzzyIndex        *self);
+void            dzl_fuzzy_index_set_max_errors      (DzlFuzzyIndex        *self,
+                                                     guint                 max_errors);
 
 G_END_DECLS
 
@@ -20,6 +20,7 @@
 #include <string.h>
 
 #include "search/dzl-fuzzy-mutable-index.h"
+#include "util/dzl-heap.h"
 
 /**
  * SECTION:dzl-fuzzy-mutable-index
@@ -38,7 +39,18 @@
  * It is a programming error to modify #Fuzzy while holding onto an array
  * of #FuzzyMatch elements. The position of strings within the DzlFuzzyMutableIndexMatch
  * may no longer be valid.
+ *
+ * Removing a key only marks it as removed. Once enough keys have been
+ * removed, the index is compacted to reclaim the space they used. This
+ * can also be done explicitly with dzl_fuzzy_mutable_index_compact().
+ */
+
+/*
+ * Compact automatically once at least this many keys have been removed
+ * and they make up at least 1/COMPACT_RATIO of the index.
  */
+#define COMPACT_MIN_REMOVED 256
+#define COMPACT_RATIO       4
 
 G_DEFINE_BOXED_TYPE (DzlFuzzyMutableIndex, dzl_fuzzy_mutable_index,
                      (GBoxedCopyFunc)dzl_fuzzy_mutable_index_ref,
@@ -52,44 +64,165 @@ struct _DzlFuzzyMutableIndex
   GPtrArray      *id_to_value;
   GHashTable     *char_tables;
   GHashTable     *removed;
+  GHashTable     *key_to_id;
+  GArray         *id_to_next;
+  GDestroyNotify  free_func;
   guint           in_bulk_insert : 1;
   guint           case_sensitive : 1;
 };
 
-#pragma pack(push, 1)
 typedef struct
 {
   guint id;
-  guint pos : 16;
+  guint pos;
 } DzlFuzzyMutableIndexItem;
-#pragma pack(pop)
 
-G_STATIC_ASSERT (sizeof(DzlFuzzyMutableIndexItem) == 6);
+/*
+ * The posting list for a character. Items are sorted by (id, pos) and
+ * stored as varints. The id is stored as the delta from the previous
+ * item. The position is stored as the delta from the previous item if
+ * the id is unchanged, otherwise as is. Since ids are allocated in
+ * increasing order, new items are always appended to the end.
+ */
+typedef struct
+{
+  GByteArray *data;
+  guint       last_id;
+  guint       last_pos;
+} DzlFuzzyMutableIndexTable;
+
+/* Sequentially decodes the items of a DzlFuzzyMutableIndexTable */
+typedef struct
+{
+  const guint8             *pos;
+  const guint8             *end;
+  DzlFuzzyMutableIndexItem  item;
+  gboolean                  valid;
+} DzlFuzzyMutableIndexReader;
 
 typedef struct
 {
    DzlFuzzyMutableIndex        *fuzzy;
-   GArray      **tables;
-   gint         *state;
-   guint         n_tables;
-   gsize         max_matches;
-   const gchar  *needle;
-   GHashTable   *matches;
+   DzlFuzzyMutableIndexReader  *readers;
+   guint                        n_tables;
+   gsize                        max_matches;
+   const gchar                 *needle;
+   GHashTable                  *matches;
 } DzlFuzzyMutableIndexLookup;
 
-static gint
-dzl_fuzzy_mutable_index_item_compare (gconstpointer a,
-                                      gconstpointer b)
+static DzlFuzzyMutableIndexTable *
+dzl_fuzzy_mutable_index_table_new (void)
 {
-  gint ret;
+  DzlFuzzyMutableIndexTable *table;
 
-  const DzlFuzzyMutableIndexItem *fa = a;
-  const DzlFuzzyMutableIndexItem *fb = b;
+  table = g_slice_new0 (DzlFuzzyMutableIndexTable);
+  table->data = g_byte_array_new ();
 
-  if ((ret = fa->id - fb->id) == 0)
-    ret = fa->pos - fb->pos;
+  return table;
+}
 
-  return ret;
+static void
+dzl_fuzzy_mutable_index_table_free (DzlFuzzyMutableIndexTable *table)
+{
+  g_byte_array_unref (table->data);
+  g_slice_free (DzlFuzzyMutableIndexTable, table);
+}
+
+static inline void
+dzl_fuzzy_mutable_index_table_put_varint (DzlFuzzyMutableIndexTable *table,
+                                          guint                      value)
+{
+  guint8 buf[5];
+  guint len = 0;
+
+  while (value >= 0x80)
+    {
+      buf[len++] = (value & 0x7F) | 0x80;
+      value >>= 7;
+    }
+
+  buf[len++] = value;
+
+  g_byte_array_append (table->data, buf, len);
+}
+
+static void
+dzl_fuzzy_mutable_index_table_append (DzlFuzzyMutableIndexTable *table,
+                                      guint                      id,
+                                      guint                      pos)
+{
+  g_assert (table != NULL);
+  g_assert (id > table->last_id || (id == table->last_id && pos >= table->last_pos));
+
+  dzl_fuzzy_mutable_index_table_put_varint (table, id - table->last_id);
+
+  if (id == table->last_id)
+    dzl_fuzzy_mutable_index_table_put_varint (table, pos - table->last_pos);
+  else
+    dzl_fuzzy_mutable_index_table_put_varint (table, pos);
+
+  table->last_id = id;
+  table->last_pos = pos;
+}
+
+static inline guint
+dzl_fuzzy_mutable_index_reader_get_varint (DzlFuzzyMutableIndexReader *reader)
+{
+  guint value = 0;
+  guint shift = 0;
+
+  while (reader->pos < reader->end)
+    {
+      guint8 b = *reader->pos++;
+
+      value |= (guint)(b & 0x7F) << shift;
+
+      if ((b & 0x80) == 0)
+        break;
+
+      shift += 7;
+    }
+
+  return value;
+}
+
+static inline void
+dzl_fuzzy_mutable_index_reader_next (DzlFuzzyMutableIndexReader *reader)
+{
+  guint delta;
+
+  if (reader->pos >= reader->end)
+    {
+      reader->valid = FALSE;
+      return;
+    }
+
+  delta = dzl_fuzzy_mutable_index_reader_get_varint (reader);
+
+  if (delta == 0)
+    {
+      reader->item.pos += dzl_fuzzy_mutable_index_reader_get_varint (reader);
+    }
+  else
+    {
+      reader->item.id += delta;
+      reader->item.pos = dzl_fuzzy_mutable_index_reader_get_varint (reader);
+    }
+
+  reader->valid = TRUE;
+}
+
+static void
+dzl_fuzzy_mutable_index_reader_init (DzlFuzzyMutableIndexReader *reader,
+                                     const GByteArray           *data)
+{
+  reader->pos = data->data;
+  reader->end = data->data + data->len;
+  reader->item.id = 0;
+  reader->item.pos = 0;
+  reader->valid = FALSE;
+
+  dzl_fuzzy_mutable_index_reader_next (reader);
 }
 
 static gint
@@ -137,9 +270,12 @@ dzl_fuzzy_mutable_index_new (gboolean case_sensitive)
   fuzzy->heap = g_byte_array_new ();
   fuzzy->id_to_value = g_ptr_array_new ();
   fuzzy->id_to_text_offset = g_array_new (FALSE, FALSE, sizeof (gsize));
-  fuzzy->char_tables = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_array_unref);
+  fuzzy->char_tables = g_hash_table_new_full (NULL, NULL, NULL,
+                                              (GDestroyNotify)dzl_fuzzy_mutable_index_table_free);
   fuzzy->case_sensitive = case_sensitive;
   fuzzy->removed = g_hash_table_new (g_direct_hash, g_direct_equal);
+  fuzzy->key_to_id = g_hash_table_new (NULL, NULL);
+  fuzzy->id_to_next = g_array_new (FALSE, FALSE, sizeof (guint));
 
   return fuzzy;
 }
@@ -162,6 +298,7 @@ dzl_fuzzy_mutable_index_set_free_func (DzlFuzzyMutableIndex *fuzzy,
 {
   g_return_if_fail (fuzzy);
 
+  fuzzy->free_func = free_func;
   g_ptr_array_set_free_func (fuzzy->id_to_value, free_func);
 }
 
@@ -181,6 +318,208 @@ dzl_fuzzy_mutable_index_heap_insert (DzlFuzzyMutableIndex *fuzzy,
   return ret;
 }
 
+/*
+ * Exact keys are found through @key_to_id, which maps the hash of a key
+ * to the most recently inserted id with that hash. The remaining ids with
+ * the same hash are chained through @id_to_next. Removed ids stay in the
+ * chain until the index is compacted.
+ */
+static void
+dzl_fuzzy_mutable_index_link_key (DzlFuzzyMutableIndex *fuzzy,
+                                  guint                 id,
+                                  const gchar          *key)
+{
+  gpointer hash = GUINT_TO_POINTER (g_str_hash (key));
+  gpointer head;
+  guint next = G_MAXUINT;
+
+  g_assert (fuzzy != NULL);
+  g_assert (id == fuzzy->id_to_next->len);
+
+  if (g_hash_table_lookup_extended (fuzzy->key_to_id, hash, NULL, &head))
+    next = GPOINTER_TO_UINT (head);
+
+  g_array_append_val (fuzzy->id_to_next, next);
+  g_hash_table_insert (fuzzy->key_to_id, hash, GUINT_TO_POINTER (id));
+}
+
+static inline const gchar *
+dzl_fuzzy_mutable_index_get_string (DzlFuzzyMutableIndex *fuzzy,
+                                    gint                  id)
+{
+  guint offset = g_array_index (fuzzy->id_to_text_offset, gsize, id);
+  return (const gchar *)&fuzzy->heap->data [offset];
+}
+
+/*
+ * Returns the first id after @id (or the first id if @id is G_MAXUINT)
+ * in the chain for @key that has not been removed, or G_MAXUINT.
+ */
+static guint
+dzl_fuzzy_mutable_index_next_key (DzlFuzzyMutableIndex *fuzzy,
+                                  const gchar          *key,
+                                  guint                 id)
+{
+  gpointer head;
+
+  g_assert (fuzzy != NULL);
+  g_assert (key != NULL);
+
+  if (id == G_MAXUINT)
+    {
+      if (!g_hash_table_lookup_extended (fuzzy->key_to_id,
+                                         GUINT_TO_POINTER (g_str_hash (key)),
+                                         NULL,
+                                         &head))
+        return G_MAXUINT;
+
+      id = GPOINTER_TO_UINT (head);
+    }
+  else
+    {
+      id = g_array_index (fuzzy->id_to_next, guint, id);
+    }
+
+  for (; id != G_MAXUINT; id = g_array_index (fuzzy->id_to_next, guint, id))
+    {
+      if (!g_hash_table_contains (fuzzy->removed, GUINT_TO_POINTER (id)) &&
+          strcmp (dzl_fuzzy_mutable_index_get_string (fuzzy, id), key) == 0)
+        break;
+    }
+
+  return id;
+}
+
+static gboolean
+dzl_fuzzy_mutable_index_compact_table (gpointer key,
+                                       gpointer value,
+                                       gpointer user_data)
+{
+  DzlFuzzyMutableIndexTable *table = value;
+  const guint *id_map = user_data;
+  DzlFuzzyMutableIndexReader reader;
+  GByteArray *old_data;
+
+  /* Re-encode the items of live keys using their new ids */
+  old_data = g_steal_pointer (&table->data);
+  table->data = g_byte_array_new ();
+  table->last_id = 0;
+  table->last_pos = 0;
+
+  for (dzl_fuzzy_mutable_index_reader_init (&reader, old_data);
+       reader.valid;
+       dzl_fuzzy_mutable_index_reader_next (&reader))
+    {
+      guint new_id = id_map [reader.item.id];
+
+      if (new_id != G_MAXUINT)
+        dzl_fuzzy_mutable_index_table_append (table, new_id, reader.item.pos);
+    }
+
+  g_byte_array_unref (old_data);
+
+  /* Drop tables that only contained removed keys */
+  return table->data->len == 0;
+}
+
+/**
+ * dzl_fuzzy_mutable_index_compact:
+ * @fuzzy: A #DzlFuzzyMutableIndex
+ *
+ * Reclaims the space used by keys that have been removed from @fuzzy.
+ *
+ * This happens automatically once enough keys have been removed, so you
+ * only need to call this if you want the space reclaimed immediately.
+ *
+ * The ids of the remaining keys may change, so any previously returned
+ * #DzlFuzzyMutableIndexMatch are no longer valid.
+ */
+void
+dzl_fuzzy_mutable_index_compact (DzlFuzzyMutableIndex *fuzzy)
+{
+  g_autofree guint *id_map = NULL;
+  guint n_ids;
+  guint n_live = 0;
+  gsize heap_len = 0;
+
+  g_return_if_fail (fuzzy != NULL);
+  g_return_if_fail (!fuzzy->in_bulk_insert);
+
+  if (g_hash_table_size (fuzzy->removed) == 0)
+    return;
+
+  n_ids = fuzzy->id_to_text_offset->len;
+  id_map = g_new (guint, MAX (1, n_ids));
+
+  /*
+   * Live keys keep their relative order, so every new id and heap offset
+   * is less than or equal to the old one and we can move them in place.
+   */
+  for (guint id = 0; id < n_ids; id++)
+    {
+      gpointer value = g_ptr_array_index (fuzzy->id_to_value, id);
+      gsize offset = g_array_index (fuzzy->id_to_text_offset, gsize, id);
+      const gchar *str = (const gchar *)&fuzzy->heap->data [offset];
+      gsize len = strlen (str) + 1;
+
+      if (g_hash_table_contains (fuzzy->removed, GUINT_TO_POINTER (id)))
+        {
+          id_map [id] = G_MAXUINT;
+
+          if (fuzzy->free_func != NULL && value != NULL)
+            fuzzy->free_func (value);
+
+          continue;
+        }
+
+      id_map [id] = n_live;
+
+      memmove (&fuzzy->heap->data [heap_len], str, len);
+      g_array_index (fuzzy->id_to_text_offset, gsize, n_live) = heap_len;
+      g_ptr_array_index (fuzzy->id_to_value, n_live) = value;
+
+      heap_len += len;
+      n_live++;
+    }
+
+  /* The tail now contains stale copies of moved values, don't free them */
+  g_ptr_array_set_free_func (fuzzy->id_to_value, NULL);
+  g_ptr_array_set_size (fuzzy->id_to_value, n_live);
+  g_ptr_array_set_free_func (fuzzy->id_to_value, fuzzy->free_func);
+
+  g_array_set_size (fuzzy->id_to_text_offset, n_live);
+  g_byte_array_set_size (fuzzy->heap, heap_len);
+
+  g_hash_table_foreach_remove (fuzzy->char_tables,
+                               dzl_fuzzy_mutable_index_compact_table,
+                               id_map);
+
+  g_hash_table_remove_all (fuzzy->removed);
+
+  /* Rebuild the exact key chains using the new ids */
+  g_hash_table_remove_all (fuzzy->key_to_id);
+  g_array_set_size (fuzzy->id_to_next, 0);
+  for (guint id = 0; id < n_live; id++)
+    dzl_fuzzy_mutable_index_link_key (fuzzy, id, dzl_fuzzy_mutable_index_get_string (fuzzy, id));
+}
+
+static void
+dzl_fuzzy_mutable_index_maybe_compact (DzlFuzzyMutableIndex *fuzzy)
+{
+  guint n_removed;
+
+  g_assert (fuzzy != NULL);
+
+  if (fuzzy->in_bulk_insert)
+    return;
+
+  n_removed = g_hash_table_size (fuzzy->removed);
+
+  if (n_removed >= COMPACT_MIN_REMOVED &&
+      n_removed >= fuzzy->id_to_text_offset->len / COMPACT_RATIO)
+    dzl_fuzzy_mutable_index_compact (fuzzy);
+}
+
 /**
  * dzl_fuzzy_mutable_index_begin_bulk_insert:
  * @fuzzy: (in): A #Fuzzy.
@@ -189,7 +528,7 @@ dzl_fuzzy_mutable_index_heap_insert (DzlFuzzyMutableIndex *fuzzy,
  * dzl_fuzzy_mutable_index_end_bulk_insert() has been called.
  *
  * This allows for inserting large numbers of strings and deferring
- * the final sort until dzl_fuzzy_mutable_index_end_bulk_insert().
+ * any compaction until dzl_fuzzy_mutable_index_end_bulk_insert().
  */
 void
 dzl_fuzzy_mutable_index_begin_bulk_insert (DzlFuzzyMutableIndex *fuzzy)
@@ -204,27 +543,17 @@ dzl_fuzzy_mutable_index_begin_bulk_insert (DzlFuzzyMutableIndex *fuzzy)
  * dzl_fuzzy_mutable_index_end_bulk_insert:
  * @fuzzy: (in): A #Fuzzy.
  *
- * Complete a bulk insert and resort the index.
+ * Complete a bulk insert, compacting the index if necessary.
  */
 void
 dzl_fuzzy_mutable_index_end_bulk_insert (DzlFuzzyMutableIndex *fuzzy)
 {
-   GHashTableIter iter;
-   gpointer key;
-   gpointer value;
-
    g_return_if_fail(fuzzy);
    g_return_if_fail(fuzzy->in_bulk_insert);
 
    fuzzy->in_bulk_insert = FALSE;
 
-   g_hash_table_iter_init (&iter, fuzzy->char_tables);
-
-   while (g_hash_table_iter_next (&iter, &key, &value)) {
-      GArray *table = value;
-
-      g_array_sort (table, dzl_fuzzy_mutable_index_item_compare);
-   }
+   dzl_fuzzy_mutable_index_maybe_compact (fuzzy);
 }
 
 /**
@@ -255,41 +584,29 @@ dzl_fuzzy_mutable_index_insert (DzlFuzzyMutableIndex *fuzzy,
   id = fuzzy->id_to_text_offset->len;
   g_array_append_val (fuzzy->id_to_text_offset, offset);
   g_ptr_array_add (fuzzy->id_to_value, value);
+  dzl_fuzzy_mutable_index_link_key (fuzzy, id, key);
 
   if (!fuzzy->case_sensitive)
     key = downcase;
 
+  /*
+   * Ids only ever increase, so appending keeps every table sorted and
+   * there is no need to resort after inserting.
+   */
   for (tmp = key; *tmp; tmp = g_utf8_next_char (tmp))
     {
       gunichar ch = g_utf8_get_char (tmp);
-      GArray *table;
-      DzlFuzzyMutableIndexItem item;
+      DzlFuzzyMutableIndexTable *table;
 
       table = g_hash_table_lookup (fuzzy->char_tables, GINT_TO_POINTER (ch));
 
       if (G_UNLIKELY (table == NULL))
         {
-          table = g_array_new (FALSE, FALSE, sizeof (DzlFuzzyMutableIndexItem));
+          table = dzl_fuzzy_mutable_index_table_new ();
           g_hash_table_insert (fuzzy->char_tables, GINT_TO_POINTER (ch), table);
         }
 
-      item.id = id;
-      item.pos = (guint)(gsize)(tmp - key);
-
-      g_array_append_val (table, item);
-    }
-
-  if (G_UNLIKELY (!fuzzy->in_bulk_insert))
-    {
-      for (tmp = key; *tmp; tmp = g_utf8_next_char (tmp))
-        {
-          GArray *table;
-          gunichar ch;
-
-          ch = g_utf8_get_char (tmp);
-          table = g_hash_table_lookup (fuzzy->char_tables, GINT_TO_POINTER (ch));
-          g_array_sort (table, dzl_fuzzy_mutable_index_item_compare);
-        }
+      dzl_fuzzy_mutable_index_table_append (table, id, (guint)(gsize)(tmp - key));
     }
 
   g_free (downcase);
@@ -325,28 +642,32 @@ dzl_fuzzy_mutable_index_unref (DzlFuzzyMutableIndex *fuzzy)
       g_hash_table_unref (fuzzy->removed);
       fuzzy->removed = NULL;
 
+      g_hash_table_unref (fuzzy->key_to_id);
+      fuzzy->key_to_id = NULL;
+
+      g_array_unref (fuzzy->id_to_next);
+      fuzzy->id_to_next = NULL;
+
       g_slice_free (DzlFuzzyMutableIndex, fuzzy);
     }
 }
 
 static gboolean
-dzl_fuzzy_mutable_index_do_match (DzlFuzzyMutableIndexLookup *lookup,
-                                  DzlFuzzyMutableIndexItem   *item,
-                                  guint                       table_index,
-                                  gint                        score)
+dzl_fuzzy_mutable_index_do_match (DzlFuzzyMutableIndexLookup     *lookup,
+                                  const DzlFuzzyMutableIndexItem *item,
+                                  guint                           table_index,
+                                  gint                            score)
 {
-  DzlFuzzyMutableIndexItem *iter;
+  DzlFuzzyMutableIndexReader *reader;
+  const DzlFuzzyMutableIndexItem *iter;
   gpointer key;
-  GArray *table;
-  gint *state;
   gint iter_score;
 
-  table = lookup->tables [table_index];
-  state = &lookup->state [table_index];
+  reader = &lookup->readers [table_index];
 
-  for (; state [0] < (gint)table->len; state [0]++)
+  for (; reader->valid; dzl_fuzzy_mutable_index_reader_next (reader))
     {
-      iter = &g_array_index (table, DzlFuzzyMutableIndexItem, state[0]);
+      iter = &reader->item;
 
       if ((iter->id < item->id) || ((iter->id == item->id) && (iter->pos <= item->pos)))
         continue;
@@ -374,12 +695,32 @@ dzl_fuzzy_mutable_index_do_match (DzlFuzzyMutableIndexLookup *lookup,
   return FALSE;
 }
 
-static inline const gchar *
-dzl_fuzzy_mutable_index_get_string (DzlFuzzyMutableIndex *fuzzy,
-                                    gint                  id)
+/*
+ * Adds @match to the results. If @heap is non-NULL, we only keep the best
+ * @max_matches results, with the worst of them at the top of the heap so
+ * that it can be replaced cheaply.
+ */
+static void
+dzl_fuzzy_mutable_index_collect (GArray                          *matches,
+                                 DzlHeap                         *heap,
+                                 gsize                            max_matches,
+                                 const DzlFuzzyMutableIndexMatch *match)
 {
-  guint offset = g_array_index (fuzzy->id_to_text_offset, gsize, id);
-  return (const gchar *)&fuzzy->heap->data [offset];
+  if (heap == NULL)
+    {
+      g_array_append_vals (matches, match, 1);
+      return;
+    }
+
+  if (heap->len == max_matches)
+    {
+      if (dzl_fuzzy_mutable_index_match_compare (match, &dzl_heap_peek (heap, DzlFuzzyMutableIndexMatch)) >= 0)
+        return;
+
+      dzl_heap_extract (heap, NULL);
+    }
+
+  dzl_heap_insert_vals (heap, match, 1);
 }
 
 /**
@@ -389,9 +730,8 @@ dzl_fuzzy_mutable_index_get_string (DzlFuzzyMutableIndex *fuzzy,
  * @max_matches: (in): The max number of matches to return.
  *
  * DzlFuzzyMutableIndex searches within @fuzzy for strings that fuzzy match @needle.
- * Only up to @max_matches will be returned.
- *
- * TODO: max_matches is not yet respected.
+ * Only up to @max_matches will be returned, sorted by score. If
+ * @max_matches is zero, all matches are returned in no particular order.
  *
  * Returns: (transfer full) (element-type DzlFuzzyMutableIndexMatch): A newly allocated
  *   #GArray containing #FuzzyMatch elements. This should be freed when
@@ -405,14 +745,14 @@ dzl_fuzzy_mutable_index_match (DzlFuzzyMutableIndex *fuzzy,
                                gsize                 max_matches)
 {
   DzlFuzzyMutableIndexLookup lookup = { 0 };
+  DzlFuzzyMutableIndexReader *root;
   DzlFuzzyMutableIndexMatch match;
-  DzlFuzzyMutableIndexItem *item;
   GHashTableIter iter;
   gpointer key;
   gpointer value;
   const gchar *tmp;
   GArray *matches = NULL;
-  GArray *root;
+  DzlHeap *heap = NULL;
   gchar *downcase = NULL;
   guint i;
 
@@ -422,6 +762,11 @@ dzl_fuzzy_mutable_index_match (DzlFuzzyMutableIndex *fuzzy,
 
   matches = g_array_new (FALSE, FALSE, sizeof (DzlFuzzyMutableIndexMatch));
 
+  /* Select the best max_matches with a bounded heap rather than sorting */
+  if (max_matches != 0)
+    heap = dzl_heap_new (sizeof (DzlFuzzyMutableIndexMatch),
+                         dzl_fuzzy_mutable_index_match_compare);
+
   if (!*needle)
     goto cleanup;
 
@@ -433,16 +778,15 @@ dzl_fuzzy_mutable_index_match (DzlFuzzyMutableIndex *fuzzy,
 
   lookup.fuzzy = fuzzy;
   lookup.n_tables = g_utf8_strlen (needle, -1);
-  lookup.state = g_new0 (gint, lookup.n_tables);
-  lookup.tables = g_new0 (GArray*, lookup.n_tables);
+  lookup.readers = g_new0 (DzlFuzzyMutableIndexReader, lookup.n_tables);
   lookup.needle = needle;
   lookup.max_matches = max_matches;
   lookup.matches = g_hash_table_new (NULL, NULL);
 
   for (i = 0, tmp = needle; *tmp; tmp = g_utf8_next_char (tmp))
     {
+      const DzlFuzzyMutableIndexTable *table;
       gunichar ch;
-      GArray *table;
 
       ch = g_utf8_get_char (tmp);
       table = g_hash_table_lookup (fuzzy->char_tables, GINT_TO_POINTER (ch));
@@ -450,19 +794,19 @@ dzl_fuzzy_mutable_index_match (DzlFuzzyMutableIndex *fuzzy,
       if (table == NULL)
         goto cleanup;
 
-      lookup.tables [i++] = table;
+      dzl_fuzzy_mutable_index_reader_init (&lookup.readers [i++], table->data);
     }
 
   g_assert (lookup.n_tables == i);
-  g_assert (lookup.tables [0] != NULL);
 
-  root = lookup.tables [0];
+  root = &lookup.readers [0];
 
   if (G_LIKELY (lookup.n_tables > 1))
     {
-      for (i = 0; i < root->len; i++)
+      for (; root->valid; dzl_fuzzy_mutable_index_reader_next (root))
         {
-          item = &g_array_index (root, DzlFuzzyMutableIndexItem, i);
+          const DzlFuzzyMutableIndexItem *item = &root->item;
+
           dzl_fuzzy_mutable_index_do_match (&lookup, item, 1, MIN (16, item->pos * 4));
         }
     }
@@ -470,21 +814,27 @@ dzl_fuzzy_mutable_index_match (DzlFuzzyMutableIndex *fuzzy,
     {
       guint last_id = G_MAXUINT;
 
-      for (i = 0; i < root->len; i++)
+      for (; root->valid; dzl_fuzzy_mutable_index_reader_next (root))
         {
-          item = &g_array_index (root, DzlFuzzyMutableIndexItem, i);
-          match.id = GPOINTER_TO_INT (item->id);
+          const DzlFuzzyMutableIndexItem *item = &root->item;
+
+          match.id = item->id;
           if (match.id != last_id)
             {
+              last_id = match.id;
+
+              /* Ignore keys that have a tombstone record. */
+              if (g_hash_table_contains (fuzzy->removed, GINT_TO_POINTER (item->id)))
+                continue;
+
               match.key = dzl_fuzzy_mutable_index_get_string (fuzzy, item->id);
               match.value = g_ptr_array_index (fuzzy->id_to_value, item->id);
               match.score = 1.0 / (strlen (match.key) + item->pos);
-              g_array_append_val (matches, match);
-              last_id = match.id;
+              dzl_fuzzy_mutable_index_collect (matches, heap, max_matches, &match);
             }
         }
 
-      goto cleanup;
+      goto finish;
     }
 
   g_hash_table_iter_init (&iter, lookup.matches);
@@ -500,140 +850,267 @@ dzl_fuzzy_mutable_index_match (DzlFuzzyMutableIndex *fuzzy,
       match.score = 1.0 / (strlen (match.key) + GPOINTER_TO_INT (value));
       match.value = g_ptr_array_index (fuzzy->id_to_value, match.id);
 
-      g_array_append_val (matches, match);
+      dzl_fuzzy_mutable_index_collect (matches, heap, max_matches, &match);
     }
 
-  /*
-   * TODO: We could be more clever here when inserting into the array
-   *       only if it is a lower score than the end or < max items.
-   */
-
-  if (max_matches != 0)
+finish:
+  if (heap != NULL)
     {
-      g_array_sort (matches, dzl_fuzzy_mutable_index_match_compare);
+      guint len = heap->len;
 
-      if (max_matches && (matches->len > max_matches))
-        g_array_set_size (matches, max_matches);
+      /* The heap yields the worst match first, so fill from the end */
+      g_array_set_size (matches, len);
+      while (len > 0)
+        dzl_heap_extract (heap, &g_array_index (matches, DzlFuzzyMutableIndexMatch, --len));
     }
 
 cleanup:
   g_free (downcase);
-  g_free (lookup.state);
-  g_free (lookup.tables);
+  g_free (lookup.readers);
   g_clear_pointer (&lookup.matches, g_hash_table_unref);
+  g_clear_pointer (&heap, dzl_heap_unref);
 
   return matches;
 }
 
+/**
+ * dzl_fuzzy_mutable_index_contains:
+ * @fuzzy: A #DzlFuzzyMutableIndex
+ * @key: the key to look for
+ *
+ * Checks if @key has been inserted into @fuzzy and not removed. Unlike
+ * dzl_fuzzy_mutable_index_match(), @key must match exactly.
+ *
+ * Returns: %TRUE if @fuzzy contains @key
+ */
 gboolean
 dzl_fuzzy_mutable_index_contains (DzlFuzzyMutableIndex *fuzzy,
                                   const gchar          *key)
 {
-  GArray *ar;
-  gboolean ret;
-
   g_return_val_if_fail (fuzzy != NULL, FALSE);
 
-  ar = dzl_fuzzy_mutable_index_match (fuzzy, key, 1);
-  ret = (ar != NULL) && (ar->len > 0);
-  g_clear_pointer (&ar, g_array_unref);
+  if (key == NULL || *key == '\0')
+    return FALSE;
 
-  return ret;
+  return dzl_fuzzy_mutable_index_next_key (fuzzy, key, G_MAXUINT) != G_MAXUINT;
 }
 
+/**
+ * dzl_fuzzy_mutable_index_remove:
+ * @fuzzy: A #DzlFuzzyMutableIndex
+ * @key: the key to remove
+ *
+ * Removes every item that was inserted with exactly @key.
+ */
 void
 dzl_fuzzy_mutable_index_remove (DzlFuzzyMutableIndex *fuzzy,
                                 const gchar          *key)
 {
-  GArray *ar;
+  guint id = G_MAXUINT;
 
   g_return_if_fail (fuzzy != NULL);
 
   if (!key || !*key)
     return;
 
-  ar = dzl_fuzzy_mutable_index_match (fuzzy, key, 1);
+  while (G_MAXUINT != (id = dzl_fuzzy_mutable_index_next_key (fuzzy, key, id)))
+    g_hash_table_insert (fuzzy->removed, GUINT_TO_POINTER (id), NULL);
 
-  if (ar != NULL && ar->len > 0)
-    {
-      for (guint i = 0; i < ar->len; i++)
-        {
-          const DzlFuzzyMutableIndexMatch *match = &g_array_index (ar, DzlFuzzyMutableIndexMatch, i);
+  dzl_fuzzy_mutable_index_maybe_compact (fuzzy);
+}
 
-          if (g_strcmp0 (match->key, key) == 0)
-            g_hash_table_insert (fuzzy->removed, GINT_TO_POINTER (match->id), NULL);
-        }
+static inline gunichar
+fuzzy_highlight_get_char (const gchar  *str,
+                          const gchar **next)
+{
+  if ((guchar)*str < 0x80)
+    {
+      *next = str + 1;
+      return (guchar)*str;
     }
 
-  g_clear_pointer (&ar, g_array_unref);
+  *next = g_utf8_next_char (str);
+
+  return g_utf8_get_char (str);
 }
 
-gchar *
-dzl_fuzzy_highlight (const gchar *str,
-                     const gchar *match,
-                     gboolean     case_sensitive)
+/*
+ * Finds the runs of @str which are matched by @match, appending them to
+ * @ranges as byte offsets. Consecutive matching characters are merged into
+ * a single range. If @skip_entities is set, the entities produced by
+ * g_markup_escape_text() for '&' and '\'' are never matched but do not
+ * interrupt a run either.
+ */
+static void
+dzl_fuzzy_highlight_internal (const gchar *str,
+                              const gchar *match,
+                              gboolean     case_sensitive,
+                              gboolean     skip_entities,
+                              GArray      *ranges)
 {
-  static const gchar *begin = "<b>";
-  static const gchar *end = "</b>";
-  GString *ret;
-  gunichar str_ch;
+  DzlFuzzyHighlightRange range;
+  const gchar *begin = str;
+  const gchar *run = NULL;
+  const gchar *match_next;
+  const gchar *next;
   gunichar match_ch;
-  gboolean element_open = FALSE;
+  gunichar match_folded;
 
-  if (str == NULL || match == NULL)
-    return g_strdup (str);
+  match_ch = fuzzy_highlight_get_char (match, &match_next);
+  match_folded = case_sensitive ? match_ch : g_unichar_tolower (match_ch);
 
-  ret = g_string_new (NULL);
-
-  for (; *str; str = g_utf8_next_char (str))
+  while (*str)
     {
-      str_ch = g_utf8_get_char (str);
-      match_ch = g_utf8_get_char (match);
+      gunichar str_ch;
 
-      if (str_ch == '&')
+      if (skip_entities && *str == '&')
         {
           if (0 == strncmp (str, "&amp;", 5))
             {
-              str += 4;
-              g_string_append (ret, "&amp;");
+              str += 5;
               continue;
             }
           else if (0 == strncmp (str, "&apos;", 6))
             {
-              str += 5;
-              g_string_append (ret, "&apos;");
+              str += 6;
               continue;
             }
         }
 
+      /* Once @match is exhausted, nothing else can be highlighted */
+      if (match_ch == 0 && run == NULL)
+        break;
+
+      str_ch = fuzzy_highlight_get_char (str, &next);
+
       if ((str_ch == match_ch) ||
-          (!case_sensitive && g_unichar_tolower (str_ch) == g_unichar_tolower (match_ch)))
+          (!case_sensitive && g_unichar_tolower (str_ch) == match_folded))
         {
-          if (!element_open)
-            {
-              g_string_append (ret, begin);
-              element_open = TRUE;
-            }
+          if (run == NULL)
+            run = str;
 
-          g_string_append_unichar (ret, str_ch);
-
-          /* TODO: We could seek to the next char and append in a batch. */
-          match = g_utf8_next_char (match);
+          match_ch = fuzzy_highlight_get_char (match_next, &match_next);
+          match_folded = case_sensitive ? match_ch : g_unichar_tolower (match_ch);
         }
-      else
+      else if (run != NULL)
         {
-          if (element_open)
-            {
-              g_string_append (ret, end);
-              element_open = FALSE;
-            }
-
-          g_string_append_unichar (ret, str_ch);
+          range.begin = run - begin;
+          range.end = str - begin;
+          g_array_append_val (ranges, range);
+          run = NULL;
         }
+
+      str = next;
+    }
+
+  if (run != NULL)
+    {
+      range.begin = run - begin;
+      range.end = str - begin;
+      g_array_append_val (ranges, range);
+    }
+}
+
+/**
+ * dzl_fuzzy_highlight_ranges:
+ * @str: the string to highlight
+ * @match: the query that matched @str
+ * @case_sensitive: if the match was case sensitive
+ * @ranges: (element-type DzlFuzzyHighlightRange): a #GArray to append to
+ *
+ * Appends the ranges of @str that were matched by @match to @ranges, as
+ * #DzlFuzzyHighlightRange. Unlike dzl_fuzzy_highlight(), @str is plain
+ * text rather than markup, and @ranges may be reused for many strings to
+ * avoid allocations.
+ */
+void
+dzl_fuzzy_highlight_ranges (const gchar *str,
+                            const gchar *match,
+                            gboolean     case_sensitive,
+                            GArray      *ranges)
+{
+  g_return_if_fail (ranges != NULL);
+  g_return_if_fail (g_array_get_element_size (ranges) == sizeof (DzlFuzzyHighlightRange));
+
+  if (str == NULL || match == NULL)
+    return;
+
+  dzl_fuzzy_highlight_internal (str, match, case_sensitive, FALSE, ranges);
+}
+
+/**
+ * dzl_fuzzy_highlight_attrs:
+ * @str: the string to highlight
+ * @match: the query that matched @str
+ * @case_sensitive: if the match was case sensitive
+ * @attrs: a #PangoAttrList
+ *
+ * Inserts bold attributes into @attrs for the ranges of @str that were
+ * matched by @match. This can be used with a #GtkLabel or
+ * #GtkCellRendererText displaying @str as plain text, which avoids
+ * generating and then parsing markup as with dzl_fuzzy_highlight().
+ */
+void
+dzl_fuzzy_highlight_attrs (const gchar   *str,
+                           const gchar   *match,
+                           gboolean       case_sensitive,
+                           PangoAttrList *attrs)
+{
+  g_autoptr(GArray) ranges = NULL;
+
+  g_return_if_fail (attrs != NULL);
+
+  if (str == NULL || match == NULL)
+    return;
+
+  ranges = g_array_new (FALSE, FALSE, sizeof (DzlFuzzyHighlightRange));
+  dzl_fuzzy_highlight_internal (str, match, case_sensitive, FALSE, ranges);
+
+  for (guint i = 0; i < ranges->len; i++)
+    {
+      const DzlFuzzyHighlightRange *range = &g_array_index (ranges, DzlFuzzyHighlightRange, i);
+      PangoAttribute *attr;
+
+      attr = pango_attr_weight_new (PANGO_WEIGHT_BOLD);
+      attr->start_index = range->begin;
+      attr->end_index = range->end;
+      pango_attr_list_insert (attrs, attr);
+    }
+}
+
+gchar *
+dzl_fuzzy_highlight (const gchar *str,
+                     const gchar *match,
+                     gboolean     case_sensitive)
+{
+  static const gchar *begin = "<b>";
+  static const gchar *end = "</b>";
+  g_autoptr(GArray) ranges = NULL;
+  GString *ret;
+  guint pos = 0;
+
+  if (str == NULL || match == NULL)
+    return g_strdup (str);
+
+  ranges = g_array_new (FALSE, FALSE, sizeof (DzlFuzzyHighlightRange));
+  dzl_fuzzy_highlight_internal (str, match, case_sensitive, TRUE, ranges);
+
+  ret = g_string_sized_new (strlen (str) + (ranges->len * 7));
+
+  /* Copy everything between the highlighted runs in one go */
+  for (guint i = 0; i < ranges->len; i++)
+    {
+      const DzlFuzzyHighlightRange *range = &g_array_index (ranges, DzlFuzzyHighlightRange, i);
+
+      g_string_append_len (ret, str + pos, range->begin - pos);
+      g_string_append (ret, begin);
+      g_string_append_len (ret, str + range->begin, range->end - range->begin);
+      g_string_append (ret, end);
+
+      pos = range->end;
     }
 
-  if (element_open)
-    g_string_append (ret, end);
+  g_string_append (ret, str + pos);
 
   return g_string_free (ret, FALSE);
 }
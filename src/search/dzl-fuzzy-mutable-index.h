@@ -20,6 +20,7 @@
 #define DZL_FUZZY_MUTABLE_INDEX_H
 
 #include <glib-object.h>
+#include <pango/pango.h>
 
 G_BEGIN_DECLS
 
@@ -35,6 +36,21 @@ typedef struct
    guint        id;
 } DzlFuzzyMutableIndexMatch;
 
+/**
+ * DzlFuzzyHighlightRange:
+ * @begin: the byte offset of the first matched character
+ * @end: the byte offset just after the last matched character
+ *
+ * A run of consecutive characters of a string which were matched by a
+ * query, as found by dzl_fuzzy_highlight_ranges(). The offsets are in
+ * bytes, so they can be used directly with #PangoAttribute.
+ */
+typedef struct
+{
+   guint begin;
+   guint end;
+} DzlFuzzyHighlightRange;
+
 GType                     dzl_fuzzy_mutable_index_get_type           (void);
 DzlFuzzyMutableIndex     *dzl_fuzzy_mutable_index_new                (gboolean              case_sensitive);
 DzlFuzzyMutableIndex     *dzl_fuzzy_mutable_index_new_with_free_func (gboolean              case_sensitive,
@@ -53,11 +69,20 @@ GArray                   *dzl_fuzzy_mutable_index_match              (DzlFuzzyMu
                                                                       gsize                 max_matches);
 void                      dzl_fuzzy_mutable_index_remove             (DzlFuzzyMutableIndex *fuzzy,
                                                                       const gchar          *key);
+void                      dzl_fuzzy_mutable_index_compact            (DzlFuzzyMutableIndex *fuzzy);
 DzlFuzzyMutableIndex     *dzl_fuzzy_mutable_index_ref                (DzlFuzzyMutableIndex *fuzzy);
 void                      dzl_fuzzy_mutable_index_unref              (DzlFuzzyMutableIndex *fuzzy);
 gchar                    *dzl_fuzzy_highlight                        (const gchar          *str,
                                                                       const gchar          *query,
                                                                       gboolean              case_sensitive);
+void                      dzl_fuzzy_highlight_ranges                 (const gchar          *str,
+                                                                      const gchar          *query,
+                                                                      gboolean              case_sensitive,
+                                                                      GArray               *ranges);
+void                      dzl_fuzzy_highlight_attrs                  (const gchar          *str,
+                                                                      const gchar          *query,
+                                                                      gboolean              case_sensitive,
+                                                                      PangoAttrList        *attrs);
 
 G_END_DECLS
 
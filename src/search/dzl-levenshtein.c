@@ -17,89 +17,461 @@
  */
 
 #include <glib.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "dzl-levenshtein.h"
+
+/*
+ * The distance is calculated with the bit-parallel algorithm by Myers, as
+ * formulated for edit distance by Hyyrö. Each bit of a 64-bit word
+ * represents a character of the needle, so a whole column of the classic
+ * dynamic programming matrix is advanced per character of the haystack.
+ * Needles longer than 64 characters are split into blocks of 64 which
+ * pass the horizontal delta from one block to the next.
+ */
+
+#define BLOCK_BITS 64
+#define N_ASCII    128
+
+typedef struct
+{
+   gunichar ch;
+   guint    index;
+} PeqEntry;
+
+/*
+ * The match masks of the needle. For every character in the needle, bit
+ * i of block b is set if character (b * 64 + i) of the needle is that
+ * character. ASCII characters are looked up directly, anything else by
+ * binary search over the sorted entries.
+ */
+typedef struct
+{
+   guint     n_chars;
+   guint     n_blocks;
+   guint     n_other;
+   guint64  *ascii;
+   guint64  *other;
+   PeqEntry *entries;
+   guint64  *pv;
+   guint64  *mv;
+
+   /* Storage for needles that fit in a single block */
+   guint64   ascii_single[N_ASCII];
+   guint64   other_single[BLOCK_BITS];
+   PeqEntry  entries_single[BLOCK_BITS];
+} Peq;
+
+static gint
+peq_entry_compare (gconstpointer a,
+                   gconstpointer b)
+{
+   const PeqEntry *entry_a = a;
+   const PeqEntry *entry_b = b;
+
+   if (entry_a->ch < entry_b->ch) {
+      return -1;
+   } else if (entry_a->ch > entry_b->ch) {
+      return 1;
+   }
+
+   return 0;
+}
+
+static inline gunichar
+next_char (const gchar **str)
+{
+   const gchar *s = *str;
+   gunichar ch;
+
+   if ((guchar)*s < 0x80) {
+      *str = s + 1;
+      return (guchar)*s;
+   }
+
+   ch = g_utf8_get_char(s);
+   *str = g_utf8_next_char(s);
+
+   return ch;
+}
+
+static inline gint
+utf8_strlen (const gchar *str)
+{
+   gint len = 0;
+
+   /* Count everything but continuation bytes */
+   for (; *str; str++) {
+      len += ((guchar)*str & 0xC0) != 0x80;
+   }
+
+   return len;
+}
+
+/**
+ * peq_init:
+ * @peq: A #Peq.
+ * @needle: the needle.
+ *
+ * Builds the match masks for @needle. Only needles longer than 64
+ * characters require allocations, which are released with peq_clear().
+ */
+static void
+peq_init (Peq         *peq,
+          const gchar *needle)
+{
+   const gchar *s;
+   guint n_entries = 0;
+   guint i;
+
+   peq->n_chars = utf8_strlen(needle);
+   peq->n_blocks = MAX(1, (peq->n_chars + BLOCK_BITS - 1) / BLOCK_BITS);
+   peq->n_other = 0;
+
+   if (peq->n_blocks == 1) {
+      memset(peq->ascii_single, 0, sizeof peq->ascii_single);
+      peq->ascii = peq->ascii_single;
+      peq->other = peq->other_single;
+      peq->entries = peq->entries_single;
+      peq->pv = NULL;
+      peq->mv = NULL;
+   } else {
+      peq->ascii = g_new0(guint64, N_ASCII * peq->n_blocks);
+      peq->other = g_new0(guint64, peq->n_chars * peq->n_blocks);
+      peq->entries = g_new(PeqEntry, peq->n_chars);
+      peq->pv = g_new(guint64, peq->n_blocks);
+      peq->mv = g_new(guint64, peq->n_blocks);
+   }
+
+   /* Collect the non-ASCII characters, deduplicated after sorting */
+   for (s = needle, i = 0; *s; i++) {
+      gunichar ch = next_char(&s);
+
+      if (ch < N_ASCII) {
+         peq->ascii[ch * peq->n_blocks + i / BLOCK_BITS] |= G_GUINT64_CONSTANT(1) << (i % BLOCK_BITS);
+      } else {
+         peq->entries[n_entries].ch = ch;
+         peq->entries[n_entries].index = i;
+         n_entries++;
+      }
+   }
+
+   if (n_entries == 0) {
+      return;
+   }
+
+   qsort(peq->entries, n_entries, sizeof(PeqEntry), peq_entry_compare);
+
+   for (i = 0; i < n_entries; i++) {
+      const PeqEntry *entry = &peq->entries[i];
+      guint64 *masks;
+
+      if (peq->n_other == 0 || peq->entries[peq->n_other - 1].ch != entry->ch) {
+         peq->entries[peq->n_other].ch = entry->ch;
+         peq->n_other++;
+         memset(&peq->other[(peq->n_other - 1) * peq->n_blocks], 0, sizeof(guint64) * peq->n_blocks);
+      }
+
+      masks = &peq->other[(peq->n_other - 1) * peq->n_blocks];
+      masks[entry->index / BLOCK_BITS] |= G_GUINT64_CONSTANT(1) << (entry->index % BLOCK_BITS);
+   }
+}
+
+static void
+peq_clear (Peq *peq)
+{
+   if (peq->n_blocks > 1) {
+      g_free(peq->ascii);
+      g_free(peq->other);
+      g_free(peq->entries);
+      g_free(peq->pv);
+      g_free(peq->mv);
+   }
+}
+
+/**
+ * peq_lookup:
+ * @peq: A #Peq.
+ * @ch: a character of the haystack.
+ *
+ * Returns: the masks for @ch, one per block, or %NULL if @ch does not
+ *   appear in the needle.
+ */
+static inline const guint64 *
+peq_lookup (const Peq *peq,
+            gunichar   ch)
+{
+   guint lo = 0;
+   guint hi = peq->n_other;
+
+   if (ch < N_ASCII) {
+      return &peq->ascii[ch * peq->n_blocks];
+   }
+
+   while (lo < hi) {
+      guint mid = (lo + hi) / 2;
+
+      if (peq->entries[mid].ch < ch) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+
+   if (lo < peq->n_other && peq->entries[lo].ch == ch) {
+      return &peq->other[lo * peq->n_blocks];
+   }
+
+   return NULL;
+}
+
+/**
+ * advance_block:
+ * @pv: the positive vertical deltas of the block.
+ * @mv: the negative vertical deltas of the block.
+ * @eq: the match mask of the block for the current character.
+ * @hin: the horizontal delta entering the block from above.
+ * @high: the bit of the last row of the block.
+ *
+ * Advances a block by a single column.
+ *
+ * Returns: the horizontal delta leaving the last row of the block.
+ */
+static inline gint
+advance_block (guint64 *pv,
+               guint64 *mv,
+               guint64  eq,
+               gint     hin,
+               guint64  high)
+{
+   guint64 xv;
+   guint64 xh;
+   guint64 ph;
+   guint64 mh;
+   gint hout = 0;
+
+   xv = eq | *mv;
+
+   if (hin < 0) {
+      eq |= 1;
+   }
+
+   xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+   ph = *mv | ~(xh | *pv);
+   mh = *pv & xh;
+
+   if (ph & high) {
+      hout = 1;
+   } else if (mh & high) {
+      hout = -1;
+   }
+
+   ph <<= 1;
+   mh <<= 1;
+
+   if (hin < 0) {
+      mh |= 1;
+   } else if (hin > 0) {
+      ph |= 1;
+   }
+
+   *pv = mh | ~(xv | ph);
+   *mv = ph & xv;
+
+   return hout;
+}
+
+/**
+ * levenshtein_peq:
+ * @peq: the prepared needle.
+ * @haystack: the haystack.
+ * @max_distance: the largest distance of interest, or -1.
+ *
+ * Calculates the distance between the needle described by @peq and
+ * @haystack. Since the distance in the last row can drop by at most one
+ * per remaining character, we stop as soon as it can no longer come
+ * back within @max_distance.
+ *
+ * Returns: the distance, or %G_MAXINT if larger than @max_distance.
+ */
+static gint
+levenshtein_peq (Peq         *peq,
+                 const gchar *haystack,
+                 gint         max_distance)
+{
+   const gchar *s = haystack;
+   gint remaining;
+   gint score;
+   guint b;
+
+   if (max_distance < 0) {
+      max_distance = G_MAXINT;
+   }
+
+   remaining = utf8_strlen(haystack);
+   score = peq->n_chars;
+
+   if (ABS(score - remaining) > max_distance) {
+      return G_MAXINT;
+   }
+
+   if (peq->n_chars == 0) {
+      return remaining;
+   }
+
+   if (peq->n_blocks == 1) {
+      guint64 last = G_GUINT64_CONSTANT(1) << (peq->n_chars - 1);
+      guint64 pv = ~G_GUINT64_CONSTANT(0);
+      guint64 mv = 0;
+
+      while (*s) {
+         const guint64 *masks = peq_lookup(peq, next_char(&s));
+         guint64 eq = masks ? masks[0] : 0;
+         guint64 xv;
+         guint64 xh;
+         guint64 ph;
+         guint64 mh;
+
+         xv = eq | mv;
+         xh = (((eq & pv) + pv) ^ pv) | eq;
+         ph = mv | ~(xh | pv);
+         mh = pv & xh;
+
+         if (ph & last) {
+            score++;
+         } else if (mh & last) {
+            score--;
+         }
+
+         /* The first row grows by one per column */
+         ph = (ph << 1) | 1;
+         mh <<= 1;
+
+         pv = mh | ~(xv | ph);
+         mv = ph & xv;
+
+         if (score - --remaining > max_distance) {
+            return G_MAXINT;
+         }
+      }
+   } else {
+      guint64 last = G_GUINT64_CONSTANT(1) << ((peq->n_chars - 1) % BLOCK_BITS);
+      guint64 high = G_GUINT64_CONSTANT(1) << (BLOCK_BITS - 1);
+
+      for (b = 0; b < peq->n_blocks; b++) {
+         peq->pv[b] = ~G_GUINT64_CONSTANT(0);
+         peq->mv[b] = 0;
+      }
+
+      while (*s) {
+         const guint64 *masks = peq_lookup(peq, next_char(&s));
+         gint h = 1;
+
+         for (b = 0; b < peq->n_blocks; b++) {
+            h = advance_block(&peq->pv[b],
+                              &peq->mv[b],
+                              masks ? masks[b] : 0,
+                              h,
+                              b + 1 == peq->n_blocks ? last : high);
+         }
+
+         score += h;
+
+         if (score - --remaining > max_distance) {
+            return G_MAXINT;
+         }
+      }
+   }
+
+   return score <= max_distance ? score : G_MAXINT;
+}
+
+/**
+ * dzl_levenshtein:
+ * @needle: the needle
+ * @haystack: the haystack
+ *
+ * Calculates the Levenshtein distance between @needle and @haystack,
+ * counting unicode characters.
+ *
+ * Returns: the number of insertions, deletions and substitutions needed to
+ *   turn @needle into @haystack.
+ */
 gint
 dzl_levenshtein (const gchar *needle,
                  const gchar *haystack)
 {
-   const gchar *s;
-   const gchar *t;
-   gunichar sc;
-   gunichar tc;
-   gint *v0;
-   gint *v1;
-   gint haystack_char_len;
-   gint cost;
-   gint i;
-   gint j;
+   return dzl_levenshtein_bounded(needle, haystack, -1);
+}
+
+/**
+ * dzl_levenshtein_bounded:
+ * @needle: the needle
+ * @haystack: the haystack
+ * @max_distance: the largest distance of interest, or -1 for no limit
+ *
+ * Like dzl_levenshtein(), but gives up as soon as the distance is known to
+ * be larger than @max_distance, which is much faster for dissimilar
+ * strings.
+ *
+ * Returns: the distance, or %G_MAXINT if it is larger than @max_distance.
+ */
+gint
+dzl_levenshtein_bounded (const gchar *needle,
+                         const gchar *haystack,
+                         gint         max_distance)
+{
+   Peq peq;
    gint ret;
 
    g_return_val_if_fail (needle, G_MAXINT);
    g_return_val_if_fail (haystack, G_MAXINT);
 
-   /*
-    * Handle degenerate cases.
-    */
    if (!g_strcmp0(needle, haystack)) {
       return 0;
-   } else if (!*needle) {
-      return g_utf8_strlen(haystack, -1);
-   } else if (!*haystack) {
-      return g_utf8_strlen(needle, -1);
-   }
-
-   haystack_char_len = g_utf8_strlen (haystack, -1);
-
-   /*
-    * Create two vectors to hold our states.
-    */
-   v0 = g_new0(int, haystack_char_len + 1);
-   v1 = g_new0(int, haystack_char_len + 1);
-
-   /*
-    * initialize v0 (the previous row of distances).
-    * this row is A[0][i]: edit distance for an empty needle.
-    * the distance is just the number of characters to delete from haystack.
-    */
-   for (i = 0; i < haystack_char_len + 1; i++) {
-      v0[i] = i;
-   }
-
-   for (i = 0, s = needle; s && *s; i++, s = g_utf8_next_char(s)) {
-      /*
-       * Calculate v1 (current row distances) from the previous row v0.
-       */
-
-      sc = g_utf8_get_char(s);
-
-      /*
-       * first element of v1 is A[i+1][0]
-       *
-       * edit distance is delete (i+1) chars from needle to match empty
-       * haystack.
-       */
-      v1[0] = i + 1;
-
-      /*
-       * use formula to fill in the rest of the row.
-       */
-      for (j = 0, t = haystack; t && *t; j++, t = g_utf8_next_char(t)) {
-         tc = g_utf8_get_char(t);
-         cost = (sc == tc) ? 0 : 1;
-         v1[j+1] = MIN(v1[j] + 1, MIN(v0[j+1] + 1, v0[j] + cost));
-      }
-
-      /*
-       * copy v1 (current row) to v0 (previous row) for next iteration.
-       */
-      memcpy(v0, v1, sizeof(gint) * haystack_char_len);
    }
 
-   ret = v1[haystack_char_len];
-
-   g_free(v0);
-   g_free(v1);
+   peq_init(&peq, needle);
+   ret = levenshtein_peq(&peq, haystack, max_distance);
+   peq_clear(&peq);
 
    return ret;
 }
+
+/**
+ * dzl_levenshtein_many:
+ * @needle: the needle
+ * @haystacks: (array length=n_haystacks): the haystacks
+ * @n_haystacks: the number of elements in @haystacks
+ * @max_distance: the largest distance of interest, or -1 for no limit
+ * @distances: (array length=n_haystacks) (out caller-allocates): the
+ *   location for the distances
+ *
+ * Calculates dzl_levenshtein_bounded() between @needle and each of
+ * @haystacks, storing the result in the same position of @distances.
+ * The needle is only prepared once, making this cheaper than scoring each
+ * haystack separately.
+ */
+void
+dzl_levenshtein_many (const gchar         *needle,
+                      const gchar * const *haystacks,
+                      guint                n_haystacks,
+                      gint                 max_distance,
+                      gint                *distances)
+{
+   Peq peq;
+   guint i;
+
+   g_return_if_fail (needle);
+   g_return_if_fail (haystacks || !n_haystacks);
+   g_return_if_fail (distances || !n_haystacks);
+
+   peq_init(&peq, needle);
+
+   for (i = 0; i < n_haystacks; i++) {
+      distances[i] = levenshtein_peq(&peq, haystacks[i], max_distance);
+   }
+
+   peq_clear(&peq);
+}
@@ -23,8 +23,16 @@
 
 G_BEGIN_DECLS
 
-gint dzl_levenshtein (const gchar *needle,
-                      const gchar *haystack);
+gint dzl_levenshtein         (const gchar         *needle,
+                              const gchar         *haystack);
+gint dzl_levenshtein_bounded (const gchar         *needle,
+                              const gchar         *haystack,
+                              gint                 max_distance);
+void dzl_levenshtein_many    (const gchar         *needle,
+                              const gchar * const *haystacks,
+                              guint                n_haystacks,
+                              gint                 max_distance,
+                              gint                *distances);
 
 G_END_DECLS
 
@@ -18,9 +18,6 @@
 
 #define G_LOG_DOMAIN "dzl-pattern-spec"
 
-#ifndef _GNU_SOURCE
-# define _GNU_SOURCE
-#endif
 #include <string.h>
 
 #include "dzl-pattern-spec.h"
@@ -36,29 +33,65 @@ G_DEFINE_BOXED_TYPE (DzlPatternSpec, dzl_pattern_spec, dzl_pattern_spec_ref, dzl
  * It tries to mtach word boundaries, but with matching partial words up
  * to those boundaries. For example, "gtk widg" would match "gtk_widget_show".
  * Word boundaries include '_' and ' '. If any character is uppercase, then
- * case sensitivity is used.
+ * case sensitivity is used, otherwise text is compared after casefolding.
+ *
+ * The needle is prepared when creating the #DzlPatternSpec, so it is
+ * cheaper to reuse one for many haystacks, such as with
+ * dzl_pattern_spec_match_many().
  */
 
+/*
+ * Each space separated part of the needle is compiled once into a
+ * casefolded string (unless the search is case sensitive) along with a
+ * Horspool skip table, so matching never has to fold the needle again and
+ * can skip over most of the haystack.
+ */
+typedef struct
+{
+  gchar  *text;
+  gsize   len;
+  guint8  shift[256];
+} DzlPatternSpecPart;
+
 struct _DzlPatternSpec
 {
-  volatile gint   ref_count;
-  gchar          *needle;
-  gchar         **parts;
-  guint           case_sensitive : 1;
+  volatile gint       ref_count;
+  gchar              *needle;
+  DzlPatternSpecPart *parts;
+  guint               n_parts;
+  guint               case_sensitive : 1;
 };
 
+static void
+dzl_pattern_spec_part_init (DzlPatternSpecPart *part,
+                            gchar              *text)
+{
+  const guchar *utext = (const guchar *)text;
+  guint8 max_shift;
+
+  part->text = text;
+  part->len = strlen (text);
+
+  /* Capping the shift keeps it safe, it only means skipping less */
+  max_shift = MIN (part->len, G_MAXUINT8);
+  memset (part->shift, max_shift, sizeof part->shift);
+
+  for (gsize i = 0; i + 1 < part->len; i++)
+    part->shift[utext[i]] = MIN (part->len - 1 - i, G_MAXUINT8);
+}
+
 DzlPatternSpec *
 dzl_pattern_spec_new (const gchar *needle)
 {
   DzlPatternSpec *self;
   const gchar *tmp;
+  gchar **parts;
 
   g_return_val_if_fail (needle, NULL);
 
   self = g_new0 (DzlPatternSpec, 1);
   self->ref_count = 1;
   self->needle = g_strdup (needle);
-  self->parts = g_strsplit (needle, " ", 0);
   self->case_sensitive = FALSE;
 
   for (tmp = needle; *tmp; tmp = g_utf8_next_char (tmp))
@@ -70,6 +103,22 @@ dzl_pattern_spec_new (const gchar *needle)
         }
     }
 
+  parts = g_strsplit (needle, " ", 0);
+  self->parts = g_new0 (DzlPatternSpecPart, g_strv_length (parts));
+
+  /* Empty parts (from repeated spaces) never affect the result */
+  for (guint i = 0; parts[i] != NULL; i++)
+    {
+      if (parts[i][0] == '\0')
+        continue;
+
+      dzl_pattern_spec_part_init (&self->parts[self->n_parts++],
+                                  self->case_sensitive ? g_strdup (parts[i])
+                                                       : g_utf8_casefold (parts[i], -1));
+    }
+
+  g_strfreev (parts);
+
   return self;
 }
 
@@ -84,7 +133,9 @@ dzl_pattern_spec_get_text (DzlPatternSpec *self)
 static void
 dzl_pattern_spec_free (DzlPatternSpec *self)
 {
-  g_strfreev (self->parts);
+  for (guint i = 0; i < self->n_parts; i++)
+    g_free (self->parts[i].text);
+  g_free (self->parts);
   g_free (self->needle);
   g_free (self);
 }
@@ -121,35 +172,155 @@ next_word_start (const gchar *haystack)
   return haystack;
 }
 
-gboolean
-dzl_pattern_spec_match (DzlPatternSpec *self,
-                        const gchar    *haystack)
+static inline guchar
+fold_ascii (guchar   ch,
+            gboolean fold)
 {
-  gsize i;
+  return (fold && ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+}
 
-  g_return_val_if_fail (self, FALSE);
-  g_return_val_if_fail (haystack, FALSE);
+/*
+ * Finds @part within the first @len bytes of @haystack using Horspool's
+ * algorithm. If @fold is set, ASCII letters of @haystack are lowered as
+ * they are read, which matches casefolding for ASCII text.
+ */
+static const gchar *
+dzl_pattern_spec_part_find (const DzlPatternSpecPart *part,
+                            const gchar              *haystack,
+                            gsize                     len,
+                            gboolean                  fold)
+{
+  const guchar *h = (const guchar *)haystack;
+  const guchar *n = (const guchar *)part->text;
+  gsize m = part->len;
+  gsize pos = 0;
 
-  for (i = 0; (haystack != NULL) && self->parts [i]; i++)
+  if (m > len)
+    return NULL;
+
+  while (pos <= len - m)
     {
-      if (self->parts [i][0] == '\0')
-        continue;
+      guchar last = fold_ascii (h[pos + m - 1], fold);
+
+      if (last == n[m - 1])
+        {
+          gsize i;
+
+          for (i = 0; i + 1 < m; i++)
+            {
+              if (fold_ascii (h[pos + i], fold) != n[i])
+                break;
+            }
+
+          if (i + 1 >= m)
+            return haystack + pos;
+        }
+
+      pos += part->shift[last];
+    }
+
+  return NULL;
+}
 
-      if (self->case_sensitive)
-        haystack = strstr (haystack, self->parts [i]);
+static gboolean
+dzl_pattern_spec_match_internal (DzlPatternSpec *self,
+                                 const gchar    *haystack)
+{
+  g_autofree gchar *folded = NULL;
+  const gchar *end;
+  gboolean fold = FALSE;
+
+  if (self->n_parts == 0)
+    return TRUE;
+
+  if (!self->case_sensitive)
+    {
+      const gchar *iter;
+
+      /*
+       * ASCII text can be folded while searching. Anything else is
+       * casefolded up front since folding may change its length.
+       */
+      for (iter = haystack; *iter && !((guchar)*iter & 0x80); iter++) { }
+
+      if (*iter)
+        {
+          haystack = folded = g_utf8_casefold (haystack, -1);
+          end = haystack + strlen (haystack);
+        }
       else
-        haystack = strcasestr (haystack, self->parts [i]);
+        {
+          end = iter;
+          fold = TRUE;
+        }
+    }
+  else
+    end = haystack + strlen (haystack);
+
+  for (guint i = 0; i < self->n_parts; i++)
+    {
+      const DzlPatternSpecPart *part = &self->parts[i];
+
+      haystack = dzl_pattern_spec_part_find (part, haystack, end - haystack, fold);
 
       if (haystack == NULL)
         return FALSE;
 
-      if (self->parts [i + 1] != NULL)
-        haystack = next_word_start (haystack + strlen (self->parts [i]));
+      if (i + 1 < self->n_parts)
+        haystack = next_word_start (haystack + part->len);
     }
 
   return TRUE;
 }
 
+gboolean
+dzl_pattern_spec_match (DzlPatternSpec *self,
+                        const gchar    *haystack)
+{
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (haystack, FALSE);
+
+  return dzl_pattern_spec_match_internal (self, haystack);
+}
+
+/**
+ * dzl_pattern_spec_match_many:
+ * @self: a #DzlPatternSpec
+ * @haystacks: (array length=n_haystacks): the haystacks to match
+ * @n_haystacks: the number of elements in @haystacks
+ * @matches: (array length=n_haystacks) (out caller-allocates) (nullable):
+ *   a location for the result of each haystack, or %NULL
+ *
+ * Matches each of @haystacks against @self, like dzl_pattern_spec_match().
+ * %NULL elements of @haystacks never match.
+ *
+ * Returns: the number of haystacks that matched
+ */
+guint
+dzl_pattern_spec_match_many (DzlPatternSpec      *self,
+                             const gchar * const *haystacks,
+                             guint                n_haystacks,
+                             gboolean            *matches)
+{
+  guint count = 0;
+
+  g_return_val_if_fail (self, 0);
+  g_return_val_if_fail (haystacks || !n_haystacks, 0);
+
+  for (guint i = 0; i < n_haystacks; i++)
+    {
+      gboolean match;
+
+      match = haystacks[i] != NULL && dzl_pattern_spec_match_internal (self, haystacks[i]);
+      count += match;
+
+      if (matches != NULL)
+        matches[i] = match;
+    }
+
+  return count;
+}
+
 DzlPatternSpec *
 dzl_pattern_spec_ref (DzlPatternSpec *self)
 {
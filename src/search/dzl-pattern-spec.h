@@ -27,13 +27,17 @@ typedef struct _DzlPatternSpec DzlPatternSpec;
 
 #define DZL_TYPE_PATTERN_SPEC (dzl_pattern_spec_get_type())
 
-GType           dzl_pattern_spec_get_type (void);
-DzlPatternSpec *dzl_pattern_spec_new      (const gchar    *keywords);
-DzlPatternSpec *dzl_pattern_spec_ref      (DzlPatternSpec *self);
-void            dzl_pattern_spec_unref    (DzlPatternSpec *self);
-gboolean        dzl_pattern_spec_match    (DzlPatternSpec *self,
-                                           const gchar     *haystack);
-const gchar    *dzl_pattern_spec_get_text (DzlPatternSpec *self);
+GType           dzl_pattern_spec_get_type   (void);
+DzlPatternSpec *dzl_pattern_spec_new        (const gchar         *keywords);
+DzlPatternSpec *dzl_pattern_spec_ref        (DzlPatternSpec      *self);
+void            dzl_pattern_spec_unref      (DzlPatternSpec      *self);
+gboolean        dzl_pattern_spec_match      (DzlPatternSpec      *self,
+                                             const gchar         *haystack);
+guint           dzl_pattern_spec_match_many (DzlPatternSpec      *self,
+                                             const gchar * const *haystacks,
+                                             guint                n_haystacks,
+                                             gboolean            *matches);
+const gchar    *dzl_pattern_spec_get_text   (DzlPatternSpec      *self);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (DzlPatternSpec, dzl_pattern_spec_unref)
 
@@ -21,15 +21,7 @@
 #include <glib/gi18n.h>
 
 #include "dzl-trie.h"
-
-#if defined(__LP64__) || __WORDSIZE == 64
-#define TRIE_64 1
-#endif
-
-#define STATIC_ASSERT(a)                              \
-   G_STMT_START {                                     \
-      G_GNUC_UNUSED gchar static_assert[(a)? 0 : -1]; \
-   } G_STMT_END
+#include "util/dzl-heap.h"
 
 /**
  * SECTION:trie
@@ -43,435 +35,673 @@
  * To insert a key and value pair into the #DzlTrie use dzl_trie_insert().
  * To remove a key from the #DzlTrie use dzl_trie_remove().
  * To traverse all children of the #DzlTrie from a given key use dzl_trie_traverse().
+ *
+ * The trie is path compressed, so a chain of nodes with a single child is
+ * stored as one edge. All nodes live in a single arena and refer to each
+ * other by offset, which allows a trie to be written to disk with
+ * dzl_trie_save_to_file() and mapped back in, read-only, with
+ * dzl_trie_new_for_file() without parsing it.
+ *
+ * To walk the keys below a prefix in sorted order, a few at a time, use a
+ * #DzlTrieIter from dzl_trie_iter_new(). Keys may be inserted with a weight
+ * using dzl_trie_insert_with_weight(), and dzl_trie_iter_new_by_weight()
+ * then returns the heaviest keys below a prefix first, without visiting
+ * the parts of the tree that cannot contain them.
  */
 
-typedef struct _DzlTrieNode      DzlTrieNode;
-typedef struct _DzlTrieNodeChunk DzlTrieNodeChunk;
+typedef struct _DzlTrieArena  DzlTrieArena;
+typedef struct _DzlTrieHeader DzlTrieHeader;
+typedef struct _DzlTrieNode   DzlTrieNode;
 
 G_DEFINE_BOXED_TYPE (DzlTrie, dzl_trie, dzl_trie_ref, dzl_trie_unref)
 
+#define DZL_TRIE_MAGIC        0x5452445a
+#define DZL_TRIE_VERSION      2
+#define DZL_TRIE_NODE_ALIGN   8
+#define DZL_TRIE_MIN_CHILDREN 2
+
 /*
- * Try to optimize for 64 bit vs 32 bit pointers. We are assuming that the
- * 32 bit also has a 32 byte cacheline. This is very likely not the case
- * everwhere, such as x86_64 compiled with -m32. However, accomidating that
- * will require some changes to the layout of each chunk.
- */
-#ifdef TRIE_64
-#define FIRST_CHUNK_KEYS         4
-#define TRIE_NODE_SIZE          64
-#define TRIE_NODE_CHUNK_SIZE    64
-#define TRIE_NODE_CHUNK_KEYS(c) (((c)->is_inline) ? 4 : 6)
-#else
-#define FIRST_CHUNK_KEYS         3
-#define TRIE_NODE_SIZE          32
-#define TRIE_NODE_CHUNK_SIZE    32
-#define TRIE_NODE_CHUNK_KEYS(c) (((c)->is_inline) ? 3 : 5)
-#endif
-
-/**
- * DzlTrieNodeChunk:
- * @flags: Flags describing behaviors of the DzlTrieNodeChunk.
- * @count: The number of items added to this chunk.
- * @keys: The keys for @children.
- * @next: The next #DzlTrieNodeChunk if there is one.
- * @children: The children #DzlTrieNodeChunk or %NULL. If the chunk is
- *   inline the DzlTrieNode, then there will be fewer items.
- */
-#pragma pack(push, 1)
-struct _DzlTrieNodeChunk
-{
-   DzlTrieNodeChunk *next;
-   gboolean          is_inline : 1;
-   guint             flags : 7;
-   guint             count : 8;
-   guint8            keys[6];
-   DzlTrieNode      *children[0];
+ * Number of unused bytes in the arena before we consider compacting it.
+ * We only compact when at least half of the arena is unused.
+ */
+#define COMPACT_MIN_GARBAGE   (64 * 1024)
+
+#define KEYS_SIZE(n)  (((n) + 3) & ~3)
+#define BLOCK_SIZE(n) (KEYS_SIZE(n) + ((n) * sizeof (guint32)))
+
+/**
+ * DzlTrieArena:
+ * @data: The arena contents.
+ * @len: The number of bytes used in @data.
+ * @allocated: The size of @data, or 0 if @data is not owned by the arena.
+ *
+ * A bump allocator that all nodes, labels and child arrays are allocated
+ * from. Allocations are addressed by offset so that they stay valid when
+ * @data is reallocated, and so that the arena can be written to disk as-is.
+ */
+struct _DzlTrieArena
+{
+   guint8 *data;
+   gsize   len;
+   gsize   allocated;
+};
+
+/**
+ * DzlTrieHeader:
+ * @magic: %DZL_TRIE_MAGIC, also used to detect byte order mismatches.
+ * @version: %DZL_TRIE_VERSION.
+ * @root: The offset of the root node.
+ * @length: The length of the file.
+ *
+ * The header is placed at the beginning of every arena, which also means
+ * that an offset of zero never refers to a node.
+ */
+struct _DzlTrieHeader
+{
+   guint32 magic;
+   guint32 version;
+   guint32 root;
+   guint32 length;
 };
-#pragma pack(pop)
 
 /**
  * DzlTrieNode:
- * @parent: The parent #DzlTrieNode. When a node is destroyed, it may need to
- *    walk up to the parent node and unlink itself.
- * @value: A pointer to the user provided value, or %NULL.
- * @chunk: The first chunk in the chain. Inline chunks have fewer children
- *    elements than extra allocated chunks so that they are cache aligned.
+ * @value: The user provided value, or 0.
+ * @label: The offset of the bytes of the edge leading to this node.
+ * @label_len: The number of bytes at @label.
+ * @children: The offset of the children block, or 0.
+ * @n_children: The number of children.
+ * @n_alloc: The capacity of the children block.
+ * @weight: The weight of @value.
+ * @max_weight: An upper bound of the weights at or below this node. This is
+ *   exact until keys are removed or their weight is lowered, and is made
+ *   exact again when the arena is compacted.
+ *
+ * The children block contains @n_alloc key bytes, which are the first byte
+ * of the label of each child in sorted order, padded to 4 bytes. They are
+ * followed by @n_alloc offsets of the children themselves. Keeping the keys
+ * together means finding a child only touches a single cacheline.
  */
-#pragma pack(push, 1)
 struct _DzlTrieNode
 {
-   DzlTrieNode      *parent;
-   gpointer          value;
-   DzlTrieNodeChunk  chunk;
+   guint64 value;
+   guint32 label;
+   guint32 label_len;
+   guint32 children;
+   guint16 n_children;
+   guint16 n_alloc;
+   guint32 weight;
+   guint32 max_weight;
 };
-#pragma pack(pop)
 
 /**
  * DzlTrie:
  * @value_destroy: A #GDestroyNotify to free data pointers.
- * @root: The root DzlTrieNode.
+ * @arena: The arena containing all nodes.
+ * @garbage: The number of bytes in @arena no longer in use.
+ * @root: The offset of the root node.
+ * @mapped: The #GMappedFile backing @arena, if loaded from disk.
  */
 struct _DzlTrie
 {
    volatile gint   ref_count;
    GDestroyNotify  value_destroy;
-   DzlTrieNode    *root;
+   DzlTrieArena    arena;
+   gsize           garbage;
+   guint32         root;
+   GMappedFile    *mapped;
 };
 
 /**
- * dzl_trie_malloc0:
- * @trie: A #DzlTrie
+ * dzl_trie_arena_alloc:
+ * @arena: A #DzlTrieArena.
  * @size: Number of bytes to allocate.
+ * @align: The alignment of the allocation, a power of two.
  *
- * Wrapper function to allocate a memory chunk. This gives us somewhere to
- * perform the abstraction if we want to use mmap()'d I/O at some point.
- * The memory will be zero'd before being returned.
+ * Allocates @size bytes at the end of @arena. The memory will be zero'd.
+ * Any pointers into @arena are invalid after calling this.
  *
- * Returns: A pointer to the allocation.
+ * Returns: The offset of the allocation.
  */
-static gpointer
-dzl_trie_malloc0 (DzlTrie *trie,
-                  gsize    size)
+static guint32
+dzl_trie_arena_alloc (DzlTrieArena *arena,
+                      gsize         size,
+                      gsize         align)
 {
-   return g_malloc0(size);
+   gsize offset;
+
+   g_assert(arena);
+   g_assert(align > 0 && (align & (align - 1)) == 0);
+
+   offset = (arena->len + align - 1) & ~(align - 1);
+
+   if (offset + size > G_MAXUINT32) {
+      g_error("DzlTrie cannot grow beyond 4 GiB");
+   }
+
+   if (offset + size > arena->allocated) {
+      gsize allocated = MAX(arena->allocated, 256);
+
+      while (allocated < offset + size) {
+         allocated *= 2;
+      }
+
+      arena->data = g_realloc(arena->data, allocated);
+      arena->allocated = allocated;
+   }
+
+   memset(&arena->data[arena->len], 0, offset + size - arena->len);
+   arena->len = offset + size;
+
+   return offset;
 }
 
 /**
- * dzl_trie_free:
- * @trie: A #DzlTrie.
- * @data: The data to free.
+ * dzl_trie_arena_init:
+ * @arena: A #DzlTrieArena.
  *
- * Frees a portion of memory allocated by @trie.
+ * Initializes @arena and reserves space for the header.
  */
 static void
-dzl_trie_free (DzlTrie  *trie,
-               gpointer  data)
+dzl_trie_arena_init (DzlTrieArena *arena)
+{
+   memset(arena, 0, sizeof *arena);
+   dzl_trie_arena_alloc(arena, sizeof(DzlTrieHeader), DZL_TRIE_NODE_ALIGN);
+}
+
+static inline DzlTrieNode *
+dzl_trie_node (const DzlTrieArena *arena,
+               guint32             offset)
 {
-   g_free(data);
+   return (DzlTrieNode *)(gpointer)&arena->data[offset];
+}
+
+static inline const guint8 *
+dzl_trie_node_label (const DzlTrieArena *arena,
+                     const DzlTrieNode  *node)
+{
+   return &arena->data[node->label];
+}
+
+static inline guint8 *
+dzl_trie_node_keys (const DzlTrieArena *arena,
+                    const DzlTrieNode  *node)
+{
+   return &arena->data[node->children];
+}
+
+static inline guint32 *
+dzl_trie_node_children (const DzlTrieArena *arena,
+                        const DzlTrieNode  *node)
+{
+   return (guint32 *)(gpointer)&arena->data[node->children + KEYS_SIZE(node->n_alloc)];
 }
 
 /**
  * dzl_trie_node_new:
- * @trie: A #DzlTrie.
- * @parent: The nodes parent or %NULL.
+ * @arena: A #DzlTrieArena.
+ * @label: The label of the edge leading to the node.
+ * @label_len: The length of @label.
  *
- * Create a new node that can be placed in a DzlTrie. The node contains a chunk
- * embedded in it that may contain only 4 pointers instead of the full 6 do
- * to the overhead of the DzlTrieNode itself.
+ * Creates a new node without children. @label is copied directly after
+ * the node so that both are likely to share a cacheline. @label must not
+ * point into @arena.
  *
- * Returns: A newly allocated DzlTrieNode that should be freed with g_free().
+ * Returns: The offset of the new node.
  */
-DzlTrieNode *
-dzl_trie_node_new (DzlTrie     *trie,
-                   DzlTrieNode *parent)
+static guint32
+dzl_trie_node_new (DzlTrieArena *arena,
+                   const gchar  *label,
+                   gsize         label_len)
 {
    DzlTrieNode *node;
+   guint32 offset;
+   guint32 label_offset;
+
+   g_assert(arena);
+   g_assert(label || !label_len);
 
-   node = dzl_trie_malloc0(trie, TRIE_NODE_SIZE);
-   node->chunk.is_inline = TRUE;
-   node->parent = parent;
-   return node;
+   offset = dzl_trie_arena_alloc(arena, sizeof(DzlTrieNode), DZL_TRIE_NODE_ALIGN);
+   label_offset = dzl_trie_arena_alloc(arena, label_len, 1);
+
+   if (label_len) {
+      memcpy(&arena->data[label_offset], label, label_len);
+   }
+
+   node = dzl_trie_node(arena, offset);
+   node->label = label_offset;
+   node->label_len = label_len;
+
+   return offset;
 }
 
 /**
- * dzl_trie_node_chunk_is_full:
- * @chunk: A #DzlTrieNodeChunk.
+ * dzl_trie_node_search:
+ * @arena: A #DzlTrieArena.
+ * @node: A #DzlTrieNode.
+ * @key: The first byte of the child's label.
+ * @found: (out): Whether a child for @key exists.
  *
- * Checks to see if all children slots are full in @chunk.
+ * Searches the sorted keys of @node for @key.
  *
- * Returns: %TRUE if there are no free slots in @chunk.
+ * Returns: The index of the child, or where it should be inserted.
  */
-G_INLINE_FUNC gboolean
-dzl_trie_node_chunk_is_full (DzlTrieNodeChunk *chunk)
+static inline guint
+dzl_trie_node_search (const DzlTrieArena *arena,
+                      const DzlTrieNode  *node,
+                      guint8              key,
+                      gboolean           *found)
 {
-   g_assert(chunk);
-   return (chunk->count == TRIE_NODE_CHUNK_KEYS(chunk));
+   const guint8 *keys = dzl_trie_node_keys(arena, node);
+   guint lo = 0;
+   guint hi = node->n_children;
+
+   while (lo < hi) {
+      guint mid = (lo + hi) / 2;
+
+      if (keys[mid] < key) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+
+   *found = (lo < node->n_children && keys[lo] == key);
+
+   return lo;
 }
 
 /**
- * dzl_trie_node_chunk_new:
- * @trie: The DzlTrie that the chunk belongs to.
- *
- * Creates a new #DzlTrieNodeChunk with empty state.
+ * dzl_trie_node_insert_child:
+ * @trie: A #DzlTrie.
+ * @offset: The offset of the parent node.
+ * @idx: The index to insert at, from dzl_trie_node_search().
+ * @key: The first byte of the child's label.
+ * @child: The offset of the child node.
  *
- * Returns: (transfer full): A #DzlTrieNodeChunk.
+ * Inserts @child into the children of the node at @offset, growing the
+ * children block if necessary. The previous block becomes garbage.
  */
-DzlTrieNodeChunk *
-dzl_trie_node_chunk_new (DzlTrie *trie)
+static void
+dzl_trie_node_insert_child (DzlTrie *trie,
+                            guint32  offset,
+                            guint    idx,
+                            guint8   key,
+                            guint32  child)
 {
-   return dzl_trie_malloc0(trie, TRIE_NODE_CHUNK_SIZE);
+   DzlTrieArena *arena = &trie->arena;
+   DzlTrieNode *node;
+   guint32 *children;
+   guint8 *keys;
+
+   node = dzl_trie_node(arena, offset);
+
+   g_assert(idx <= node->n_children);
+
+   if (node->n_children == node->n_alloc) {
+      guint n_alloc = MAX(DZL_TRIE_MIN_CHILDREN, node->n_alloc * 2);
+      guint32 block;
+
+      block = dzl_trie_arena_alloc(arena, BLOCK_SIZE(n_alloc), sizeof(guint32));
+      node = dzl_trie_node(arena, offset);
+
+      if (node->n_children) {
+         memcpy(&arena->data[block],
+                dzl_trie_node_keys(arena, node),
+                node->n_children);
+         memcpy(&arena->data[block + KEYS_SIZE(n_alloc)],
+                dzl_trie_node_children(arena, node),
+                node->n_children * sizeof(guint32));
+      }
+
+      trie->garbage += BLOCK_SIZE(node->n_alloc);
+
+      node->children = block;
+      node->n_alloc = n_alloc;
+   }
+
+   keys = dzl_trie_node_keys(arena, node);
+   children = dzl_trie_node_children(arena, node);
+
+   memmove(&keys[idx + 1], &keys[idx], node->n_children - idx);
+   memmove(&children[idx + 1], &children[idx], (node->n_children - idx) * sizeof(guint32));
+
+   keys[idx] = key;
+   children[idx] = child;
+   node->n_children++;
 }
 
 /**
- * dzl_trie_append_to_node:
- * @chunk: A #DzlTrieNodeChunk.
- * @key: The key to append.
- * @child: A #DzlTrieNode to append.
- *
- * Appends @child to the chunk. If there is not room in the chunk,
- * then a new chunk will be added and append to @chunk.
+ * dzl_trie_node_remove_child:
+ * @trie: A #DzlTrie.
+ * @offset: The offset of the parent node.
+ * @idx: The index of the child to remove.
  *
- * @chunk MUST be the last chunk in the chain (therefore chunk->next
- * is %NULL).
+ * Removes the child at @idx from the node at @offset. The child itself
+ * becomes garbage.
  */
 static void
-dzl_trie_append_to_node (DzlTrie          *trie,
-                         DzlTrieNode      *node,
-                         DzlTrieNodeChunk *chunk,
-                         guint8            key,
-                         DzlTrieNode      *child)
+dzl_trie_node_remove_child (DzlTrie *trie,
+                            guint32  offset,
+                            guint    idx)
 {
-   g_assert(trie);
-   g_assert(node);
-   g_assert(chunk);
-   g_assert(child);
+   DzlTrieArena *arena = &trie->arena;
+   DzlTrieNode *node;
+   DzlTrieNode *child;
+   guint32 *children;
+   guint8 *keys;
 
-   if (dzl_trie_node_chunk_is_full(chunk)) {
-      chunk->next = dzl_trie_node_chunk_new(trie);
-      chunk = chunk->next;
-   }
+   node = dzl_trie_node(arena, offset);
+
+   g_assert(idx < node->n_children);
+
+   keys = dzl_trie_node_keys(arena, node);
+   children = dzl_trie_node_children(arena, node);
+   child = dzl_trie_node(arena, children[idx]);
+
+   trie->garbage += sizeof(DzlTrieNode) + child->label_len + BLOCK_SIZE(child->n_alloc);
 
-   chunk->keys[chunk->count] = key;
-   chunk->children[chunk->count] = child;
-   chunk->count++;
+   node->n_children--;
+
+   memmove(&keys[idx], &keys[idx + 1], node->n_children - idx);
+   memmove(&children[idx], &children[idx + 1], (node->n_children - idx) * sizeof(guint32));
 }
 
 /**
- * dzl_trie_node_move_to_front:
- * @node: A #DzlTrieNode.
- * @chunk: A #DzlTrieNodeChunk.
- * @idx: The index of the item to move.
+ * dzl_trie_node_split:
+ * @trie: A #DzlTrie.
+ * @parent: The offset of the parent node.
+ * @idx: The index of the child whose edge should be split.
+ * @n: The number of bytes of the label to keep above the split.
+ *
+ * Splits the edge leading to a child of @parent after @n bytes by
+ * inserting a new node. Both halves of the label continue to share the
+ * same bytes in the arena.
  *
- * Moves the key and child found at @idx to the beginning of the first chunk
- * to achieve better cache locality.
+ * Returns: The offset of the new node.
  */
-static void
-dzl_trie_node_move_to_front (DzlTrieNode      *node,
-                             DzlTrieNodeChunk *chunk,
-                             guint             idx)
+static guint32
+dzl_trie_node_split (DzlTrie *trie,
+                     guint32  parent,
+                     guint    idx,
+                     guint32  n)
 {
-   DzlTrieNodeChunk *first;
+   DzlTrieArena *arena = &trie->arena;
    DzlTrieNode *child;
-   guint8 offset;
+   DzlTrieNode *mid;
+   guint32 child_offset;
+   guint32 mid_offset;
    guint8 key;
 
-   g_assert(node);
-   g_assert(chunk);
+   mid_offset = dzl_trie_arena_alloc(arena, sizeof(DzlTrieNode), DZL_TRIE_NODE_ALIGN);
+   child_offset = dzl_trie_node_children(arena, dzl_trie_node(arena, parent))[idx];
 
-   first = &node->chunk;
+   child = dzl_trie_node(arena, child_offset);
+   mid = dzl_trie_node(arena, mid_offset);
 
-   key = chunk->keys[idx];
-   child = chunk->children[idx];
+   g_assert(n > 0 && n < child->label_len);
 
-   offset = ((first == chunk) ? first->count : FIRST_CHUNK_KEYS) - 1;
-   chunk->keys[idx] = first->keys[offset];
-   chunk->children[idx] = first->children[offset];
+   mid->label = child->label;
+   mid->label_len = n;
+   mid->max_weight = child->max_weight;
 
-#ifdef TRIE_64
-   STATIC_ASSERT(sizeof(gpointer) == 8);
-   STATIC_ASSERT((FIRST_CHUNK_KEYS-1) == 3);
-   STATIC_ASSERT(((FIRST_CHUNK_KEYS-1) * sizeof(gpointer)) == 24);
-#else
-   STATIC_ASSERT(sizeof(gpointer) == 4);
-   STATIC_ASSERT((FIRST_CHUNK_KEYS-1) == 2);
-   STATIC_ASSERT(((FIRST_CHUNK_KEYS-1) * sizeof(gpointer)) == 8);
-#endif
+   child->label += n;
+   child->label_len -= n;
+   key = dzl_trie_node_label(arena, child)[0];
 
-   memmove(&first->keys[1], &first->keys[0], (FIRST_CHUNK_KEYS-1));
-   memmove(&first->children[1], &first->children[0], (FIRST_CHUNK_KEYS-1) * sizeof(DzlTrieNode *));
+   dzl_trie_node_insert_child(trie, mid_offset, 0, key, child_offset);
+   dzl_trie_node_children(arena, dzl_trie_node(arena, parent))[idx] = mid_offset;
 
-   first->keys[0] = key;
-   first->children[0] = child;
+   return mid_offset;
 }
 
 /**
- * dzl_trie_find_node:
- * @trie: The #DzlTrie we are searching.
- * @node: A #DzlTrieNode.
- * @key: The key to find in this node.
- *
- * Searches the chunk chain of the current node for the key provided. If
- * found, the child node for that key is returned.
+ * dzl_trie_node_merge:
+ * @trie: A #DzlTrie.
+ * @offset: The offset of a node.
  *
- * Returns: (transfer none): A #DzlTrieNode or %NULL.
+ * If the node at @offset has no value and a single child, it absorbs the
+ * child so that the trie stays path compressed.
  */
-static DzlTrieNode *
-dzl_trie_find_node (DzlTrie     *trie,
-                    DzlTrieNode *node,
-                    guint8       key)
+static void
+dzl_trie_node_merge (DzlTrie *trie,
+                     guint32  offset)
 {
-   DzlTrieNodeChunk *iter;
-   guint i;
+   DzlTrieArena *arena = &trie->arena;
+   DzlTrieNode *node;
+   DzlTrieNode *child;
 
-   g_assert(node);
-
-   for (iter = &node->chunk; iter; iter = iter->next) {
-      for (i = 0; i < iter->count; i++) {
-         if (iter->keys[i] == key) {
-            if (iter != &node->chunk) {
-               dzl_trie_node_move_to_front(node, iter, i);
-               __builtin_prefetch(node->chunk.children[0]);
-               return node->chunk.children[0];
-            }
-            __builtin_prefetch(iter->children[i]);
-            return iter->children[i];
-         }
-      }
+   node = dzl_trie_node(arena, offset);
+
+   if (node->value || node->n_children != 1) {
+      return;
    }
 
-   return NULL;
+   child = dzl_trie_node(arena, dzl_trie_node_children(arena, node)[0]);
+
+   if (node->label + node->label_len != child->label) {
+      guint32 label;
+
+      label = dzl_trie_arena_alloc(arena, node->label_len + child->label_len, 1);
+
+      node = dzl_trie_node(arena, offset);
+      child = dzl_trie_node(arena, dzl_trie_node_children(arena, node)[0]);
+
+      memcpy(&arena->data[label], &arena->data[node->label], node->label_len);
+      memcpy(&arena->data[label + node->label_len], &arena->data[child->label], child->label_len);
+
+      trie->garbage += node->label_len + child->label_len;
+
+      node->label = label;
+   }
+
+   trie->garbage += sizeof(DzlTrieNode) + BLOCK_SIZE(node->n_alloc);
+
+   node->label_len += child->label_len;
+   node->value = child->value;
+   node->weight = child->weight;
+   node->max_weight = child->max_weight;
+   node->children = child->children;
+   node->n_children = child->n_children;
+   node->n_alloc = child->n_alloc;
 }
 
 /**
- * dzl_trie_find_or_create_node:
+ * dzl_trie_copy_node:
  * @trie: A #DzlTrie.
- * @node: A #DzlTrieNode.
- * @key: The key to insert.
+ * @dst: The #DzlTrieArena to copy into.
+ * @offset: The offset of the node within @trie.
+ * @key: The key leading up to the node.
+ * @func: (nullable): A function to convert values, or %NULL.
+ * @user_data: User data for @func.
  *
- * Attempts to find key within @node. If @key is not found, it is added to the
- * node. The child for the key is returned.
+ * Recursively copies the node at @offset into @dst. Nodes are written in
+ * depth-first order, without any garbage and with tightly sized children
+ * blocks, which keeps nodes that are visited together close together. The
+ * maximum weights are recalculated along the way.
  *
- * Returns: (transfer none): The child #DzlTrieNode for @key.
+ * Returns: The offset of the copy within @dst.
  */
-static DzlTrieNode *
-dzl_trie_find_or_create_node (DzlTrie     *trie,
-                              DzlTrieNode *node,
-                              guint8       key)
+static guint32
+dzl_trie_copy_node (DzlTrie              *trie,
+                    DzlTrieArena         *dst,
+                    guint32               offset,
+                    GString              *key,
+                    DzlTrieSerializeFunc  func,
+                    gpointer              user_data)
 {
-   DzlTrieNodeChunk *iter;
-   DzlTrieNodeChunk *last = NULL;
+   const DzlTrieNode *node;
+   DzlTrieNode *copy;
+   guint32 copy_offset;
+   guint32 block = 0;
+   guint n_children;
    guint i;
 
-   g_assert(node);
-
-   for (iter = &node->chunk; iter; iter = iter->next) {
-      for (i = 0; i < iter->count; i++) {
-         if (iter->keys[i] == key) {
-            if (iter != &node->chunk) {
-               dzl_trie_node_move_to_front(node, iter, i);
-               __builtin_prefetch(node->chunk.children[0]);
-               return node->chunk.children[0];
-            }
-            __builtin_prefetch(iter->children[i]);
-            return iter->children[i];
-         }
+   node = dzl_trie_node(&trie->arena, offset);
+   n_children = node->n_children;
+
+   g_string_append_len(key,
+                       (const gchar *)dzl_trie_node_label(&trie->arena, node),
+                       node->label_len);
+
+   copy_offset = dzl_trie_node_new(dst,
+                                   (const gchar *)dzl_trie_node_label(&trie->arena, node),
+                                   node->label_len);
+
+   if (n_children) {
+      block = dzl_trie_arena_alloc(dst, BLOCK_SIZE(n_children), sizeof(guint32));
+      memcpy(&dst->data[block], dzl_trie_node_keys(&trie->arena, node), n_children);
+   }
+
+   copy = dzl_trie_node(dst, copy_offset);
+   copy->children = block;
+   copy->n_children = n_children;
+   copy->n_alloc = n_children;
+
+   copy->weight = node->weight;
+   copy->max_weight = node->weight;
+
+   if (node->value) {
+      if (func) {
+         copy->value = func(trie, key->str, GSIZE_TO_POINTER((gsize)node->value), user_data);
+      } else {
+         copy->value = node->value;
       }
-      last = iter;
    }
 
-   g_assert(last);
+   for (i = 0; i < n_children; i++) {
+      guint32 child;
+
+      child = dzl_trie_copy_node(trie,
+                                 dst,
+                                 dzl_trie_node_children(&trie->arena, node)[i],
+                                 key,
+                                 func,
+                                 user_data);
+      copy = dzl_trie_node(dst, copy_offset);
+      dzl_trie_node_children(dst, copy)[i] = child;
+      copy->max_weight = MAX(copy->max_weight, dzl_trie_node(dst, child)->max_weight);
+   }
+
+   g_string_truncate(key, key->len - node->label_len);
 
-   node = dzl_trie_node_new(trie, node);
-   dzl_trie_append_to_node(trie, node->parent, last, key, node);
-   return node;
+   return copy_offset;
 }
 
 /**
- * dzl_trie_node_remove_fast:
- * @node: A #DzlTrieNode.
- * @chunk: A #DzlTrieNodeChunk.
- * @idx: The child within the chunk.
+ * dzl_trie_maybe_compact:
+ * @trie: A #DzlTrie.
  *
- * Removes child at index @idx from the chunk. The last item in the
- * chain of chunks will be moved to the slot indicated by @idx.
+ * Rebuilds the arena of @trie if most of it is no longer in use.
  */
-G_INLINE_FUNC void
-dzl_trie_node_remove_fast (DzlTrieNode      *node,
-                           DzlTrieNodeChunk *chunk,
-                           guint             idx)
+static void
+dzl_trie_maybe_compact (DzlTrie *trie)
 {
-   DzlTrieNodeChunk *iter;
-
-   g_assert(node);
-   g_assert(chunk);
-
-   for (iter = chunk; iter->next && iter->next->count; iter = iter->next) { }
-
-   g_assert(iter->count);
+   DzlTrieArena arena;
+   GString *key;
+   guint32 root;
 
-   chunk->keys[idx] = iter->keys[iter->count-1];
-   chunk->children[idx] = iter->children[iter->count-1];
+   if (trie->garbage < COMPACT_MIN_GARBAGE || trie->garbage < trie->arena.len / 2) {
+      return;
+   }
 
-   iter->count--;
+   key = g_string_new(NULL);
+   dzl_trie_arena_init(&arena);
+   root = dzl_trie_copy_node(trie, &arena, trie->root, key, NULL, NULL);
+   g_string_free(key, TRUE);
 
-   iter->keys[iter->count] = '\0';
-   iter->children[iter->count] = NULL;
+   g_free(trie->arena.data);
+   trie->arena = arena;
+   trie->root = root;
+   trie->garbage = 0;
 }
 
 /**
- * dzl_trie_node_unlink:
- * @node: A #DzlTrieNode.
+ * dzl_trie_find:
+ * @trie: A #DzlTrie.
+ * @key: The key to find.
+ * @node_offset: (out): The offset of the node containing the end of @key.
+ * @pos: (out): The number of bytes of the label of the node that matched.
+ *
+ * Walks @key from the root of @trie. Since edges may be longer than a
+ * single byte, @key may end in the middle of the label of a node, in which
+ * case @pos will be less than the length of the label.
  *
- * Unlinks @node from the DzlTrie. The parent node has its pointer to @node
- * removed.
+ * Returns: %TRUE if @trie contains keys prefixed with @key.
  */
-static void
-dzl_trie_node_unlink (DzlTrieNode *node)
+static gboolean
+dzl_trie_find (DzlTrie     *trie,
+               const gchar *key,
+               guint32     *node_offset,
+               guint32     *pos)
 {
-   DzlTrieNodeChunk *iter;
-   DzlTrieNode *parent;
-   guint i;
+   const DzlTrieArena *arena = &trie->arena;
+   const DzlTrieNode *node;
+   const guint8 *label;
+   guint32 offset;
+   guint32 i;
 
-   g_assert(node);
-
-   if ((parent = node->parent)) {
-      node->parent = NULL;
-      for (iter = &parent->chunk; iter; iter = iter->next) {
-         for (i = 0; i < iter->count; i++) {
-            if (iter->children[i] == node) {
-               dzl_trie_node_remove_fast(node, iter, i);
-               g_assert(iter->children[i] != node);
-               return;
-            }
+   offset = trie->root;
+   node = dzl_trie_node(arena, offset);
+   label = dzl_trie_node_label(arena, node);
+   i = node->label_len;
+
+   while (*key) {
+      if (i == node->label_len) {
+         gboolean found;
+         guint idx;
+
+         idx = dzl_trie_node_search(arena, node, *key, &found);
+
+         if (!found) {
+            return FALSE;
          }
+
+         offset = dzl_trie_node_children(arena, node)[idx];
+         node = dzl_trie_node(arena, offset);
+         label = dzl_trie_node_label(arena, node);
+         i = 0;
+      }
+
+      if (label[i] != (guint8)*key) {
+         return FALSE;
       }
+
+      i++;
+      key++;
    }
+
+   *node_offset = offset;
+   *pos = i;
+
+   return TRUE;
 }
 
 /**
- * dzl_trie_destroy_node:
+ * dzl_trie_destroy_values:
  * @trie: A #DzlTrie.
- * @node: A #DzlTrieNode.
- * @value_destroy: A #GDestroyNotify or %NULL.
+ * @offset: The offset of a node.
  *
- * Removes @node from the #DzlTrie and releases all memory associated with it.
- * If the nodes value is set, @value_destroy will be called to release it.
- *
- * The reclaimation happens as such:
- *
- * 1) the node is unlinked from its parent.
- * 2) each of the children are destroyed, leaving us an empty chain.
- * 3) each of the allocated chain links are freed.
- * 4) the value pointer is freed.
- * 5) the structure itself is freed.
+ * Calls the value destroy function of @trie for every value at or below
+ * the node at @offset. Only reachable nodes are visited, since garbage
+ * nodes may still refer to values that have moved.
  */
 static void
-dzl_trie_destroy_node (DzlTrie        *trie,
-                       DzlTrieNode    *node,
-                       GDestroyNotify  value_destroy)
+dzl_trie_destroy_values (DzlTrie *trie,
+                         guint32  offset)
 {
-   DzlTrieNodeChunk *iter;
-   DzlTrieNodeChunk *tmp;
-
-   g_assert(node);
-
-   dzl_trie_node_unlink(node);
+   const DzlTrieNode *node;
+   guint i;
 
-   while (node->chunk.count) {
-      dzl_trie_destroy_node(trie, node->chunk.children[0], value_destroy);
-   }
+   node = dzl_trie_node(&trie->arena, offset);
 
-   for (iter = node->chunk.next; iter;) {
-      tmp = iter;
-      iter = iter->next;
-      dzl_trie_free(trie, tmp);
+   if (node->value) {
+      trie->value_destroy(GSIZE_TO_POINTER((gsize)node->value));
    }
 
-   if (node->value && value_destroy) {
-      value_destroy(node->value);
+   for (i = 0; i < node->n_children; i++) {
+      dzl_trie_destroy_values(trie, dzl_trie_node_children(&trie->arena, node)[i]);
    }
-
-   dzl_trie_free(trie, node);
 }
 
 /**
@@ -489,22 +719,271 @@ dzl_trie_new (GDestroyNotify value_destroy)
 {
    DzlTrie *trie;
 
-#ifdef TRIE_64
-   STATIC_ASSERT(sizeof(DzlTrieNode) == 32);
-   STATIC_ASSERT(sizeof(DzlTrieNodeChunk) == 16);
-#else
-   STATIC_ASSERT(sizeof(DzlTrieNode) == 20);
-   STATIC_ASSERT(sizeof(DzlTrieNodeChunk) == 12);
-#endif
+   G_STATIC_ASSERT(sizeof(DzlTrieNode) == 32);
+   G_STATIC_ASSERT(sizeof(DzlTrieHeader) % DZL_TRIE_NODE_ALIGN == 0);
 
    trie = g_new0(DzlTrie, 1);
    trie->ref_count = 1;
-   trie->root = dzl_trie_node_new(trie, NULL);
    trie->value_destroy = value_destroy;
 
+   dzl_trie_arena_init(&trie->arena);
+   trie->root = dzl_trie_node_new(&trie->arena, NULL, 0);
+
    return trie;
 }
 
+/**
+ * dzl_trie_arena_node_is_valid:
+ * @arena: A #DzlTrieArena.
+ * @offset: The offset of a node.
+ *
+ * Checks that the node at @offset, its label and its children block all
+ * lie within @arena.
+ *
+ * Returns: %TRUE if the node may be accessed.
+ */
+static gboolean
+dzl_trie_arena_node_is_valid (const DzlTrieArena *arena,
+                              guint32             offset)
+{
+   const DzlTrieNode *node;
+
+   if (offset % DZL_TRIE_NODE_ALIGN != 0 ||
+       offset < sizeof(DzlTrieHeader) ||
+       offset > arena->len - sizeof(DzlTrieNode)) {
+      return FALSE;
+   }
+
+   node = dzl_trie_node(arena, offset);
+
+   if (node->label > arena->len ||
+       node->label_len > arena->len - node->label ||
+       node->n_children > node->n_alloc) {
+      return FALSE;
+   }
+
+   if (node->n_alloc &&
+       (node->children % sizeof(guint32) != 0 ||
+        node->children > arena->len ||
+        BLOCK_SIZE(node->n_alloc) > arena->len - node->children)) {
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+/**
+ * dzl_trie_arena_validate:
+ * @arena: A #DzlTrieArena loaded from a file.
+ * @root: The offset of the root node.
+ *
+ * Walks every node reachable from @root once, checking that it lies within
+ * @arena and is reached through the key matching its label. Nodes must
+ * form a tree, which rules out cycles. The trie may then be used without
+ * further checks.
+ *
+ * Returns: %TRUE if @arena contains a valid trie.
+ */
+static gboolean
+dzl_trie_arena_validate (const DzlTrieArena *arena,
+                         guint32             root)
+{
+   g_autofree guint8 *visited = NULL;
+   g_autoptr(GArray) stack = NULL;
+
+   if (!dzl_trie_arena_node_is_valid(arena, root)) {
+      return FALSE;
+   }
+
+   /* One bit for every aligned offset that may hold a node */
+   visited = g_malloc0(arena->len / DZL_TRIE_NODE_ALIGN / 8 + 1);
+   stack = g_array_new(FALSE, FALSE, sizeof(guint32));
+   g_array_append_val(stack, root);
+
+   while (stack->len) {
+      const DzlTrieNode *node;
+      guint32 offset;
+      guint i;
+
+      offset = g_array_index(stack, guint32, stack->len - 1);
+      g_array_set_size(stack, stack->len - 1);
+      node = dzl_trie_node(arena, offset);
+
+      for (i = 0; i < node->n_children; i++) {
+         const DzlTrieNode *child;
+         guint32 child_offset;
+         guint slot;
+
+         child_offset = dzl_trie_node_children(arena, node)[i];
+
+         if (!dzl_trie_arena_node_is_valid(arena, child_offset) || child_offset == root) {
+            return FALSE;
+         }
+
+         slot = child_offset / DZL_TRIE_NODE_ALIGN;
+
+         if (visited[slot / 8] & (1 << (slot % 8))) {
+            return FALSE;
+         }
+
+         visited[slot / 8] |= 1 << (slot % 8);
+
+         child = dzl_trie_node(arena, child_offset);
+
+         if (!child->label_len ||
+             dzl_trie_node_label(arena, child)[0] != dzl_trie_node_keys(arena, node)[i]) {
+            return FALSE;
+         }
+
+         g_array_append_val(stack, child_offset);
+      }
+   }
+
+   return TRUE;
+}
+
+/**
+ * dzl_trie_new_for_file:
+ * @file: A #GFile.
+ * @error: A location for a #GError, or %NULL.
+ *
+ * Maps a trie previously written with dzl_trie_save_to_file() into memory.
+ * The file is used in place, so no time is spent parsing it and its pages
+ * are shared between processes using the same file.
+ *
+ * The resulting trie is read-only. Values are those produced by the
+ * #DzlTrieSerializeFunc used when saving, and may be converted back with
+ * GPOINTER_TO_UINT().
+ *
+ * The file must have been created by dzl_trie_save_to_file() on a machine
+ * with the same byte order. Every node is checked to lie within the file
+ * when it is loaded, so a truncated or corrupt file results in an error.
+ *
+ * Returns: (transfer full): A #DzlTrie or %NULL and @error is set.
+ */
+DzlTrie *
+dzl_trie_new_for_file (GFile   *file,
+                       GError **error)
+{
+   g_autoptr(GMappedFile) mapped = NULL;
+   g_autofree gchar *path = NULL;
+   const DzlTrieHeader *header;
+   DzlTrieArena arena = { 0 };
+   DzlTrie *trie;
+   gsize len;
+
+   g_return_val_if_fail(G_IS_FILE(file), NULL);
+
+   if (!g_file_is_native(file) || NULL == (path = g_file_get_path(file))) {
+      g_set_error(error,
+                  G_IO_ERROR,
+                  G_IO_ERROR_INVALID_FILENAME,
+                  "Trie must be a local file");
+      return NULL;
+   }
+
+   if (NULL == (mapped = g_mapped_file_new(path, FALSE, error))) {
+      return NULL;
+   }
+
+   len = g_mapped_file_get_length(mapped);
+   header = (const DzlTrieHeader *)(gconstpointer)g_mapped_file_get_contents(mapped);
+
+   if (len < sizeof *header + sizeof(DzlTrieNode) ||
+       header->magic != DZL_TRIE_MAGIC ||
+       header->version != DZL_TRIE_VERSION ||
+       header->length != len) {
+      g_set_error(error,
+                  G_IO_ERROR,
+                  G_IO_ERROR_INVALID_DATA,
+                  "Invalid or unsupported trie file");
+      return NULL;
+   }
+
+   arena.data = (guint8 *)g_mapped_file_get_contents(mapped);
+   arena.len = len;
+
+   if (!dzl_trie_arena_validate(&arena, header->root)) {
+      g_set_error(error,
+                  G_IO_ERROR,
+                  G_IO_ERROR_INVALID_DATA,
+                  "Corrupt trie file");
+      return NULL;
+   }
+
+   trie = g_new0(DzlTrie, 1);
+   trie->ref_count = 1;
+   trie->root = header->root;
+   trie->arena = arena;
+   trie->mapped = g_steal_pointer(&mapped);
+
+   return trie;
+}
+
+/**
+ * dzl_trie_save_to_file:
+ * @trie: A #DzlTrie.
+ * @file: A #GFile.
+ * @func: (scope call) (closure user_data) (nullable): A function to
+ *   convert values for storage, or %NULL.
+ * @user_data: User data for @func.
+ * @cancellable: (nullable): A #GCancellable or %NULL.
+ * @error: A location for a #GError, or %NULL.
+ *
+ * Writes @trie to @file so that it may be loaded with
+ * dzl_trie_new_for_file().
+ *
+ * Pointers cannot be stored on disk, so @func is called for every value to
+ * convert it into a non-zero integer, such as an index into a table stored
+ * elsewhere. If @func is %NULL, values are stored as-is, which is only
+ * useful for values created with GUINT_TO_POINTER().
+ *
+ * Returns: %TRUE if successful; otherwise %FALSE and @error is set.
+ */
+gboolean
+dzl_trie_save_to_file (DzlTrie               *trie,
+                       GFile                 *file,
+                       DzlTrieSerializeFunc   func,
+                       gpointer               user_data,
+                       GCancellable          *cancellable,
+                       GError               **error)
+{
+   DzlTrieHeader *header;
+   DzlTrieArena arena;
+   GString *key;
+   gboolean ret;
+   guint32 root;
+
+   g_return_val_if_fail(trie, FALSE);
+   g_return_val_if_fail(G_IS_FILE(file), FALSE);
+   g_return_val_if_fail(!cancellable || G_IS_CANCELLABLE(cancellable), FALSE);
+
+   key = g_string_new(NULL);
+   dzl_trie_arena_init(&arena);
+   root = dzl_trie_copy_node(trie, &arena, trie->root, key, func, user_data);
+   g_string_free(key, TRUE);
+
+   header = (DzlTrieHeader *)(gpointer)arena.data;
+   header->magic = DZL_TRIE_MAGIC;
+   header->version = DZL_TRIE_VERSION;
+   header->root = root;
+   header->length = arena.len;
+
+   ret = g_file_replace_contents(file,
+                                 (const gchar *)arena.data,
+                                 arena.len,
+                                 NULL,
+                                 FALSE,
+                                 G_FILE_CREATE_REPLACE_DESTINATION,
+                                 NULL,
+                                 cancellable,
+                                 error);
+
+   g_free(arena.data);
+
+   return ret;
+}
+
 /**
  * dzl_trie_insert:
  * @trie: A #DzlTrie.
@@ -518,24 +997,80 @@ dzl_trie_insert (DzlTrie     *trie,
                  const gchar *key,
                  gpointer     value)
 {
+   dzl_trie_insert_with_weight(trie, key, value, 0);
+}
+
+/**
+ * dzl_trie_insert_with_weight:
+ * @trie: A #DzlTrie.
+ * @key: The key to insert.
+ * @value: The value to insert.
+ * @weight: The weight of @key.
+ *
+ * Inserts @value into @trie located with @key, like dzl_trie_insert().
+ * @weight is used to order the results of dzl_trie_iter_new_by_weight().
+ */
+void
+dzl_trie_insert_with_weight (DzlTrie     *trie,
+                             const gchar *key,
+                             gpointer     value,
+                             guint        weight)
+{
+   DzlTrieArena *arena;
    DzlTrieNode *node;
+   guint32 offset;
 
    g_return_if_fail(trie);
    g_return_if_fail(key);
    g_return_if_fail(value);
+   g_return_if_fail(trie->mapped == NULL);
 
-   node = trie->root;
+   arena = &trie->arena;
+   offset = trie->root;
 
    while (*key) {
-      node = dzl_trie_find_or_create_node(trie, node, *key);
-      key++;
+      const DzlTrieNode *child;
+      const guint8 *label;
+      gboolean found;
+      guint32 child_offset;
+      guint32 n;
+      guint idx;
+
+      node = dzl_trie_node(arena, offset);
+      node->max_weight = MAX(node->max_weight, weight);
+      idx = dzl_trie_node_search(arena, node, *key, &found);
+
+      if (!found) {
+         child_offset = dzl_trie_node_new(arena, key, strlen(key));
+         dzl_trie_node_insert_child(trie, offset, idx, *key, child_offset);
+         offset = child_offset;
+         break;
+      }
+
+      child_offset = dzl_trie_node_children(arena, node)[idx];
+      child = dzl_trie_node(arena, child_offset);
+      label = dzl_trie_node_label(arena, child);
+
+      /* Labels never contain '\0', so this stops at the end of @key */
+      for (n = 1; n < child->label_len && label[n] == (guint8)key[n]; n++) { }
+
+      if (n < child->label_len) {
+         child_offset = dzl_trie_node_split(trie, offset, idx, n);
+      }
+
+      offset = child_offset;
+      key += n;
    }
 
+   node = dzl_trie_node(arena, offset);
+
    if (node->value && trie->value_destroy) {
-      trie->value_destroy(node->value);
+      trie->value_destroy(GSIZE_TO_POINTER((gsize)node->value));
    }
 
-   node->value = value;
+   node->value = GPOINTER_TO_SIZE(value);
+   node->weight = weight;
+   node->max_weight = MAX(node->max_weight, weight);
 }
 
 /**
@@ -551,22 +1086,24 @@ gpointer
 dzl_trie_lookup (DzlTrie     *trie,
                  const gchar *key)
 {
-   DzlTrieNode *node;
-
-   __builtin_prefetch(trie);
-   __builtin_prefetch(key);
+   const DzlTrieNode *node;
+   guint32 offset;
+   guint32 pos;
 
    g_return_val_if_fail(trie, NULL);
    g_return_val_if_fail(key, NULL);
 
-   node = trie->root;
+   if (!dzl_trie_find(trie, key, &offset, &pos)) {
+      return NULL;
+   }
 
-   while (*key && node) {
-      node = dzl_trie_find_node(trie, node, *key);
-      key++;
+   node = dzl_trie_node(&trie->arena, offset);
+
+   if (pos != node->label_len) {
+      return NULL;
    }
 
-   return node ? node->value : NULL;
+   return GSIZE_TO_POINTER((gsize)node->value);
 }
 
 /**
@@ -583,161 +1120,165 @@ gboolean
 dzl_trie_remove (DzlTrie     *trie,
                  const gchar *key)
 {
+   const DzlTrieArena *arena;
    DzlTrieNode *node;
+   gpointer value;
+   guint32 offset;
+   guint32 parent = 0;
+   guint idx = 0;
 
    g_return_val_if_fail(trie, FALSE);
    g_return_val_if_fail(key, FALSE);
+   g_return_val_if_fail(trie->mapped == NULL, FALSE);
 
-   node = trie->root;
+   arena = &trie->arena;
+   offset = trie->root;
 
-   while (*key && node) {
-      node = dzl_trie_find_node(trie, node, *key);
-      key++;
-   }
-
-   if (node && node->value) {
-      if (trie->value_destroy) {
-         trie->value_destroy(node->value);
+   while (*key) {
+      const DzlTrieNode *child;
+      const guint8 *label;
+      gboolean found;
+      guint32 child_offset;
+      guint32 n;
+      guint i;
+
+      node = dzl_trie_node(arena, offset);
+      i = dzl_trie_node_search(arena, node, *key, &found);
+
+      if (!found) {
+         return FALSE;
       }
 
-      node->value = NULL;
+      child_offset = dzl_trie_node_children(arena, node)[i];
+      child = dzl_trie_node(arena, child_offset);
+      label = dzl_trie_node_label(arena, child);
 
-      if (!node->chunk.count) {
-         while (node->parent &&
-                node->parent->parent &&
-                !node->parent->value &&
-                (node->parent->chunk.count == 1)) {
-            node = node->parent;
+      for (n = 1; n < child->label_len; n++) {
+         if (label[n] != (guint8)key[n]) {
+            return FALSE;
          }
-         dzl_trie_destroy_node(trie, node, trie->value_destroy);
       }
 
-      return TRUE;
+      parent = offset;
+      idx = i;
+      offset = child_offset;
+      key += n;
    }
 
-   return FALSE;
-}
+   node = dzl_trie_node(arena, offset);
 
-/**
- * dzl_trie_traverse_node_pre_order:
- * @trie: A #DzlTrie.
- * @node: A #DzlTrieNode.
- * @str: The prefix for this node.
- * @flags: The flags for which nodes to callback.
- * @max_depth: the maximum depth to process.
- * @func: (scope call) (closure user_data): The func to execute for each matching node.
- * @user_data: User data for @func.
- *
- * Traverses node and all of its children according to the parameters
- * provided. @func is called for each matching node.
- *
- * This assumes that the order is %G_POST_ORDER, and therefore does not
- * have the conditionals to check pre-vs-pre ordering.
- *
- * Returns: %TRUE if traversal was cancelled; otherwise %FALSE.
- */
-static gboolean
-dzl_trie_traverse_node_pre_order (DzlTrie             *trie,
-                                  DzlTrieNode         *node,
-                                  GString             *str,
-                                  GTraverseFlags       flags,
-                                  gint                 max_depth,
-                                  DzlTrieTraverseFunc  func,
-                                  gpointer             user_data)
-{
-   DzlTrieNodeChunk *iter;
-   gboolean ret = FALSE;
-   guint i;
+   if (!node->value) {
+      return FALSE;
+   }
 
-   g_assert(trie);
-   g_assert(node);
-   g_assert(str);
+   value = GSIZE_TO_POINTER((gsize)node->value);
+   node->value = 0;
+   node->weight = 0;
 
-   if (max_depth) {
-      if ((!node->value && (flags & G_TRAVERSE_NON_LEAVES)) ||
-          (node->value && (flags & G_TRAVERSE_LEAVES))) {
-         if (func(trie, str->str, node->value, user_data)) {
-            return TRUE;
-         }
-      }
-      for (iter = &node->chunk; iter; iter = iter->next) {
-         for (i = 0; i < iter->count; i++) {
-            g_string_append_c(str, iter->keys[i]);
-            if (dzl_trie_traverse_node_pre_order(trie,
-                                             iter->children[i],
-                                             str,
-                                             flags,
-                                             max_depth - 1,
-                                             func,
-                                             user_data)) {
-               return TRUE;
-            }
-            g_string_truncate(str, str->len - 1);
+   if (offset != trie->root) {
+      if (!node->n_children) {
+         dzl_trie_node_remove_child(trie, parent, idx);
+         if (parent != trie->root) {
+            dzl_trie_node_merge(trie, parent);
          }
+      } else {
+         dzl_trie_node_merge(trie, offset);
       }
    }
 
-   return ret;
+   if (trie->value_destroy) {
+      trie->value_destroy(value);
+   }
+
+   dzl_trie_maybe_compact(trie);
+
+   return TRUE;
 }
 
 /**
- * dzl_trie_traverse_node_post_order:
+ * dzl_trie_traverse_node:
  * @trie: A #DzlTrie.
- * @node: A #DzlTrieNode.
- * @str: The prefix for this node.
+ * @offset: The offset of a node.
+ * @pos: The number of bytes of the label of the node already in @str.
+ * @str: The key for this position.
+ * @order: The order to traverse.
  * @flags: The flags for which nodes to callback.
  * @max_depth: the maximum depth to process.
  * @func: (scope call) (closure user_data): The func to execute for each matching node.
  * @user_data: User data for @func.
  *
- * Traverses node and all of its children according to the parameters
- * provided. @func is called for each matching node.
+ * Traverses the position @pos within the label of the node at @offset and
+ * everything below it according to the parameters provided. @func is
+ * called for each matching position.
  *
- * This assumes that the order is %G_POST_ORDER, and therefore does not
- * have the conditionals to check pre-vs-post ordering.
+ * Every byte of a label counts as a level of the tree, as though the trie
+ * was not path compressed, so positions within a label are treated as
+ * nodes without a value and a single child.
  *
  * Returns: %TRUE if traversal was cancelled; otherwise %FALSE.
  */
 static gboolean
-dzl_trie_traverse_node_post_order (DzlTrie             *trie,
-                                   DzlTrieNode         *node,
-                                   GString             *str,
-                                   GTraverseFlags       flags,
-                                   gint                 max_depth,
-                                   DzlTrieTraverseFunc  func,
-                                   gpointer             user_data)
-{
-   DzlTrieNodeChunk *iter;
-   gboolean ret = FALSE;
+dzl_trie_traverse_node (DzlTrie             *trie,
+                        guint32              offset,
+                        guint32              pos,
+                        GString             *str,
+                        GTraverseType        order,
+                        GTraverseFlags       flags,
+                        gint                 max_depth,
+                        DzlTrieTraverseFunc  func,
+                        gpointer             user_data)
+{
+   const DzlTrieNode *node;
+   gpointer value = NULL;
+   gboolean visit;
    guint i;
 
    g_assert(trie);
-   g_assert(node);
    g_assert(str);
 
-   if (max_depth) {
-      for (iter = &node->chunk; iter; iter = iter->next) {
-         for (i = 0; i < iter->count; i++) {
-            g_string_append_c(str, iter->keys[i]);
-            if (dzl_trie_traverse_node_post_order(trie,
-                                                  iter->children[i],
-                                                  str,
-                                                  flags,
-                                                  max_depth - 1,
-                                                  func,
-                                                  user_data)) {
-               return TRUE;
-            }
-            g_string_truncate(str, str->len - 1);
-         }
+   if (!max_depth) {
+      return FALSE;
+   }
+
+   node = dzl_trie_node(&trie->arena, offset);
+
+   if (pos == node->label_len) {
+      value = GSIZE_TO_POINTER((gsize)node->value);
+   }
+
+   visit = ((!value && (flags & G_TRAVERSE_NON_LEAVES)) ||
+            (value && (flags & G_TRAVERSE_LEAVES)));
+
+   if (order == G_PRE_ORDER && visit) {
+      if (func(trie, str->str, value, user_data)) {
+         return TRUE;
       }
-      if ((!node->value && (flags & G_TRAVERSE_NON_LEAVES)) ||
-          (node->value && (flags & G_TRAVERSE_LEAVES))) {
-         ret = func(trie, str->str, node->value, user_data);
+   }
+
+   if (pos < node->label_len) {
+      g_string_append_c(str, dzl_trie_node_label(&trie->arena, node)[pos]);
+      if (dzl_trie_traverse_node(trie, offset, pos + 1, str, order, flags,
+                                 max_depth - 1, func, user_data)) {
+         return TRUE;
+      }
+      g_string_truncate(str, str->len - 1);
+   } else {
+      for (i = 0; i < node->n_children; i++) {
+         g_string_append_c(str, dzl_trie_node_keys(&trie->arena, node)[i]);
+         if (dzl_trie_traverse_node(trie, dzl_trie_node_children(&trie->arena, node)[i],
+                                    1, str, order, flags, max_depth - 1, func,
+                                    user_data)) {
+            return TRUE;
+         }
+         g_string_truncate(str, str->len - 1);
       }
    }
 
-   return ret;
+   if (order == G_POST_ORDER && visit) {
+      return func(trie, str->str, value, user_data);
+   }
+
+   return FALSE;
 }
 
 /**
@@ -767,33 +1308,452 @@ dzl_trie_traverse (DzlTrie             *trie,
                    DzlTrieTraverseFunc  func,
                    gpointer             user_data)
 {
-   DzlTrieNode *node;
    GString *str;
+   guint32 offset;
+   guint32 pos;
 
    g_return_if_fail(trie);
    g_return_if_fail(func);
 
-   node = trie->root;
+   if (order != G_PRE_ORDER && order != G_POST_ORDER) {
+      g_warning(_("Traversal order %u is not supported on DzlTrie."), order);
+      return;
+   }
+
    key = key ? key : "";
 
+   if (!dzl_trie_find(trie, key, &offset, &pos)) {
+      return;
+   }
+
    str = g_string_new(key);
+   dzl_trie_traverse_node(trie, offset, pos, str, order, flags, max_depth, func, user_data);
+   g_string_free(str, TRUE);
+}
 
-   while (*key && node) {
-      node = dzl_trie_find_node(trie, node, *key);
-      key++;
+/**
+ * DzlTrieIter:
+ *
+ * An iterator over the keys of a #DzlTrie below a prefix. Create one with
+ * dzl_trie_iter_new() or dzl_trie_iter_new_by_weight() and pull keys from
+ * it with dzl_trie_iter_next(). The trie must not be modified while an
+ * iterator is in use.
+ */
+struct _DzlTrieIter
+{
+   DzlTrie *trie;
+   GString *key;
+
+   /* The stack of DzlTrieIterFrame when iterating in order */
+   GArray  *stack;
+
+   /*
+    * When iterating by weight, a heap of DzlTrieIterEntry along with the
+    * DzlTrieIterRecord they refer to. Records point at their parent so
+    * the key only needs to be built for the results returned.
+    */
+   DzlHeap *heap;
+   GArray  *records;
+   GArray  *chain;
+   gsize    base_len;
+};
+
+typedef struct
+{
+   guint32  offset;
+   guint32  key_len;
+   guint    next_child;
+   gboolean value_pending;
+} DzlTrieIterFrame;
+
+typedef struct
+{
+   guint32 offset;
+   guint32 parent;
+} DzlTrieIterRecord;
+
+typedef struct
+{
+   guint32 bound;
+   guint32 record;
+   guint   is_value : 1;
+} DzlTrieIterEntry;
+
+static gint
+dzl_trie_iter_entry_compare (gconstpointer a,
+                             gconstpointer b)
+{
+   const DzlTrieIterEntry *entry_a = a;
+   const DzlTrieIterEntry *entry_b = b;
+
+   if (entry_a->bound != entry_b->bound) {
+      return entry_a->bound < entry_b->bound ? -1 : 1;
    }
 
-   if (node) {
-      if (order == G_PRE_ORDER) {
-         dzl_trie_traverse_node_pre_order(trie, node, str, flags, max_depth, func, user_data);
-      } else if (order == G_POST_ORDER) {
-         dzl_trie_traverse_node_post_order(trie, node, str, flags, max_depth, func, user_data);
-      } else {
-         g_warning(_("Traversal order %u is not supported on DzlTrie."), order);
+   /* Prefer values over subtrees that can at best match them */
+   if (entry_a->is_value != entry_b->is_value) {
+      return entry_a->is_value ? 1 : -1;
+   }
+
+   /* Otherwise, the first discovered which is usually the shortest */
+   if (entry_a->record != entry_b->record) {
+      return entry_a->record < entry_b->record ? 1 : -1;
+   }
+
+   return 0;
+}
+
+static void
+dzl_trie_iter_push (DzlTrieIter *iter,
+                    guint32      offset)
+{
+   DzlTrieIterFrame frame;
+
+   frame.offset = offset;
+   frame.key_len = iter->key->len;
+   frame.next_child = 0;
+   frame.value_pending = TRUE;
+
+   g_array_append_val(iter->stack, frame);
+}
+
+/**
+ * dzl_trie_iter_seek:
+ * @iter: A #DzlTrieIter.
+ * @after: The key to resume after.
+ *
+ * Positions @iter so that the next key returned is the first key that
+ * sorts after @after. Only the path towards @after is visited.
+ */
+static void
+dzl_trie_iter_seek (DzlTrieIter *iter,
+                    const gchar *after)
+{
+   const DzlTrieArena *arena = &iter->trie->arena;
+   gsize after_len = strlen(after);
+
+   while (iter->stack->len > 0) {
+      DzlTrieIterFrame *frame;
+      const DzlTrieNode *node;
+      const DzlTrieNode *child;
+      gboolean found;
+      gsize len;
+      guint idx;
+      gint cmp;
+
+      frame = &g_array_index(iter->stack, DzlTrieIterFrame, iter->stack->len - 1);
+      node = dzl_trie_node(arena, frame->offset);
+      len = frame->key_len;
+      cmp = memcmp(iter->key->str, after, MIN(len, after_len));
+
+      /* Everything below this node sorts after @after */
+      if (cmp > 0 || (cmp == 0 && len > after_len)) {
+         return;
+      }
+
+      /* Everything below this node sorts before @after */
+      if (cmp < 0) {
+         g_array_set_size(iter->stack, iter->stack->len - 1);
+         return;
+      }
+
+      /* The key of this node is a prefix of @after */
+      frame->value_pending = FALSE;
+
+      if (len == after_len) {
+         return;
       }
+
+      idx = dzl_trie_node_search(arena, node, after[len], &found);
+      frame->next_child = idx;
+
+      if (!found) {
+         return;
+      }
+
+      frame->next_child = idx + 1;
+      child = dzl_trie_node(arena, dzl_trie_node_children(arena, node)[idx]);
+
+      g_string_append_len(iter->key,
+                          (const gchar *)dzl_trie_node_label(arena, child),
+                          child->label_len);
+      dzl_trie_iter_push(iter, dzl_trie_node_children(arena, node)[idx]);
    }
+}
 
-   g_string_free(str, TRUE);
+static DzlTrieIter *
+dzl_trie_iter_new_internal (DzlTrie     *trie,
+                            const gchar *prefix,
+                            guint32     *offset)
+{
+   const DzlTrieNode *node;
+   DzlTrieIter *iter;
+   guint32 pos;
+
+   iter = g_slice_new0(DzlTrieIter);
+   iter->trie = dzl_trie_ref(trie);
+   iter->key = g_string_new(prefix);
+
+   if (!dzl_trie_find(trie, prefix, offset, &pos)) {
+      *offset = 0;
+      return iter;
+   }
+
+   node = dzl_trie_node(&trie->arena, *offset);
+   g_string_append_len(iter->key,
+                       (const gchar *)dzl_trie_node_label(&trie->arena, node) + pos,
+                       node->label_len - pos);
+
+   return iter;
+}
+
+/**
+ * dzl_trie_iter_new:
+ * @trie: A #DzlTrie.
+ * @prefix: (nullable): The prefix of the keys to iterate, or %NULL.
+ * @after: (nullable): A key to resume after, or %NULL.
+ *
+ * Creates a new iterator over the keys of @trie starting with @prefix, in
+ * the order of strcmp().
+ *
+ * Since keys are only produced as dzl_trie_iter_next() is called, the
+ * number of keys visited is limited by how many the caller asks for. To
+ * continue later, such as when the user scrolls to the next page of
+ * results, pass the last key returned as @after.
+ *
+ * Returns: (transfer full): A #DzlTrieIter to free with dzl_trie_iter_free().
+ */
+DzlTrieIter *
+dzl_trie_iter_new (DzlTrie     *trie,
+                   const gchar *prefix,
+                   const gchar *after)
+{
+   DzlTrieIter *iter;
+   guint32 offset;
+
+   g_return_val_if_fail(trie, NULL);
+
+   iter = dzl_trie_iter_new_internal(trie, prefix ? prefix : "", &offset);
+   iter->stack = g_array_new(FALSE, FALSE, sizeof(DzlTrieIterFrame));
+
+   if (offset) {
+      dzl_trie_iter_push(iter, offset);
+      if (after) {
+         dzl_trie_iter_seek(iter, after);
+      }
+   }
+
+   return iter;
+}
+
+/**
+ * dzl_trie_iter_new_by_weight:
+ * @trie: A #DzlTrie.
+ * @prefix: (nullable): The prefix of the keys to iterate, or %NULL.
+ *
+ * Creates a new iterator over the keys of @trie starting with @prefix,
+ * heaviest first, as set with dzl_trie_insert_with_weight().
+ *
+ * Each node knows the heaviest weight below it, so fetching the top few
+ * completions for a prefix only visits the nodes leading to them rather
+ * than every key starting with @prefix.
+ *
+ * Returns: (transfer full): A #DzlTrieIter to free with dzl_trie_iter_free().
+ */
+DzlTrieIter *
+dzl_trie_iter_new_by_weight (DzlTrie     *trie,
+                             const gchar *prefix)
+{
+   DzlTrieIterRecord record;
+   DzlTrieIterEntry entry = { 0 };
+   DzlTrieIter *iter;
+   guint32 offset;
+
+   g_return_val_if_fail(trie, NULL);
+
+   iter = dzl_trie_iter_new_internal(trie, prefix ? prefix : "", &offset);
+   iter->heap = dzl_heap_new(sizeof(DzlTrieIterEntry), dzl_trie_iter_entry_compare);
+   iter->records = g_array_new(FALSE, FALSE, sizeof(DzlTrieIterRecord));
+   iter->chain = g_array_new(FALSE, FALSE, sizeof(guint32));
+   iter->base_len = iter->key->len;
+
+   if (offset) {
+      record.offset = offset;
+      record.parent = 0;
+      g_array_append_val(iter->records, record);
+
+      entry.bound = dzl_trie_node(&trie->arena, offset)->max_weight;
+      entry.record = 0;
+      entry.is_value = FALSE;
+      dzl_heap_insert_val(iter->heap, entry);
+   }
+
+   return iter;
+}
+
+static gboolean
+dzl_trie_iter_next_in_order (DzlTrieIter  *iter,
+                             const gchar **key,
+                             gpointer     *value)
+{
+   const DzlTrieArena *arena = &iter->trie->arena;
+
+   while (iter->stack->len > 0) {
+      DzlTrieIterFrame *frame;
+      const DzlTrieNode *node;
+      const DzlTrieNode *child;
+      guint32 child_offset;
+
+      frame = &g_array_index(iter->stack, DzlTrieIterFrame, iter->stack->len - 1);
+      node = dzl_trie_node(arena, frame->offset);
+
+      g_string_truncate(iter->key, frame->key_len);
+
+      if (frame->value_pending) {
+         frame->value_pending = FALSE;
+         if (node->value) {
+            *key = iter->key->str;
+            *value = GSIZE_TO_POINTER((gsize)node->value);
+            return TRUE;
+         }
+      }
+
+      if (frame->next_child < node->n_children) {
+         child_offset = dzl_trie_node_children(arena, node)[frame->next_child++];
+         child = dzl_trie_node(arena, child_offset);
+         g_string_append_len(iter->key,
+                             (const gchar *)dzl_trie_node_label(arena, child),
+                             child->label_len);
+         dzl_trie_iter_push(iter, child_offset);
+         continue;
+      }
+
+      g_array_set_size(iter->stack, iter->stack->len - 1);
+   }
+
+   return FALSE;
+}
+
+static gboolean
+dzl_trie_iter_next_by_weight (DzlTrieIter  *iter,
+                              const gchar **key,
+                              gpointer     *value)
+{
+   const DzlTrieArena *arena = &iter->trie->arena;
+   DzlTrieIterEntry entry;
+
+   while (dzl_heap_extract(iter->heap, &entry)) {
+      const DzlTrieIterRecord *record;
+      const DzlTrieNode *node;
+      guint i;
+
+      record = &g_array_index(iter->records, DzlTrieIterRecord, entry.record);
+      node = dzl_trie_node(arena, record->offset);
+
+      if (entry.is_value) {
+         g_string_truncate(iter->key, iter->base_len);
+         g_array_set_size(iter->chain, 0);
+
+         for (guint32 r = entry.record; r != 0; r = g_array_index(iter->records, DzlTrieIterRecord, r).parent) {
+            g_array_append_val(iter->chain, r);
+         }
+
+         for (i = iter->chain->len; i > 0; i--) {
+            guint32 r = g_array_index(iter->chain, guint32, i - 1);
+            const DzlTrieNode *link;
+
+            link = dzl_trie_node(arena, g_array_index(iter->records, DzlTrieIterRecord, r).offset);
+            g_string_append_len(iter->key,
+                                (const gchar *)dzl_trie_node_label(arena, link),
+                                link->label_len);
+         }
+
+         *key = iter->key->str;
+         *value = GSIZE_TO_POINTER((gsize)node->value);
+
+         return TRUE;
+      }
+
+      if (node->value) {
+         DzlTrieIterEntry value_entry = { node->weight, entry.record, TRUE };
+
+         dzl_heap_insert_val(iter->heap, value_entry);
+      }
+
+      for (i = 0; i < node->n_children; i++) {
+         DzlTrieIterRecord child_record;
+         DzlTrieIterEntry child_entry;
+
+         child_record.offset = dzl_trie_node_children(arena, node)[i];
+         child_record.parent = entry.record;
+
+         child_entry.bound = dzl_trie_node(arena, child_record.offset)->max_weight;
+         child_entry.record = iter->records->len;
+         child_entry.is_value = FALSE;
+
+         g_array_append_val(iter->records, child_record);
+         dzl_heap_insert_val(iter->heap, child_entry);
+      }
+   }
+
+   return FALSE;
+}
+
+/**
+ * dzl_trie_iter_next:
+ * @iter: A #DzlTrieIter.
+ * @key: (out) (optional): A location for the key.
+ * @value: (out) (optional): A location for the value.
+ *
+ * Advances @iter to the next key. The key is owned by @iter and is only
+ * valid until the next call to dzl_trie_iter_next().
+ *
+ * Returns: %TRUE if @key and @value were set; %FALSE if there are no
+ *   more keys.
+ */
+gboolean
+dzl_trie_iter_next (DzlTrieIter  *iter,
+                    const gchar **key,
+                    gpointer     *value)
+{
+   const gchar *dummy_key;
+   gpointer dummy_value;
+
+   g_return_val_if_fail(iter, FALSE);
+
+   if (!key) {
+      key = &dummy_key;
+   }
+
+   if (!value) {
+      value = &dummy_value;
+   }
+
+   if (iter->heap) {
+      return dzl_trie_iter_next_by_weight(iter, key, value);
+   }
+
+   return dzl_trie_iter_next_in_order(iter, key, value);
+}
+
+/**
+ * dzl_trie_iter_free:
+ * @iter: A #DzlTrieIter.
+ *
+ * Frees @iter and releases its reference on the #DzlTrie.
+ */
+void
+dzl_trie_iter_free (DzlTrieIter *iter)
+{
+   if (iter) {
+      g_clear_pointer(&iter->stack, g_array_unref);
+      g_clear_pointer(&iter->heap, dzl_heap_unref);
+      g_clear_pointer(&iter->records, g_array_unref);
+      g_clear_pointer(&iter->chain, g_array_unref);
+      g_string_free(iter->key, TRUE);
+      dzl_trie_unref(iter->trie);
+      g_slice_free(DzlTrieIter, iter);
+   }
 }
 
 /**
@@ -810,8 +1770,15 @@ dzl_trie_unref (DzlTrie *trie)
    g_return_if_fail(trie->ref_count > 0);
 
    if (g_atomic_int_dec_and_test(&trie->ref_count)) {
-      dzl_trie_destroy_node(trie, trie->root, trie->value_destroy);
-      trie->root = NULL;
+      if (trie->mapped) {
+         g_clear_pointer(&trie->mapped, g_mapped_file_unref);
+      } else {
+         if (trie->value_destroy) {
+            dzl_trie_destroy_values(trie, trie->root);
+         }
+         g_free(trie->arena.data);
+      }
+      trie->arena.data = NULL;
       trie->value_destroy = NULL;
       g_free(trie);
    }
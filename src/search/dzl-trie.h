@@ -19,38 +19,78 @@
 #ifndef DZL_TRIE_H
 #define DZL_TRIE_H
 
-#include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
 #define DZL_TYPE_TRIE (dzl_trie_get_type())
 
-typedef struct _DzlTrie DzlTrie;
+typedef struct _DzlTrie     DzlTrie;
+typedef struct _DzlTrieIter DzlTrieIter;
 
 typedef gboolean (*DzlTrieTraverseFunc) (DzlTrie     *dzl_trie,
                                          const gchar *key,
                                          gpointer     value,
                                          gpointer     user_data);
 
-GType     dzl_trie_get_type (void);
-void      dzl_trie_destroy  (DzlTrie             *trie);
-void      dzl_trie_unref    (DzlTrie             *trie);
-DzlTrie  *dzl_trie_ref      (DzlTrie             *trie);
-void      dzl_trie_insert   (DzlTrie             *trie,
-                             const gchar         *key,
-                             gpointer             value);
-gpointer  dzl_trie_lookup   (DzlTrie             *trie,
-                             const gchar         *key);
-DzlTrie  *dzl_trie_new      (GDestroyNotify       value_destroy);
-gboolean  dzl_trie_remove   (DzlTrie             *trie,
-                             const gchar         *key);
-void      dzl_trie_traverse (DzlTrie             *trie,
-                             const gchar         *key,
-                             GTraverseType        order,
-                             GTraverseFlags       flags,
-                             gint                 max_depth,
-                             DzlTrieTraverseFunc  func,
-                             gpointer             user_data);
+/**
+ * DzlTrieSerializeFunc:
+ * @dzl_trie: A #DzlTrie
+ * @key: the key for @value
+ * @value: the value to convert
+ * @user_data: closure data
+ *
+ * Converts @value into a non-zero integer that can be stored on disk.
+ *
+ * Returns: the integer to store for @value
+ */
+typedef guint (*DzlTrieSerializeFunc) (DzlTrie     *dzl_trie,
+                                       const gchar *key,
+                                       gpointer     value,
+                                       gpointer     user_data);
+
+GType        dzl_trie_get_type           (void);
+void         dzl_trie_destroy            (DzlTrie               *trie);
+void         dzl_trie_unref              (DzlTrie               *trie);
+DzlTrie     *dzl_trie_ref                (DzlTrie               *trie);
+void         dzl_trie_insert             (DzlTrie               *trie,
+                                          const gchar           *key,
+                                          gpointer               value);
+void         dzl_trie_insert_with_weight (DzlTrie               *trie,
+                                          const gchar           *key,
+                                          gpointer               value,
+                                          guint                  weight);
+gpointer     dzl_trie_lookup             (DzlTrie               *trie,
+                                          const gchar           *key);
+DzlTrie     *dzl_trie_new                (GDestroyNotify         value_destroy);
+DzlTrie     *dzl_trie_new_for_file       (GFile                 *file,
+                                          GError               **error);
+gboolean     dzl_trie_save_to_file       (DzlTrie               *trie,
+                                          GFile                 *file,
+                                          DzlTrieSerializeFunc   func,
+                                          gpointer               user_data,
+                                          GCancellable          *cancellable,
+                                          GError               **error);
+gboolean     dzl_trie_remove             (DzlTrie               *trie,
+                                          const gchar           *key);
+void         dzl_trie_traverse           (DzlTrie               *trie,
+                                          const gchar           *key,
+                                          GTraverseType          order,
+                                          GTraverseFlags         flags,
+                                          gint                   max_depth,
+                                          DzlTrieTraverseFunc    func,
+                                          gpointer               user_data);
+DzlTrieIter *dzl_trie_iter_new           (DzlTrie               *trie,
+                                          const gchar           *prefix,
+                                          const gchar           *after);
+DzlTrieIter *dzl_trie_iter_new_by_weight (DzlTrie               *trie,
+                                          const gchar           *prefix);
+gboolean     dzl_trie_iter_next          (DzlTrieIter           *iter,
+                                          const gchar          **key,
+                                          gpointer              *value);
+void         dzl_trie_iter_free          (DzlTrieIter           *iter);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DzlTrieIter, dzl_trie_iter_free)
 
 G_END_DECLS
 
@@ -39,6 +39,8 @@
  * To access an item in the heap, use dzl_heap_index().
  *
  * To remove an arbitrary item from the heap, use dzl_heap_extract_index().
+ * To know the index of an item without searching the heap for it, track
+ * its position with dzl_heap_set_index_func().
  *
  * To remove the highest priority item in the heap, use dzl_heap_extract().
  *
@@ -86,13 +88,14 @@ typedef struct _DzlHeapReal DzlHeapReal;
 
 struct _DzlHeapReal
 {
-  gchar          *data;
-  gssize          len;
-  volatile gint   ref_count;
-  guint           element_size;
-  gsize           allocated_len;
-  GCompareFunc    compare;
-  gchar           tmp[0];
+  gchar           *data;
+  gssize           len;
+  volatile gint    ref_count;
+  guint            element_size;
+  gsize            allocated_len;
+  GCompareFunc     compare;
+  DzlHeapIndexFunc index_func;
+  gchar            tmp[0];
 };
 
 #define heap_parent(npos)   (((npos)-1)/2)
@@ -100,11 +103,18 @@ struct _DzlHeapReal
 #define heap_right(npos)    (((npos)*2)+2)
 #define heap_index(h,i)     ((h)->data + (i * (h)->element_size))
 #define heap_compare(h,a,b) ((h)->compare(heap_index(h,a), heap_index(h,b)))
+#define heap_moved(h,i)                                                 \
+  G_STMT_START {                                                        \
+      if ((h)->index_func != NULL)                                      \
+        (h)->index_func (heap_index (h, i), i);                         \
+ } G_STMT_END
 #define heap_swap(h,a,b)                                                \
   G_STMT_START {                                                        \
       memcpy ((h)->tmp, heap_index (h, a), (h)->element_size);          \
       memcpy (heap_index (h, a), heap_index (h, b), (h)->element_size); \
       memcpy (heap_index (h, b), (h)->tmp, (h)->element_size);          \
+      heap_moved (h, a);                                                \
+      heap_moved (h, b);                                                \
  } G_STMT_END
 
 /**
@@ -135,6 +145,7 @@ dzl_heap_new (guint        element_size,
     real->element_size = element_size;
     real->allocated_len = 0;
     real->compare = compare_func;
+    real->index_func = NULL;
 
     return (DzlHeap *)real;
 }
@@ -233,6 +244,8 @@ dzl_heap_real_insert_val (DzlHeapReal   *real,
   ipos = real->len;
   ppos = heap_parent (ipos);
 
+  heap_moved (real, ipos);
+
   while ((ipos > 0) && (heap_compare (real, ppos, ipos) < 0))
     {
       heap_swap (real, ppos, ipos);
@@ -287,6 +300,8 @@ dzl_heap_extract (DzlHeap  *heap,
 
       ipos = 0;
 
+      heap_moved (real, ipos);
+
       while (TRUE)
         {
           lpos = heap_left (ipos);
@@ -348,6 +363,8 @@ dzl_heap_extract_index (DzlHeap  *heap,
       ipos = index_;
       ppos = heap_parent (ipos);
 
+      heap_moved (real, ipos);
+
       while (heap_compare (real, ipos, ppos) > 0)
         {
           heap_swap (real, ipos, ppos);
@@ -385,3 +402,28 @@ dzl_heap_extract_index (DzlHeap  *heap,
 
   return TRUE;
 }
+
+/**
+ * dzl_heap_set_index_func: (skip)
+ * @heap: An #DzlHeap
+ * @index_func: (nullable): A #DzlHeapIndexFunc or %NULL
+ *
+ * Sets a function to be called whenever an element is placed at a new
+ * index of @heap, such as when inserting it or when other elements are
+ * inserted or extracted.
+ *
+ * Elements can then record their index, so that they can be removed with
+ * dzl_heap_extract_index() in O(log n) rather than by searching the heap.
+ *
+ * This should be set before inserting elements into @heap.
+ */
+void
+dzl_heap_set_index_func (DzlHeap          *heap,
+                         DzlHeapIndexFunc  index_func)
+{
+  DzlHeapReal *real = (DzlHeapReal *)heap;
+
+  g_return_if_fail (heap);
+
+  real->index_func = index_func;
+}
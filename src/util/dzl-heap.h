@@ -30,25 +30,40 @@ G_BEGIN_DECLS
 
 typedef struct _DzlHeap DzlHeap;
 
+/**
+ * DzlHeapIndexFunc:
+ * @element: a pointer to the element within the heap
+ * @index_: the index of @element within the heap
+ *
+ * Notifies that @element was placed at @index_ of the heap. See
+ * dzl_heap_set_index_func().
+ */
+typedef void (*DzlHeapIndexFunc) (gpointer element,
+                                  gsize    index_);
+
 struct _DzlHeap
 {
   gchar *data;
   gsize  len;
 };
 
-GType      dzl_heap_get_type      (void);
-DzlHeap   *dzl_heap_new           (guint           element_size,
-                                   GCompareFunc    compare_func);
-DzlHeap   *dzl_heap_ref           (DzlHeap        *heap);
-void       dzl_heap_unref         (DzlHeap        *heap);
-void       dzl_heap_insert_vals   (DzlHeap        *heap,
-                                   gconstpointer   data,
-                                   guint           len);
-gboolean   dzl_heap_extract       (DzlHeap        *heap,
-                                   gpointer        result);
-gboolean   dzl_heap_extract_index (DzlHeap        *heap,
-                                   gsize           index_,
-                                   gpointer        result);
+GType      dzl_heap_get_type       (void);
+DzlHeap   *dzl_heap_new            (guint             element_size,
+                                    GCompareFunc      compare_func);
+DzlHeap   *dzl_heap_ref            (DzlHeap          *heap);
+void       dzl_heap_unref          (DzlHeap          *heap);
+void       dzl_heap_insert_vals    (DzlHeap          *heap,
+                                    gconstpointer     data,
+                                    guint             len);
+gboolean   dzl_heap_extract        (DzlHeap          *heap,
+                                    gpointer          result);
+gboolean   dzl_heap_extract_index  (DzlHeap          *heap,
+                                    gsize             index_,
+                                    gpointer          result);
+void       dzl_heap_set_index_func (DzlHeap          *heap,
+                                    DzlHeapIndexFunc  index_func);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DzlHeap, dzl_heap_unref)
 
 G_END_DECLS
 
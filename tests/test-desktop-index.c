@@ -1,5 +1,8 @@
 #include <dazzle.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "search/dzl-fuzzy-index-private.h"
 
 static GTimer *timer;
 static gchar *last_query;
@@ -251,11 +254,9 @@ static void
 fsck_index (void)
 {
   g_autofree gchar *contents = NULL;
-  g_autoptr(GVariant) variant = NULL;
-  g_autoptr(GVariantIter) iter = NULL;
-  const gchar *key;
-  GVariant *value;
-  GVariantDict dict;
+  const DzlFuzzyIndexHeader *header;
+  const DzlFuzzyIndexTable *directory;
+  const DzlFuzzyIndexItem *items;
   gsize len;
   GError *error = NULL;
   gboolean r;
@@ -264,37 +265,37 @@ fsck_index (void)
   g_assert_no_error (error);
   g_assert (r);
 
-  variant = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT, contents, len, FALSE, NULL, NULL);
-  g_assert (variant != NULL);
-  g_variant_take_ref (variant);
+  g_assert_cmpint (len, >=, sizeof *header);
+  header = (const DzlFuzzyIndexHeader *)(gpointer)contents;
+  g_assert (memcmp (header->magic, DZL_FUZZY_INDEX_MAGIC, DZL_FUZZY_INDEX_MAGIC_LEN) == 0);
+  g_assert_cmpint (header->version, ==, DZL_FUZZY_INDEX_VERSION_2);
+  g_assert_cmpint (header->items_offset + header->n_items * sizeof *items, <=, len);
+  g_assert_cmpint (header->directory_offset + header->n_tables * sizeof *directory, <=, len);
 
-  g_variant_dict_init (&dict, variant);
-
-  r = g_variant_dict_lookup (&dict, "tables", "a{sv}" , &iter);
-  g_assert (r);
+  directory = (const DzlFuzzyIndexTable *)(gpointer)&contents [header->directory_offset];
+  items = (const DzlFuzzyIndexItem *)(gpointer)&contents [header->items_offset];
 
-  while (g_variant_iter_loop (iter, "{sv}", &key, &value))
+  for (guint i = 0; i < header->n_tables; i++)
     {
-      g_autoptr(GVariantIter) aiter = NULL;
       guint last_key_id = 0;
       gint last_offset = -1;
-      guint key_id;
-      guint offset;
 
-      aiter = g_variant_iter_new (value);
-      g_assert (aiter != NULL);
+      if (i > 0)
+        g_assert_cmpint (directory [i - 1].ch, <, directory [i].ch);
 
-      while (g_variant_iter_loop (aiter, "(uu)", &offset, &key_id))
+      g_assert_cmpint (directory [i].offset + directory [i].n_items, <=, header->n_items);
+
+      for (guint j = 0; j < directory [i].n_items; j++)
         {
-          g_assert_cmpint (key_id, >=, last_key_id);
-          if (key_id == last_key_id)
-            g_assert_cmpint (offset, >, last_offset);
-          last_key_id = key_id;
-          last_offset = offset;
+          const DzlFuzzyIndexItem *item = &items [directory [i].offset + j];
+
+          g_assert_cmpint (item->lookaside_id, >=, last_key_id);
+          if (item->lookaside_id == last_key_id)
+            g_assert_cmpint (item->position, >, last_offset);
+          last_key_id = item->lookaside_id;
+          last_offset = item->position;
         }
     }
-
-  g_variant_dict_clear (&dict);
 }
 
 gint
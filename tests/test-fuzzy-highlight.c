@@ -0,0 +1,108 @@
+#include <dazzle.h>
+
+typedef struct
+{
+  const gchar *str;
+  const gchar *match;
+  gboolean     case_sensitive;
+  const gchar *expected;
+} HighlightCheck;
+
+static void
+test_fuzzy_highlight_markup (void)
+{
+  static const HighlightCheck check[] = {
+    { "gtk_widget", "gw", FALSE, "<b>g</b>tk_<b>w</b>idget" },
+    { "gtk_widget", "gtk", FALSE, "<b>gtk</b>_widget" },
+    { "gtk_widget", "GW", FALSE, "<b>g</b>tk_<b>w</b>idget" },
+    { "gtk_widget", "GW", TRUE, "gtk_widget" },
+    { "gtk_widget", "", FALSE, "gtk_widget" },
+    { "gtk_widget", "gtk_widget", FALSE, "<b>gtk_widget</b>" },
+    { "a&amp;b", "ab", FALSE, "<b>a&amp;b</b>" },
+    { "a&amp;b", "a", FALSE, "<b>a&amp;</b>b" },
+    { "it&apos;s", "its", FALSE, "<b>it&apos;s</b>" },
+    { "Ünïcödé", "üd", FALSE, "<b>Ü</b>nïcö<b>d</b>é" },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (check); i++)
+    {
+      g_autofree gchar *markup = dzl_fuzzy_highlight (check[i].str, check[i].match, check[i].case_sensitive);
+      g_assert_cmpstr (markup, ==, check[i].expected);
+    }
+}
+
+static void
+test_fuzzy_highlight_ranges (void)
+{
+  g_autoptr(GArray) ranges = g_array_new (FALSE, FALSE, sizeof (DzlFuzzyHighlightRange));
+  const DzlFuzzyHighlightRange *range;
+
+  dzl_fuzzy_highlight_ranges ("gtk_widget", "gw", FALSE, ranges);
+  g_assert_cmpint (ranges->len, ==, 2);
+  range = &g_array_index (ranges, DzlFuzzyHighlightRange, 0);
+  g_assert_cmpint (range->begin, ==, 0);
+  g_assert_cmpint (range->end, ==, 1);
+  range = &g_array_index (ranges, DzlFuzzyHighlightRange, 1);
+  g_assert_cmpint (range->begin, ==, 4);
+  g_assert_cmpint (range->end, ==, 5);
+
+  /* Ranges are appended, and are byte offsets */
+  dzl_fuzzy_highlight_ranges ("Ünïcödé", "nï", FALSE, ranges);
+  g_assert_cmpint (ranges->len, ==, 3);
+  range = &g_array_index (ranges, DzlFuzzyHighlightRange, 2);
+  g_assert_cmpint (range->begin, ==, 2);
+  g_assert_cmpint (range->end, ==, 5);
+
+  /* Plain text has no entities */
+  g_array_set_size (ranges, 0);
+  dzl_fuzzy_highlight_ranges ("a&amp;b", "a&", FALSE, ranges);
+  g_assert_cmpint (ranges->len, ==, 1);
+  range = &g_array_index (ranges, DzlFuzzyHighlightRange, 0);
+  g_assert_cmpint (range->begin, ==, 0);
+  g_assert_cmpint (range->end, ==, 2);
+
+  g_array_set_size (ranges, 0);
+  dzl_fuzzy_highlight_ranges ("gtk_widget", "xyz", FALSE, ranges);
+  g_assert_cmpint (ranges->len, ==, 0);
+}
+
+static void
+test_fuzzy_highlight_attrs (void)
+{
+  PangoAttrList *attrs = pango_attr_list_new ();
+  PangoAttrIterator *iter;
+  PangoAttribute *attr;
+
+  dzl_fuzzy_highlight_attrs ("gtk_widget", "gw", FALSE, attrs);
+
+  iter = pango_attr_list_get_iterator (attrs);
+
+  attr = pango_attr_iterator_get (iter, PANGO_ATTR_WEIGHT);
+  g_assert_nonnull (attr);
+  g_assert_cmpint (attr->start_index, ==, 0);
+  g_assert_cmpint (attr->end_index, ==, 1);
+  g_assert_cmpint (((PangoAttrInt *)attr)->value, ==, PANGO_WEIGHT_BOLD);
+
+  g_assert_true (pango_attr_iterator_next (iter));
+  g_assert_null (pango_attr_iterator_get (iter, PANGO_ATTR_WEIGHT));
+
+  g_assert_true (pango_attr_iterator_next (iter));
+  attr = pango_attr_iterator_get (iter, PANGO_ATTR_WEIGHT);
+  g_assert_nonnull (attr);
+  g_assert_cmpint (attr->start_index, ==, 4);
+  g_assert_cmpint (attr->end_index, ==, 5);
+
+  pango_attr_iterator_destroy (iter);
+  pango_attr_list_unref (attrs);
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/Dazzle/Fuzzy/highlight/markup", test_fuzzy_highlight_markup);
+  g_test_add_func ("/Dazzle/Fuzzy/highlight/ranges", test_fuzzy_highlight_ranges);
+  g_test_add_func ("/Dazzle/Fuzzy/highlight/attrs", test_fuzzy_highlight_attrs);
+  return g_test_run ();
+}
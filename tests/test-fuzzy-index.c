@@ -17,8 +17,12 @@
  */
 
 #include <dazzle.h>
+#include <string.h>
+
+#include "search/dzl-fuzzy-index-private.h"
 
 static GMainLoop *main_loop;
+static guint n_completed;
 
 static void
 test_index_builder_basic_cb (GObject      *object,
@@ -38,9 +42,8 @@ static void
 test_index_builder_basic (void)
 {
   DzlFuzzyIndexBuilder *builder;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
   gchar *contents = NULL;
-  g_autoptr(GVariant) variant = NULL;
-  GVariantDict dict;
   GVariant *v;
   GError *error = NULL;
   GFile *file;
@@ -75,43 +78,21 @@ test_index_builder_basic (void)
   g_assert_no_error (error);
   g_assert (r);
 
-  variant = g_variant_new_from_data (G_VARIANT_TYPE_VARDICT,
-                                     contents,
-                                     len,
-                                     FALSE,
-                                     g_free,
-                                     contents);
-  g_assert (variant != NULL);
-  g_variant_ref_sink (variant);
-
-#if 0
-  g_print ("%s\n", g_variant_print (variant, TRUE));
-#endif
-
-  g_variant_dict_init (&dict, variant);
-
-  v = g_variant_dict_lookup_value (&dict, "version", G_VARIANT_TYPE_INT32);
-  g_assert (v != NULL);
-  g_variant_unref (v);
-
-  v = g_variant_dict_lookup_value (&dict, "tables", G_VARIANT_TYPE_VARDICT);
-  g_assert (v != NULL);
-  g_variant_unref (v);
-
-  v = g_variant_dict_lookup_value (&dict, "keys", G_VARIANT_TYPE_ARRAY);
-  g_assert (v != NULL);
-  g_variant_unref (v);
+  /* Version 2 indexes are a flat file starting with a magic header */
+  g_assert_cmpint (len, >, 8);
+  g_assert (memcmp (contents, "DZLFUZZY", 8) == 0);
+  g_free (contents);
 
-  v = g_variant_dict_lookup_value (&dict, "lookaside", G_VARIANT_TYPE_ARRAY);
-  g_assert (v != NULL);
-  g_variant_unref (v);
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
 
-  v = g_variant_dict_lookup_value (&dict, "documents", G_VARIANT_TYPE_ARRAY);
+  v = dzl_fuzzy_index_get_metadata (index, "case-sensitive");
   g_assert (v != NULL);
+  g_assert_false (g_variant_get_boolean (v));
   g_variant_unref (v);
 
-  g_variant_dict_clear (&dict);
-
   g_object_unref (builder);
   g_assert (builder == NULL);
 
@@ -262,6 +243,1090 @@ test_index_basic (void)
   g_assert (file == NULL);
 }
 
+static void
+test_index_v1_query_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  DzlFuzzyIndex *index = (DzlFuzzyIndex *)object;
+  g_autoptr(GListModel) matches = NULL;
+  g_autoptr(DzlFuzzyIndexMatch) match = NULL;
+  GError *error = NULL;
+
+  matches = dzl_fuzzy_index_query_finish (index, result, &error);
+  g_assert_no_error (error);
+  g_assert (matches != NULL);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 1);
+
+  match = g_list_model_get_item (matches, 0);
+  g_assert_cmpstr (dzl_fuzzy_index_match_get_key (match), ==, "bar");
+  g_assert_cmpint (g_variant_get_int32 (dzl_fuzzy_index_match_get_document (match)), ==, 2);
+
+  g_main_loop_quit (main_loop);
+}
+
+static void
+test_index_v1 (void)
+{
+  static const gchar *keys[] = { "foo", "bar", "baz", NULL };
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GHashTable) rows = NULL;
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GFile) file = NULL;
+  GVariantBuilder documents;
+  GVariantBuilder lookaside;
+  GVariantDict tables;
+  GVariantDict metadata;
+  GVariantDict dict;
+  GHashTableIter iter;
+  gpointer key, value;
+  GError *error = NULL;
+  gboolean r;
+
+  /*
+   * Build a version 1 index by hand, which was a GVariant of the entire
+   * file, to ensure that we can still load indexes from older builders.
+   */
+  rows = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_variant_builder_unref);
+  g_variant_builder_init (&documents, G_VARIANT_TYPE ("ai"));
+  g_variant_builder_init (&lookaside, G_VARIANT_TYPE ("a(uu)"));
+
+  for (guint i = 0; keys[i]; i++)
+    {
+      g_variant_builder_add (&documents, "i", i + 1);
+      g_variant_builder_add (&lookaside, "(uu)", i, i);
+
+      for (guint j = 0; keys[i][j]; j++)
+        {
+          GVariantBuilder *row = g_hash_table_lookup (rows, GUINT_TO_POINTER (keys[i][j]));
+
+          if (row == NULL)
+            {
+              row = g_variant_builder_new (G_VARIANT_TYPE ("a(uu)"));
+              g_hash_table_insert (rows, GUINT_TO_POINTER (keys[i][j]), row);
+            }
+
+          g_variant_builder_add (row, "(uu)", j, i);
+        }
+    }
+
+  g_variant_dict_init (&tables, NULL);
+  g_hash_table_iter_init (&iter, rows);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      gchar ch[2] = { GPOINTER_TO_UINT (key), 0 };
+      g_variant_dict_insert_value (&tables, ch, g_variant_builder_end (value));
+    }
+
+  g_variant_dict_init (&metadata, NULL);
+  g_variant_dict_insert (&metadata, "case-sensitive", "b", FALSE);
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "version", "i", 1);
+  g_variant_dict_insert_value (&dict, "metadata", g_variant_dict_end (&metadata));
+  g_variant_dict_insert_value (&dict, "keys", g_variant_new_strv (keys, -1));
+  g_variant_dict_insert_value (&dict, "lookaside", g_variant_builder_end (&lookaside));
+  g_variant_dict_insert_value (&dict, "tables", g_variant_dict_end (&tables));
+  g_variant_dict_insert_value (&dict, "documents", g_variant_builder_end (&documents));
+  variant = g_variant_ref_sink (g_variant_dict_end (&dict));
+
+  file = g_file_new_for_path ("index-v1.gvariant");
+  r = g_file_replace_contents (file,
+                               g_variant_get_data (variant),
+                               g_variant_get_size (variant),
+                               NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  dzl_fuzzy_index_query_async (index, "br", 0, NULL, test_index_v1_query_cb, NULL);
+  g_main_loop_run (main_loop);
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static gboolean
+is_subsequence (const gchar *haystack,
+                const gchar *needle)
+{
+  for (; *haystack && *needle; haystack++)
+    {
+      if (*haystack == *needle)
+        needle++;
+    }
+
+  return *needle == 0;
+}
+
+static void
+test_index_large_query_cb (GObject      *object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  DzlFuzzyIndex *index = (DzlFuzzyIndex *)object;
+  g_autoptr(GListModel) matches = NULL;
+  guint *n_items = user_data;
+  GError *error = NULL;
+
+  matches = dzl_fuzzy_index_query_finish (index, result, &error);
+  g_assert_no_error (error);
+  g_assert (matches != NULL);
+
+  *n_items = g_list_model_get_n_items (matches);
+
+  /* Results must be sorted by score */
+  for (guint i = 1; i < *n_items; i++)
+    {
+      g_autoptr(DzlFuzzyIndexMatch) a = g_list_model_get_item (matches, i - 1);
+      g_autoptr(DzlFuzzyIndexMatch) b = g_list_model_get_item (matches, i);
+
+      g_assert_cmpfloat (dzl_fuzzy_index_match_get_score (a), >=, dzl_fuzzy_index_match_get_score (b));
+    }
+
+  /* The batch accessor must agree with the match objects */
+  if (DZL_IS_FUZZY_INDEX_CURSOR (matches))
+    {
+      g_autofree DzlFuzzyIndexCursorMatch *batch = g_new0 (DzlFuzzyIndexCursorMatch, *n_items);
+      guint n_batch;
+
+      n_batch = dzl_fuzzy_index_cursor_get_matches (DZL_FUZZY_INDEX_CURSOR (matches), 0, batch, *n_items);
+      g_assert_cmpint (n_batch, ==, *n_items);
+
+      for (guint i = 0; i < n_batch; i++)
+        {
+          g_autoptr(DzlFuzzyIndexMatch) match = g_list_model_get_item (matches, i);
+          g_autoptr(DzlFuzzyIndexMatch) again = g_list_model_get_item (matches, i);
+          g_autoptr(GVariant) document = NULL;
+
+          document = dzl_fuzzy_index_cursor_get_document (DZL_FUZZY_INDEX_CURSOR (matches), batch[i].document_id);
+
+          g_assert (match == again);
+          g_assert_cmpstr (batch[i].key, ==, dzl_fuzzy_index_match_get_key (match));
+          g_assert_cmpfloat (batch[i].score, ==, dzl_fuzzy_index_match_get_score (match));
+          g_assert (g_variant_equal (document, dzl_fuzzy_index_match_get_document (match)));
+        }
+
+      g_assert_cmpint (dzl_fuzzy_index_cursor_get_matches (DZL_FUZZY_INDEX_CURSOR (matches), *n_items, batch, *n_items), ==, 0);
+    }
+
+  g_main_loop_quit (main_loop);
+}
+
+static void
+test_index_memory_budget (void)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(GFile) file1 = NULL;
+  g_autoptr(GFile) file2 = NULL;
+  g_autofree gchar *contents1 = NULL;
+  g_autofree gchar *contents2 = NULL;
+  gsize len1 = 0;
+  gsize len2 = 0;
+  GError *error = NULL;
+  gboolean r;
+
+  builder = dzl_fuzzy_index_builder_new ();
+
+  for (guint i = 0; i < 20000; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("gtk_widget_%05u", (i * 7919) % 20000);
+
+      dzl_fuzzy_index_builder_insert (builder, key, g_variant_new_uint32 (i), i % 3);
+    }
+
+  file1 = g_file_new_for_path ("index-unbounded.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file1, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  /* Force many sorted runs to be spilled and merged */
+  dzl_fuzzy_index_builder_set_memory_budget (builder, 16 * 1024);
+  g_assert_cmpint (dzl_fuzzy_index_builder_get_memory_budget (builder), ==, 16 * 1024);
+
+  file2 = g_file_new_for_path ("index-budget.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file2, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  /* Spilling must not change the output */
+  r = g_file_load_contents (file1, NULL, &contents1, &len1, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  r = g_file_load_contents (file2, NULL, &contents2, &len2, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  g_assert_cmpint (len1, ==, len2);
+  g_assert (memcmp (contents1, contents2, len1) == 0);
+
+  r = g_file_delete (file1, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  r = g_file_delete (file2, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static void
+test_index_layers_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  DzlFuzzyIndex *index = (DzlFuzzyIndex *)object;
+  GListModel **matches = user_data;
+  GError *error = NULL;
+
+  *matches = dzl_fuzzy_index_query_finish (index, result, &error);
+  g_assert_no_error (error);
+  g_assert (*matches != NULL);
+
+  g_main_loop_quit (main_loop);
+}
+
+static void
+test_index_layers_compact_cb (GObject      *object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  DzlFuzzyIndex *index = (DzlFuzzyIndex *)object;
+  GError *error = NULL;
+  gboolean r;
+
+  r = dzl_fuzzy_index_compact_finish (index, result, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  g_main_loop_quit (main_loop);
+}
+
+static DzlFuzzyIndex *
+load_index (GFile *file)
+{
+  DzlFuzzyIndex *index = dzl_fuzzy_index_new ();
+  GError *error = NULL;
+  gboolean r;
+
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  return index;
+}
+
+static void
+assert_layer_matches (GListModel  *matches,
+                      const gchar *first_key,
+                      guint32      first_document)
+{
+  g_autoptr(DzlFuzzyIndexMatch) match = NULL;
+
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 2);
+
+  match = g_list_model_get_item (matches, 0);
+  g_assert_cmpstr (dzl_fuzzy_index_match_get_key (match), ==, first_key);
+  g_assert_cmpint (g_variant_get_uint32 (dzl_fuzzy_index_match_get_document (match)), ==, first_document);
+}
+
+static void
+test_index_layers (void)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) base_builder = NULL;
+  g_autoptr(DzlFuzzyIndexBuilder) delta_builder = NULL;
+  g_autoptr(DzlFuzzyIndex) base = NULL;
+  g_autoptr(DzlFuzzyIndex) delta = NULL;
+  g_autoptr(DzlFuzzyIndex) compacted = NULL;
+  g_autoptr(GListModel) matches = NULL;
+  g_autoptr(GFile) base_file = NULL;
+  g_autoptr(GFile) delta_file = NULL;
+  g_autoptr(GFile) compact_file = NULL;
+  GError *error = NULL;
+  gboolean r;
+
+  base_builder = dzl_fuzzy_index_builder_new ();
+  dzl_fuzzy_index_builder_insert (base_builder, "foo_bar", g_variant_new_uint32 (1), 0);
+  dzl_fuzzy_index_builder_insert (base_builder, "foo_baz", g_variant_new_uint32 (2), 0);
+  dzl_fuzzy_index_builder_insert (base_builder, "food", g_variant_new_uint32 (3), 0);
+  dzl_fuzzy_index_builder_insert (base_builder, "file_buffer", g_variant_new_uint32 (4), 0);
+
+  base_file = g_file_new_for_path ("index-base.gvariant");
+  r = dzl_fuzzy_index_builder_write (base_builder, base_file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  /* Remove document 1 and replace document 2 with a new key */
+  delta_builder = dzl_fuzzy_index_builder_new ();
+  dzl_fuzzy_index_builder_add_tombstone (delta_builder, g_variant_new_uint32 (1));
+  dzl_fuzzy_index_builder_add_tombstone (delta_builder, g_variant_new_uint32 (2));
+  dzl_fuzzy_index_builder_insert (delta_builder, "fb", g_variant_new_uint32 (2), 0);
+
+  delta_file = g_file_new_for_path ("index-delta.gvariant");
+  r = dzl_fuzzy_index_builder_write (delta_builder, delta_file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  base = load_index (base_file);
+  delta = load_index (delta_file);
+  dzl_fuzzy_index_add_delta (base, delta);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  dzl_fuzzy_index_query_async (base, "fb", 0, NULL, test_index_layers_cb, &matches);
+  g_main_loop_run (main_loop);
+  assert_layer_matches (matches, "fb", 2);
+  g_clear_object (&matches);
+
+  /* Tombstones must not starve a bounded query */
+  dzl_fuzzy_index_query_async (base, "fb", 2, NULL, test_index_layers_cb, &matches);
+  g_main_loop_run (main_loop);
+  assert_layer_matches (matches, "fb", 2);
+  g_clear_object (&matches);
+
+  compact_file = g_file_new_for_path ("index-compact.gvariant");
+  dzl_fuzzy_index_compact_async (base, compact_file, G_PRIORITY_DEFAULT, NULL, test_index_layers_compact_cb, NULL);
+  g_main_loop_run (main_loop);
+
+  compacted = load_index (compact_file);
+  dzl_fuzzy_index_query_async (compacted, "fb", 0, NULL, test_index_layers_cb, &matches);
+  g_main_loop_run (main_loop);
+  assert_layer_matches (matches, "fb", 2);
+  g_clear_object (&matches);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  g_assert (g_file_delete (base_file, NULL, NULL));
+  g_assert (g_file_delete (delta_file, NULL, NULL));
+  g_assert (g_file_delete (compact_file, NULL, NULL));
+}
+
+static void
+test_index_refine_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  DzlFuzzyIndex *index = (DzlFuzzyIndex *)object;
+  GListModel **matches = user_data;
+  GError *error = NULL;
+
+  *matches = dzl_fuzzy_index_query_refine_finish (index, result, &error);
+  g_assert_no_error (error);
+  g_assert (*matches != NULL);
+
+  g_main_loop_quit (main_loop);
+}
+
+static void
+test_index_refine (void)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GListModel) first = NULL;
+  g_autoptr(GListModel) second = NULL;
+  g_autoptr(GListModel) third = NULL;
+  g_autoptr(GFile) file = NULL;
+  GError *error = NULL;
+  guint expected = 0;
+  guint expected_w1 = 0;
+  gboolean r;
+
+  builder = dzl_fuzzy_index_builder_new ();
+
+  for (guint i = 0; i < 20000; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("gtk_widget_%05u", i);
+
+      dzl_fuzzy_index_builder_insert (builder, key, g_variant_new_uint32 (i), 0);
+
+      if (is_subsequence (key, "gw123"))
+        expected++;
+
+      if (is_subsequence (key, "w1"))
+        expected_w1++;
+    }
+
+  file = g_file_new_for_path ("index-refine.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  dzl_fuzzy_index_query_refine_async (index, NULL, "gw1", 0, NULL, test_index_refine_cb, &first);
+  g_main_loop_run (main_loop);
+
+  dzl_fuzzy_index_query_refine_async (index, first, "gw12", 0, NULL, test_index_refine_cb, &second);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (g_list_model_get_n_items (second), <=, g_list_model_get_n_items (first));
+
+  dzl_fuzzy_index_query_refine_async (index, second, "gw123", 0, NULL, test_index_refine_cb, &third);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (expected, >, 0);
+  g_assert_cmpint (g_list_model_get_n_items (third), ==, expected);
+
+  /* A query that does not extend the previous one falls back to a full query */
+  g_clear_object (&second);
+  dzl_fuzzy_index_query_refine_async (index, third, "gw2", 0, NULL, test_index_refine_cb, &second);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (g_list_model_get_n_items (second), >, g_list_model_get_n_items (third));
+
+  /* Single character queries record candidates too, so they can be refined */
+  g_clear_object (&first);
+  g_clear_object (&second);
+  g_clear_object (&third);
+
+  dzl_fuzzy_index_query_refine_async (index, NULL, "w", 0, NULL, test_index_refine_cb, &first);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (g_list_model_get_n_items (first), ==, 20000);
+
+  dzl_fuzzy_index_query_refine_async (index, first, "w1", 0, NULL, test_index_refine_cb, &second);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (expected_w1, >, 0);
+  g_assert_cmpint (g_list_model_get_n_items (second), ==, expected_w1);
+
+  dzl_fuzzy_index_query_refine_async (index, second, "w12", 0, NULL, test_index_refine_cb, &third);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (g_list_model_get_n_items (third), <=, g_list_model_get_n_items (second));
+  g_assert_cmpint (g_list_model_get_n_items (third), >, 0);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static void
+assert_same_matches (GListModel *a,
+                     GListModel *b)
+{
+  guint n_items = g_list_model_get_n_items (a);
+  g_autofree DzlFuzzyIndexCursorMatch *matches_a = g_new0 (DzlFuzzyIndexCursorMatch, n_items);
+  g_autofree DzlFuzzyIndexCursorMatch *matches_b = g_new0 (DzlFuzzyIndexCursorMatch, n_items);
+
+  g_assert_cmpint (n_items, ==, g_list_model_get_n_items (b));
+  g_assert_cmpint (n_items, ==, dzl_fuzzy_index_cursor_get_matches (DZL_FUZZY_INDEX_CURSOR (a), 0, matches_a, n_items));
+  g_assert_cmpint (n_items, ==, dzl_fuzzy_index_cursor_get_matches (DZL_FUZZY_INDEX_CURSOR (b), 0, matches_b, n_items));
+
+  for (guint i = 0; i < n_items; i++)
+    {
+      g_assert_cmpstr (matches_a[i].key, ==, matches_b[i].key);
+      g_assert_cmpint (matches_a[i].document_id, ==, matches_b[i].document_id);
+      g_assert_cmpfloat (matches_a[i].score, ==, matches_b[i].score);
+    }
+}
+
+static void
+get_counter_cb (DzlCounter *counter,
+                gpointer    user_data)
+{
+  DzlCounter **found = user_data;
+
+  if (g_strcmp0 (counter->category, "DzlFuzzyIndex") == 0 &&
+      g_strcmp0 (counter->name, "Cache Hits") == 0)
+    *found = counter;
+}
+
+static gint64
+get_cache_hits (void)
+{
+  DzlCounter *counter = NULL;
+
+  dzl_counter_arena_foreach (dzl_counter_arena_get_default (), get_counter_cb, &counter);
+  g_assert (counter != NULL);
+
+  return dzl_counter_get (counter);
+}
+
+static void
+test_index_cache (void)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GListModel) first = NULL;
+  g_autoptr(GListModel) second = NULL;
+  g_autoptr(GListModel) bounded = NULL;
+  g_autoptr(GListModel) uncached = NULL;
+  g_autoptr(GFile) file = NULL;
+  GError *error = NULL;
+  gint64 hits;
+  gboolean r;
+
+  builder = dzl_fuzzy_index_builder_new ();
+
+  for (guint i = 0; i < 20000; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("gtk_widget_%05u", i);
+      dzl_fuzzy_index_builder_insert (builder, key, g_variant_new_uint32 (i), 0);
+    }
+
+  file = g_file_new_for_path ("index-cache.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  dzl_fuzzy_index_set_cache_budget (index, 1024 * 1024);
+  g_assert_cmpint (dzl_fuzzy_index_get_cache_budget (index), ==, 1024 * 1024);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  hits = get_cache_hits ();
+  dzl_fuzzy_index_query_refine_async (index, NULL, "gw12", 0, NULL, test_index_refine_cb, &first);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (g_list_model_get_n_items (first), >, 0);
+  g_assert_cmpint (get_cache_hits (), ==, hits);
+
+  /* Served from the cache */
+  dzl_fuzzy_index_query_refine_async (index, NULL, "gw12", 0, NULL, test_index_refine_cb, &second);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (get_cache_hits (), ==, hits + 1);
+  g_assert (first != second);
+  assert_same_matches (first, second);
+
+  /* A different max_matches is a different query */
+  dzl_fuzzy_index_query_refine_async (index, NULL, "gw12", 5, NULL, test_index_refine_cb, &bounded);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (get_cache_hits (), ==, hits + 1);
+  g_assert_cmpint (g_list_model_get_n_items (bounded), ==, 5);
+
+  /* Too small for any results, so everything is evicted */
+  dzl_fuzzy_index_set_cache_budget (index, 1);
+  dzl_fuzzy_index_query_refine_async (index, NULL, "gw12", 0, NULL, test_index_refine_cb, &uncached);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (get_cache_hits (), ==, hits + 1);
+  assert_same_matches (first, uncached);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static void
+test_index_large (void)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GFile) file = NULL;
+  GError *error = NULL;
+  guint expected = 0;
+  guint n_items = 0;
+  gboolean r;
+
+  /*
+   * Large enough that the first table is split into multiple shards,
+   * which must produce the same results as a single walk.
+   */
+  builder = dzl_fuzzy_index_builder_new ();
+
+  for (guint i = 0; i < 50000; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("gtk_widget_%05u", i);
+
+      dzl_fuzzy_index_builder_insert (builder, key, g_variant_new_uint32 (i), 0);
+
+      if (is_subsequence (key, "gw99"))
+        expected++;
+    }
+
+  file = g_file_new_for_path ("index-large.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  dzl_fuzzy_index_query_async (index, "gw99", 0, NULL, test_index_large_query_cb, &n_items);
+  g_main_loop_run (main_loop);
+
+  g_assert_cmpint (expected, >, 10);
+  g_assert_cmpint (n_items, ==, expected);
+
+  /* Now with a bounded number of results */
+  dzl_fuzzy_index_query_async (index, "gw99", 10, NULL, test_index_large_query_cb, &n_items);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (n_items, ==, 10);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static void
+test_index_errors_cb (GObject      *object,
+                      GAsyncResult *result,
+                      gpointer      user_data)
+{
+  GListModel **matches = user_data;
+  GError *error = NULL;
+
+  *matches = G_LIST_MODEL (g_async_initable_new_finish (G_ASYNC_INITABLE (object), result, &error));
+  g_assert_no_error (error);
+  g_assert (*matches != NULL);
+
+  g_main_loop_quit (main_loop);
+}
+
+static void
+test_index_invalid_lookaside (void)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree gchar *contents = NULL;
+  DzlFuzzyIndexHeader *header;
+  DzlFuzzyIndexLookaside *lookaside;
+  GError *error = NULL;
+  gsize length = 0;
+  gboolean r;
+
+  builder = dzl_fuzzy_index_builder_new ();
+  dzl_fuzzy_index_builder_insert (builder, "foo", g_variant_new_uint32 (1), 0);
+  dzl_fuzzy_index_builder_insert (builder, "bar", g_variant_new_uint32 (2), 0);
+
+  file = g_file_new_for_path ("index-invalid.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  r = g_file_load_contents (file, NULL, &contents, &length, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+  g_assert_cmpint (length, >=, sizeof *header);
+
+  /* Point the first key at a document that does not exist */
+  header = (DzlFuzzyIndexHeader *)(gpointer)contents;
+  g_assert_cmpint (header->n_lookaside, >, 0);
+  lookaside = (DzlFuzzyIndexLookaside *)(gpointer)&contents [header->lookaside_offset];
+  lookaside [0].document_id = 1000;
+
+  r = g_file_replace_contents (file, contents, length, NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+  g_assert (!r);
+  g_clear_error (&error);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static GListModel *
+query_with_errors (DzlFuzzyIndex *index,
+                   const gchar   *query,
+                   guint          max_errors)
+{
+  GListModel *matches = NULL;
+
+  g_async_initable_new_async (DZL_TYPE_FUZZY_INDEX_CURSOR,
+                              G_PRIORITY_DEFAULT,
+                              NULL,
+                              test_index_errors_cb,
+                              &matches,
+                              "index", index,
+                              "query", query,
+                              "max-errors", max_errors,
+                              NULL);
+  g_main_loop_run (main_loop);
+
+  return matches;
+}
+
+static void
+test_index_errors (void)
+{
+  static const gchar *keys[] = {
+    "gtk_widget_show",
+    "gtk_widget_hide",
+    "gtk_window_new",
+    "gtk_wdiget_typo",
+    "pango_layout_new",
+  };
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(DzlFuzzyIndexMatch) first = NULL;
+  g_autoptr(GFile) file = NULL;
+  GListModel *previous;
+  GListModel *matches;
+  GError *error = NULL;
+  gboolean r;
+
+  builder = dzl_fuzzy_index_builder_new ();
+  for (guint i = 0; i < G_N_ELEMENTS (keys); i++)
+    dzl_fuzzy_index_builder_insert (builder, keys[i], g_variant_new_uint32 (i), 0);
+
+  file = g_file_new_for_path ("index-errors.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  /* Swapped characters */
+  matches = query_with_errors (index, "wdiget", 0);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 1);
+  g_object_unref (matches);
+
+  matches = query_with_errors (index, "wdiget", 1);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 3);
+  first = g_list_model_get_item (matches, 0);
+  g_assert_cmpstr (dzl_fuzzy_index_match_get_key (first), ==, "gtk_wdiget_typo");
+  g_object_unref (matches);
+
+  /* A character that is in no key at all */
+  matches = query_with_errors (index, "wxidget", 0);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 0);
+  g_object_unref (matches);
+
+  matches = query_with_errors (index, "wxidget", 1);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 2);
+  g_object_unref (matches);
+
+  /* Mistyped characters */
+  matches = query_with_errors (index, "pangp_lay", 1);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 1);
+  g_object_unref (matches);
+
+  /* Some character of the query must always match */
+  matches = query_with_errors (index, "xq", 3);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 0);
+  g_object_unref (matches);
+
+  /* Queries of the index use its max-errors, including refined queries */
+  dzl_fuzzy_index_set_max_errors (index, 1);
+  g_assert_cmpint (dzl_fuzzy_index_get_max_errors (index), ==, 1);
+  dzl_fuzzy_index_query_async (index, "wdiget", 0, NULL, test_index_layers_cb, &matches);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 3);
+
+  previous = g_steal_pointer (&matches);
+  dzl_fuzzy_index_set_max_errors (index, 0);
+  dzl_fuzzy_index_query_refine_async (index, previous, "wdiget_", 0, NULL, test_index_layers_cb, &matches);
+  g_main_loop_run (main_loop);
+  g_assert_cmpint (g_list_model_get_n_items (matches), ==, 1);
+  g_object_unref (matches);
+  g_object_unref (previous);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static GListModel *
+query_with_max_matches (DzlFuzzyIndex *index,
+                        const gchar   *query,
+                        guint          max_matches)
+{
+  GListModel *matches = NULL;
+
+  g_async_initable_new_async (DZL_TYPE_FUZZY_INDEX_CURSOR,
+                              G_PRIORITY_DEFAULT,
+                              NULL,
+                              test_index_errors_cb,
+                              &matches,
+                              "index", index,
+                              "query", query,
+                              "max-matches", max_matches,
+                              NULL);
+  g_main_loop_run (main_loop);
+
+  return matches;
+}
+
+static DzlFuzzyIndexCursorMatch *
+get_cursor_matches (GListModel *matches,
+                    guint      *n_matches)
+{
+  guint n_items = g_list_model_get_n_items (matches);
+  DzlFuzzyIndexCursorMatch *ret = g_new0 (DzlFuzzyIndexCursorMatch, MAX (1, n_items));
+
+  g_assert_cmpint (n_items, ==, dzl_fuzzy_index_cursor_get_matches (DZL_FUZZY_INDEX_CURSOR (matches), 0, ret, n_items));
+  *n_matches = n_items;
+
+  return ret;
+}
+
+static void
+test_index_duplicates (void)
+{
+  static const guint max_matches[] = { 1, 2, 7, 50, 199, 200, 1000, G_MAXUINT / 2, G_MAXUINT / 2 + 1, G_MAXUINT };
+  static const gchar *formats[] = { "xfxoxo_%03u", "f_o_o_%03u", "fo_o_%03u", "foo_%03u" };
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GListModel) all = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree DzlFuzzyIndexCursorMatch *all_matches = NULL;
+  GError *error = NULL;
+  guint n_all;
+  gboolean r;
+
+  /* Every document has several keys, the best of which is inserted last */
+  builder = dzl_fuzzy_index_builder_new ();
+  for (guint i = 0; i < 200; i++)
+    {
+      for (guint j = 0; j < G_N_ELEMENTS (formats); j++)
+        {
+          g_autofree gchar *key = g_strdup_printf (formats[j], i);
+          dzl_fuzzy_index_builder_insert (builder, key, g_variant_new_uint32 (i), 0);
+        }
+    }
+
+  file = g_file_new_for_path ("index-duplicates.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  /* Without max_matches, each document is returned once for its best key */
+  all = query_with_max_matches (index, "foo", 0);
+  all_matches = get_cursor_matches (all, &n_all);
+  g_assert_cmpint (n_all, ==, 200);
+
+  for (guint i = 0; i < n_all; i++)
+    g_assert_true (g_str_has_prefix (all_matches[i].key, "foo_"));
+
+  /* The bounded heap must select the same documents, with the same keys */
+  for (guint m = 0; m < G_N_ELEMENTS (max_matches); m++)
+    {
+      g_autoptr(GListModel) best = NULL;
+      g_autoptr(GHashTable) seen = g_hash_table_new (NULL, NULL);
+      g_autofree DzlFuzzyIndexCursorMatch *best_matches = NULL;
+      guint n_best;
+
+      best = query_with_max_matches (index, "foo", max_matches[m]);
+      best_matches = get_cursor_matches (best, &n_best);
+      g_assert_cmpint (n_best, ==, MIN (max_matches[m], n_all));
+
+      for (guint i = 0; i < n_best; i++)
+        {
+          g_assert_false (g_hash_table_contains (seen, GUINT_TO_POINTER (best_matches[i].document_id)));
+          g_hash_table_add (seen, GUINT_TO_POINTER (best_matches[i].document_id));
+
+          g_assert_cmpint (best_matches[i].document_id, ==, all_matches[i].document_id);
+          g_assert_cmpstr (best_matches[i].key, ==, all_matches[i].key);
+          g_assert_cmpfloat (best_matches[i].score, ==, all_matches[i].score);
+        }
+    }
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static void
+test_index_errors_order (void)
+{
+  static const struct {
+    const gchar *key;
+    guint        priority;
+  } keys[] = {
+    { "w_i_d_g_e_t_spread_out", 5 },
+    { "wdiget",                 5 },
+    { "wdigte",                 5 },
+    { "widget_low_priority",    9 },
+    { "wdiget_high_priority",   1 },
+  };
+  static const gchar *expected[] = {
+    "wdiget_high_priority",
+    "w_i_d_g_e_t_spread_out",
+    "wdiget",
+    "wdigte",
+    "widget_low_priority",
+  };
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GListModel) matches = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree DzlFuzzyIndexCursorMatch *results = NULL;
+  GError *error = NULL;
+  guint n_results;
+  gboolean r;
+
+  builder = dzl_fuzzy_index_builder_new ();
+  for (guint i = 0; i < G_N_ELEMENTS (keys); i++)
+    dzl_fuzzy_index_builder_insert (builder, keys[i].key, g_variant_new_uint32 (i), keys[i].priority);
+
+  file = g_file_new_for_path ("index-errors-order.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  /*
+   * Priority comes first. Within a priority, the exact match ranks above
+   * the tighter matches with one error, which are less than four times
+   * tighter, and those rank above two errors.
+   */
+  matches = query_with_errors (index, "widget", 2);
+  results = get_cursor_matches (matches, &n_results);
+  g_assert_cmpint (n_results, ==, G_N_ELEMENTS (expected));
+
+  for (guint i = 0; i < n_results; i++)
+    {
+      g_assert_cmpstr (results[i].key, ==, expected[i]);
+      if (i > 0)
+        g_assert_cmpfloat (results[i].score, <, results[i - 1].score);
+    }
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
+static void
+test_index_latest_wins_cb (GObject      *object,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  DzlFuzzyIndex *index = (DzlFuzzyIndex *)object;
+  g_autoptr(GListModel) matches = NULL;
+  GError **error = user_data;
+
+  matches = dzl_fuzzy_index_query_finish (index, result, error);
+
+  if (matches != NULL)
+    g_assert_cmpint (g_list_model_get_n_items (matches), >, 0);
+  else
+    g_assert (*error != NULL);
+
+  if (++n_completed == 2)
+    g_main_loop_quit (main_loop);
+}
+
+static void
+test_index_latest_wins (void)
+{
+  g_autoptr(DzlFuzzyIndexBuilder) builder = NULL;
+  g_autoptr(DzlFuzzyIndex) index = NULL;
+  g_autoptr(GFile) file = NULL;
+  GError *first_error = NULL;
+  GError *second_error = NULL;
+  GError *error = NULL;
+  gboolean r;
+
+  builder = dzl_fuzzy_index_builder_new ();
+
+  for (guint i = 0; i < 50000; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("gtk_widget_%05u", i);
+      dzl_fuzzy_index_builder_insert (builder, key, g_variant_new_uint32 (i), 0);
+    }
+
+  file = g_file_new_for_path ("index-latest-wins.gvariant");
+  r = dzl_fuzzy_index_builder_write (builder, file, G_PRIORITY_DEFAULT, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  index = dzl_fuzzy_index_new ();
+  r = dzl_fuzzy_index_load_file (index, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+
+  g_assert_false (dzl_fuzzy_index_get_latest_wins (index));
+  dzl_fuzzy_index_set_latest_wins (index, TRUE);
+  g_assert_true (dzl_fuzzy_index_get_latest_wins (index));
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  /* The second query supersedes the first, as if typed into an entry */
+  n_completed = 0;
+  dzl_fuzzy_index_query_async (index, "gw", 0, NULL, test_index_latest_wins_cb, &first_error);
+  dzl_fuzzy_index_query_async (index, "gw9", 0, NULL, test_index_latest_wins_cb, &second_error);
+  g_main_loop_run (main_loop);
+
+  g_assert_error (first_error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_no_error (second_error);
+  g_clear_error (&first_error);
+
+  /* Without the policy, both queries complete */
+  dzl_fuzzy_index_set_latest_wins (index, FALSE);
+  n_completed = 0;
+  dzl_fuzzy_index_query_async (index, "gw", 0, NULL, test_index_latest_wins_cb, &first_error);
+  dzl_fuzzy_index_query_async (index, "gw9", 0, NULL, test_index_latest_wins_cb, &second_error);
+  g_main_loop_run (main_loop);
+
+  g_assert_no_error (first_error);
+  g_assert_no_error (second_error);
+
+  /* Results served from the cache are superseded as well */
+  dzl_fuzzy_index_set_cache_budget (index, 8 * 1024 * 1024);
+  n_completed = 0;
+  dzl_fuzzy_index_query_async (index, "gw9", 0, NULL, test_index_latest_wins_cb, &first_error);
+  dzl_fuzzy_index_query_async (index, "gw1", 0, NULL, test_index_latest_wins_cb, &second_error);
+  g_main_loop_run (main_loop);
+
+  g_assert_no_error (first_error);
+  g_assert_no_error (second_error);
+
+  dzl_fuzzy_index_set_latest_wins (index, TRUE);
+  n_completed = 0;
+  dzl_fuzzy_index_query_async (index, "gw9", 0, NULL, test_index_latest_wins_cb, &first_error);
+  dzl_fuzzy_index_query_async (index, "gw1", 0, NULL, test_index_latest_wins_cb, &second_error);
+  g_main_loop_run (main_loop);
+
+  g_assert_error (first_error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_no_error (second_error);
+  g_clear_error (&first_error);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+
+  r = g_file_delete (file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert (r);
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -269,5 +1334,16 @@ main (gint   argc,
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/Dazzle/Fuzzy/IndexBuilder/basic", test_index_builder_basic);
   g_test_add_func ("/Dazzle/Fuzzy/Index/basic", test_index_basic);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/v1", test_index_v1);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/invalid-lookaside", test_index_invalid_lookaside);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/large", test_index_large);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/refine", test_index_refine);
+  g_test_add_func ("/Dazzle/Fuzzy/IndexBuilder/memory-budget", test_index_memory_budget);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/layers", test_index_layers);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/errors", test_index_errors);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/errors-order", test_index_errors_order);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/duplicates", test_index_duplicates);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/cache", test_index_cache);
+  g_test_add_func ("/Dazzle/Fuzzy/Index/latest-wins", test_index_latest_wins);
   return g_test_run ();
 }
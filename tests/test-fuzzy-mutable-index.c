@@ -15,9 +15,375 @@ compare_match (gconstpointer a,
   return 0;
 }
 
-gint
-main (gint   argc,
-      gchar *argv[])
+static GArray *
+sorted_matches (DzlFuzzyMutableIndex *fuzzy,
+                const gchar          *needle)
+{
+  GArray *matches = dzl_fuzzy_mutable_index_match (fuzzy, needle, 0);
+  g_array_sort (matches, compare_match);
+  return matches;
+}
+
+static gboolean
+has_match (GArray      *matches,
+           const gchar *key)
+{
+  for (guint i = 0; i < matches->len; i++)
+    {
+      if (g_str_equal (g_array_index (matches, DzlFuzzyMutableIndexMatch, i).key, key))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+test_max_matches (void)
+{
+  DzlFuzzyMutableIndex *fuzzy;
+  g_autoptr(GArray) all = NULL;
+  g_autoptr(GArray) best = NULL;
+  static const gchar *keys[] = {
+    "foo", "foobar", "f_o_o", "fxoxo", "foo_bar_baz", "afoo", "fooo", "frobnicate_o_o",
+  };
+
+  fuzzy = dzl_fuzzy_mutable_index_new (FALSE);
+
+  for (guint i = 0; i < G_N_ELEMENTS (keys); i++)
+    dzl_fuzzy_mutable_index_insert (fuzzy, keys[i], GUINT_TO_POINTER (i + 1));
+
+  all = sorted_matches (fuzzy, "foo");
+  g_assert_cmpint (all->len, ==, G_N_ELEMENTS (keys));
+
+  /* The bounded heap must select the same best matches, best first */
+  for (guint max_matches = 1; max_matches <= G_N_ELEMENTS (keys) + 1; max_matches++)
+    {
+      best = dzl_fuzzy_mutable_index_match (fuzzy, "foo", max_matches);
+      g_assert_cmpint (best->len, ==, MIN (max_matches, all->len));
+
+      for (guint i = 0; i < best->len; i++)
+        {
+          const DzlFuzzyMutableIndexMatch *a = &g_array_index (all, DzlFuzzyMutableIndexMatch, i);
+          const DzlFuzzyMutableIndexMatch *b = &g_array_index (best, DzlFuzzyMutableIndexMatch, i);
+
+          g_assert_cmpfloat (a->score, ==, b->score);
+          if (i > 0)
+            g_assert_cmpfloat (b->score, <=, g_array_index (best, DzlFuzzyMutableIndexMatch, i - 1).score);
+        }
+
+      g_clear_pointer (&best, g_array_unref);
+    }
+
+  /* Single character queries take a separate path */
+  best = dzl_fuzzy_mutable_index_match (fuzzy, "f", 2);
+  g_assert_cmpint (best->len, ==, 2);
+  g_assert_cmpfloat (g_array_index (best, DzlFuzzyMutableIndexMatch, 0).score, >=,
+                     g_array_index (best, DzlFuzzyMutableIndexMatch, 1).score);
+
+  dzl_fuzzy_mutable_index_unref (fuzzy);
+}
+
+static void
+test_max_matches_removed (void)
+{
+  DzlFuzzyMutableIndex *fuzzy;
+  g_autoptr(GArray) matches = NULL;
+
+  fuzzy = dzl_fuzzy_mutable_index_new (FALSE);
+
+  dzl_fuzzy_mutable_index_insert (fuzzy, "foo", GUINT_TO_POINTER (1));
+  dzl_fuzzy_mutable_index_insert (fuzzy, "foobar", GUINT_TO_POINTER (2));
+  dzl_fuzzy_mutable_index_insert (fuzzy, "foo_bar_baz", GUINT_TO_POINTER (3));
+  dzl_fuzzy_mutable_index_insert (fuzzy, "f_o_o_bar_baz", GUINT_TO_POINTER (4));
+
+  /* Removing the best matches must not leave gaps in the results */
+  dzl_fuzzy_mutable_index_remove (fuzzy, "foo");
+  dzl_fuzzy_mutable_index_remove (fuzzy, "foobar");
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "foo", 2);
+  g_assert_cmpint (matches->len, ==, 2);
+  g_assert_cmpstr (g_array_index (matches, DzlFuzzyMutableIndexMatch, 0).key, ==, "foo_bar_baz");
+  g_assert_cmpstr (g_array_index (matches, DzlFuzzyMutableIndexMatch, 1).key, ==, "f_o_o_bar_baz");
+  g_clear_pointer (&matches, g_array_unref);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "f", 1);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_false (has_match (matches, "foo"));
+  g_assert_false (has_match (matches, "foobar"));
+  g_clear_pointer (&matches, g_array_unref);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "foo", 0);
+  g_assert_cmpint (matches->len, ==, 2);
+  g_assert_false (has_match (matches, "foo"));
+  g_assert_false (has_match (matches, "foobar"));
+
+  dzl_fuzzy_mutable_index_unref (fuzzy);
+}
+
+static guint n_freed;
+
+static void
+count_free (gpointer data)
+{
+  n_freed++;
+}
+
+/*
+ * Checks that @matches contains exactly the keys "key_%04u" for which
+ * @live is set, each with its own value, and that their ids are unique
+ * and less than @max_id.
+ */
+static void
+assert_live_matches (GArray         *matches,
+                     const gboolean *live,
+                     guint           n_keys,
+                     guint           max_id)
+{
+  g_autoptr(GHashTable) ids = g_hash_table_new (NULL, NULL);
+  guint n_live = 0;
+
+  for (guint i = 0; i < n_keys; i++)
+    n_live += !!live[i];
+
+  g_assert_cmpint (matches->len, ==, n_live);
+
+  for (guint i = 0; i < matches->len; i++)
+    {
+      const DzlFuzzyMutableIndexMatch *match = &g_array_index (matches, DzlFuzzyMutableIndexMatch, i);
+      g_autofree gchar *expected = NULL;
+      guint n = GPOINTER_TO_UINT (match->value) - 1;
+
+      g_assert_cmpint (n, <, n_keys);
+      g_assert_true (live[n]);
+
+      expected = g_strdup_printf ("key_%04u", n);
+      g_assert_cmpstr (match->key, ==, expected);
+
+      g_assert_cmpint (match->id, <, max_id);
+      g_assert_false (g_hash_table_contains (ids, GUINT_TO_POINTER (match->id)));
+      g_hash_table_add (ids, GUINT_TO_POINTER (match->id));
+    }
+}
+
+static void
+test_compact (void)
+{
+  DzlFuzzyMutableIndex *fuzzy;
+  GArray *matches;
+  gboolean live[100];
+
+  n_freed = 0;
+  fuzzy = dzl_fuzzy_mutable_index_new_with_free_func (FALSE, count_free);
+
+  for (guint i = 0; i < G_N_ELEMENTS (live); i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("key_%04u", i);
+      dzl_fuzzy_mutable_index_insert (fuzzy, key, GUINT_TO_POINTER (i + 1));
+      live[i] = TRUE;
+    }
+
+  /* Too few removals to compact automatically */
+  for (guint i = 0; i < G_N_ELEMENTS (live); i += 3)
+    {
+      g_autofree gchar *key = g_strdup_printf ("key_%04u", i);
+      dzl_fuzzy_mutable_index_remove (fuzzy, key);
+      live[i] = FALSE;
+    }
+
+  g_assert_cmpint (n_freed, ==, 0);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "key", 0);
+  assert_live_matches (matches, live, G_N_ELEMENTS (live), G_N_ELEMENTS (live));
+  g_array_unref (matches);
+
+  /* Compacting frees the removed values and renumbers the survivors */
+  dzl_fuzzy_mutable_index_compact (fuzzy);
+  g_assert_cmpint (n_freed, ==, 34);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "key", 0);
+  assert_live_matches (matches, live, G_N_ELEMENTS (live), 66);
+  g_array_unref (matches);
+
+  /* Both the multiple and single character paths */
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "y", 0);
+  assert_live_matches (matches, live, G_N_ELEMENTS (live), 66);
+  g_array_unref (matches);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "key_0001", 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (g_array_index (matches, DzlFuzzyMutableIndexMatch, 0).key, ==, "key_0001");
+  g_assert_cmpint (GPOINTER_TO_UINT (g_array_index (matches, DzlFuzzyMutableIndexMatch, 0).value), ==, 2);
+  g_array_unref (matches);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "key_0003", 0);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_array_unref (matches);
+
+  /* Keys inserted after compacting get ids after the survivors */
+  dzl_fuzzy_mutable_index_insert (fuzzy, "key_0000", GUINT_TO_POINTER (1));
+  live[0] = TRUE;
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "key", 0);
+  assert_live_matches (matches, live, G_N_ELEMENTS (live), 67);
+  g_array_unref (matches);
+
+  /* Compacting without removed keys does nothing */
+  dzl_fuzzy_mutable_index_compact (fuzzy);
+  g_assert_cmpint (n_freed, ==, 34);
+
+  dzl_fuzzy_mutable_index_unref (fuzzy);
+  g_assert_cmpint (n_freed, ==, 101);
+}
+
+static void
+test_compact_auto (void)
+{
+  DzlFuzzyMutableIndex *fuzzy;
+  GArray *matches;
+  gboolean live[2000];
+  guint n_removed = 0;
+  guint max_id = 0;
+
+  n_freed = 0;
+  fuzzy = dzl_fuzzy_mutable_index_new_with_free_func (FALSE, count_free);
+
+  dzl_fuzzy_mutable_index_begin_bulk_insert (fuzzy);
+  for (guint i = 0; i < G_N_ELEMENTS (live); i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("key_%04u", i);
+      dzl_fuzzy_mutable_index_insert (fuzzy, key, GUINT_TO_POINTER (i + 1));
+      live[i] = TRUE;
+    }
+  dzl_fuzzy_mutable_index_end_bulk_insert (fuzzy);
+
+  /*
+   * Remove the keys from the front, so that the survivors keep their ids
+   * until the index compacts itself once a quarter of them are removed.
+   */
+  for (guint i = 0; n_freed == 0; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("key_%04u", i);
+
+      g_assert_cmpint (i, <, G_N_ELEMENTS (live) / 2);
+
+      matches = dzl_fuzzy_mutable_index_match (fuzzy, "key_1999", 0);
+      g_assert_cmpint (matches->len, ==, 1);
+      max_id = g_array_index (matches, DzlFuzzyMutableIndexMatch, 0).id;
+      g_array_unref (matches);
+
+      dzl_fuzzy_mutable_index_remove (fuzzy, key);
+      live[i] = FALSE;
+      n_removed++;
+    }
+
+  g_assert_cmpint (max_id, ==, G_N_ELEMENTS (live) - 1);
+  g_assert_cmpint (n_removed, ==, G_N_ELEMENTS (live) / 4);
+  g_assert_cmpint (n_freed, ==, n_removed);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "key", 0);
+  assert_live_matches (matches, live, G_N_ELEMENTS (live), G_N_ELEMENTS (live) - n_removed);
+  g_array_unref (matches);
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "key", 10);
+  g_assert_cmpint (matches->len, ==, 10);
+  g_array_unref (matches);
+
+  dzl_fuzzy_mutable_index_unref (fuzzy);
+  g_assert_cmpint (n_freed, ==, G_N_ELEMENTS (live));
+}
+
+static void
+test_contains_remove (void)
+{
+  DzlFuzzyMutableIndex *fuzzy;
+  GArray *matches;
+
+  fuzzy = dzl_fuzzy_mutable_index_new (FALSE);
+
+  dzl_fuzzy_mutable_index_insert (fuzzy, "foo", GUINT_TO_POINTER (1));
+  dzl_fuzzy_mutable_index_insert (fuzzy, "foobar", GUINT_TO_POINTER (2));
+  dzl_fuzzy_mutable_index_insert (fuzzy, "foo", GUINT_TO_POINTER (3));
+  dzl_fuzzy_mutable_index_insert (fuzzy, "bar", GUINT_TO_POINTER (4));
+
+  /* Only exact keys are contained, not fuzzy matches or prefixes */
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foo"));
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foobar"));
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "bar"));
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "fo"));
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "fbr"));
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "foobarbaz"));
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, ""));
+
+  /* Removing a key removes every duplicate, but not keys it prefixes */
+  dzl_fuzzy_mutable_index_remove (fuzzy, "foo");
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "foo"));
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foobar"));
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "foo", 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (g_array_index (matches, DzlFuzzyMutableIndexMatch, 0).key, ==, "foobar");
+  g_assert_cmpint (GPOINTER_TO_UINT (g_array_index (matches, DzlFuzzyMutableIndexMatch, 0).value), ==, 2);
+  g_array_unref (matches);
+
+  /* Removing a key which is a prefix of nothing leaves the others alone */
+  dzl_fuzzy_mutable_index_remove (fuzzy, "fooba");
+  dzl_fuzzy_mutable_index_remove (fuzzy, "missing");
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foobar"));
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "bar"));
+
+  /* A key inserted again after removing it is contained again */
+  dzl_fuzzy_mutable_index_insert (fuzzy, "foo", GUINT_TO_POINTER (5));
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foo"));
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "foo", 0);
+  g_assert_cmpint (matches->len, ==, 2);
+  g_assert_true (has_match (matches, "foo"));
+  g_array_unref (matches);
+
+  /* The exact key chains are rebuilt with the new ids when compacting */
+  dzl_fuzzy_mutable_index_remove (fuzzy, "bar");
+  dzl_fuzzy_mutable_index_compact (fuzzy);
+
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foo"));
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foobar"));
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "bar"));
+
+  dzl_fuzzy_mutable_index_remove (fuzzy, "foobar");
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "foobar"));
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "foo"));
+
+  matches = dzl_fuzzy_mutable_index_match (fuzzy, "foo", 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpint (GPOINTER_TO_UINT (g_array_index (matches, DzlFuzzyMutableIndexMatch, 0).value), ==, 5);
+  g_array_unref (matches);
+
+  dzl_fuzzy_mutable_index_unref (fuzzy);
+}
+
+static void
+test_contains_case_insensitive (void)
+{
+  DzlFuzzyMutableIndex *fuzzy;
+
+  fuzzy = dzl_fuzzy_mutable_index_new (FALSE);
+
+  /* Keys are stored as inserted, so they are compared exactly */
+  dzl_fuzzy_mutable_index_insert (fuzzy, "FooBar", NULL);
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "FooBar"));
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "foobar"));
+
+  dzl_fuzzy_mutable_index_remove (fuzzy, "foobar");
+  g_assert_true (dzl_fuzzy_mutable_index_contains (fuzzy, "FooBar"));
+
+  dzl_fuzzy_mutable_index_remove (fuzzy, "FooBar");
+  g_assert_false (dzl_fuzzy_mutable_index_contains (fuzzy, "FooBar"));
+
+  dzl_fuzzy_mutable_index_unref (fuzzy);
+}
+
+static gint
+search_main (gint   argc,
+             gchar *argv[])
 {
   g_autofree gchar *path = g_build_filename (TEST_DATA_DIR, "test-fuzzy-mutable-index.txt", NULL);
   DzlFuzzyMutableIndex *fuzzy;
@@ -28,13 +394,6 @@ main (gint   argc,
   GFile *file;
   gchar *line;
 
-  if (argc == 1)
-    {
-      g_printerr ("usage: %s FUZZY_NEEDLE\n"
-                  "Search fuzzy index for needle\n", argv[0]);
-      return EXIT_FAILURE;
-    }
-
   fuzzy = dzl_fuzzy_mutable_index_new_with_free_func (FALSE, g_free);
   file = g_file_new_for_path (path);
   file_stream = g_file_read (file, NULL, NULL);
@@ -81,3 +440,21 @@ main (gint   argc,
 
   return EXIT_SUCCESS;
 }
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  /* Search the test corpus for needles given on the command line */
+  if (argc > 1 && argv[1][0] != '-')
+    return search_main (argc, argv);
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/Dazzle/FuzzyMutableIndex/max-matches", test_max_matches);
+  g_test_add_func ("/Dazzle/FuzzyMutableIndex/max-matches-removed", test_max_matches_removed);
+  g_test_add_func ("/Dazzle/FuzzyMutableIndex/compact", test_compact);
+  g_test_add_func ("/Dazzle/FuzzyMutableIndex/compact-auto", test_compact_auto);
+  g_test_add_func ("/Dazzle/FuzzyMutableIndex/contains-remove", test_contains_remove);
+  g_test_add_func ("/Dazzle/FuzzyMutableIndex/contains-case", test_contains_case_insensitive);
+  return g_test_run ();
+}
@@ -158,6 +158,71 @@ test_DzlHeap_extract_int (void)
    dzl_heap_unref (heap);
 }
 
+typedef struct
+{
+   gint  priority;
+   gsize index;
+} Node;
+
+static int
+cmpnode (gconstpointer a,
+         gconstpointer b)
+{
+   return (*(Node **)a)->priority - (*(Node **)b)->priority;
+}
+
+static void
+node_set_index (gpointer element,
+                gsize    index_)
+{
+   (*(Node **)element)->index = index_;
+}
+
+static void
+test_DzlHeap_index_func (void)
+{
+   DzlHeap *heap;
+   Node *nodes;
+   Node *node;
+   gsize i;
+   gint last;
+
+   nodes = g_new0 (Node, 10000);
+   heap = dzl_heap_new (sizeof (Node *), cmpnode);
+   dzl_heap_set_index_func (heap, node_set_index);
+
+   for (i = 0; i < 10000; i++) {
+      node = &nodes[i];
+      node->priority = g_random_int_range (0, 1000);
+      dzl_heap_insert_val (heap, node);
+   }
+
+   for (i = 0; i < heap->len; i++)
+      g_assert_cmpint (dzl_heap_index (heap, Node *, i)->index, ==, i);
+
+   /* Remove every other node by its tracked index */
+   for (i = 0; i < 10000; i += 2) {
+      dzl_heap_extract_index (heap, nodes[i].index, &node);
+      g_assert (node == &nodes[i]);
+   }
+
+   g_assert_cmpint (heap->len, ==, 5000);
+
+   for (i = 0; i < heap->len; i++)
+      g_assert_cmpint (dzl_heap_index (heap, Node *, i)->index, ==, i);
+
+   last = G_MAXINT;
+
+   while (dzl_heap_extract (heap, &node)) {
+      g_assert_cmpint (node->priority, <=, last);
+      g_assert ((node - nodes) % 2 == 1);
+      last = node->priority;
+   }
+
+   dzl_heap_unref (heap);
+   g_free (nodes);
+}
+
 int
 main (gint   argc,
       gchar *argv[])
@@ -168,6 +233,7 @@ main (gint   argc,
    g_test_add_func ("/Dazzle/Heap/insert_and_extract<gpointer>", test_DzlHeap_insert_val_ptr);
    g_test_add_func ("/Dazzle/Heap/insert_and_extract<Tuple>", test_DzlHeap_insert_val_tuple);
    g_test_add_func ("/Dazzle/Heap/extract_index<int>", test_DzlHeap_extract_int);
+   g_test_add_func ("/Dazzle/Heap/index_func", test_DzlHeap_index_func);
 
    return g_test_run ();
 }
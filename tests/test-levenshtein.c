@@ -12,12 +12,19 @@ test_levenshtein_basic (void)
 {
   static const WordCheck check[] = {
     { "gtk", "gkt", 2 },
-    { "LibreFreeOpen", "Cromulent", 10 },
+    { "LibreFreeOpen", "Cromulent", 11 },
     { "Xorg", "Wayland", 7 },
     { "glib", "gobject", 6 },
     { "gbobject", "gobject", 1 },
     { "flip", "fliiiip", 3 },
     { "flip", "fliiiipper", 6 },
+    { "", "gtk", 3 },
+    { "gtk", "", 3 },
+    { "héllo", "hello", 1 },
+    { "日本語", "日本", 1 },
+    /* Longer than a single 64-bit block */
+    { "gtk_widget_class_set_template_from_resource_and_bind_children_in_order",
+      "gtk_widget_class_set_template_from_resources_and_bind_child_in_order", 4 },
     { NULL }
   };
 
@@ -29,11 +36,38 @@ test_levenshtein_basic (void)
     }
 }
 
+static void
+test_levenshtein_bounded (void)
+{
+  g_assert_cmpint (dzl_levenshtein_bounded ("gtk", "gkt", 2), ==, 2);
+  g_assert_cmpint (dzl_levenshtein_bounded ("gtk", "gkt", 1), ==, G_MAXINT);
+  g_assert_cmpint (dzl_levenshtein_bounded ("glib", "gobject", 0), ==, G_MAXINT);
+  g_assert_cmpint (dzl_levenshtein_bounded ("glib", "glib", 0), ==, 0);
+  g_assert_cmpint (dzl_levenshtein_bounded ("glib", "gobject", -1), ==, 6);
+}
+
+static void
+test_levenshtein_many (void)
+{
+  static const gchar *haystacks[] = { "gkt", "gtk", "", "gtk_widget", "gdk" };
+  gint distances[G_N_ELEMENTS (haystacks)];
+
+  dzl_levenshtein_many ("gtk", haystacks, G_N_ELEMENTS (haystacks), 2, distances);
+
+  g_assert_cmpint (distances[0], ==, 2);
+  g_assert_cmpint (distances[1], ==, 0);
+  g_assert_cmpint (distances[2], ==, G_MAXINT);
+  g_assert_cmpint (distances[3], ==, G_MAXINT);
+  g_assert_cmpint (distances[4], ==, 1);
+}
+
 gint
 main (gint argc,
       gchar *argv[])
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/Dazzle/Levenshtein/basic", test_levenshtein_basic);
+  g_test_add_func ("/Dazzle/Levenshtein/bounded", test_levenshtein_bounded);
+  g_test_add_func ("/Dazzle/Levenshtein/many", test_levenshtein_many);
   return g_test_run ();
 }
@@ -0,0 +1,71 @@
+#include <dazzle.h>
+
+typedef struct
+{
+  const gchar *needle;
+  const gchar *haystack;
+  gboolean     expected;
+} PatternCheck;
+
+static void
+test_pattern_spec_basic (void)
+{
+  static const PatternCheck check[] = {
+    { "gtk widg", "gtk_widget_show", TRUE },
+    { "gtk widg", "gtkwidget", FALSE },
+    { "widg gtk", "gtk_widget_show", FALSE },
+    { "gtk  show", "gtk_widget_show", TRUE },
+    { "GTK", "gtk_widget_show", FALSE },
+    { "GTK", "GTK_WIDGET", TRUE },
+    { "widget", "GTK_WIDGET", TRUE },
+    { "", "anything", TRUE },
+    { "font", "Editor Font", TRUE },
+    { "édit", "Éditeur de texte", TRUE },
+    { "straße", "STRASSE", TRUE },
+    { "texte", "Éditeur", FALSE },
+    { NULL }
+  };
+
+  for (guint i = 0; check[i].needle != NULL; i++)
+    {
+      g_autoptr(DzlPatternSpec) spec = dzl_pattern_spec_new (check[i].needle);
+
+      g_assert_cmpint (dzl_pattern_spec_match (spec, check[i].haystack), ==, check[i].expected);
+    }
+}
+
+static void
+test_pattern_spec_many (void)
+{
+  static const gchar *haystacks[] = {
+    "Show line numbers",
+    NULL,
+    "Highlight current line",
+    "Show grid lines",
+    "Font",
+  };
+  g_autoptr(DzlPatternSpec) spec = dzl_pattern_spec_new ("show line");
+  gboolean matches[G_N_ELEMENTS (haystacks)];
+  guint count;
+
+  count = dzl_pattern_spec_match_many (spec, haystacks, G_N_ELEMENTS (haystacks), matches);
+
+  g_assert_cmpint (count, ==, 2);
+  g_assert_true (matches[0]);
+  g_assert_false (matches[1]);
+  g_assert_false (matches[2]);
+  g_assert_true (matches[3]);
+  g_assert_false (matches[4]);
+
+  g_assert_cmpint (dzl_pattern_spec_match_many (spec, haystacks, 1, NULL), ==, 1);
+}
+
+gint
+main (gint argc,
+      gchar *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+  g_test_add_func ("/Dazzle/PatternSpec/basic", test_pattern_spec_basic);
+  g_test_add_func ("/Dazzle/PatternSpec/many", test_pattern_spec_many);
+  return g_test_run ();
+}
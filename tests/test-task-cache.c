@@ -1,4 +1,7 @@
 #include <dazzle.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <utime.h>
 
 static GMainLoop *main_loop;
 static DzlTaskCache *cache;
@@ -58,11 +61,841 @@ test_task_cache (void)
   g_assert (foo == NULL);
 }
 
+static void
+populate_string_callback (DzlTaskCache  *self,
+                          gconstpointer  key,
+                          GTask         *task,
+                          gpointer       user_data)
+{
+  g_task_return_pointer (task, g_strdup (key), g_free);
+}
+
+static void
+get_string_cb (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  gchar **value = user_data;
+  GError *error = NULL;
+
+  *value = dzl_task_cache_get_finish (DZL_TASK_CACHE (object), result, &error);
+  g_assert_no_error (error);
+  g_assert (*value != NULL);
+
+  g_main_loop_quit (main_loop);
+}
+
+static void
+get_string (DzlTaskCache *string_cache,
+            const gchar  *key)
+{
+  g_autofree gchar *value = NULL;
+
+  dzl_task_cache_get_async (string_cache, key, FALSE, NULL, get_string_cb, &value);
+  g_main_loop_run (main_loop);
+
+  g_assert_cmpstr (value, ==, key);
+}
+
+static DzlTaskCache *
+string_cache_new (void)
+{
+  return dzl_task_cache_new (g_str_hash,
+                             g_str_equal,
+                             (GBoxedCopyFunc)g_strdup,
+                             (GBoxedFreeFunc)g_free,
+                             (GBoxedCopyFunc)g_strdup,
+                             (GBoxedFreeFunc)g_free,
+                             0,
+                             populate_string_callback, NULL, NULL);
+}
+
+static void
+test_task_cache_lru (void)
+{
+  g_autoptr(DzlTaskCache) string_cache = string_cache_new ();
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  dzl_task_cache_set_max_items (string_cache, 3);
+  g_assert_cmpint (dzl_task_cache_get_max_items (string_cache), ==, 3);
+  g_assert_cmpint (dzl_task_cache_get_eviction_policy (string_cache), ==, DZL_TASK_CACHE_EVICTION_LRU);
+
+  get_string (string_cache, "a");
+  get_string (string_cache, "b");
+  get_string (string_cache, "c");
+
+  /* Using "a" makes "b" the least recently used */
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "a"));
+  get_string (string_cache, "d");
+
+  g_assert_null (dzl_task_cache_peek (string_cache, "b"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "a"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "c"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "d"));
+
+  /* Shrinking evicts immediately */
+  dzl_task_cache_set_max_items (string_cache, 1);
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "d"));
+  g_assert_null (dzl_task_cache_peek (string_cache, "a"));
+  g_assert_null (dzl_task_cache_peek (string_cache, "c"));
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+}
+
+static gsize
+string_cost (gconstpointer value,
+             gpointer      user_data)
+{
+  return strlen (value);
+}
+
+static void
+test_task_cache_cost (void)
+{
+  g_autoptr(DzlTaskCache) string_cache = string_cache_new ();
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  dzl_task_cache_set_cost_func (string_cache, string_cost, NULL, NULL);
+  dzl_task_cache_set_max_cost (string_cache, 10);
+  g_assert_cmpint (dzl_task_cache_get_max_cost (string_cache), ==, 10);
+
+  get_string (string_cache, "aaaa");
+  get_string (string_cache, "bbbb");
+  get_string (string_cache, "cc");
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "aaaa"));
+
+  /* 13 is over budget, so the least recently used item goes */
+  get_string (string_cache, "ddd");
+  g_assert_null (dzl_task_cache_peek (string_cache, "bbbb"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "aaaa"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "cc"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "ddd"));
+
+  /* Values costing more than the whole budget are not kept */
+  get_string (string_cache, "eeeeeeeeeeee");
+  g_assert_null (dzl_task_cache_peek (string_cache, "eeeeeeeeeeee"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "aaaa"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "cc"));
+  g_assert_nonnull (dzl_task_cache_peek (string_cache, "ddd"));
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+}
+
+static void
+test_task_cache_tiny_lfu (void)
+{
+  g_autoptr(DzlTaskCache) string_cache = string_cache_new ();
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  dzl_task_cache_set_eviction_policy (string_cache, DZL_TASK_CACHE_EVICTION_TINY_LFU);
+  dzl_task_cache_set_max_items (string_cache, 50);
+
+  for (guint i = 0; i < 10; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("hot-%u", i);
+
+      for (guint j = 0; j < 5; j++)
+        get_string (string_cache, key);
+    }
+
+  /* Scanning many keys once must not flush the frequently used ones */
+  for (guint i = 0; i < 200; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("scan-%u", i);
+      get_string (string_cache, key);
+    }
+
+  for (guint i = 0; i < 10; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("hot-%u", i);
+      g_assert_nonnull (dzl_task_cache_peek (string_cache, key));
+    }
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+}
+
+static guint n_populates;
+
+static void
+populate_counting_callback (DzlTaskCache  *self,
+                            gconstpointer  key,
+                            GTask         *task,
+                            gpointer       user_data)
+{
+  n_populates++;
+  g_task_return_pointer (task, g_strdup_printf ("%s:%u", (const gchar *)key, n_populates), g_free);
+}
+
+static gchar *
+get_counted (DzlTaskCache *counting_cache,
+             const gchar  *key)
+{
+  gchar *value = NULL;
+
+  dzl_task_cache_get_async (counting_cache, key, FALSE, NULL, get_string_cb, &value);
+  g_main_loop_run (main_loop);
+
+  return value;
+}
+
+static void
+drain_main_context (void)
+{
+  while (g_main_context_pending (NULL))
+    g_main_context_iteration (NULL, FALSE);
+}
+
+static void
+test_task_cache_stale_while_revalidate (void)
+{
+  g_autoptr(DzlTaskCache) counting_cache = NULL;
+  g_autofree gchar *value1 = NULL;
+  g_autofree gchar *value2 = NULL;
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_populates = 0;
+
+  counting_cache = dzl_task_cache_new (g_str_hash,
+                                       g_str_equal,
+                                       (GBoxedCopyFunc)g_strdup,
+                                       (GBoxedFreeFunc)g_free,
+                                       (GBoxedCopyFunc)g_strdup,
+                                       (GBoxedFreeFunc)g_free,
+                                       50 /* msec */,
+                                       populate_counting_callback, NULL, NULL);
+  dzl_task_cache_set_stale_while_revalidate (counting_cache, 60 * 1000);
+  g_assert_cmpint (dzl_task_cache_get_stale_while_revalidate (counting_cache), ==, 60 * 1000);
+
+  value1 = get_counted (counting_cache, "a");
+  g_assert_cmpstr (value1, ==, "a:1");
+
+  g_usleep (G_USEC_PER_SEC / 10);
+  drain_main_context ();
+
+  /* The expired value is returned at once while it is refreshed */
+  value2 = get_counted (counting_cache, "a");
+  g_assert_cmpstr (value2, ==, "a:1");
+  g_assert_cmpint (n_populates, ==, 2);
+
+  drain_main_context ();
+  g_assert_cmpstr (dzl_task_cache_peek (counting_cache, "a"), ==, "a:2");
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+}
+
+static void
+test_task_cache_refresh_ahead (void)
+{
+  g_autoptr(DzlTaskCache) counting_cache = NULL;
+  g_autofree gchar *value1 = NULL;
+  g_autofree gchar *value2 = NULL;
+  g_autofree gchar *value3 = NULL;
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_populates = 0;
+
+  counting_cache = dzl_task_cache_new (g_str_hash,
+                                       g_str_equal,
+                                       (GBoxedCopyFunc)g_strdup,
+                                       (GBoxedFreeFunc)g_free,
+                                       (GBoxedCopyFunc)g_strdup,
+                                       (GBoxedFreeFunc)g_free,
+                                       3000 /* msec */,
+                                       populate_counting_callback, NULL, NULL);
+  dzl_task_cache_set_refresh_ahead (counting_cache, 80);
+  g_assert_cmpint (dzl_task_cache_get_refresh_ahead (counting_cache), ==, 80);
+
+  value1 = get_counted (counting_cache, "b");
+  g_assert_cmpstr (value1, ==, "b:1");
+
+  /* Fresh items are not refreshed */
+  value2 = get_counted (counting_cache, "b");
+  g_assert_cmpstr (value2, ==, "b:1");
+  g_assert_cmpint (n_populates, ==, 1);
+
+  /*
+   * But they are within the last 80% of their time to live, which starts
+   * after 600 msec. Sleeping halfway to the expiration leaves a wide margin
+   * on both sides for slow or loaded machines.
+   */
+  g_usleep (G_USEC_PER_SEC * 3 / 2);
+  value3 = get_counted (counting_cache, "b");
+  g_assert_cmpstr (value3, ==, "b:1");
+  g_assert_cmpint (n_populates, ==, 2);
+
+  drain_main_context ();
+  g_assert_cmpstr (dzl_task_cache_peek (counting_cache, "b"), ==, "b:2");
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+}
+
+static void
+populate_variant_callback (DzlTaskCache  *self,
+                           gconstpointer  key,
+                           GTask         *task,
+                           gpointer       user_data)
+{
+  g_autofree gchar *value = g_strdup_printf ("value-of-%s", g_variant_get_string ((GVariant *)key, NULL));
+
+  n_populates++;
+  g_task_return_pointer (task, g_variant_ref_sink (g_variant_new_string (value)), (GDestroyNotify)g_variant_unref);
+}
+
+static void
+get_variant_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  GVariant **value = user_data;
+  GError *error = NULL;
+
+  *value = dzl_task_cache_get_finish (DZL_TASK_CACHE (object), result, &error);
+  g_assert_no_error (error);
+  g_assert (*value != NULL);
+
+  g_main_loop_quit (main_loop);
+}
+
+static DzlTaskCache *
+disk_cache_new (const gchar *path)
+{
+  g_autoptr(GFile) directory = g_file_new_for_path (path);
+  DzlTaskCache *disk_cache;
+
+  disk_cache = dzl_task_cache_new (g_variant_hash,
+                                   g_variant_equal,
+                                   (GBoxedCopyFunc)g_variant_ref,
+                                   (GBoxedFreeFunc)g_variant_unref,
+                                   (GBoxedCopyFunc)g_variant_ref,
+                                   (GBoxedFreeFunc)g_variant_unref,
+                                   0,
+                                   populate_variant_callback, NULL, NULL);
+  dzl_task_cache_set_disk_directory (disk_cache, directory);
+  g_assert (dzl_task_cache_get_disk_directory (disk_cache) == directory);
+
+  return disk_cache;
+}
+
+static guint
+count_disk_entries (const gchar *path)
+{
+  g_autoptr(GDir) dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+  guint count = 0;
+
+  while (dir != NULL && NULL != (name = g_dir_read_name (dir)))
+    count += g_str_has_suffix (name, ".gvariant");
+
+  return count;
+}
+
+static void
+test_task_cache_disk (void)
+{
+  g_autoptr(GVariant) key = g_variant_ref_sink (g_variant_new_string ("a"));
+  g_autoptr(GVariant) value1 = NULL;
+  g_autoptr(GVariant) value2 = NULL;
+  g_autoptr(GDir) dir = NULL;
+  g_autofree gchar *path = NULL;
+  DzlTaskCache *disk_cache;
+  const gchar *name;
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_populates = 0;
+
+  path = g_dir_make_tmp ("test-task-cache-XXXXXX", NULL);
+  g_assert (path != NULL);
+
+  disk_cache = disk_cache_new (path);
+  dzl_task_cache_get_async (disk_cache, key, FALSE, NULL, get_variant_cb, &value1);
+  g_main_loop_run (main_loop);
+  g_assert_cmpstr (g_variant_get_string (value1, NULL), ==, "value-of-a");
+  g_assert_cmpint (n_populates, ==, 1);
+
+  /* The entry is written in a worker thread */
+  while (count_disk_entries (path) == 0)
+    g_usleep (G_USEC_PER_SEC / 1000);
+
+  g_object_unref (disk_cache);
+
+  /* A new cache, as after a restart, finds the value on disk */
+  disk_cache = disk_cache_new (path);
+  dzl_task_cache_get_async (disk_cache, key, FALSE, NULL, get_variant_cb, &value2);
+  g_main_loop_run (main_loop);
+  g_assert_cmpstr (g_variant_get_string (value2, NULL), ==, "value-of-a");
+  g_assert_cmpint (n_populates, ==, 1);
+  g_object_unref (disk_cache);
+
+  dir = g_dir_open (path, 0, NULL);
+  while (NULL != (name = g_dir_read_name (dir)))
+    {
+      g_autofree gchar *entry_path = g_build_filename (path, name, NULL);
+      g_unlink (entry_path);
+    }
+  g_rmdir (path);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+}
+
+static void
+get_disk_value (DzlTaskCache *disk_cache,
+                const gchar  *key)
+{
+  g_autoptr(GVariant) key_variant = g_variant_ref_sink (g_variant_new_string (key));
+  g_autoptr(GVariant) value = NULL;
+  g_autofree gchar *expected = g_strdup_printf ("value-of-%s", key);
+
+  dzl_task_cache_get_async (disk_cache, key_variant, FALSE, NULL, get_variant_cb, &value);
+  g_main_loop_run (main_loop);
+
+  g_assert_cmpstr (g_variant_get_string (value, NULL), ==, expected);
+}
+
+static gchar *
+get_entry_path (const gchar *path,
+                const gchar *key)
+{
+  g_autoptr(GVariant) key_variant = g_variant_ref_sink (g_variant_new_string (key));
+  g_autofree gchar *checksum = NULL;
+  g_autofree gchar *name = NULL;
+
+  /* Entries are named after the checksum of the serialized key */
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                          g_variant_get_data (key_variant),
+                                          g_variant_get_size (key_variant));
+  name = g_strconcat (checksum, ".gvariant", NULL);
+
+  return g_build_filename (path, name, NULL);
+}
+
+static gboolean
+has_disk_entry (const gchar *path,
+                const gchar *key)
+{
+  g_autofree gchar *entry_path = get_entry_path (path, key);
+
+  return g_file_test (entry_path, G_FILE_TEST_EXISTS);
+}
+
+static GStatBuf
+stat_disk_entry (const gchar *path,
+                 const gchar *key)
+{
+  g_autofree gchar *entry_path = get_entry_path (path, key);
+  GStatBuf st;
+
+  g_assert_cmpint (g_stat (entry_path, &st), ==, 0);
+
+  return st;
+}
+
+/*
+ * The reaper only removes entries older than a second, so entries are
+ * aged explicitly rather than by sleeping.
+ */
+static void
+set_disk_entry_age (const gchar *path,
+                    const gchar *key,
+                    gint64       age)
+{
+  g_autofree gchar *entry_path = get_entry_path (path, key);
+  struct utimbuf times;
+
+  times.actime = g_get_real_time () / G_USEC_PER_SEC - age;
+  times.modtime = times.actime;
+
+  g_assert_cmpint (g_utime (entry_path, &times), ==, 0);
+}
+
+static void
+test_task_cache_disk_max_size (void)
+{
+  g_autoptr(GDir) dir = NULL;
+  g_autofree gchar *path = NULL;
+  DzlTaskCache *disk_cache;
+  const gchar *name;
+  gint64 before;
+  gsize entry_size;
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  n_populates = 0;
+
+  path = g_dir_make_tmp ("test-task-cache-XXXXXX", NULL);
+  g_assert (path != NULL);
+
+  disk_cache = disk_cache_new (path);
+  get_disk_value (disk_cache, "a");
+  get_disk_value (disk_cache, "b");
+  get_disk_value (disk_cache, "c");
+  g_assert_cmpint (n_populates, ==, 3);
+
+  /* The entries are written in a worker thread */
+  while (count_disk_entries (path) < 3)
+    g_usleep (G_USEC_PER_SEC / 1000);
+
+  g_object_unref (disk_cache);
+
+  set_disk_entry_age (path, "a", 300);
+  set_disk_entry_age (path, "b", 200);
+  set_disk_entry_age (path, "c", 100);
+
+  /* Reading an entry marks it as recently used */
+  before = g_get_real_time () / G_USEC_PER_SEC;
+  disk_cache = disk_cache_new (path);
+  get_disk_value (disk_cache, "a");
+  g_assert_cmpint (n_populates, ==, 3);
+  g_assert_cmpint (stat_disk_entry (path, "a").st_mtime, >=, before);
+
+  /* Old enough to be reaped, but still the most recently used */
+  set_disk_entry_age (path, "a", 50);
+
+  /* The values are the same size, so only two entries fit */
+  entry_size = stat_disk_entry (path, "a").st_size;
+  g_assert_cmpint (entry_size, ==, stat_disk_entry (path, "b").st_size);
+  g_assert_cmpint (entry_size, ==, stat_disk_entry (path, "c").st_size);
+
+  /* Lowering the budget reclaims the least recently used entry */
+  dzl_task_cache_set_disk_max_size (disk_cache, entry_size * 5 / 2);
+  g_assert_cmpint (dzl_task_cache_get_disk_max_size (disk_cache), ==, entry_size * 5 / 2);
+
+  while (has_disk_entry (path, "b"))
+    g_usleep (G_USEC_PER_SEC / 1000);
+
+  g_assert_true (has_disk_entry (path, "a"));
+  g_assert_true (has_disk_entry (path, "c"));
+  g_assert_cmpint (count_disk_entries (path), ==, 2);
+
+  /* Storing a new entry over the budget reclaims the next one */
+  get_disk_value (disk_cache, "d");
+  g_assert_cmpint (n_populates, ==, 4);
+
+  while (!has_disk_entry (path, "d") || has_disk_entry (path, "c"))
+    g_usleep (G_USEC_PER_SEC / 1000);
+
+  g_assert_true (has_disk_entry (path, "a"));
+  g_assert_cmpint (count_disk_entries (path), ==, 2);
+
+  g_object_unref (disk_cache);
+
+  dir = g_dir_open (path, 0, NULL);
+  while (NULL != (name = g_dir_read_name (dir)))
+    {
+      g_autofree gchar *entry_path = g_build_filename (path, name, NULL);
+      g_unlink (entry_path);
+    }
+  g_rmdir (path);
+
+  g_clear_pointer (&main_loop, g_main_loop_unref);
+}
+
+#define N_THREADS 8
+#define N_KEYS    32
+
+static guint n_fetches;
+static guint n_finished;
+
+typedef struct
+{
+  GMainContext *context;
+  guint         n_completed;
+} ThreadState;
+
+typedef struct
+{
+  ThreadState *state;
+  gchar       *key;
+} ThreadRequest;
+
+static void
+fetch_in_thread (GTask        *task,
+                 gpointer      source_object,
+                 gpointer      task_data,
+                 GCancellable *cancellable)
+{
+  /* Give the other threads a chance to request the same key */
+  g_usleep (G_USEC_PER_SEC / 100);
+  g_task_return_pointer (task, g_strdup (task_data), g_free);
+}
+
+static void
+populate_threaded_callback (DzlTaskCache  *self,
+                            gconstpointer  key,
+                            GTask         *task,
+                            gpointer       user_data)
+{
+  g_atomic_int_inc (&n_fetches);
+  g_task_set_task_data (task, g_strdup (key), g_free);
+  g_task_run_in_thread (task, fetch_in_thread);
+}
+
+static void
+threaded_get_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  ThreadRequest *request = user_data;
+  g_autofree gchar *value = NULL;
+  GError *error = NULL;
+
+  /* Completions must be delivered to the thread which made the request */
+  g_assert (g_main_context_get_thread_default () == request->state->context);
+
+  value = dzl_task_cache_get_finish (DZL_TASK_CACHE (object), result, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (value, ==, request->key);
+
+  request->state->n_completed++;
+
+  g_free (request->key);
+  g_slice_free (ThreadRequest, request);
+}
+
+static gpointer
+threaded_worker (gpointer data)
+{
+  DzlTaskCache *sharded_cache = data;
+  ThreadState state = { 0 };
+
+  state.context = g_main_context_new ();
+  g_main_context_push_thread_default (state.context);
+
+  for (guint i = 0; i < N_KEYS; i++)
+    {
+      ThreadRequest *request = g_slice_new0 (ThreadRequest);
+
+      request->state = &state;
+      request->key = g_strdup_printf ("key-%u", i);
+
+      dzl_task_cache_get_async (sharded_cache, request->key, FALSE, NULL, threaded_get_cb, request);
+    }
+
+  while (state.n_completed < N_KEYS)
+    g_main_context_iteration (state.context, TRUE);
+
+  g_main_context_pop_thread_default (state.context);
+  g_main_context_unref (state.context);
+
+  g_atomic_int_inc (&n_finished);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+/*
+ * The keys are populated in the main context the cache was created in,
+ * so it must be iterated while waiting for the threads.
+ */
+static void
+wait_for_threads (guint n_threads)
+{
+  while ((guint)g_atomic_int_get (&n_finished) < n_threads)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+test_task_cache_threaded (void)
+{
+  g_autoptr(DzlTaskCache) sharded_cache = NULL;
+  GThread *threads[N_THREADS];
+
+  sharded_cache = g_object_new (DZL_TYPE_TASK_CACHE,
+                                "key-hash-func", g_str_hash,
+                                "key-equal-func", g_str_equal,
+                                "key-copy-func", g_strdup,
+                                "key-destroy-func", g_free,
+                                "n-shards", 4,
+                                "populate-callback", populate_threaded_callback,
+                                "time-to-live", G_GINT64_CONSTANT (0),
+                                "value-copy-func", g_strdup,
+                                "value-destroy-func", g_free,
+                                NULL);
+  g_assert_cmpint (dzl_task_cache_get_n_shards (sharded_cache), ==, 4);
+
+  n_finished = 0;
+
+  for (guint i = 0; i < N_THREADS; i++)
+    threads[i] = g_thread_new ("test-task-cache", threaded_worker, sharded_cache);
+
+  wait_for_threads (N_THREADS);
+
+  for (guint i = 0; i < N_THREADS; i++)
+    g_thread_join (threads[i]);
+
+  /* Requests for a key in flight wait for it, so each key is fetched once */
+  g_assert_cmpint (n_fetches, ==, N_KEYS);
+
+  for (guint i = 0; i < N_KEYS; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("key-%u", i);
+      g_assert_cmpstr (dzl_task_cache_peek (sharded_cache, key), ==, key);
+    }
+}
+
+static GTask *deferred_fetch;
+static gint first_queued;
+static gint second_queued;
+
+static void
+populate_deferred_callback (DzlTaskCache  *self,
+                            gconstpointer  key,
+                            GTask         *task,
+                            gpointer       user_data)
+{
+  /* Completed by the test, once the first requester has left */
+  g_atomic_int_inc (&n_fetches);
+  deferred_fetch = task;
+}
+
+static void
+cancelled_get_cb (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  gboolean *done = user_data;
+  g_autofree gchar *value = NULL;
+  GError *error = NULL;
+
+  value = dzl_task_cache_get_finish (DZL_TASK_CACHE (object), result, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (value);
+  g_clear_error (&error);
+
+  *done = TRUE;
+}
+
+static gpointer
+cancelled_worker (gpointer data)
+{
+  DzlTaskCache *shared_cache = data;
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  GMainContext *context = g_main_context_new ();
+  gboolean done = FALSE;
+
+  g_main_context_push_thread_default (context);
+
+  dzl_task_cache_get_async (shared_cache, "shared", FALSE, cancellable, cancelled_get_cb, &done);
+  g_atomic_int_set (&first_queued, TRUE);
+
+  while (!g_atomic_int_get (&second_queued))
+    g_usleep (G_USEC_PER_SEC / 1000);
+
+  /* Give up on the key and stop iterating our main context for good */
+  g_cancellable_cancel (cancellable);
+
+  while (!done)
+    g_main_context_iteration (context, TRUE);
+
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
+
+  g_atomic_int_inc (&n_finished);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+static void
+waiting_get_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  gchar **value = user_data;
+  GError *error = NULL;
+
+  *value = dzl_task_cache_get_finish (DZL_TASK_CACHE (object), result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (*value);
+}
+
+static gpointer
+waiting_worker (gpointer data)
+{
+  DzlTaskCache *shared_cache = data;
+  GMainContext *context = g_main_context_new ();
+  g_autofree gchar *value = NULL;
+
+  g_main_context_push_thread_default (context);
+
+  dzl_task_cache_get_async (shared_cache, "shared", FALSE, NULL, waiting_get_cb, &value);
+  g_atomic_int_set (&second_queued, TRUE);
+
+  while (value == NULL)
+    g_main_context_iteration (context, TRUE);
+
+  g_assert_cmpstr (value, ==, "shared-value");
+
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
+
+  g_atomic_int_inc (&n_finished);
+  g_main_context_wakeup (NULL);
+
+  return NULL;
+}
+
+static void
+test_task_cache_first_requester_leaves (void)
+{
+  g_autoptr(DzlTaskCache) shared_cache = NULL;
+  GThread *first;
+  GThread *second;
+
+  n_fetches = 0;
+  n_finished = 0;
+  first_queued = FALSE;
+  second_queued = FALSE;
+  deferred_fetch = NULL;
+
+  shared_cache = dzl_task_cache_new (g_str_hash,
+                                     g_str_equal,
+                                     (GBoxedCopyFunc)g_strdup,
+                                     (GBoxedFreeFunc)g_free,
+                                     (GBoxedCopyFunc)g_strdup,
+                                     (GBoxedFreeFunc)g_free,
+                                     0,
+                                     populate_deferred_callback, NULL, NULL);
+
+  /* The first request starts the fetch, the second waits for it */
+  first = g_thread_new ("test-task-cache-first", cancelled_worker, shared_cache);
+  while (!g_atomic_int_get (&first_queued))
+    g_usleep (G_USEC_PER_SEC / 1000);
+  second = g_thread_new ("test-task-cache-second", waiting_worker, shared_cache);
+
+  /* The first thread cancels its request and exits */
+  wait_for_threads (1);
+  g_thread_join (first);
+
+  /* The fetch is populated in our main context, not that of the first thread */
+  while (deferred_fetch == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (n_fetches, ==, 1);
+
+  g_task_return_pointer (deferred_fetch, g_strdup ("shared-value"), g_free);
+
+  wait_for_threads (2);
+  g_thread_join (second);
+
+  g_assert_cmpint (n_fetches, ==, 1);
+  g_assert_cmpstr (dzl_task_cache_peek (shared_cache, "shared"), ==, "shared-value");
+}
+
 gint
 main (gint   argc,
       gchar *argv[])
 {
   g_test_init (&argc, &argv, NULL);
   g_test_add_func ("/Dazzle/TaskCache/basic", test_task_cache);
+  g_test_add_func ("/Dazzle/TaskCache/lru", test_task_cache_lru);
+  g_test_add_func ("/Dazzle/TaskCache/cost", test_task_cache_cost);
+  g_test_add_func ("/Dazzle/TaskCache/tiny-lfu", test_task_cache_tiny_lfu);
+  g_test_add_func ("/Dazzle/TaskCache/threaded", test_task_cache_threaded);
+  g_test_add_func ("/Dazzle/TaskCache/first-requester-leaves", test_task_cache_first_requester_leaves);
+  g_test_add_func ("/Dazzle/TaskCache/stale-while-revalidate", test_task_cache_stale_while_revalidate);
+  g_test_add_func ("/Dazzle/TaskCache/refresh-ahead", test_task_cache_refresh_ahead);
+  g_test_add_func ("/Dazzle/TaskCache/disk", test_task_cache_disk);
+  g_test_add_func ("/Dazzle/TaskCache/disk-max-size", test_task_cache_disk_max_size);
   return g_test_run ();
 }
@@ -1,4 +1,5 @@
 #include <dazzle.h>
+#include <string.h>
 
 static void
 test_dzl_trie_insert (void)
@@ -36,6 +37,266 @@ traverse_cb (DzlTrie        *trie,
    return FALSE;
 }
 
+static void
+test_dzl_trie_prefixes (void)
+{
+   DzlTrie *trie;
+   guint count = 0;
+
+   trie = dzl_trie_new(g_free);
+   dzl_trie_insert(trie, "foobar", g_strdup("foobar"));
+   dzl_trie_insert(trie, "foo", g_strdup("foo"));
+   dzl_trie_insert(trie, "fob", g_strdup("fob"));
+   dzl_trie_insert(trie, "", g_strdup(""));
+
+   g_assert_null(dzl_trie_lookup(trie, "fo"));
+   g_assert_null(dzl_trie_lookup(trie, "foob"));
+   g_assert_null(dzl_trie_lookup(trie, "foobarbaz"));
+   g_assert_cmpstr("foo", ==, dzl_trie_lookup(trie, "foo"));
+   g_assert_cmpstr("", ==, dzl_trie_lookup(trie, ""));
+
+   g_assert(dzl_trie_remove(trie, "foo"));
+   g_assert(!dzl_trie_remove(trie, "foo"));
+   g_assert(!dzl_trie_remove(trie, "fo"));
+   g_assert_cmpstr("foobar", ==, dzl_trie_lookup(trie, "foobar"));
+   g_assert_cmpstr("fob", ==, dzl_trie_lookup(trie, "fob"));
+
+   /* Every byte is still a level, even within a compressed edge */
+   dzl_trie_traverse(trie, "foo", G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+                     traverse_cb, &count);
+   g_assert_cmpint(count, ==, 4);
+
+   dzl_trie_unref(trie);
+}
+
+static guint
+serialize_cb (DzlTrie     *trie,
+              const gchar *key,
+              gpointer     value,
+              gpointer     user_data)
+{
+   return strlen(key) + 1;
+}
+
+static void
+test_dzl_trie_save (void)
+{
+   GFileIOStream *stream = NULL;
+   GFile *file;
+   GError *error = NULL;
+   DzlTrie *trie;
+   DzlTrie *mapped;
+   gchar *contents = NULL;
+   gsize len = 0;
+   gboolean r;
+   guint count = 0;
+
+   trie = dzl_trie_new(NULL);
+   dzl_trie_insert(trie, "gtk_widget_show", "a");
+   dzl_trie_insert(trie, "gtk_widget_hide", "b");
+   dzl_trie_insert(trie, "gtk_window_new", "c");
+   dzl_trie_insert(trie, "g", "d");
+
+   file = g_file_new_tmp("test-trie-XXXXXX.bin", &stream, &error);
+   g_assert_no_error(error);
+   g_assert(file != NULL);
+   g_io_stream_close(G_IO_STREAM(stream), NULL, NULL);
+   g_object_unref(stream);
+
+   r = dzl_trie_save_to_file(trie, file, serialize_cb, NULL, NULL, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+   dzl_trie_unref(trie);
+
+   mapped = dzl_trie_new_for_file(file, &error);
+   g_assert_no_error(error);
+   g_assert(mapped != NULL);
+
+   g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(mapped, "gtk_widget_show")), ==, 16);
+   g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(mapped, "gtk_window_new")), ==, 15);
+   g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(mapped, "g")), ==, 2);
+   g_assert_null(dzl_trie_lookup(mapped, "gtk_widget"));
+
+   dzl_trie_traverse(mapped, "gtk_wi", G_PRE_ORDER, G_TRAVERSE_LEAVES, -1,
+                     traverse_cb, &count);
+   g_assert_cmpint(count, ==, 3);
+
+   dzl_trie_unref(mapped);
+
+   /* Offsets past the end of the file must be caught when loading */
+   r = g_file_load_contents(file, NULL, &contents, &len, NULL, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+   memset(&contents[len / 2], 0xFF, len - len / 2);
+   r = g_file_replace_contents(file, contents, len, NULL, FALSE,
+                               G_FILE_CREATE_NONE, NULL, NULL, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+   g_free(contents);
+
+   mapped = dzl_trie_new_for_file(file, &error);
+   g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+   g_assert_null(mapped);
+   g_clear_error(&error);
+
+   r = g_file_delete(file, NULL, &error);
+   g_assert_no_error(error);
+   g_assert(r);
+   g_object_unref(file);
+}
+
+static guint n_destroyed;
+
+static void
+count_destroy (gpointer data)
+{
+   n_destroyed++;
+}
+
+static void
+test_dzl_trie_compact (void)
+{
+   static const guint n_keys = 20000;
+   DzlTrieIter *iter;
+   DzlTrie *trie;
+   const gchar *key;
+   gpointer value;
+   guint n_live = n_keys;
+   guint prev = 0;
+   guint i;
+
+   n_destroyed = 0;
+   trie = dzl_trie_new(count_destroy);
+
+   for (i = 0; i < n_keys; i++) {
+      g_autofree gchar *k = g_strdup_printf("key_%05u", i);
+      dzl_trie_insert_with_weight(trie, k, GUINT_TO_POINTER(i + 1), i % 7);
+   }
+
+   /*
+    * Removing every key not divisible by 10 leaves most of the arena as
+    * garbage, so the trie is compacted, likely more than once, along the
+    * way. Check that lookups stay correct as it happens.
+    */
+   for (i = 0; i < n_keys; i++) {
+      g_autofree gchar *k = g_strdup_printf("key_%05u", (i * 7919) % n_keys);
+      guint n = (i * 7919) % n_keys;
+
+      if (n % 10 != 0) {
+         g_assert(dzl_trie_remove(trie, k));
+         n_live--;
+      }
+
+      if (i % 1000 == 0) {
+         g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(trie, "key_00000")), ==, 1);
+         g_assert_null(dzl_trie_lookup(trie, "key_0000"));
+      }
+   }
+
+   g_assert_cmpint(n_live, ==, n_keys / 10);
+   g_assert_cmpint(n_destroyed, ==, n_keys - n_live);
+
+   for (i = 0; i < n_keys; i++) {
+      g_autofree gchar *k = g_strdup_printf("key_%05u", i);
+
+      if (i % 10 == 0) {
+         g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(trie, k)), ==, i + 1);
+      } else {
+         g_assert_null(dzl_trie_lookup(trie, k));
+         g_assert(!dzl_trie_remove(trie, k));
+      }
+   }
+
+   /* Iteration visits exactly the remaining keys, in order */
+   iter = dzl_trie_iter_new(trie, "key_", NULL);
+   for (i = 0; dzl_trie_iter_next(iter, &key, &value); i++) {
+      g_autofree gchar *expected = g_strdup_printf("key_%05u", i * 10);
+
+      g_assert_cmpstr(key, ==, expected);
+      g_assert_cmpint(GPOINTER_TO_UINT(value), ==, i * 10 + 1);
+   }
+   g_assert_cmpint(i, ==, n_live);
+   dzl_trie_iter_free(iter);
+
+   /* And the weights survive compaction */
+   iter = dzl_trie_iter_new_by_weight(trie, "key_");
+   for (i = 0; dzl_trie_iter_next(iter, &key, &value); i++) {
+      guint weight = (GPOINTER_TO_UINT(value) - 1) % 7;
+
+      if (i > 0) {
+         g_assert_cmpint(weight, <=, prev);
+      }
+      prev = weight;
+   }
+   g_assert_cmpint(i, ==, n_live);
+   dzl_trie_iter_free(iter);
+
+   /* The compacted trie can still be modified */
+   dzl_trie_insert(trie, "key_00001", GUINT_TO_POINTER(2));
+   dzl_trie_insert(trie, "key_0000", GUINT_TO_POINTER(n_keys + 1));
+   g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(trie, "key_00001")), ==, 2);
+   g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(trie, "key_0000")), ==, n_keys + 1);
+   g_assert_cmpint(GPOINTER_TO_UINT(dzl_trie_lookup(trie, "key_00000")), ==, 1);
+
+   dzl_trie_unref(trie);
+   g_assert_cmpint(n_destroyed, ==, n_keys + 2);
+}
+
+static void
+test_dzl_trie_iter (void)
+{
+   static const gchar *keys[] = {
+      "gtk_widget_show", "gtk_widget_hide", "gtk_widget", "gtk_window_new",
+      "gtk_window_present", "gdk_window_show", "gtk",
+   };
+   DzlTrieIter *iter;
+   DzlTrie *trie;
+   const gchar *key;
+   gpointer value;
+   guint i;
+
+   trie = dzl_trie_new(NULL);
+   for (i = 0; i < G_N_ELEMENTS(keys); i++) {
+      dzl_trie_insert_with_weight(trie, keys[i], (gpointer)keys[i], i);
+   }
+
+   /* In order, from a prefix ending within an edge */
+   iter = dzl_trie_iter_new(trie, "gtk_w", NULL);
+   g_assert(dzl_trie_iter_next(iter, &key, &value));
+   g_assert_cmpstr(key, ==, "gtk_widget");
+   g_assert_cmpstr(value, ==, "gtk_widget");
+   g_assert(dzl_trie_iter_next(iter, &key, NULL));
+   g_assert_cmpstr(key, ==, "gtk_widget_hide");
+   g_assert(dzl_trie_iter_next(iter, &key, NULL));
+   g_assert_cmpstr(key, ==, "gtk_widget_show");
+   dzl_trie_iter_free(iter);
+
+   /* Resuming after the last key seen */
+   iter = dzl_trie_iter_new(trie, "gtk_w", "gtk_widget_show");
+   g_assert(dzl_trie_iter_next(iter, &key, NULL));
+   g_assert_cmpstr(key, ==, "gtk_window_new");
+   g_assert(dzl_trie_iter_next(iter, &key, NULL));
+   g_assert_cmpstr(key, ==, "gtk_window_present");
+   g_assert(!dzl_trie_iter_next(iter, &key, NULL));
+   dzl_trie_iter_free(iter);
+
+   /* Heaviest first */
+   iter = dzl_trie_iter_new_by_weight(trie, "gtk");
+   g_assert(dzl_trie_iter_next(iter, &key, NULL));
+   g_assert_cmpstr(key, ==, "gtk");
+   g_assert(dzl_trie_iter_next(iter, &key, NULL));
+   g_assert_cmpstr(key, ==, "gtk_window_present");
+   g_assert(dzl_trie_iter_next(iter, &key, NULL));
+   g_assert_cmpstr(key, ==, "gtk_window_new");
+   dzl_trie_iter_free(iter);
+
+   iter = dzl_trie_iter_new(trie, "gtkx", NULL);
+   g_assert(!dzl_trie_iter_next(iter, &key, &value));
+   dzl_trie_iter_free(iter);
+
+   dzl_trie_unref(trie);
+}
+
 static void
 test_dzl_trie_gauntlet (void)
 {
@@ -130,6 +391,10 @@ main (gint   argc,
 {
    g_test_init(&argc, &argv, NULL);
    g_test_add_func("/Dazzle/Trie/insert", test_dzl_trie_insert);
+   g_test_add_func("/Dazzle/Trie/prefixes", test_dzl_trie_prefixes);
+   g_test_add_func("/Dazzle/Trie/save", test_dzl_trie_save);
+   g_test_add_func("/Dazzle/Trie/iter", test_dzl_trie_iter);
+   g_test_add_func("/Dazzle/Trie/compact", test_dzl_trie_compact);
    g_test_add_func("/Dazzle/Trie/gauntlet", test_dzl_trie_gauntlet);
    return g_test_run();
 }